@@ -20,8 +20,13 @@
 #include <cstring>
 #include <stdio.h>
 #include <float.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "peakfinder8.hh"
+#include "peakfinder8_radial_stats.hh"
+#include "peakfinder8_gpu.hh"
 
 
 void allocatePeakList(tPeakList *peak, long NpeaksMax)
@@ -78,16 +83,70 @@ struct radial_stats
 	float *lthreshold;
 	float *rsigma;
 	int *rcount;
+	float *pthreshold;					// Thresholds read by the pre-screen
 	int n_rad_bins;
 };
 
 
+// Radial background profile carried across frames by the temporal estimator: the
+// mean and the mean square of the background pixels of each bin
+struct radial_model
+{
+	double *mean;
+	double *mean_sq;
+	char *has_data;
+	int n_rad_bins;
+	int valid;					// 0 until the model is initialized by a full estimate
+};
+
+
+// Integral images along the rows of each panel, used by the integral local
+// background. For each pixel of a panel row, they store the sum, the sum of squares
+// and the number of the unmasked pixels below the threshold of their radial bin that
+// come before it in the row. A panel row is only computed the first time that the
+// local background of a peak needs it. The disc searched around each peak is stored
+// as one span of fs offsets for each ss offset, from -ring_width to ring_width-1
+struct local_background_tables
+{
+	double *sum;
+	double *sum_sq;
+	int *count;
+	char *row_ready;				// One flag per panel row, cleared for each frame
+	int num_panels_fs;
+	long row_stride;				// One more entry than the pixels in a panel row
+	int ring_width;					// -1 until the spans are computed
+	int *span_first;
+	int *span_last;
+};
+
+
+// Runs of consecutive unmasked pixels, in frame order. They are only computed again
+// when a mask at a different address is passed, or when the caller reports that the
+// mask changed with notifyPeakfinder8MaskChanged, so that the passes over the whole
+// frame do not need to test the mask of each pixel
+struct mask_spans
+{
+	const char *mask;				// Mask from which the spans were computed
+	long generation;				// Mask generation of the context at that time
+	long num_pix;
+	int *first;
+	int *length;
+	long num_spans;
+	int valid;						// 0 until the spans are first computed
+};
+
+
 struct peakfinder_intern_data
 {
 	char *pix_in_peak_map;
 	int *infs;
 	int *inss;
 	int *peak_pixels;
+	int *touched_pixels;
+	int num_touched_pixels;
+	int owns_pix_in_peak_map;
+	int collect_stats;
+	tPeakfinder8Stats stats;			// Of the panels processed for the current frame
 };
 
 
@@ -102,25 +161,74 @@ struct peakfinder_peak_data
 	float *max_i;
 	float *sigma;
 	float *snr;
+	int *pixels;					// Pixels of each peak, pixel_stride entries each
+	int pixel_stride;
 };
 
 
-static void compute_num_radial_bins(int w, int h, float *r_map, float *max_r)
+static void compute_num_radial_bins(long num_pix, const float *r_map, float *max_r)
 {
-	int ifs, iss;
-	int pidx;
+	long pidx;
 
-	for ( iss=0 ; iss<h ; iss++ ) {
-		for ( ifs=0 ; ifs<w ; ifs++ ) {
-			pidx = iss * w + ifs;
-			if ( r_map[pidx] > *max_r ) {
-				*max_r = r_map[pidx];
-			}
+	for ( pidx=0 ; pidx<num_pix ; pidx++ ) {
+		if ( r_map[pidx] > *max_r ) {
+			*max_r = r_map[pidx];
 		}
 	}
 }
 
 
+// Converts a radius map into a map of radial bin indexes. The radius map is fixed
+// for the whole run, so this only needs to be done once per geometry. Returns the
+// number of radial bins, or -1 if the radius map stores values above 65535 pixels
+int computePeakfinder8RadialBins(const float *r_map, long num_pix,
+                                 unsigned short *r_bin)
+{
+	float max_r;
+	int num_rad_bins;
+	long pidx;
+
+	max_r = -1e9;
+
+	compute_num_radial_bins(num_pix, r_map, &max_r);
+
+	num_rad_bins = (int)ceil(max_r) + 1;
+
+	// The bin indexes are stored as 16-bit integers
+	if ( num_rad_bins < 1 || num_rad_bins > USHRT_MAX + 1 ) {
+		return -1;
+	}
+
+	for ( pidx=0 ; pidx<num_pix ; pidx++ ) {
+		r_bin[pidx] = (unsigned short)rint(r_map[pidx]);
+	}
+
+	return num_rad_bins;
+}
+
+
+static unsigned short *compute_radial_bin_map(float *r_map, int num_pix_fs,
+                                              int num_pix_ss, int *num_rad_bins)
+{
+	unsigned short *r_bin;
+	long num_pix_tot;
+
+	num_pix_tot = (long)num_pix_fs * num_pix_ss;
+	r_bin = (unsigned short *)malloc(num_pix_tot*sizeof(unsigned short));
+	if ( r_bin == NULL ) {
+		return NULL;
+	}
+
+	*num_rad_bins = computePeakfinder8RadialBins(r_map, num_pix_tot, r_bin);
+	if ( *num_rad_bins < 0 ) {
+		free(r_bin);
+		return NULL;
+	}
+
+	return r_bin;
+}
+
+
 static struct radial_stats* allocate_radial_stats(int num_rad_bins)
 {
 	struct radial_stats* rstats;
@@ -170,6 +278,17 @@ static struct radial_stats* allocate_radial_stats(int num_rad_bins)
 		return NULL;
 	}
 
+	rstats->pthreshold = (float *)malloc(num_rad_bins*sizeof(float));
+	if ( rstats->pthreshold == NULL ) {
+		free(rstats->roffset);
+		free(rstats->rthreshold);
+		free(rstats->lthreshold);
+		free(rstats->rsigma);
+		free(rstats->rcount);
+		free(rstats);
+		return NULL;
+	}
+
 	rstats->n_rad_bins = num_rad_bins;
 
 	return rstats;
@@ -183,40 +302,109 @@ static void free_radial_stats(struct radial_stats *rstats)
 	free(rstats->lthreshold);
 	free(rstats->rsigma);
 	free(rstats->rcount);
+	free(rstats->pthreshold);
 	free(rstats);
 }
 
 
-static void fill_radial_bins(float *data,
-                             int w,
-                             int h,
-                             float *r_map,
-                             char *mask,
+static struct mask_spans *allocate_mask_spans(long num_pix)
+{
+	struct mask_spans *spans;
+
+	spans = (struct mask_spans *)malloc(sizeof(struct mask_spans));
+	if ( spans == NULL ) {
+		return NULL;
+	}
+
+	// Two spans are always separated by at least one masked pixel
+	spans->first = (int *)malloc((num_pix/2+1)*sizeof(int));
+	spans->length = (int *)malloc((num_pix/2+1)*sizeof(int));
+	if ( spans->first == NULL || spans->length == NULL ) {
+		free(spans->first);
+		free(spans->length);
+		free(spans);
+		return NULL;
+	}
+	spans->mask = NULL;
+	spans->generation = 0;
+	spans->num_pix = num_pix;
+	spans->num_spans = 0;
+	spans->valid = 0;
+
+	return spans;
+}
+
+
+static void free_mask_spans(struct mask_spans *spans)
+{
+	free(spans->first);
+	free(spans->length);
+	free(spans);
+}
+
+
+// Computes the spans again if the mask is not the one they were computed from, or if
+// it changed since then. The mask itself is not read when it did not change
+static void update_mask_spans(struct mask_spans *spans, const char *mask,
+                              long generation)
+{
+	long pi;
+	long num_spans;
+
+	if ( spans->valid && spans->mask == mask && spans->generation == generation ) {
+		return;
+	}
+	spans->mask = mask;
+	spans->generation = generation;
+
+	num_spans = 0;
+	pi = 0;
+	while ( pi < spans->num_pix ) {
+		if ( mask[pi] == 0 ) {
+			pi++;
+			continue;
+		}
+		spans->first[num_spans] = pi;
+		while ( pi < spans->num_pix && mask[pi] != 0 ) {
+			pi++;
+		}
+		spans->length[num_spans] = pi - spans->first[num_spans];
+		num_spans++;
+	}
+	spans->num_spans = num_spans;
+	spans->valid = 1;
+}
+
+
+// Visits the unmasked pixels in frame order, like a scan of the whole frame that
+// skips the masked pixels, so the sums are the same
+template <typename T>
+static void fill_radial_bins(const T *data,
+                             const struct mask_spans *spans,
+                             unsigned short *r_bin,
                              float *rthreshold,
                              float *lthreshold,
                              float *roffset,
                              float *rsigma,
                              int *rcount)
 {
-	int iss, ifs;
-	int pidx;
+	long si;
+	int pidx, last;
 
 	int curr_r;
 	float value;
 
-	for ( iss=0; iss<h ; iss++ ) {
-		for ( ifs=0; ifs<w ; ifs++ ) {
-			pidx = iss * w + ifs;
-			if ( mask[pidx] != 0 ) {
-				curr_r = (int)rint(r_map[pidx]);
-				value = data[pidx];
-				if ( value < rthreshold[curr_r]
-				  && value > lthreshold[curr_r] )
-				{
-					roffset[curr_r] += value;
-					rsigma[curr_r] += (value * value);
-					rcount[curr_r] += 1;
-				}
+	for ( si=0; si<spans->num_spans ; si++ ) {
+		last = spans->first[si] + spans->length[si];
+		for ( pidx=spans->first[si]; pidx<last ; pidx++ ) {
+			curr_r = r_bin[pidx];
+			value = (float)data[pidx];
+			if ( value < rthreshold[curr_r]
+			  && value > lthreshold[curr_r] )
+			{
+				roffset[curr_r] += value;
+				rsigma[curr_r] += (value * value);
+				rcount[curr_r] += 1;
 			}
 		}
 	}
@@ -263,33 +451,20 @@ static void compute_radial_stats(float *rthreshold,
 }
 
 
-static struct radial_stats *compute_radial_bins(float *data,
-                                                char *mask,
-                                                int num_pix,
-                                                float *r_map,
-                                                int iterations,
-                                                float min_snr,
-                                                float acd_threshold,
-                                                int num_pix_fs,
-                                                int num_pix_ss)
+template <typename T>
+static void compute_radial_bins(struct radial_stats *rstats,
+                                const T *data,
+                                const struct mask_spans *spans,
+                                unsigned short *r_bin,
+                                int iterations,
+                                float min_snr,
+                                float acd_threshold)
 {
-	float max_r;
 	int it_counter;
 	int i;
 	int num_rad_bins;
-	struct radial_stats *rstats;
-
-	max_r = -1e9;
-
-	compute_num_radial_bins(num_pix_fs, num_pix_ss, r_map, &max_r);
 
-	num_rad_bins = (int)ceil(max_r) + 1;
-
-	// Allocate and zero arrays
-	rstats = allocate_radial_stats(num_rad_bins);
-	if ( rstats == NULL ) {
-		return NULL;
-	}
+	num_rad_bins = rstats->n_rad_bins;
 
 	for ( i=0; i<num_rad_bins; i++ ) {
 		rstats->rthreshold[i] = 1e9;
@@ -308,10 +483,8 @@ static struct radial_stats *compute_radial_bins(float *data,
 		}
 
 		fill_radial_bins(data,
-                         num_pix_fs,
-                         num_pix_ss,
-		                 r_map,
-		                 mask,
+		                 spans,
+		                 r_bin,
 		                 rstats->rthreshold,
 		                 rstats->lthreshold,
 		                 rstats->roffset,
@@ -328,11 +501,286 @@ static struct radial_stats *compute_radial_bins(float *data,
 		                     acd_threshold);
 
 	}
-	return rstats;
 }
 
 
-struct peakfinder_peak_data *allocate_peak_data(int max_num_peaks)
+static void set_radial_bin_stats(struct radial_stats *rstats,
+                                 int ri,
+                                 double sum,
+                                 double sum_sq,
+                                 int count,
+                                 float min_snr,
+                                 float acd_threshold)
+{
+	double this_offset, this_sigma;
+
+	rstats->rcount[ri] = count;
+
+	// Same rules as compute_radial_stats, evaluated from double precision sums
+	if ( count == 0 ) {
+		rstats->roffset[ri] = 0;
+		rstats->rsigma[ri] = 0;
+		rstats->rthreshold[ri] = FLT_MAX;
+		rstats->lthreshold[ri] = FLT_MIN;
+	} else {
+		this_offset = sum / count;
+		this_sigma = sum_sq / count - (this_offset * this_offset);
+		if ( this_sigma >= 0 ) {
+			this_sigma = sqrt(this_sigma);
+		}
+
+		rstats->roffset[ri] = this_offset;
+		rstats->rsigma[ri] = this_sigma;
+		rstats->rthreshold[ri] = rstats->roffset[ri] + min_snr*rstats->rsigma[ri];
+		rstats->lthreshold[ri] = rstats->roffset[ri] - min_snr*rstats->rsigma[ri];
+
+		if ( rstats->rthreshold[ri] < acd_threshold ) {
+			rstats->rthreshold[ri] = acd_threshold;
+		}
+	}
+}
+
+
+// Same iterations as compute_radial_bins, but working on the pixels grouped by
+// radial bin, so that the thresholds are constant within each slice and the sums can
+// be vectorized without scatter conflicts. The thresholds of a bin only depend on the
+// pixels in that bin, so all the iterations for a bin are run back to back while its
+// slice is still in cache. This gives exactly the same result as iterating over the
+// whole frame. If an iteration does not change the thresholds, all the following
+// ones would not change them either, so the loop stops early.
+template <typename T>
+static void compute_radial_bins_sorted(struct radial_stats *rstats,
+                                       struct radial_order *rorder,
+                                       radial_sums_function radial_sums,
+                                       const T *data,
+                                       char *mask,
+                                       int iterations,
+                                       float min_snr,
+                                       float acd_threshold)
+{
+	int it_counter;
+	int ri;
+	double sum, sum_sq;
+	int count;
+	int bin_start, bin_size;
+	float prev_rthreshold, prev_lthreshold;
+
+	fill_radial_order(rorder, data, mask);
+
+	for ( ri=0; ri<rstats->n_rad_bins; ri++ ) {
+		bin_start = rorder->bin_start[ri];
+		bin_size = rorder->bin_start[ri + 1] - bin_start;
+
+		rstats->rthreshold[ri] = 1e9;
+		rstats->lthreshold[ri] = -1e9;
+
+		for ( it_counter=0 ; it_counter<iterations ; it_counter++ ) {
+			prev_rthreshold = rstats->rthreshold[ri];
+			prev_lthreshold = rstats->lthreshold[ri];
+
+			radial_sums(rorder->values + bin_start, bin_size,
+			            rstats->lthreshold[ri], rstats->rthreshold[ri],
+			            &sum, &sum_sq, &count);
+			set_radial_bin_stats(rstats, ri, sum, sum_sq, count, min_snr,
+			                     acd_threshold);
+
+			if ( rstats->rthreshold[ri] == prev_rthreshold
+			  && rstats->lthreshold[ri] == prev_lthreshold ) {
+				break;
+			}
+		}
+	}
+}
+
+
+// Robust single pass estimator: the median of each bin is used as background
+// offset, and the scaled median absolute deviation as background sigma
+template <typename T>
+static void compute_radial_bins_median_mad(struct radial_stats *rstats,
+                                           struct radial_order *rorder,
+                                           const T *data,
+                                           char *mask,
+                                           float min_snr,
+                                           float acd_threshold)
+{
+	int ri;
+	double median, mad;
+	int count;
+	int bin_start;
+
+	fill_radial_order(rorder, data, mask);
+
+	for ( ri=0; ri<rstats->n_rad_bins; ri++ ) {
+		bin_start = rorder->bin_start[ri];
+		radial_median_mad(rorder->values + bin_start,
+		                  rorder->bin_start[ri + 1] - bin_start,
+		                  rorder->scratch, &median, &mad, &count);
+
+		rstats->rcount[ri] = count;
+		if ( count == 0 ) {
+			rstats->roffset[ri] = 0;
+			rstats->rsigma[ri] = 0;
+			rstats->rthreshold[ri] = FLT_MAX;
+			rstats->lthreshold[ri] = FLT_MIN;
+		} else {
+			// 1.4826 makes the MAD a consistent estimator of sigma for normal noise
+			rstats->roffset[ri] = median;
+			rstats->rsigma[ri] = 1.4826 * mad;
+			rstats->rthreshold[ri] = rstats->roffset[ri] + min_snr*rstats->rsigma[ri];
+			rstats->lthreshold[ri] = rstats->roffset[ri] - min_snr*rstats->rsigma[ri];
+			if ( rstats->rthreshold[ri] < acd_threshold ) {
+				rstats->rthreshold[ri] = acd_threshold;
+			}
+		}
+	}
+}
+
+
+static struct radial_model *allocate_radial_model(int num_rad_bins)
+{
+	struct radial_model *rmodel;
+
+	rmodel = (struct radial_model *)malloc(sizeof(struct radial_model));
+	if ( rmodel == NULL ) {
+		return NULL;
+	}
+
+	rmodel->mean = (double *)malloc(num_rad_bins*sizeof(double));
+	rmodel->mean_sq = (double *)malloc(num_rad_bins*sizeof(double));
+	rmodel->has_data = (char *)malloc(num_rad_bins*sizeof(char));
+	if ( rmodel->mean == NULL || rmodel->mean_sq == NULL
+	  || rmodel->has_data == NULL ) {
+		free(rmodel->mean);
+		free(rmodel->mean_sq);
+		free(rmodel->has_data);
+		free(rmodel);
+		return NULL;
+	}
+
+	rmodel->n_rad_bins = num_rad_bins;
+	rmodel->valid = 0;
+
+	return rmodel;
+}
+
+
+static void free_radial_model(struct radial_model *rmodel)
+{
+	free(rmodel->mean);
+	free(rmodel->mean_sq);
+	free(rmodel->has_data);
+	free(rmodel);
+}
+
+
+// Computes the radial offsets, sigmas and thresholds from the temporal model
+static void set_radial_stats_from_model(struct radial_stats *rstats,
+                                        struct radial_model *rmodel,
+                                        float min_snr,
+                                        float acd_threshold)
+{
+	int ri;
+	double this_sigma;
+
+	for ( ri=0; ri<rstats->n_rad_bins; ri++ ) {
+		if ( !rmodel->has_data[ri] ) {
+			rstats->roffset[ri] = 0;
+			rstats->rsigma[ri] = 0;
+			rstats->rthreshold[ri] = FLT_MAX;
+			rstats->lthreshold[ri] = FLT_MIN;
+			continue;
+		}
+
+		this_sigma = rmodel->mean_sq[ri] - rmodel->mean[ri] * rmodel->mean[ri];
+		this_sigma = this_sigma > 0 ? sqrt(this_sigma) : 0;
+
+		rstats->roffset[ri] = rmodel->mean[ri];
+		rstats->rsigma[ri] = this_sigma;
+		rstats->rthreshold[ri] = rstats->roffset[ri] + min_snr*rstats->rsigma[ri];
+		rstats->lthreshold[ri] = rstats->roffset[ri] - min_snr*rstats->rsigma[ri];
+		if ( rstats->rthreshold[ri] < acd_threshold ) {
+			rstats->rthreshold[ri] = acd_threshold;
+		}
+	}
+}
+
+
+// Initializes the temporal model from the radial statistics computed by the
+// iterative estimator
+static void init_radial_model(struct radial_model *rmodel,
+                              struct radial_stats *rstats)
+{
+	int ri;
+
+	for ( ri=0; ri<rmodel->n_rad_bins; ri++ ) {
+		rmodel->has_data[ri] = rstats->rcount[ri] > 0;
+		rmodel->mean[ri] = rstats->roffset[ri];
+		rmodel->mean_sq[ri] = (double)rstats->rsigma[ri] * rstats->rsigma[ri]
+		                    + (double)rstats->roffset[ri] * rstats->roffset[ri];
+	}
+	rmodel->valid = 1;
+}
+
+
+// Temporal estimator: the background profile is an exponentially weighted average
+// over frames. Each frame needs a single clipped pass with the thresholds of the
+// current model, instead of the iterations of the sigma clipping. Since each update
+// is one more clipping iteration, in steady state the model converges to the same
+// profile as the iterative estimator
+template <typename T>
+static void update_radial_model(struct radial_stats *rstats,
+                                struct radial_model *rmodel,
+                                const T *data,
+                                const struct mask_spans *spans,
+                                unsigned short *r_bin,
+                                float decay,
+                                float min_snr,
+                                float acd_threshold)
+{
+	int ri;
+	double frame_mean, frame_mean_sq;
+
+	// The thresholds are computed again, in case the parameters have changed
+	set_radial_stats_from_model(rstats, rmodel, min_snr, acd_threshold);
+
+	for ( ri=0; ri<rstats->n_rad_bins; ri++ ) {
+		rstats->roffset[ri] = 0;
+		rstats->rsigma[ri] = 0;
+		rstats->rcount[ri] = 0;
+
+		// Bins without a model yet accept all the pixels, like the first
+		// iteration of the sigma clipping
+		if ( !rmodel->has_data[ri] ) {
+			rstats->rthreshold[ri] = 1e9;
+			rstats->lthreshold[ri] = -1e9;
+		}
+	}
+
+	fill_radial_bins(data, spans, r_bin, rstats->rthreshold, rstats->lthreshold,
+	                 rstats->roffset, rstats->rsigma, rstats->rcount);
+
+	for ( ri=0; ri<rmodel->n_rad_bins; ri++ ) {
+		if ( rstats->rcount[ri] == 0 ) {
+			continue;
+		}
+		frame_mean = (double)rstats->roffset[ri] / rstats->rcount[ri];
+		frame_mean_sq = (double)rstats->rsigma[ri] / rstats->rcount[ri];
+		if ( rmodel->has_data[ri] ) {
+			rmodel->mean[ri] += decay * (frame_mean - rmodel->mean[ri]);
+			rmodel->mean_sq[ri] += decay * (frame_mean_sq - rmodel->mean_sq[ri]);
+		} else {
+			rmodel->mean[ri] = frame_mean;
+			rmodel->mean_sq[ri] = frame_mean_sq;
+			rmodel->has_data[ri] = 1;
+		}
+	}
+
+	set_radial_stats_from_model(rstats, rmodel, min_snr, acd_threshold);
+}
+
+
+static struct peakfinder_peak_data *allocate_peak_data(int max_num_peaks,
+                                                       int max_pix_count)
 {
 	struct peakfinder_peak_data *pkdata;
 
@@ -364,7 +812,7 @@ struct peakfinder_peak_data *allocate_peak_data(int max_num_peaks)
 	}
 
 	pkdata->com_index = (int *)malloc(max_num_peaks*sizeof(int));
-	if ( pkdata->com_ss == NULL ) {
+	if ( pkdata->com_index == NULL ) {
 		free(pkdata->npix);
 		free(pkdata->com_fs);
 		free(pkdata->com_ss);
@@ -418,6 +866,21 @@ struct peakfinder_peak_data *allocate_peak_data(int max_num_peaks)
 		return NULL;
 	}
 
+	pkdata->pixel_stride = max_pix_count;
+	pkdata->pixels = (int *)malloc((long)max_num_peaks*max_pix_count*sizeof(int));
+	if ( pkdata->pixels == NULL ) {
+		free(pkdata->npix);
+		free(pkdata->com_fs);
+		free(pkdata->com_ss);
+		free(pkdata->com_index);
+		free(pkdata->tot_i);
+		free(pkdata->max_i);
+		free(pkdata->sigma);
+		free(pkdata->snr);
+		free(pkdata);
+		return NULL;
+	}
+
 	return pkdata;
 }
 
@@ -431,12 +894,17 @@ static void free_peak_data(struct peakfinder_peak_data *pkdata) {
 	free(pkdata->max_i);
 	free(pkdata->sigma);
 	free(pkdata->snr);
+	free(pkdata->pixels);
 	free(pkdata);
 }
 
 
+// If shared_pix_in_peak_map is not NULL, the scratch data uses that map instead of
+// allocating its own. This is used by the worker threads, which all write to the
+// frame-wide map, each within its own panels
 static struct peakfinder_intern_data *allocate_peakfinder_intern_data(int data_size,
-                                                                      int max_pix_count)
+                                                                      int max_pix_count,
+                                                                      char *shared_pix_in_peak_map)
 {
 
 	struct peakfinder_intern_data *intern_data;
@@ -446,22 +914,28 @@ static struct peakfinder_intern_data *allocate_peakfinder_intern_data(int data_s
 		return NULL;
 	}
 
-	intern_data->pix_in_peak_map =(char *)calloc(data_size, sizeof(char));
-	if ( intern_data->pix_in_peak_map == NULL ) {
-		free(intern_data);
-		return NULL;
+	if ( shared_pix_in_peak_map != NULL ) {
+		intern_data->pix_in_peak_map = shared_pix_in_peak_map;
+		intern_data->owns_pix_in_peak_map = 0;
+	} else {
+		intern_data->pix_in_peak_map =(char *)calloc(data_size, sizeof(char));
+		if ( intern_data->pix_in_peak_map == NULL ) {
+			free(intern_data);
+			return NULL;
+		}
+		intern_data->owns_pix_in_peak_map = 1;
 	}
 
 	intern_data->infs =(int *)calloc(data_size, sizeof(int));
 	if ( intern_data->infs == NULL ) {
-		free(intern_data->pix_in_peak_map);
+		if ( intern_data->owns_pix_in_peak_map ) free(intern_data->pix_in_peak_map);
 		free(intern_data);
 		return NULL;
 	}
 
 	intern_data->inss =(int *)calloc(data_size, sizeof(int));
 	if ( intern_data->inss == NULL ) {
-		free(intern_data->pix_in_peak_map);
+		if ( intern_data->owns_pix_in_peak_map ) free(intern_data->pix_in_peak_map);
 		free(intern_data->infs);
 		free(intern_data);
 		return NULL;
@@ -469,21 +943,50 @@ static struct peakfinder_intern_data *allocate_peakfinder_intern_data(int data_s
 
 	intern_data->peak_pixels =(int *)calloc(max_pix_count, sizeof(int));
 	if ( intern_data->peak_pixels == NULL ) {
-		free(intern_data->pix_in_peak_map);
+		if ( intern_data->owns_pix_in_peak_map ) free(intern_data->pix_in_peak_map);
 		free(intern_data->infs);
 		free(intern_data->inss);
 		free(intern_data);
 		return NULL;
 	}
 
+	intern_data->touched_pixels =(int *)malloc(data_size*sizeof(int));
+	if ( intern_data->touched_pixels == NULL ) {
+		if ( intern_data->owns_pix_in_peak_map ) free(intern_data->pix_in_peak_map);
+		free(intern_data->infs);
+		free(intern_data->inss);
+		free(intern_data->peak_pixels);
+		free(intern_data);
+		return NULL;
+	}
+	intern_data->num_touched_pixels = 0;
+	intern_data->collect_stats = 0;
+	memset(&intern_data->stats, 0, sizeof(tPeakfinder8Stats));
+
 	return intern_data;
 }
 
 
+static void reset_peakfinder_intern_data(struct peakfinder_intern_data *pfid)
+{
+	int i;
+
+	// Only the pixels that were added to a peak in the previous frame need to be
+	// cleared: the rest of the map is still zero
+	for ( i=0 ; i<pfid->num_touched_pixels ; i++ ) {
+		pfid->pix_in_peak_map[pfid->touched_pixels[i]] = 0;
+	}
+	pfid->num_touched_pixels = 0;
+}
+
+
 static void free_peakfinder_intern_data(struct peakfinder_intern_data *pfid)
 {
+	free(pfid->touched_pixels);
 	free(pfid->peak_pixels);
-	free(pfid->pix_in_peak_map);
+	if ( pfid->owns_pix_in_peak_map ) {
+		free(pfid->pix_in_peak_map);
+	}
 	free(pfid->infs);
 	free(pfid->inss);
 	free(pfid);
@@ -491,9 +994,21 @@ static void free_peakfinder_intern_data(struct peakfinder_intern_data *pfid)
 
 
 
+static long long stats_clock_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+// The panel size and the width of the frame are passed as template arguments by the
+// kernels compiled for a fixed layout, and are 0 for the generic kernel
+template <typename T, int ASIC_FS, int ASIC_SS, int NUM_PIX_FS>
 static void peak_search(int p,
                         struct peakfinder_intern_data *pfinter,
-                        float *copy, char *mask, float *r_map,
+                        const T *copy, char *mask, unsigned short *r_bin,
                         float *rthreshold, float *roffset,
                         int *num_pix_in_peak, int asic_size_fs,
                         int asic_size_ss, int aifs, int aiss,
@@ -512,6 +1027,12 @@ static void peak_search(int p,
 	int search_ss[9] = { 0, -1, -1, -1, 0, 0, 1, 1, 1 };
 	int search_n = 9;
 
+	if ( ASIC_FS != 0 ) {
+		asic_size_fs = ASIC_FS;
+		asic_size_ss = ASIC_SS;
+		num_pix_fs = NUM_PIX_FS;
+	}
+
 	// Loop through search pattern
 	for ( k=0; k<search_n; k++ ) {
 
@@ -525,15 +1046,15 @@ static void peak_search(int p,
 		curr_ss = pfinter->inss[p] + search_ss[k] + aiss * asic_size_ss;
 		pi = curr_fs + curr_ss * num_pix_fs;
 
-		curr_radius = (int)rint(r_map[pi]);
+		curr_radius = r_bin[pi];
 		curr_threshold = rthreshold[curr_radius];
 
 		// Above threshold?
-		if ( copy[pi] > curr_threshold
+		if ( (float)copy[pi] > curr_threshold
 		  && pfinter->pix_in_peak_map[pi] == 0
 		  && mask[pi] != 0 ) {
 
-			curr_i = copy[pi] - roffset[curr_radius];
+			curr_i = (float)copy[pi] - roffset[curr_radius];
 			*sum_i += curr_i;
 			*sum_com_fs += curr_i * ((float)curr_fs);  // for center of mass x
 			*sum_com_ss += curr_i * ((float)curr_ss);  // for center of mass y
@@ -541,6 +1062,8 @@ static void peak_search(int p,
 			pfinter->inss[*num_pix_in_peak] = pfinter->inss[p] + search_ss[k];
 			pfinter->infs[*num_pix_in_peak] = pfinter->infs[p] + search_fs[k];
 			pfinter->pix_in_peak_map[pi] = 1;
+			pfinter->touched_pixels[pfinter->num_touched_pixels] = pi;
+			pfinter->num_touched_pixels += 1;
 			if ( *num_pix_in_peak < max_pix_count ) {
 				  pfinter->peak_pixels[*num_pix_in_peak] = pi;
 			}
@@ -550,8 +1073,9 @@ static void peak_search(int p,
 }
 
 
+template <typename T, int ASIC_FS, int ASIC_SS, int NUM_PIX_FS>
 static void search_in_ring(int ring_width, int com_fs_int, int com_ss_int,
-                           float *copy, float *r_map,
+                           const T *copy, unsigned short *r_bin,
                            float *rthreshold, float *roffset,
                            char *pix_in_peak_map, char *mask, int asic_size_fs,
                            int asic_size_ss, int aifs, int aiss,
@@ -574,6 +1098,12 @@ static void search_in_ring(int ring_width, int com_fs_int, int com_ss_int,
 	float sum_i;
 	float sum_i_squared;
 
+	if ( ASIC_FS != 0 ) {
+		asic_size_fs = ASIC_FS;
+		asic_size_ss = ASIC_SS;
+		num_pix_fs = NUM_PIX_FS;
+	}
+
 	ring_width = 2 * local_bg_radius;
 
 	sum_i = 0;
@@ -601,11 +1131,11 @@ static void search_in_ring(int ring_width, int com_fs_int, int com_ss_int,
 			curr_ss = com_ss_int + ssj + aiss * asic_size_ss;
 			pi = curr_fs + curr_ss * num_pix_fs;
 
-			curr_radius = (int)rint(r_map[pi]);
+			curr_radius = r_bin[pi];
 			curr_threshold = rthreshold[curr_radius];
 
 			// Intensity above background ??? just intensity?
-			curr_i = copy[pi];
+			curr_i = (float)copy[pi];
 
 			// Keep track of value and value-squared for offset and sigma calculation
 			if ( curr_i < curr_threshold && pix_in_peak_map[pi] == 0 && mask[pi] != 0 ) {
@@ -632,61 +1162,431 @@ static void search_in_ring(int ring_width, int com_fs_int, int com_ss_int,
 			*local_sigma = 0.01;
 		}
 	} else {
-		local_radius = (int)rint(r_map[(int)rint(com_idx)]);
+		local_radius = r_bin[com_idx];
 		*local_offset = roffset[local_radius];
 		*local_sigma = 0.01;
 	}
 }
 
 
-static void process_panel(int asic_size_fs, int asic_size_ss, int num_pix_fs,
-                          int aiss, int aifs, float *rthreshold,
-                          float *roffset, int *peak_count,
-                          float *copy, struct peakfinder_intern_data *pfinter,
-                          float *r_map, char *mask, int *npix, float *com_fs,
-                          float *com_ss, int *com_index, float *tot_i,
-                          float *max_i, float *sigma, float *snr,
-                          int min_pix_count, int max_pix_count,
-                          int local_bg_radius, float min_snr, int max_n_peaks)
+// Allocates the integral images of the rows of all the panels, and marks every row as
+// not computed. The spans of the disc are only computed when the radius of the local
+// background is known
+static struct local_background_tables *allocate_local_background_tables(int asic_size_fs,
+                                                                        int num_pix_ss,
+                                                                        int num_panels_fs)
 {
-	int pxss, pxfs;
-	int num_pix_in_peak;
+	struct local_background_tables *lbgtab;
+	long num_rows;
 
-	// Loop over pixels within a module
-	for ( pxss=1 ; pxss<asic_size_ss-1 ; pxss++ ) {
-		for ( pxfs=1 ; pxfs<asic_size_fs-1 ; pxfs++ ) {
+	lbgtab = (struct local_background_tables *)malloc(sizeof(struct local_background_tables));
+	if ( lbgtab == NULL ) {
+		return NULL;
+	}
 
-			float curr_thresh;
-			int pxidx;
-			int curr_rad;
+	lbgtab->num_panels_fs = num_panels_fs;
+	lbgtab->row_stride = asic_size_fs + 1;
+	num_rows = (long)num_pix_ss * num_panels_fs;
+	lbgtab->sum = (double *)malloc(num_rows*lbgtab->row_stride*sizeof(double));
+	lbgtab->sum_sq = (double *)malloc(num_rows*lbgtab->row_stride*sizeof(double));
+	lbgtab->count = (int *)malloc(num_rows*lbgtab->row_stride*sizeof(int));
+	lbgtab->row_ready = (char *)calloc(num_rows, sizeof(char));
+	if ( lbgtab->sum == NULL || lbgtab->sum_sq == NULL || lbgtab->count == NULL
+	  || lbgtab->row_ready == NULL ) {
+		free(lbgtab->sum);
+		free(lbgtab->sum_sq);
+		free(lbgtab->count);
+		free(lbgtab->row_ready);
+		free(lbgtab);
+		return NULL;
+	}
 
-			pxidx = (pxss + aiss * asic_size_ss) * num_pix_fs +
-			pxfs + aifs * asic_size_fs;
+	lbgtab->ring_width = -1;
+	lbgtab->span_first = NULL;
+	lbgtab->span_last = NULL;
 
-			curr_rad = (int)rint(r_map[pxidx]);
-			curr_thresh = rthreshold[curr_rad];
+	return lbgtab;
+}
 
-			if ( copy[pxidx] > curr_thresh
-			  && pfinter->pix_in_peak_map[pxidx] == 0
-			  && mask[pxidx] != 0 ) {   //??? not sure if needed
 
-				// This might be the start of a new peak - start searching
-				float sum_com_fs, sum_com_ss;
-				float sum_i;
-				float peak_com_fs, peak_com_ss;
-				float peak_com_fs_int, peak_com_ss_int;
-				float peak_tot_i, pk_tot_i_raw;
-				float peak_max_i, pk_max_i_raw;
-				float peak_snr;
-				float local_sigma, local_offset;
-				float background_max_i;
-				int lt_num_pix_in_pk;
-				int ring_width;
-				int peak_idx;
-				int com_idx;
-				int p;
+static void free_local_background_tables(struct local_background_tables *lbgtab)
+{
+	free(lbgtab->sum);
+	free(lbgtab->sum_sq);
+	free(lbgtab->count);
+	free(lbgtab->row_ready);
+	free(lbgtab->span_first);
+	free(lbgtab->span_last);
+	free(lbgtab);
+}
 
-				pfinter->infs[0] = pxfs;
+
+// Computes the spans of the disc searched by search_in_ring: the pixels with
+// fsi*fsi + ssj*ssj <= ring_width*ring_width, in the square from -ring_width
+// (included) to ring_width (excluded). Returns 1 if memory cannot be allocated
+static int set_local_background_spans(struct local_background_tables *lbgtab,
+                                      int ring_width)
+{
+	int *span_first;
+	int *span_last;
+	int ssj;
+	int half_width;
+	int max_sq;
+
+	if ( ring_width == lbgtab->ring_width ) {
+		return 0;
+	}
+
+	span_first = NULL;
+	span_last = NULL;
+	if ( ring_width > 0 ) {
+		span_first = (int *)malloc(2*ring_width*sizeof(int));
+		span_last = (int *)malloc(2*ring_width*sizeof(int));
+		if ( span_first == NULL || span_last == NULL ) {
+			free(span_first);
+			free(span_last);
+			return 1;
+		}
+	}
+
+	for ( ssj=-ring_width ; ssj<ring_width ; ssj++ ) {
+		max_sq = ring_width * ring_width - ssj * ssj;
+		half_width = (int)sqrt((double)max_sq);
+		while ( half_width * half_width > max_sq ) half_width--;
+		while ( (half_width + 1) * (half_width + 1) <= max_sq ) half_width++;
+		span_first[ssj + ring_width] = -half_width;
+		span_last[ssj + ring_width] = half_width < ring_width - 1 ? half_width
+		                                                          : ring_width - 1;
+	}
+
+	free(lbgtab->span_first);
+	free(lbgtab->span_last);
+	lbgtab->span_first = span_first;
+	lbgtab->span_last = span_last;
+	lbgtab->ring_width = ring_width;
+
+	return 0;
+}
+
+
+// Computes the integral images of a panel row, and returns the index of their first
+// entry. The pixels in a peak are always above threshold, so the pixels that
+// search_in_ring uses for the local background do not change during the search and
+// the row can be computed at any time
+template <typename T>
+static long local_background_row(struct local_background_tables *lbgtab,
+                                 const T *copy, char *mask, unsigned short *r_bin,
+                                 float *rthreshold, int asic_size_fs, int num_pix_fs,
+                                 int aifs, int curr_ss)
+{
+	long row_index;
+	long row;
+	long pidx;
+	int ifs;
+	double sum_i, sum_i_squared;
+	int np_sigma;
+	float curr_i;
+
+	row_index = (long)curr_ss * lbgtab->num_panels_fs + aifs;
+	row = row_index * lbgtab->row_stride;
+	if ( lbgtab->row_ready[row_index] ) {
+		return row;
+	}
+
+	pidx = (long)curr_ss * num_pix_fs + aifs * asic_size_fs;
+	sum_i = 0;
+	sum_i_squared = 0;
+	np_sigma = 0;
+	lbgtab->sum[row] = 0;
+	lbgtab->sum_sq[row] = 0;
+	lbgtab->count[row] = 0;
+	for ( ifs=0 ; ifs<asic_size_fs ; ifs++ ) {
+		curr_i = (float)copy[pidx + ifs];
+		if ( curr_i < rthreshold[r_bin[pidx + ifs]] && mask[pidx + ifs] != 0 ) {
+			sum_i += curr_i;
+			sum_i_squared += (double)curr_i * curr_i;
+			np_sigma++;
+		}
+		lbgtab->sum[row + ifs + 1] = sum_i;
+		lbgtab->sum_sq[row + ifs + 1] = sum_i_squared;
+		lbgtab->count[row + ifs + 1] = np_sigma;
+	}
+	lbgtab->row_ready[row_index] = 1;
+
+	return row;
+}
+
+
+// Local background and standard deviation from the integral images, with two
+// lookups per row of the disc instead of one test per pixel, so the cost for each
+// peak grows with the radius of the disc, not with its area. An exact disc cannot be
+// read from a 2D summed-area table with a constant number of lookups. The sums are
+// accumulated in double precision, while search_in_ring accumulates them in single
+// precision, so the two methods can differ by rounding. The maximum background
+// intensity is computed separately, by local_background_max
+template <typename T>
+static void integral_local_background(struct local_background_tables *lbgtab,
+                                      int com_fs_int, int com_ss_int, const T *copy,
+                                      char *mask, unsigned short *r_bin,
+                                      float *rthreshold, float *roffset,
+                                      int asic_size_fs, int asic_size_ss, int aifs,
+                                      int aiss, int num_pix_fs, int com_idx,
+                                      float *local_sigma, float *local_offset)
+{
+	int si;
+	int curr_ss;
+	int first_fs, last_fs;
+	long row;
+	double sum_i, sum_i_squared;
+	double mean, variance;
+	int np_sigma;
+
+	sum_i = 0;
+	sum_i_squared = 0;
+	np_sigma = 0;
+
+	for ( si=0 ; si<2*lbgtab->ring_width ; si++ ) {
+
+		curr_ss = com_ss_int + si - lbgtab->ring_width;
+		if ( curr_ss < 0 || curr_ss >= asic_size_ss ) continue;
+
+		first_fs = com_fs_int + lbgtab->span_first[si];
+		last_fs = com_fs_int + lbgtab->span_last[si];
+		if ( first_fs < 0 ) first_fs = 0;
+		if ( last_fs >= asic_size_fs ) last_fs = asic_size_fs - 1;
+		if ( first_fs > last_fs ) continue;
+
+		row = local_background_row(lbgtab, copy, mask, r_bin, rthreshold,
+		                           asic_size_fs, num_pix_fs, aifs,
+		                           curr_ss + aiss * asic_size_ss);
+		sum_i += lbgtab->sum[row + last_fs + 1] - lbgtab->sum[row + first_fs];
+		sum_i_squared += lbgtab->sum_sq[row + last_fs + 1]
+		               - lbgtab->sum_sq[row + first_fs];
+		np_sigma += lbgtab->count[row + last_fs + 1] - lbgtab->count[row + first_fs];
+	}
+
+	if ( np_sigma != 0 ) {
+		mean = sum_i / np_sigma;
+		variance = sum_i_squared / np_sigma - mean * mean;
+		*local_offset = mean;
+		if ( variance >= 0 ) {
+			*local_sigma = sqrt(variance);
+		} else {
+			*local_sigma = 0.01;
+		}
+	} else {
+		*local_offset = roffset[r_bin[com_idx]];
+		*local_sigma = 0.01;
+	}
+}
+
+
+// Maximum intensity of the local background pixels of a peak, visiting only the
+// pixels in the disc. This still costs one test per pixel of the disc, but it is only
+// needed by the peaks that pass the signal-to-noise test
+template <typename T>
+static float local_background_max(const struct local_background_tables *lbgtab,
+                                  int com_fs_int, int com_ss_int, const T *copy,
+                                  char *mask, unsigned short *r_bin,
+                                  float *rthreshold, int asic_size_fs,
+                                  int asic_size_ss, int aifs, int aiss,
+                                  int num_pix_fs)
+{
+	int si;
+	int curr_ss;
+	int first_fs, last_fs;
+	long pi, last_pi;
+	float curr_i;
+	float background_max_i;
+
+	background_max_i = 0;
+
+	for ( si=0 ; si<2*lbgtab->ring_width ; si++ ) {
+
+		curr_ss = com_ss_int + si - lbgtab->ring_width;
+		if ( curr_ss < 0 || curr_ss >= asic_size_ss ) continue;
+
+		first_fs = com_fs_int + lbgtab->span_first[si];
+		last_fs = com_fs_int + lbgtab->span_last[si];
+		if ( first_fs < 0 ) first_fs = 0;
+		if ( last_fs >= asic_size_fs ) last_fs = asic_size_fs - 1;
+
+		pi = (long)(curr_ss + aiss * asic_size_ss) * num_pix_fs + aifs * asic_size_fs;
+		last_pi = pi + last_fs;
+		for ( pi=pi+first_fs ; pi<=last_pi ; pi++ ) {
+			curr_i = (float)copy[pi];
+			if ( curr_i > background_max_i && curr_i < rthreshold[r_bin[pi]]
+			  && mask[pi] != 0 ) {
+				background_max_i = curr_i;
+			}
+		}
+	}
+
+	return background_max_i;
+}
+
+
+// Builds the bitmap of the unmasked pixels above the threshold of their radial bin,
+// which are the candidate seeds of the peak search. Each row of the frame starts at
+// a new word
+template <typename T>
+static void fill_seed_bitmap(unsigned long long *seed_bitmap, long row_words,
+                             const T *data, char *mask, unsigned short *r_bin,
+                             float *rthreshold, int num_pix_fs, int num_pix_ss)
+{
+	int iss;
+	long wi;
+	int bi, num_bits;
+	long pidx;
+	unsigned long long word;
+
+	for ( iss=0 ; iss<num_pix_ss ; iss++ ) {
+		for ( wi=0 ; wi<row_words ; wi++ ) {
+			pidx = (long)iss * num_pix_fs + wi * 64;
+			num_bits = num_pix_fs - wi * 64;
+			if ( num_bits > 64 ) {
+				num_bits = 64;
+			}
+			word = 0;
+			for ( bi=0 ; bi<num_bits ; bi++ ) {
+				word |= (unsigned long long)(((float)data[pidx + bi]
+				                              > rthreshold[r_bin[pidx + bi]])
+				                             & (mask[pidx + bi] != 0)) << bi;
+			}
+			seed_bitmap[iss * row_words + wi] = word;
+		}
+	}
+}
+
+
+// Float frames are read directly by the vectorized kernels
+static void fill_seed_bitmap(unsigned long long *seed_bitmap, long row_words,
+                             const float *data, char *mask, unsigned short *r_bin,
+                             float *rthreshold, int num_pix_fs, int num_pix_ss)
+{
+	seed_bitmap_row_function fill_row;
+	int iss;
+	long row_start;
+
+	fill_row = get_seed_bitmap_row_function();
+	for ( iss=0 ; iss<num_pix_ss ; iss++ ) {
+		row_start = (long)iss * num_pix_fs;
+		fill_row(data + row_start, mask + row_start, r_bin + row_start, rthreshold,
+		         num_pix_fs, seed_bitmap + iss * row_words);
+	}
+}
+
+
+// Returns the index of the first set bit between first and end (excluded) in a row
+// of the seed bitmap, or end if there is none
+static inline int next_seed_pixel(const unsigned long long *row, int first, int end)
+{
+	int wi;
+	unsigned long long word;
+	int bit;
+
+	wi = first >> 6;
+	word = row[wi] & (~0ULL << (first & 63));
+	while ( word == 0 ) {
+		wi += 1;
+		if ( (wi << 6) >= end ) {
+			return end;
+		}
+		word = row[wi];
+	}
+	bit = (wi << 6) + __builtin_ctzll(word);
+
+	return bit < end ? bit : end;
+}
+
+
+template <typename T, int ASIC_FS, int ASIC_SS, int NUM_PIX_FS>
+static void process_panel(int asic_size_fs, int asic_size_ss, int num_pix_fs,
+                          int aiss, int aifs, float *rthreshold,
+                          float *roffset, int *peak_count,
+                          const T *copy, struct peakfinder_intern_data *pfinter,
+                          unsigned short *r_bin, char *mask, int *npix, float *com_fs,
+                          float *com_ss, int *com_index, float *tot_i,
+                          float *max_i, float *sigma, float *snr,
+                          int *peak_pixels, int pixel_stride,
+                          int min_pix_count, int max_pix_count,
+                          int local_bg_radius, float min_snr, int max_n_peaks,
+                          const unsigned long long *seed_bitmap,
+                          long seed_bitmap_row_words,
+                          struct local_background_tables *lbgtab)
+{
+	int pxss, pxfs;
+	int num_pix_in_peak;
+	int panel_fs, panel_ss;
+	tPeakfinder8Stats *stats;
+	long long panel_start, stage_start, nested_ns;
+
+	// The index arithmetic is folded by the compiler when the layout is fixed
+	if ( ASIC_FS != 0 ) {
+		asic_size_fs = ASIC_FS;
+		asic_size_ss = ASIC_SS;
+		num_pix_fs = NUM_PIX_FS;
+	}
+
+	panel_fs = aifs * asic_size_fs;
+	panel_ss = aiss * asic_size_ss;
+
+	// The time spent growing the peaks and computing their local background is
+	// subtracted from the time of the whole panel to get the candidate scan time
+	stats = pfinter->collect_stats ? &pfinter->stats : NULL;
+	panel_start = 0;
+	stage_start = 0;
+	nested_ns = 0;
+	if ( stats != NULL ) {
+		panel_start = stats_clock_ns();
+	}
+
+	// Loop over pixels within a module
+	for ( pxss=1 ; pxss<asic_size_ss-1 ; pxss++ ) {
+		for ( pxfs=1 ; pxfs<asic_size_fs-1 ; pxfs++ ) {
+
+			float curr_thresh;
+			int pxidx;
+			int curr_rad;
+
+			// Skips directly to the next pixel that can start a peak. The test below
+			// is still needed, since the pixel could be part of a peak by now
+			if ( seed_bitmap != NULL ) {
+				pxfs = next_seed_pixel(seed_bitmap + (pxss + aiss * asic_size_ss)
+				                       * seed_bitmap_row_words,
+				                       panel_fs + pxfs,
+				                       panel_fs + asic_size_fs - 1) - panel_fs;
+				if ( pxfs >= asic_size_fs - 1 ) {
+					break;
+				}
+			}
+
+			pxidx = (pxss + aiss * asic_size_ss) * num_pix_fs +
+			pxfs + aifs * asic_size_fs;
+
+			curr_rad = r_bin[pxidx];
+			curr_thresh = rthreshold[curr_rad];
+
+			if ( (float)copy[pxidx] > curr_thresh
+			  && pfinter->pix_in_peak_map[pxidx] == 0
+			  && mask[pxidx] != 0 ) {   //??? not sure if needed
+
+				// This might be the start of a new peak - start searching
+				float sum_com_fs, sum_com_ss;
+				float sum_i;
+				float peak_com_fs, peak_com_ss;
+				float peak_com_fs_int, peak_com_ss_int;
+				float peak_tot_i, pk_tot_i_raw;
+				float peak_max_i, pk_max_i_raw;
+				float peak_snr;
+				float local_sigma, local_offset;
+				float background_max_i;
+				int ring_width;
+				int peak_idx;
+				int com_idx;
+				int p;
+
+				pfinter->infs[0] = pxfs;
 				pfinter->inss[0] = pxss;
 				pfinter->peak_pixels[0] = pxidx;
 				num_pix_in_peak = 0; //y 1;
@@ -695,35 +1595,54 @@ static void process_panel(int asic_size_fs, int asic_size_ss, int num_pix_fs,
 				sum_com_fs = 0;
 				sum_com_ss = 0;
 
-				// Keep looping until the pixel count within this peak does not change
-				do {
-					lt_num_pix_in_pk = num_pix_in_peak;
-
-					// Loop through points known to be within this peak
-					for ( p=0; p<=num_pix_in_peak; p++ ) { //changed from 1 to 0 by O.Y.
-						peak_search(p,
-						            pfinter, copy, mask,
-						            r_map,
-						            rthreshold,
-						            roffset,
-						            &num_pix_in_peak,
-						            asic_size_fs,
-						            asic_size_ss,
-						            aifs, aiss,
-						            num_pix_fs,
-						            &sum_com_fs,
-						            &sum_com_ss,
-						            &sum_i,
-						            max_pix_count);
-					}
+				if ( stats != NULL ) {
+					stats->num_seeds += 1;
+					stage_start = stats_clock_ns();
+				}
+
+				// Flood fill: the list of pixels in the peak is also the queue of the
+				// pixels whose neighbours must be searched, and the loop bound grows
+				// as pixels are added, so each pixel is visited once. The original
+				// code repeated this loop until the pixel count did not change, but a
+				// second pass can never add a pixel: the neighbours rejected in the
+				// first pass are still below threshold, masked or already in a peak.
+				// The seed passes the same test as its neighbours, so the search
+				// around it adds it to the list as pixel 0. The original code also
+				// searched the stale entry just past the end of the list, which could
+				// add a pixel in the middle of the loop and overwrite the coordinates
+				// of the pixel that was being searched
+				for ( p=0; p==0 || p<num_pix_in_peak; p++ ) { //changed from 1 to 0 by O.Y.
+					peak_search<T, ASIC_FS, ASIC_SS, NUM_PIX_FS>(
+					    p, pfinter, copy, mask, r_bin, rthreshold, roffset,
+					    &num_pix_in_peak, asic_size_fs, asic_size_ss, aifs, aiss,
+					    num_pix_fs, &sum_com_fs, &sum_com_ss, &sum_i, max_pix_count);
+				}
 
-				} while ( lt_num_pix_in_pk != num_pix_in_peak );
+				if ( stats != NULL ) {
+					stage_start = stats_clock_ns() - stage_start;
+					stats->stage_ns[PF8_STAGE_PEAK_GROWTH] += stage_start;
+					nested_ns += stage_start;
+					if ( num_pix_in_peak > stats->max_peak_pixels ) {
+						stats->max_peak_pixels = num_pix_in_peak;
+					}
+				}
 
 				// Too many or too few pixels means ignore this 'peak'; move on now
-				if ( num_pix_in_peak < min_pix_count || num_pix_in_peak > max_pix_count ) continue;
+				if ( num_pix_in_peak < min_pix_count || num_pix_in_peak > max_pix_count ) {
+					if ( stats != NULL ) stats->num_rejected[PF8_REJECTED_PIX_COUNT] += 1;
+					continue;
+				}
 
 				// If for some reason sum_i is 0 - it's better to skip
-				if ( fabs(sum_i) < 1e-10 ) continue;
+				if ( fabs(sum_i) < 1e-10 ) {
+					if ( stats != NULL ) stats->num_rejected[PF8_REJECTED_INTENSITY] += 1;
+					continue;
+				}
+
+				if ( stats != NULL ) {
+					stats->num_candidates += 1;
+					stage_start = stats_clock_ns();
+				}
 
 				// Calculate center of mass for this peak from initial peak search
 				peak_com_fs = sum_com_fs / fabs(sum_i);
@@ -742,19 +1661,27 @@ static void process_panel(int asic_size_fs, int asic_size_ss, int num_pix_fs,
 
 				ring_width = 2 * local_bg_radius;
 
-				search_in_ring(ring_width, peak_com_fs_int,
-				               peak_com_ss_int,
-				               copy, r_map, rthreshold,
-				               roffset,
-				               pfinter->pix_in_peak_map,
-				               mask, asic_size_fs,
-				               asic_size_ss,
-				               aifs, aiss,
-				               num_pix_fs,
-				               &local_sigma,
-				               &local_offset,
-				               &background_max_i,
-				               com_idx, local_bg_radius);
+				if ( lbgtab == NULL ) {
+					search_in_ring<T, ASIC_FS, ASIC_SS, NUM_PIX_FS>(
+					    ring_width, peak_com_fs_int, peak_com_ss_int, copy, r_bin,
+					    rthreshold, roffset, pfinter->pix_in_peak_map, mask,
+					    asic_size_fs, asic_size_ss, aifs, aiss, num_pix_fs,
+					    &local_sigma, &local_offset, &background_max_i, com_idx,
+					    local_bg_radius);
+				} else {
+					integral_local_background(lbgtab, peak_com_fs_int,
+					                          peak_com_ss_int, copy, mask, r_bin,
+					                          rthreshold, roffset, asic_size_fs,
+					                          asic_size_ss, aifs, aiss, num_pix_fs,
+					                          com_idx, &local_sigma,
+					                          &local_offset);
+				}
+
+				if ( stats != NULL ) {
+					stage_start = stats_clock_ns() - stage_start;
+					stats->stage_ns[PF8_STAGE_LOCAL_BACKGROUND] += stage_start;
+					nested_ns += stage_start;
+				}
 
 				// Re-integrate (and re-centroid) peak using local background estimates
 				peak_tot_i = 0;
@@ -774,14 +1701,16 @@ static void process_panel(int asic_size_fs, int asic_size_ss, int num_pix_fs,
 					int curr_fs, curr_ss;
 
 					curr_idx = pfinter->peak_pixels[peak_idx];
-					curr_i_raw = copy[curr_idx];
+					curr_i_raw = (float)copy[curr_idx];
 					curr_i = curr_i_raw - local_offset;
 					peak_tot_i += curr_i;
 					pk_tot_i_raw += curr_i_raw;
 
-					// Remember that curr_idx = curr_fs + curr_ss*num_pix_fs
-					curr_fs = curr_idx % num_pix_fs;
-					curr_ss = curr_idx / num_pix_fs;
+					// The panel coordinates of the pixels are stored, in the same
+					// order, while the peak grows: they do not need to be recovered
+					// from curr_idx = curr_fs + curr_ss*num_pix_fs
+					curr_fs = pfinter->infs[peak_idx] + panel_fs;
+					curr_ss = pfinter->inss[peak_idx] + panel_ss;
 					sum_com_fs += curr_i_raw * ((float)curr_fs);
 					sum_com_ss += curr_i_raw * ((float)curr_ss);
 
@@ -791,7 +1720,10 @@ static void process_panel(int asic_size_fs, int asic_size_ss, int num_pix_fs,
 
 
 				// This CAN happen! Better to skip...
-				if ( fabs(pk_tot_i_raw) < 1e-10 ) continue;
+				if ( fabs(pk_tot_i_raw) < 1e-10 ) {
+					if ( stats != NULL ) stats->num_rejected[PF8_REJECTED_INTENSITY] += 1;
+					continue;
+				}
 
 				peak_com_fs = sum_com_fs / fabs(pk_tot_i_raw);
 				peak_com_ss = sum_com_ss / fabs(pk_tot_i_raw);
@@ -803,7 +1735,28 @@ static void process_panel(int asic_size_fs, int asic_size_ss, int num_pix_fs,
 					peak_snr = 0;
 				}
 
-				if (peak_snr < min_snr) continue;
+				if (peak_snr < min_snr) {
+					if ( stats != NULL ) stats->num_rejected[PF8_REJECTED_SNR] += 1;
+					continue;
+				}
+
+				// With the integral local background, the background maximum is only
+				// needed by the peaks that get this far
+				if ( lbgtab != NULL ) {
+					if ( stats != NULL ) {
+						stage_start = stats_clock_ns();
+					}
+					background_max_i = local_background_max(lbgtab, peak_com_fs_int,
+					                                        peak_com_ss_int, copy, mask,
+					                                        r_bin, rthreshold,
+					                                        asic_size_fs, asic_size_ss,
+					                                        aifs, aiss, num_pix_fs);
+					if ( stats != NULL ) {
+						stage_start = stats_clock_ns() - stage_start;
+						stats->stage_ns[PF8_STAGE_LOCAL_BACKGROUND] += stage_start;
+						nested_ns += stage_start;
+					}
+				}
 
 				// Is the maximum intensity in the peak enough above intensity in background region to
 				// be a peak and not noise? The more pixels there are in the peak, the more relaxed we
@@ -811,13 +1764,17 @@ static void process_panel(int asic_size_fs, int asic_size_ss, int num_pix_fs,
 				//f_background_thresh = background_max_i - local_offset; //!!! Ofiget'!  If I uncomment
 				// if (peak_max_i < f_background_thresh) {               // these lines the result is
 				// different!
-				if (peak_max_i < background_max_i - local_offset) continue;
+				if (peak_max_i < background_max_i - local_offset) {
+					if ( stats != NULL ) stats->num_rejected[PF8_REJECTED_BACKGROUND] += 1;
+					continue;
+				}
 
 				if ( peak_com_fs < aifs*asic_size_fs
 				  || peak_com_fs > (aifs+1)*asic_size_fs-1
 				  || peak_com_ss < aiss*asic_size_ss
 				  || peak_com_ss > (aiss+1)*asic_size_ss-1)
 				{
+					if ( stats != NULL ) stats->num_rejected[PF8_REJECTED_PANEL_EDGE] += 1;
 					continue;
 				}
 
@@ -850,54 +1807,127 @@ static void process_panel(int asic_size_fs, int asic_size_ss, int num_pix_fs,
 						max_i[pidx] = peak_max_i;
 						sigma[pidx] = local_sigma;
 						snr[pidx] = peak_snr;
+						memcpy(peak_pixels + (long)pidx * pixel_stride,
+						       pfinter->peak_pixels, num_pix_in_peak*sizeof(int));
 					}
 					*peak_count += 1;
 				}
 			}
 		}
 	}
+
+	if ( stats != NULL ) {
+		stats->stage_ns[PF8_STAGE_CANDIDATE_SCAN] += stats_clock_ns() - panel_start
+		                                             - nested_ns;
+	}
+}
+
+
+// Kernel searching the peaks in one panel
+template <typename T>
+struct panel_function
+{
+	typedef void (*type)(int asic_size_fs, int asic_size_ss, int num_pix_fs,
+	                     int aiss, int aifs, float *rthreshold, float *roffset,
+	                     int *peak_count, const T *copy,
+	                     struct peakfinder_intern_data *pfinter,
+	                     unsigned short *r_bin, char *mask, int *npix,
+	                     float *com_fs, float *com_ss, int *com_index,
+	                     float *tot_i, float *max_i, float *sigma, float *snr,
+	                     int *peak_pixels, int pixel_stride, int min_pix_count,
+	                     int max_pix_count, int local_bg_radius, float min_snr,
+	                     int max_n_peaks, const unsigned long long *seed_bitmap,
+	                     long seed_bitmap_row_words,
+	                     struct local_background_tables *lbgtab);
+};
+
+
+// Returns the panel kernel compiled for a layout, among the ones returned by
+// get_peakfinder8_info in om.algorithms.crystallography, or the generic kernel for
+// any other layout
+template <typename T>
+static typename panel_function<T>::type get_panel_function(int panel_kernel,
+                                                           int asic_size_fs,
+                                                           int asic_size_ss,
+                                                           int num_pix_fs)
+{
+	if ( panel_kernel == PF8_PANEL_KERNEL_LAYOUT ) {
+
+		// CSPAD
+		if ( asic_size_fs == 194 && asic_size_ss == 185 && num_pix_fs == 8 * 194 ) {
+			return process_panel<T, 194, 185, 8 * 194>;
+		}
+
+		// Pilatus
+		if ( asic_size_fs == 2463 && asic_size_ss == 2527 && num_pix_fs == 2463 ) {
+			return process_panel<T, 2463, 2527, 2463>;
+		}
+
+		// Jungfrau 1M and 4M
+		if ( asic_size_fs == 1024 && asic_size_ss == 512 && num_pix_fs == 1024 ) {
+			return process_panel<T, 1024, 512, 1024>;
+		}
+
+		// Epix10KA 2M
+		if ( asic_size_fs == 384 && asic_size_ss == 352 && num_pix_fs == 384 ) {
+			return process_panel<T, 384, 352, 384>;
+		}
+
+		// Rayonix
+		if ( asic_size_fs == 1920 && asic_size_ss == 1920 && num_pix_fs == 1920 ) {
+			return process_panel<T, 1920, 1920, 1920>;
+		}
+	}
+
+	return process_panel<T, 0, 0, 0>;
 }
 
 
+template <typename T>
 static int peakfinder8_base(float *roffset, float *rthreshold,
-                            float *data, char *mask, float *r_map,
+                            const T *data, char *mask, unsigned short *r_bin,
                             int asic_size_fs, int num_asics_fs,
                             int asic_size_ss, int num_asics_ss,
                             int max_n_peaks, int *num_found_peaks,
                             int *npix, float *com_fs,
                             float *com_ss, int *com_index, float *tot_i,
                             float *max_i, float *sigma, float *snr,
+                            int *peak_pixels, int pixel_stride,
                             int min_pix_count, int max_pix_count,
                             int local_bg_radius, float min_snr,
-                            char* outliersMask)
+                            struct peakfinder_intern_data *pfinter,
+                            const unsigned long long *seed_bitmap,
+                            long seed_bitmap_row_words,
+                            struct local_background_tables *lbgtab,
+                            int panel_kernel, char* outliersMask)
 {
 
 	int num_pix_fs, num_pix_ss, num_pix_tot;
 	int aifs, aiss;
 	int peak_count;
-	struct peakfinder_intern_data *pfinter;
+	typename panel_function<T>::type process_panel_kernel;
 
 	num_pix_fs = asic_size_fs * num_asics_fs;
 	num_pix_ss = asic_size_ss * num_asics_ss;
 	num_pix_tot = num_pix_fs * num_pix_ss;
+	process_panel_kernel = get_panel_function<T>(panel_kernel, asic_size_fs,
+	                                             asic_size_ss, num_pix_fs);
 
-	pfinter = allocate_peakfinder_intern_data(num_pix_tot, max_pix_count);
-	if ( pfinter == NULL ) {
-		return 1;
-	}
+	reset_peakfinder_intern_data(pfinter);
 
 	peak_count = 0;
 
 	// Loop over modules (nxn array)
 	for ( aiss=0 ; aiss<num_asics_ss ; aiss++ ) {
 		for ( aifs=0 ; aifs<num_asics_fs ; aifs++ ) {                 // ??? to change to proper panels need
-			process_panel(asic_size_fs, asic_size_ss, num_pix_fs, // change copy, mask, r_map
-			              aiss, aifs, rthreshold, roffset,
-			              &peak_count, data, pfinter, r_map, mask,
-			              npix, com_fs, com_ss, com_index, tot_i,
-			              max_i, sigma, snr, min_pix_count,
-			              max_pix_count, local_bg_radius, min_snr,
-			              max_n_peaks);
+			process_panel_kernel(asic_size_fs, asic_size_ss, num_pix_fs, // change copy, mask, r_bin
+			                     aiss, aifs, rthreshold, roffset,
+			                     &peak_count, data, pfinter, r_bin, mask,
+			                     npix, com_fs, com_ss, com_index, tot_i,
+			                     max_i, sigma, snr, peak_pixels, pixel_stride,
+			                     min_pix_count, max_pix_count, local_bg_radius,
+			                     min_snr, max_n_peaks, seed_bitmap,
+			                     seed_bitmap_row_words, lbgtab);
 		}
 	}
 	*num_found_peaks = peak_count;
@@ -906,103 +1936,1969 @@ static int peakfinder8_base(float *roffset, float *rthreshold,
 		memcpy(outliersMask, pfinter->pix_in_peak_map, num_pix_tot*sizeof(char));
 	}
 
-	free_peakfinder_intern_data(pfinter);
-
 	return 0;
 }
 
-// Cheetah Peakfinder8
-// Count peaks by searching for connected pixels above threshold
-// Includes modifications during Cherezov December 2014 LE80
-// Anton Barty
-int peakfinder8(tPeakList *peaklist, float *data, char *mask, float *pix_r,
-                long asic_nx, long asic_ny, long nasics_x, long nasics_y,
-                float ADCthresh, float hitfinderMinSNR,
-                long hitfinderMinPixCount, long hitfinderMaxPixCount,
-                long hitfinderLocalBGRadius, char* outliersMask)
+
+// Parameters of the frame that the worker threads are processing
+struct peakfinder_frame_job
 {
-	struct radial_stats *rstats;
-	struct peakfinder_peak_data *pkdata;
-	int iterations;
-	int num_pix_fs, num_pix_ss;
-	int num_pix_tot;
-	int max_num_peaks;
-	int num_found_peaks;
-	int ret;
-	int pki;
-	int peaks_to_add;
+	float *roffset;
+	float *rthreshold;
+	const void *data;
+	int data_type;
+	char *mask;
+	unsigned short *r_bin;
+	int asic_size_fs;
+	int num_asics_fs;
+	int asic_size_ss;
+	int num_asics_ss;
+	int max_n_peaks;
+	int min_pix_count;
+	int max_pix_count;
+	int local_bg_radius;
+	float min_snr;
+	const unsigned long long *seed_bitmap;
+	long seed_bitmap_row_words;
+	struct local_background_tables *lbgtab;
+	int panel_kernel;
+};
 
-	max_num_peaks = peaklist->nPeaks_max;
 
-	// Derived values
-	num_pix_fs = asic_nx * nasics_x;
-	num_pix_ss = asic_ny * nasics_y;
-	num_pix_tot = num_pix_fs * num_pix_ss;
+struct peakfinder_worker
+{
+	struct peakfinder_thread_pool *pool;
+	int index;
+	struct peakfinder_intern_data *pfinter;	// Scratch data, sized for one panel
+	struct peakfinder_peak_data *pkdata;	// Peaks found by this worker, in panel order
+	int num_peaks;
+};
 
-	// Compute radial statistics as 1 function (O.Y.)
-	iterations = 5;
-	rstats = compute_radial_bins(data, mask, num_pix_tot, pix_r,
-	                             iterations, hitfinderMinSNR, ADCthresh,
-	                             num_pix_fs, num_pix_ss);
 
-	pkdata = allocate_peak_data(max_num_peaks);
-	if ( pkdata == NULL ) {
-		free_radial_stats(rstats);
-		return 1;
+// Pool of threads searching for peaks in different panels of the same frame. The
+// thread calling peakfinder8_context works as well, as worker 0.
+struct peakfinder_thread_pool
+{
+	int num_threads;
+	int num_started;			// Threads running, including the caller
+	int num_panels;
+	int panel_size;
+	pthread_t *threads;
+	struct peakfinder_worker *workers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	int generation;				// Incremented for each new frame
+	int num_running;			// Worker threads still processing the frame
+	int next_panel;				// Next panel that has not been claimed yet
+	int shutdown;
+
+	struct peakfinder_frame_job job;
+
+	// Which worker processed each panel, and where its peaks are stored
+	int *panel_worker;
+	int *panel_first_peak;
+	int *panel_num_peaks;
+};
+
+
+// Prepares the scratch data of a worker for a new panel, and clears the part of the
+// pixel map covered by the panel, which still stores the peaks of the previous frame
+static void begin_panel(struct peakfinder_intern_data *pfinter, int aifs, int aiss,
+                        int asic_size_fs, int asic_size_ss, int num_pix_fs)
+{
+	int pxss;
+
+	for ( pxss=0 ; pxss<asic_size_ss ; pxss++ ) {
+		memset(pfinter->pix_in_peak_map +
+		       (pxss + aiss * asic_size_ss) * num_pix_fs + aifs * asic_size_fs,
+		       0, asic_size_fs*sizeof(char));
 	}
+	pfinter->num_touched_pixels = 0;
+}
 
-	num_found_peaks = 0;
-
-	ret = peakfinder8_base(rstats->roffset,
-	                       rstats->rthreshold,
-	                       data,
-	                       mask,
-	                       pix_r,
-	                       asic_nx, nasics_x,
-	                       asic_ny, nasics_y,
-	                       max_num_peaks  ,
-	                       &num_found_peaks,
-	                       pkdata->npix,
-	                       pkdata->com_fs,
-	                       pkdata->com_ss,
-	                       pkdata->com_index,
-	                       pkdata->tot_i,
-	                       pkdata->max_i,
-	                       pkdata->sigma,
-	                       pkdata->snr,
-	                       hitfinderMinPixCount,
-	                       hitfinderMaxPixCount,
-	                       hitfinderLocalBGRadius,
-	                       hitfinderMinSNR,
-	                       outliersMask);
 
-	if ( ret != 0 ) {
-		free_radial_stats(rstats);
-		free_peak_data(pkdata);
-		return 1;
+template <typename T>
+static void process_job_panels(struct peakfinder_thread_pool *pool,
+                               struct peakfinder_worker *worker, const T *data)
+{
+	struct peakfinder_frame_job *job;
+	struct peakfinder_peak_data *pkdata;
+	int num_pix_fs;
+	int panel;
+	int aifs, aiss;
+	int first_peak;
+	typename panel_function<T>::type process_panel_kernel;
+
+	job = &pool->job;
+	pkdata = worker->pkdata;
+	num_pix_fs = job->asic_size_fs * job->num_asics_fs;
+	process_panel_kernel = get_panel_function<T>(job->panel_kernel, job->asic_size_fs,
+	                                             job->asic_size_ss, num_pix_fs);
+	worker->num_peaks = 0;
+
+	while ( 1 ) {
+
+		// Panels are claimed in increasing order, so the peaks found by each worker
+		// are stored in panel order too
+		pthread_mutex_lock(&pool->lock);
+		panel = pool->next_panel;
+		pool->next_panel += 1;
+		pthread_mutex_unlock(&pool->lock);
+
+		if ( panel >= pool->num_panels ) {
+			break;
+		}
+
+		aiss = panel / job->num_asics_fs;
+		aifs = panel % job->num_asics_fs;
+
+		begin_panel(worker->pfinter, aifs, aiss, job->asic_size_fs,
+		            job->asic_size_ss, num_pix_fs);
+
+		first_peak = worker->num_peaks;
+		process_panel_kernel(job->asic_size_fs, job->asic_size_ss, num_pix_fs,
+		                     aiss, aifs, job->rthreshold, job->roffset,
+		                     &worker->num_peaks, data, worker->pfinter, job->r_bin,
+		                     job->mask, pkdata->npix, pkdata->com_fs,
+		                     pkdata->com_ss, pkdata->com_index, pkdata->tot_i,
+		                     pkdata->max_i, pkdata->sigma, pkdata->snr,
+		                     pkdata->pixels, pkdata->pixel_stride,
+		                     job->min_pix_count, job->max_pix_count,
+		                     job->local_bg_radius, job->min_snr, job->max_n_peaks,
+		                     job->seed_bitmap, job->seed_bitmap_row_words,
+		                     job->lbgtab);
+
+		pool->panel_worker[panel] = worker->index;
+		pool->panel_first_peak[panel] = first_peak;
+		pool->panel_num_peaks[panel] = worker->num_peaks - first_peak;
 	}
+}
 
-	peaks_to_add = num_found_peaks;
 
-	if ( num_found_peaks > max_num_peaks ) {
-		peaks_to_add = max_num_peaks;
+static void run_job_panels(struct peakfinder_thread_pool *pool,
+                           struct peakfinder_worker *worker)
+{
+	switch ( pool->job.data_type ) {
+		case PF8_DATA_FLOAT64:
+			process_job_panels(pool, worker, (const double *)pool->job.data);
+			break;
+
+		case PF8_DATA_UINT16:
+			process_job_panels(pool, worker, (const unsigned short *)pool->job.data);
+			break;
+
+		case PF8_DATA_INT32:
+			process_job_panels(pool, worker, (const int *)pool->job.data);
+			break;
+
+		default:
+			process_job_panels(pool, worker, (const float *)pool->job.data);
+			break;
 	}
+}
 
-	for ( pki=0 ; pki<peaks_to_add ; pki++ ) {
 
-		peaklist->peak_maxintensity[pki] = pkdata->max_i[pki];
-		peaklist->peak_totalintensity[pki] = pkdata->tot_i[pki];
-		peaklist->peak_sigma[pki] = pkdata->sigma[pki];
-		peaklist->peak_snr[pki] = pkdata->snr[pki];
-		peaklist->peak_npix[pki] = pkdata->npix[pki];
-		peaklist->peak_com_x[pki] = pkdata->com_fs[pki];
-		peaklist->peak_com_y[pki] = pkdata->com_ss[pki];
-		peaklist->peak_com_index[pki] = pkdata->com_index[pki];
+static void *peakfinder_worker_thread(void *arg)
+{
+	struct peakfinder_worker *worker;
+	struct peakfinder_thread_pool *pool;
+	int generation;
+
+	worker = (struct peakfinder_worker *)arg;
+	pool = worker->pool;
+
+	// The pool starts at generation 0. A frame could already have been submitted
+	// before this thread gets here, so the current generation must not be used
+	generation = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while ( 1 ) {
+		while ( pool->generation == generation && !pool->shutdown ) {
+			pthread_cond_wait(&pool->start_cond, &pool->lock);
+		}
+		if ( pool->shutdown ) {
+			break;
+		}
+		generation = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		run_job_panels(pool, worker);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->num_running -= 1;
+		if ( pool->num_running == 0 ) {
+			pthread_cond_signal(&pool->done_cond);
+		}
 	}
+	pthread_mutex_unlock(&pool->lock);
 
-	peaklist->nPeaks = peaks_to_add;
+	return NULL;
+}
+
+
+static void free_thread_pool(struct peakfinder_thread_pool *pool)
+{
+	int ti;
+
+	if ( pool->threads != NULL ) {
+		pthread_mutex_lock(&pool->lock);
+		pool->shutdown = 1;
+		pthread_cond_broadcast(&pool->start_cond);
+		pthread_mutex_unlock(&pool->lock);
+		for ( ti=1 ; ti<pool->num_started ; ti++ ) {
+			pthread_join(pool->threads[ti], NULL);
+		}
+		free(pool->threads);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start_cond);
+	pthread_cond_destroy(&pool->done_cond);
+
+	for ( ti=0 ; ti<pool->num_threads ; ti++ ) {
+		if ( pool->workers[ti].pfinter != NULL ) {
+			free_peakfinder_intern_data(pool->workers[ti].pfinter);
+		}
+		if ( pool->workers[ti].pkdata != NULL ) {
+			free_peak_data(pool->workers[ti].pkdata);
+		}
+	}
+	free(pool->workers);
+	free(pool->panel_worker);
+	free(pool->panel_first_peak);
+	free(pool->panel_num_peaks);
+	free(pool);
+}
+
+
+static struct peakfinder_thread_pool *allocate_thread_pool(tPeakfinder8Context *context,
+                                                           int num_threads)
+{
+	struct peakfinder_thread_pool *pool;
+	int ti;
+
+	pool = (struct peakfinder_thread_pool *)calloc(1, sizeof(struct peakfinder_thread_pool));
+	if ( pool == NULL ) {
+		return NULL;
+	}
+
+	pool->num_threads = num_threads;
+	pool->num_panels = context->nasics_x * context->nasics_y;
+	pool->panel_size = context->asic_nx * context->asic_ny;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	pool->workers = (struct peakfinder_worker *)calloc(num_threads,
+	                                                    sizeof(struct peakfinder_worker));
+	pool->panel_worker = (int *)malloc(pool->num_panels*sizeof(int));
+	pool->panel_first_peak = (int *)malloc(pool->num_panels*sizeof(int));
+	pool->panel_num_peaks = (int *)malloc(pool->num_panels*sizeof(int));
+	if ( pool->workers == NULL || pool->panel_worker == NULL
+	  || pool->panel_first_peak == NULL || pool->panel_num_peaks == NULL ) {
+		pool->num_threads = 0;
+		free_thread_pool(pool);
+		return NULL;
+	}
+
+	for ( ti=0 ; ti<num_threads ; ti++ ) {
+		pool->workers[ti].pool = pool;
+		pool->workers[ti].index = ti;
+		pool->workers[ti].pfinter = allocate_peakfinder_intern_data(
+		                                pool->panel_size, context->max_pix_count,
+		                                context->pfinter->pix_in_peak_map);
+		pool->workers[ti].pkdata = allocate_peak_data(context->max_num_peaks,
+		                                              context->max_pix_count);
+		if ( pool->workers[ti].pfinter == NULL || pool->workers[ti].pkdata == NULL ) {
+			free_thread_pool(pool);
+			return NULL;
+		}
+	}
+
+	pool->threads = (pthread_t *)malloc(num_threads*sizeof(pthread_t));
+	if ( pool->threads == NULL ) {
+		free_thread_pool(pool);
+		return NULL;
+	}
+
+	for ( pool->num_started=1 ; pool->num_started<num_threads ; pool->num_started++ ) {
+		if ( pthread_create(&pool->threads[pool->num_started], NULL,
+		                    peakfinder_worker_thread,
+		                    &pool->workers[pool->num_started]) != 0 ) {
+			free_thread_pool(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+
+// Multithreaded version of peakfinder8_base. Each panel is processed independently,
+// and the peaks are merged in panel order, so the result does not depend on the
+// number of threads or on the scheduling
+static int peakfinder8_base_threaded(struct peakfinder_thread_pool *pool,
+                                     float *roffset, float *rthreshold,
+                                     const void *data, int data_type,
+                                     char *mask, unsigned short *r_bin,
+                                     int asic_size_fs, int num_asics_fs,
+                                     int asic_size_ss, int num_asics_ss,
+                                     int max_n_peaks, int *num_found_peaks,
+                                     struct peakfinder_peak_data *pkdata,
+                                     int min_pix_count, int max_pix_count,
+                                     int local_bg_radius, float min_snr,
+                                     const unsigned long long *seed_bitmap,
+                                     long seed_bitmap_row_words,
+                                     struct local_background_tables *lbgtab,
+                                     int panel_kernel, char *pix_in_peak_map,
+                                     char* outliersMask)
+{
+	struct peakfinder_peak_data *wkdata;
+	int panel;
+	int peak_count;
+	int num_stored;
+	int pi, src;
+
+	pool->job.roffset = roffset;
+	pool->job.rthreshold = rthreshold;
+	pool->job.data = data;
+	pool->job.data_type = data_type;
+	pool->job.mask = mask;
+	pool->job.r_bin = r_bin;
+	pool->job.asic_size_fs = asic_size_fs;
+	pool->job.num_asics_fs = num_asics_fs;
+	pool->job.asic_size_ss = asic_size_ss;
+	pool->job.num_asics_ss = num_asics_ss;
+	pool->job.max_n_peaks = max_n_peaks;
+	pool->job.min_pix_count = min_pix_count;
+	pool->job.max_pix_count = max_pix_count;
+	pool->job.local_bg_radius = local_bg_radius;
+	pool->job.min_snr = min_snr;
+	pool->job.seed_bitmap = seed_bitmap;
+	pool->job.seed_bitmap_row_words = seed_bitmap_row_words;
+	pool->job.lbgtab = lbgtab;
+	pool->job.panel_kernel = panel_kernel;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->next_panel = 0;
+	pool->num_running = pool->num_threads - 1;
+	pool->generation += 1;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	run_job_panels(pool, &pool->workers[0]);
+
+	pthread_mutex_lock(&pool->lock);
+	while ( pool->num_running > 0 ) {
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	// A worker stores at most max_n_peaks peaks. The ones it drops come after all the
+	// peaks it kept, so they would not fit in the merged list either
+	peak_count = 0;
+	num_stored = 0;
+	for ( panel=0 ; panel<pool->num_panels ; panel++ ) {
+		wkdata = pool->workers[pool->panel_worker[panel]].pkdata;
+		for ( pi=0 ; pi<pool->panel_num_peaks[panel] ; pi++ ) {
+			src = pool->panel_first_peak[panel] + pi;
+			if ( num_stored < max_n_peaks && src < max_n_peaks ) {
+				pkdata->npix[num_stored] = wkdata->npix[src];
+				pkdata->com_fs[num_stored] = wkdata->com_fs[src];
+				pkdata->com_ss[num_stored] = wkdata->com_ss[src];
+				pkdata->com_index[num_stored] = wkdata->com_index[src];
+				pkdata->tot_i[num_stored] = wkdata->tot_i[src];
+				pkdata->max_i[num_stored] = wkdata->max_i[src];
+				pkdata->sigma[num_stored] = wkdata->sigma[src];
+				pkdata->snr[num_stored] = wkdata->snr[src];
+				memcpy(pkdata->pixels + (long)num_stored * pkdata->pixel_stride,
+				       wkdata->pixels + (long)src * wkdata->pixel_stride,
+				       wkdata->npix[src]*sizeof(int));
+				num_stored += 1;
+			}
+		}
+		peak_count += pool->panel_num_peaks[panel];
+	}
+	*num_found_peaks = peak_count;
+
+	if (outliersMask != NULL) {
+		memcpy(outliersMask, pix_in_peak_map,
+		       asic_size_fs*num_asics_fs*asic_size_ss*num_asics_ss*sizeof(char));
+	}
+
+	return 0;
+}
+
+// Frees the radial bin map of a context, if the context owns it
+static void free_radial_bin_map(unsigned short *r_bin, int r_bin_owned)
+{
+	if ( r_bin_owned ) {
+		free(r_bin);
+	}
+}
+
+
+// Creates a context for the given radial bin map. If r_bin_owned is not 0, the map
+// is then owned by the context (and freed if the context cannot be created).
+// Otherwise, the map is shared and must outlive the context
+static tPeakfinder8Context *create_context(unsigned short *r_bin, int r_bin_owned,
+                                           int num_rad_bins, long asic_nx,
+                                           long asic_ny, long nasics_x, long nasics_y,
+                                           long NpeaksMax, long maxPixCount)
+{
+	tPeakfinder8Context *context;
+
+	context = (tPeakfinder8Context *)malloc(sizeof(tPeakfinder8Context));
+	if ( context == NULL ) {
+		free_radial_bin_map(r_bin, r_bin_owned);
+		return NULL;
+	}
+
+	context->asic_nx = asic_nx;
+	context->asic_ny = asic_ny;
+	context->nasics_x = nasics_x;
+	context->nasics_y = nasics_y;
+	context->num_pix_tot = asic_nx * nasics_x * asic_ny * nasics_y;
+	context->max_num_peaks = NpeaksMax;
+	context->max_pix_count = maxPixCount;
+
+	context->r_bin = r_bin;
+	context->r_bin_owned = r_bin_owned;
+	context->num_rad_bins = num_rad_bins;
+
+	context->rstats = allocate_radial_stats(context->num_rad_bins);
+	if ( context->rstats == NULL ) {
+		free_radial_bin_map(context->r_bin, context->r_bin_owned);
+		free(context);
+		return NULL;
+	}
+
+	// The sorted pixel order is only allocated when the first frame is processed
+	// with a kernel, or an estimator, that needs it
+	context->rorder = NULL;
+	context->radial_stats_kernel = PF8_RADIAL_STATS_SCALAR;
+	context->background_estimator = PF8_BACKGROUND_SIGMA_CLIPPING;
+	context->background_decay = 0.1;
+	context->rmodel = NULL;
+	context->num_threads = 1;
+	context->pool = NULL;
+	context->num_frame_threads = 1;
+	context->frame_pool = NULL;
+	context->seed_scan = PF8_SEED_SCAN_PIXEL;
+	context->panel_kernel = PF8_PANEL_KERNEL_LAYOUT;
+	context->seed_bitmap = NULL;
+	context->seed_bitmap_row_words = (asic_nx * nasics_x + 63) / 64;
+	context->local_background = PF8_LOCAL_BACKGROUND_RING;
+	context->lbgtab = NULL;
+	context->backend = PF8_BACKEND_CPU;
+	context->gpu = NULL;
+	context->peak_refinement = PF8_PEAK_REFINEMENT_CENTER_OF_MASS;
+	context->geometry_x_map = NULL;
+	context->geometry_y_map = NULL;
+	context->pixels_per_meter = 0;
+	context->beam_energy = 0;
+	context->detector_distance = 0;
+	context->peak_pixels_valid = 0;
+	context->prescreen_min_peaks = 0;
+	context->prescreen_validation = 0;
+	context->prescreen_max_rejections = PF8_PRESCREEN_MAX_REJECTIONS;
+	context->prescreen_num_consecutive_rejected = 0;
+	context->prescreen_result = PF8_PRESCREEN_NOT_RUN;
+	context->prescreen_num_pixels = 0;
+	context->prescreen_cache_valid = 0;
+	context->prescreen_adc_thresh = 0;
+	context->prescreen_min_snr = 0;
+	resetPeakfinder8PrescreenStats(context);
+	context->collect_stats = 0;
+	resetPeakfinder8Stats(context);
+	context->mask_generation = 0;
+
+	context->pkdata = allocate_peak_data(NpeaksMax, maxPixCount);
+	if ( context->pkdata == NULL ) {
+		free_radial_stats(context->rstats);
+		free_radial_bin_map(context->r_bin, context->r_bin_owned);
+		free(context);
+		return NULL;
+	}
+
+	context->pfinter = allocate_peakfinder_intern_data(context->num_pix_tot,
+	                                                   maxPixCount, NULL);
+	if ( context->pfinter == NULL ) {
+		free_peak_data(context->pkdata);
+		free_radial_stats(context->rstats);
+		free_radial_bin_map(context->r_bin, context->r_bin_owned);
+		free(context);
+		return NULL;
+	}
+
+	context->spans = allocate_mask_spans(context->num_pix_tot);
+	if ( context->spans == NULL ) {
+		free_peakfinder_intern_data(context->pfinter);
+		free_peak_data(context->pkdata);
+		free_radial_stats(context->rstats);
+		free_radial_bin_map(context->r_bin, context->r_bin_owned);
+		free(context);
+		return NULL;
+	}
+
+	allocatePeakList(&context->peak_list, NpeaksMax);
+
+	if ( setPeakfinder8RadialStatsKernel(context,
+	                                     detect_radial_stats_kernel()) != 0 ) {
+		freePeakfinder8Context(context);
+		return NULL;
+	}
+
+	return context;
+}
+
+
+tPeakfinder8Context *allocatePeakfinder8Context(float *pix_r,
+                                                long asic_nx, long asic_ny,
+                                                long nasics_x, long nasics_y,
+                                                long NpeaksMax, long maxPixCount)
+{
+	unsigned short *r_bin;
+	int num_rad_bins;
+
+	r_bin = compute_radial_bin_map(pix_r, asic_nx * nasics_x, asic_ny * nasics_y,
+	                               &num_rad_bins);
+	if ( r_bin == NULL ) {
+		return NULL;
+	}
+
+	return create_context(r_bin, 1, num_rad_bins, asic_nx, asic_ny, nasics_x,
+	                      nasics_y, NpeaksMax, maxPixCount);
+}
+
+
+// Creates a context from a radial bin map computed in advance, for example one
+// stored in a pixel map cache. The context uses its own copy of the map
+tPeakfinder8Context *allocatePeakfinder8ContextFromBins(const unsigned short *r_bin,
+                                                        int num_rad_bins,
+                                                        long asic_nx, long asic_ny,
+                                                        long nasics_x, long nasics_y,
+                                                        long NpeaksMax, long maxPixCount)
+{
+	unsigned short *r_bin_copy;
+	long num_pix_tot;
+
+	if ( num_rad_bins < 1 || num_rad_bins > USHRT_MAX + 1 ) {
+		return NULL;
+	}
+
+	num_pix_tot = asic_nx * nasics_x * asic_ny * nasics_y;
+	r_bin_copy = (unsigned short *)malloc(num_pix_tot*sizeof(unsigned short));
+	if ( r_bin_copy == NULL ) {
+		return NULL;
+	}
+	memcpy(r_bin_copy, r_bin, num_pix_tot*sizeof(unsigned short));
+
+	return create_context(r_bin_copy, 1, num_rad_bins, asic_nx, asic_ny, nasics_x,
+	                      nasics_y, NpeaksMax, maxPixCount);
+}
+
+
+// Creates a context that reads a radial bin map computed in advance, without copying
+// it: for example the map stored in a pixel map cache, which is shared by all the
+// processes of a machine. The map is never written, and must outlive the context and
+// all its clones
+tPeakfinder8Context *allocatePeakfinder8ContextSharedBins(const unsigned short *r_bin,
+                                                          int num_rad_bins,
+                                                          long asic_nx, long asic_ny,
+                                                          long nasics_x, long nasics_y,
+                                                          long NpeaksMax,
+                                                          long maxPixCount)
+{
+	if ( num_rad_bins < 1 || num_rad_bins > USHRT_MAX + 1 ) {
+		return NULL;
+	}
+
+	return create_context((unsigned short *)r_bin, 0, num_rad_bins, asic_nx, asic_ny,
+	                      nasics_x, nasics_y, NpeaksMax, maxPixCount);
+}
+
+
+// Creates a new context with the same layout, radial bins and settings as an
+// existing one. The two contexts do not share any buffer that is written, so they
+// can process different frames at the same time: a shared radial bin map is also
+// shared by the clone. The number of frame threads is not copied
+tPeakfinder8Context *clonePeakfinder8Context(const tPeakfinder8Context *context)
+{
+	tPeakfinder8Context *clone;
+	unsigned short *r_bin;
+
+	if ( context->r_bin_owned ) {
+		r_bin = (unsigned short *)malloc(context->num_pix_tot*sizeof(unsigned short));
+		if ( r_bin == NULL ) {
+			return NULL;
+		}
+		memcpy(r_bin, context->r_bin, context->num_pix_tot*sizeof(unsigned short));
+	} else {
+		r_bin = context->r_bin;
+	}
+
+	clone = create_context(r_bin, context->r_bin_owned, context->num_rad_bins,
+	                       context->asic_nx, context->asic_ny, context->nasics_x,
+	                       context->nasics_y, context->max_num_peaks,
+	                       context->max_pix_count);
+	if ( clone == NULL ) {
+		return NULL;
+	}
+
+	if ( setPeakfinder8RadialStatsKernel(clone, context->radial_stats_kernel) != 0
+	  || setPeakfinder8BackgroundEstimator(clone, context->background_estimator) != 0
+	  || setPeakfinder8BackgroundDecay(clone, context->background_decay) != 0
+	  || setPeakfinder8NumThreads(clone, context->num_threads) != 0
+	  || setPeakfinder8SeedScan(clone, context->seed_scan) != 0
+	  || setPeakfinder8PanelKernel(clone, context->panel_kernel) != 0
+	  || setPeakfinder8LocalBackground(clone, context->local_background) != 0
+	  || setPeakfinder8Backend(clone, context->backend) != 0 ) {
+		freePeakfinder8Context(clone);
+		return NULL;
+	}
+	setPeakfinder8Prescreen(clone, context->prescreen_min_peaks,
+	                        context->prescreen_validation,
+	                        context->prescreen_max_rejections);
+	setPeakfinder8CollectStats(clone, context->collect_stats);
+	setPeakfinder8PeakRefinement(clone, context->peak_refinement);
+	setPeakfinder8PeakGeometry(clone, context->geometry_x_map, context->geometry_y_map,
+	                           context->pixels_per_meter);
+	setPeakfinder8BeamParameters(clone, context->beam_energy,
+	                             context->detector_distance);
+	clone->mask_generation = context->mask_generation;
+
+	return clone;
+}
+
+
+void freePeakfinder8Context(tPeakfinder8Context *context)
+{
+	if ( context == NULL ) {
+		return;
+	}
+	free_radial_bin_map(context->r_bin, context->r_bin_owned);
+	free_radial_stats(context->rstats);
+	if ( context->rorder != NULL ) {
+		free_radial_order(context->rorder);
+	}
+	if ( context->rmodel != NULL ) {
+		free_radial_model(context->rmodel);
+	}
+	if ( context->lbgtab != NULL ) {
+		free_local_background_tables(context->lbgtab);
+	}
+	if ( context->gpu != NULL ) {
+		free_peakfinder_gpu(context->gpu);
+	}
+	if ( context->frame_pool != NULL ) {
+		freePeakfinder8FramePool(context->frame_pool);
+	}
+	if ( context->pool != NULL ) {
+		free_thread_pool(context->pool);
+	}
+	free(context->seed_bitmap);
+	free_peak_data(context->pkdata);
+	free_peakfinder_intern_data(context->pfinter);
+	free_mask_spans(context->spans);
+	freePeakList(context->peak_list);
+	free(context);
+}
+
+
+static int ensure_radial_order(tPeakfinder8Context *context)
+{
+	if ( context->rorder == NULL ) {
+		context->rorder = allocate_radial_order(context->r_bin,
+		                                        context->num_pix_tot,
+		                                        context->num_rad_bins);
+		if ( context->rorder == NULL ) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+// Selects the kernel used to compute the radial statistics. Returns 1 if the kernel
+// is not available on this machine
+int setPeakfinder8RadialStatsKernel(tPeakfinder8Context *context, int kernel)
+{
+	if ( kernel != PF8_RADIAL_STATS_SCALAR
+	  && get_radial_sums_function(kernel) == NULL ) {
+		return 1;
+	}
+	context->radial_stats_kernel = kernel;
+	return 0;
+}
+
+
+// Selects the estimator used for the radial background. Returns 1 if the estimator
+// is unknown, or if memory cannot be allocated
+int setPeakfinder8BackgroundEstimator(tPeakfinder8Context *context, int estimator)
+{
+	if ( estimator == PF8_BACKGROUND_TEMPORAL ) {
+		if ( context->rmodel == NULL ) {
+			context->rmodel = allocate_radial_model(context->num_rad_bins);
+			if ( context->rmodel == NULL ) {
+				return 1;
+			}
+		}
+		if ( context->background_estimator != PF8_BACKGROUND_TEMPORAL ) {
+			context->rmodel->valid = 0;
+		}
+	} else if ( estimator != PF8_BACKGROUND_SIGMA_CLIPPING
+	         && estimator != PF8_BACKGROUND_MEDIAN_MAD ) {
+		return 1;
+	}
+	context->background_estimator = estimator;
+	return 0;
+}
+
+
+// Sets the weight of each new frame in the temporal background model, between 0
+// (excluded) and 1. The weight of a frame then decays by a factor (1 - decay) with
+// each following frame. Returns 1 if the decay is out of range
+int setPeakfinder8BackgroundDecay(tPeakfinder8Context *context, float decay)
+{
+	if ( !(decay > 0 && decay <= 1) ) {
+		return 1;
+	}
+	context->background_decay = decay;
+	return 0;
+}
+
+
+// Reports that the content of the mask passed with the frames changed, without its
+// address changing. The unmasked pixels are then found again with the next frame
+void notifyPeakfinder8MaskChanged(tPeakfinder8Context *context)
+{
+	context->mask_generation += 1;
+}
+
+
+// Discards the temporal background model, for example when a new run starts. The
+// next frame initializes a new model with the iterative estimator
+void resetPeakfinder8Background(tPeakfinder8Context *context)
+{
+	if ( context->rmodel != NULL ) {
+		context->rmodel->valid = 0;
+	}
+}
+
+
+// Sets the number of threads that search for peaks, panel by panel. With a single
+// thread, the panels are processed sequentially by the calling thread. Returns 1 if
+// the threads or their memory cannot be allocated
+int setPeakfinder8NumThreads(tPeakfinder8Context *context, int num_threads)
+{
+	struct peakfinder_thread_pool *pool;
+
+	if ( num_threads < 1 ) {
+		num_threads = 1;
+	}
+	if ( num_threads == context->num_threads ) {
+		return 0;
+	}
+
+	pool = NULL;
+	if ( num_threads > 1 ) {
+		pool = allocate_thread_pool(context, num_threads);
+		if ( pool == NULL ) {
+			return 1;
+		}
+	}
+
+	if ( context->pool != NULL ) {
+		free_thread_pool(context->pool);
+	}
+	context->pool = pool;
+	context->num_threads = num_threads;
+
+	// The sequential and the threaded search clear the pixel map in different ways,
+	// so the map is cleared completely when switching
+	memset(context->pfinter->pix_in_peak_map, 0, context->num_pix_tot*sizeof(char));
+	context->pfinter->num_touched_pixels = 0;
+
+	return 0;
+}
+
+
+// Selects how the pixels that can start a peak are found. Both modes find the same
+// peaks. Returns 1 if the mode is unknown, or if memory cannot be allocated
+int setPeakfinder8SeedScan(tPeakfinder8Context *context, int seed_scan)
+{
+	if ( seed_scan == PF8_SEED_SCAN_BITMAP ) {
+		if ( context->seed_bitmap == NULL ) {
+			context->seed_bitmap = (unsigned long long *)malloc(
+			    context->seed_bitmap_row_words * context->asic_ny * context->nasics_y
+			    * sizeof(unsigned long long));
+			if ( context->seed_bitmap == NULL ) {
+				return 1;
+			}
+		}
+	} else if ( seed_scan != PF8_SEED_SCAN_PIXEL ) {
+		return 1;
+	}
+	context->seed_scan = seed_scan;
+	return 0;
+}
+
+
+// Selects the kernel searching the peaks in each panel. Both kernels find the same
+// peaks. Returns 1 if the kernel is unknown
+int setPeakfinder8PanelKernel(tPeakfinder8Context *context, int panel_kernel)
+{
+	if ( panel_kernel != PF8_PANEL_KERNEL_GENERIC
+	  && panel_kernel != PF8_PANEL_KERNEL_LAYOUT ) {
+		return 1;
+	}
+	context->panel_kernel = panel_kernel;
+	return 0;
+}
+
+
+// Selects how the local background of each peak is computed. Both methods give the
+// same background pixels. Returns 1 if the method is unknown, or if memory cannot be
+// allocated
+int setPeakfinder8LocalBackground(tPeakfinder8Context *context, int local_background)
+{
+	if ( local_background == PF8_LOCAL_BACKGROUND_INTEGRAL ) {
+		if ( context->lbgtab == NULL ) {
+			context->lbgtab = allocate_local_background_tables(
+			    context->asic_nx, context->asic_ny * context->nasics_y,
+			    context->nasics_x);
+			if ( context->lbgtab == NULL ) {
+				return 1;
+			}
+		}
+	} else if ( local_background != PF8_LOCAL_BACKGROUND_RING ) {
+		return 1;
+	}
+	context->local_background = local_background;
+	return 0;
+}
+
+
+// Selects where the peaks are searched. Each context with the GPU backend has its own
+// device buffers and stream. Returns 1 if the backend is unknown, if there is no GPU,
+// or if device memory cannot be allocated
+int setPeakfinder8Backend(tPeakfinder8Context *context, int backend)
+{
+	if ( backend == PF8_BACKEND_GPU ) {
+		if ( context->gpu == NULL ) {
+			context->gpu = allocate_peakfinder_gpu(context->r_bin,
+			                                       context->num_rad_bins,
+			                                       context->asic_nx, context->asic_ny,
+			                                       context->nasics_x,
+			                                       context->nasics_y,
+			                                       context->max_num_peaks);
+			if ( context->gpu == NULL ) {
+				return 1;
+			}
+		}
+	} else if ( backend == PF8_BACKEND_CPU ) {
+		if ( context->gpu != NULL ) {
+			free_peakfinder_gpu(context->gpu);
+			context->gpu = NULL;
+		}
+	} else {
+		return 1;
+	}
+	context->backend = backend;
+	return 0;
+}
+
+
+// Selects how the position of each peak is computed. Returns 1 if the method is
+// unknown
+int setPeakfinder8PeakRefinement(tPeakfinder8Context *context, int refinement)
+{
+	if ( refinement != PF8_PEAK_REFINEMENT_CENTER_OF_MASS
+	  && refinement != PF8_PEAK_REFINEMENT_QUADRATIC
+	  && refinement != PF8_PEAK_REFINEMENT_GAUSSIAN ) {
+		return 1;
+	}
+	context->peak_refinement = refinement;
+	return 0;
+}
+
+
+// Sets the maps of the x and y coordinates of each pixel, in pixels, in the detector
+// reference system, and the size of the pixels. The maps are not copied, and must
+// not be freed while the context uses them. When x_map is NULL, the assembled
+// position and the resolution of the peaks are not computed
+void setPeakfinder8PeakGeometry(tPeakfinder8Context *context, const float *x_map,
+                                const float *y_map, float pixels_per_meter)
+{
+	context->geometry_x_map = x_map;
+	context->geometry_y_map = y_map;
+	context->pixels_per_meter = pixels_per_meter;
+}
+
+
+// Sets the beam energy, in eV, and the distance between the sample and the detector,
+// in meters, used to compute the resolution of the peaks of the following frames
+void setPeakfinder8BeamParameters(tPeakfinder8Context *context, double beam_energy,
+                                  double detector_distance)
+{
+	context->beam_energy = beam_energy;
+	context->detector_distance = detector_distance;
+}
+
+
+// Returns 1 if the extension was built with GPU support and a GPU is present
+int peakfinder8GpuAvailable(void)
+{
+	return peakfinder_gpu_available();
+}
+
+
+// Enables the pre-screen, which rejects a frame without searching for peaks when it
+// cannot contain min_num_peaks peaks. A peak of at least hitfinderMinPixCount pixels
+// needs as many pixels above the radial threshold of their bin, so the pixels above
+// the thresholds computed for the last searched frame are counted first. The
+// thresholds are only computed by a full search, so after max_rejections frames in a
+// row are rejected, the next frame is searched to compute them again. The thresholds
+// of the frames are not the same: in validation mode, the full search is also
+// performed on the rejected frames, without replacing the thresholds, and the frames
+// that turn out to have at least min_num_peaks peaks are counted as false negatives.
+// A min_num_peaks value of 0 disables the pre-screen
+void setPeakfinder8Prescreen(tPeakfinder8Context *context, int min_num_peaks,
+                             int validation, int max_rejections)
+{
+	if ( min_num_peaks < 0 ) {
+		min_num_peaks = 0;
+	}
+	if ( max_rejections < 1 ) {
+		max_rejections = 1;
+	}
+	context->prescreen_min_peaks = min_num_peaks;
+	context->prescreen_validation = validation != 0;
+	context->prescreen_max_rejections = max_rejections;
+}
+
+
+void resetPeakfinder8PrescreenStats(tPeakfinder8Context *context)
+{
+	context->prescreen_num_frames = 0;
+	context->prescreen_num_rejected = 0;
+	context->prescreen_num_false_negatives = 0;
+}
+
+
+// Enables or disables the collection of the statistics of the processed frames.
+// When they are disabled, the frames are processed without reading any timer
+void setPeakfinder8CollectStats(tPeakfinder8Context *context, int collect_stats)
+{
+	context->collect_stats = collect_stats != 0;
+}
+
+
+void resetPeakfinder8Stats(tPeakfinder8Context *context)
+{
+	memset(&context->stats, 0, sizeof(tPeakfinder8Stats));
+}
+
+
+// Adds statistics collected separately, for example by different contexts, to a
+// total
+void addPeakfinder8Stats(tPeakfinder8Stats *total, const tPeakfinder8Stats *stats)
+{
+	int i;
+
+	total->num_frames += stats->num_frames;
+	for ( i=0 ; i<PF8_NUM_STAGES ; i++ ) {
+		total->stage_ns[i] += stats->stage_ns[i];
+	}
+	total->num_seeds += stats->num_seeds;
+	total->num_candidates += stats->num_candidates;
+	for ( i=0 ; i<PF8_NUM_REJECTIONS ; i++ ) {
+		total->num_rejected[i] += stats->num_rejected[i];
+	}
+	total->num_peaks += stats->num_peaks;
+	if ( stats->max_peak_pixels > total->max_peak_pixels ) {
+		total->max_peak_pixels = stats->max_peak_pixels;
+	}
+}
+
+
+// Prepares the scratch data used for the panels of a new frame to collect, or not,
+// the statistics of the frame
+static void begin_frame_stats(tPeakfinder8Context *context)
+{
+	struct peakfinder_intern_data *pfinter;
+	int ti, num_scratch;
+
+	num_scratch = context->pool != NULL ? context->pool->num_threads : 1;
+	for ( ti=0 ; ti<num_scratch ; ti++ ) {
+		pfinter = context->pool != NULL ? context->pool->workers[ti].pfinter
+		                                : context->pfinter;
+		pfinter->collect_stats = context->collect_stats;
+		if ( context->collect_stats ) {
+			memset(&pfinter->stats, 0, sizeof(tPeakfinder8Stats));
+		}
+	}
+}
+
+
+// Adds the statistics of the frame that has just been processed to the ones of the
+// context
+static void end_frame_stats(tPeakfinder8Context *context, long long frame_start,
+                            long long radial_stats_ns, long num_peaks)
+{
+	struct peakfinder_intern_data *pfinter;
+	int ti, num_scratch;
+
+	num_scratch = context->pool != NULL ? context->pool->num_threads : 1;
+	for ( ti=0 ; ti<num_scratch ; ti++ ) {
+		pfinter = context->pool != NULL ? context->pool->workers[ti].pfinter
+		                                : context->pfinter;
+		addPeakfinder8Stats(&context->stats, &pfinter->stats);
+	}
+	context->stats.num_frames += 1;
+	context->stats.stage_ns[PF8_STAGE_RADIAL_STATS] += radial_stats_ns;
+	context->stats.stage_ns[PF8_STAGE_TOTAL] += stats_clock_ns() - frame_start;
+	context->stats.num_peaks += num_peaks;
+}
+
+
+// Counts the unmasked pixels above the threshold of their radial bin, stopping as
+// soon as max_count pixels have been found
+template <typename T>
+static long count_pixels_above_threshold(const T *data,
+                                         const struct mask_spans *spans,
+                                         unsigned short *r_bin, float *rthreshold,
+                                         long max_count)
+{
+	long count;
+	long si;
+	long pi, last;
+
+	count = 0;
+	for ( si=0 ; si<spans->num_spans ; si++ ) {
+		last = spans->first[si] + spans->length[si];
+		for ( pi=spans->first[si] ; pi<last ; pi++ ) {
+			if ( (float)data[pi] > rthreshold[r_bin[pi]] ) {
+				count += 1;
+				if ( count >= max_count ) {
+					return count;
+				}
+			}
+		}
+	}
+
+	return count;
+}
+
+
+// Computes the radial statistics of a frame with the background estimator of the
+// context. The temporal model is only used, and updated, if use_model is set:
+// otherwise the iterative estimator is used in its place. Returns 1 if the sorted
+// pixel order cannot be allocated
+template <typename T>
+static int compute_context_radial_stats(tPeakfinder8Context *context, const T *data,
+                                        char *mask, float ADCthresh,
+                                        float hitfinderMinSNR, int use_model)
+{
+	int iterations;
+	int temporal;
+
+	// The pixel order is built the first time it is needed, so that the contexts
+	// that process a single frame with the scalar kernel do not sort the pixels
+	if ( ( context->background_estimator == PF8_BACKGROUND_MEDIAN_MAD
+	    || context->radial_stats_kernel != PF8_RADIAL_STATS_SCALAR )
+	  && ensure_radial_order(context) != 0 ) {
+		return 1;
+	}
+
+	iterations = 5;
+	temporal = use_model && context->background_estimator == PF8_BACKGROUND_TEMPORAL;
+	if ( temporal && context->rmodel->valid ) {
+		update_radial_model(context->rstats, context->rmodel, data, context->spans,
+		                    context->r_bin, context->background_decay,
+		                    hitfinderMinSNR, ADCthresh);
+	} else if ( context->background_estimator == PF8_BACKGROUND_MEDIAN_MAD ) {
+		compute_radial_bins_median_mad(context->rstats, context->rorder, data, mask,
+		                               hitfinderMinSNR, ADCthresh);
+	} else if ( context->radial_stats_kernel == PF8_RADIAL_STATS_SCALAR ) {
+		compute_radial_bins(context->rstats, data, context->spans, context->r_bin,
+		                    iterations, hitfinderMinSNR, ADCthresh);
+	} else {
+		compute_radial_bins_sorted(context->rstats, context->rorder,
+		                           get_radial_sums_function(
+		                               context->radial_stats_kernel),
+		                           data, mask, iterations, hitfinderMinSNR,
+		                           ADCthresh);
+	}
+
+	// The first frame, and the first one after a reset, initialize the temporal
+	// model with the iterative estimator
+	if ( temporal && !context->rmodel->valid ) {
+		init_radial_model(context->rmodel, context->rstats);
+	}
+
+	return 0;
+}
+
+
+// Searches the peaks of a frame using the radial statistics currently stored in the
+// context. The peaks are stored in the peak data of the context. Returns 1 if the
+// search fails
+template <typename T>
+static int search_context_peaks(tPeakfinder8Context *context, const T *data,
+                                int data_type, char *mask, float hitfinderMinSNR,
+                                long hitfinderMinPixCount, long hitfinderMaxPixCount,
+                                long hitfinderLocalBGRadius, char *outliersMask,
+                                int *num_found_peaks)
+{
+	struct peakfinder_peak_data *pkdata;
+	int num_pix_fs, num_pix_ss;
+	int max_num_peaks;
+	int ret;
+	const unsigned long long *seed_bitmap;
+	struct local_background_tables *lbgtab;
+	long long stage_start;
+
+	// Derived values
+	num_pix_fs = context->asic_nx * context->nasics_x;
+	num_pix_ss = context->asic_ny * context->nasics_y;
+	pkdata = context->pkdata;
+	max_num_peaks = context->max_num_peaks;
+
+	stage_start = 0;
+	if ( context->collect_stats ) {
+		stage_start = stats_clock_ns();
+	}
+
+	seed_bitmap = NULL;
+	if ( context->seed_scan == PF8_SEED_SCAN_BITMAP ) {
+		fill_seed_bitmap(context->seed_bitmap, context->seed_bitmap_row_words, data,
+		                 mask, context->r_bin, context->rstats->rthreshold,
+		                 num_pix_fs, num_pix_ss);
+		seed_bitmap = context->seed_bitmap;
+	}
+
+	// Filling the seed bitmap is part of the candidate scan
+	if ( context->collect_stats ) {
+		context->stats.stage_ns[PF8_STAGE_CANDIDATE_SCAN] += stats_clock_ns()
+		                                                     - stage_start;
+	}
+
+	lbgtab = NULL;
+	if ( context->local_background == PF8_LOCAL_BACKGROUND_INTEGRAL ) {
+		if ( set_local_background_spans(context->lbgtab,
+		                                2 * hitfinderLocalBGRadius) != 0 ) {
+			return 1;
+		}
+		memset(context->lbgtab->row_ready, 0,
+		       num_pix_ss * context->nasics_x * sizeof(char));
+		lbgtab = context->lbgtab;
+	}
+
+	*num_found_peaks = 0;
+
+	if ( context->pool != NULL ) {
+
+		ret = peakfinder8_base_threaded(context->pool,
+		                                context->rstats->roffset,
+		                                context->rstats->rthreshold,
+		                                data,
+		                                data_type,
+		                                mask,
+		                                context->r_bin,
+		                                context->asic_nx, context->nasics_x,
+		                                context->asic_ny, context->nasics_y,
+		                                max_num_peaks,
+		                                num_found_peaks,
+		                                pkdata,
+		                                hitfinderMinPixCount,
+		                                hitfinderMaxPixCount,
+		                                hitfinderLocalBGRadius,
+		                                hitfinderMinSNR,
+		                                seed_bitmap,
+		                                context->seed_bitmap_row_words,
+		                                lbgtab,
+		                                context->panel_kernel,
+		                                context->pfinter->pix_in_peak_map,
+		                                outliersMask);
+	} else {
+		ret = peakfinder8_base(context->rstats->roffset,
+		                       context->rstats->rthreshold,
+		                       data,
+		                       mask,
+		                       context->r_bin,
+		                       context->asic_nx, context->nasics_x,
+		                       context->asic_ny, context->nasics_y,
+		                       max_num_peaks,
+		                       num_found_peaks,
+		                       pkdata->npix,
+		                       pkdata->com_fs,
+		                       pkdata->com_ss,
+		                       pkdata->com_index,
+		                       pkdata->tot_i,
+		                       pkdata->max_i,
+		                       pkdata->sigma,
+		                       pkdata->snr,
+		                       pkdata->pixels,
+		                       pkdata->pixel_stride,
+		                       hitfinderMinPixCount,
+		                       hitfinderMaxPixCount,
+		                       hitfinderLocalBGRadius,
+		                       hitfinderMinSNR,
+		                       context->pfinter,
+		                       seed_bitmap,
+		                       context->seed_bitmap_row_words,
+		                       lbgtab,
+		                       context->panel_kernel,
+		                       outliersMask);
+	}
+
+	return ret;
+}
+
+
+// Offset of the vertex of the parabola through three consecutive values, or, for the
+// Gaussian refinement, of the parabola through their logarithms above the local
+// background. Returns 1 if the center value is not a maximum, or if the offset would
+// take the peak out of the center pixel
+static int fit_three_pixels(float left, float center, float right, float background,
+                            int refinement, float *offset)
+{
+	float curvature;
+
+	if ( refinement == PF8_PEAK_REFINEMENT_GAUSSIAN ) {
+		left -= background;
+		center -= background;
+		right -= background;
+		if ( left <= 0 || center <= 0 || right <= 0 ) {
+			return 1;
+		}
+		left = logf(left);
+		center = logf(center);
+		right = logf(right);
+	}
+
+	curvature = left - 2 * center + right;
+	if ( curvature >= 0 ) {
+		return 1;
+	}
+	*offset = 0.5f * (left - right) / curvature;
+	if ( *offset < -0.5f || *offset > 0.5f ) {
+		return 1;
+	}
+
+	return 0;
+}
+
+
+// Refines the position of a peak around its brightest pixel. The neighbours must be
+// in the same panel and unmasked. The maximum intensity of the peak is measured from
+// the local background, which can therefore be recovered from the brightest pixel
+template <typename T>
+static void refine_peak_position(const tPeakfinder8Context *context, const T *data,
+                                 const char *mask, const int *pixels, int num_pixels,
+                                 float max_i, int refinement, float *com_fs,
+                                 float *com_ss)
+{
+	long num_pix_fs;
+	long pidx;
+	long ifs, iss;
+	float background;
+	float offset;
+	int pi;
+
+	pidx = pixels[0];
+	for ( pi=1 ; pi<num_pixels ; pi++ ) {
+		if ( (float)data[pixels[pi]] > (float)data[pidx] ) {
+			pidx = pixels[pi];
+		}
+	}
+
+	num_pix_fs = context->asic_nx * context->nasics_x;
+	ifs = pidx % num_pix_fs;
+	iss = pidx / num_pix_fs;
+	background = (float)data[pidx] - max_i;
+
+	if ( ifs % context->asic_nx > 0 && ifs % context->asic_nx < context->asic_nx - 1
+	  && (mask == NULL || (mask[pidx-1] != 0 && mask[pidx+1] != 0))
+	  && fit_three_pixels((float)data[pidx-1], (float)data[pidx],
+	                      (float)data[pidx+1], background, refinement,
+	                      &offset) == 0 ) {
+		*com_fs = (float)ifs + offset;
+	}
+
+	if ( iss % context->asic_ny > 0 && iss % context->asic_ny < context->asic_ny - 1
+	  && (mask == NULL || (mask[pidx-num_pix_fs] != 0 && mask[pidx+num_pix_fs] != 0))
+	  && fit_three_pixels((float)data[pidx-num_pix_fs], (float)data[pidx],
+	                      (float)data[pidx+num_pix_fs], background, refinement,
+	                      &offset) == 0 ) {
+		*com_ss = (float)iss + offset;
+	}
+}
+
+
+// Value of a geometry map at a fractional position. The maps are linear within each
+// panel, so they are extrapolated from the nearest pixel and its neighbours in the
+// same panel
+static float interpolate_geometry_map(const tPeakfinder8Context *context,
+                                      const float *map, float fs, float ss)
+{
+	long num_pix_fs;
+	long ifs, iss;
+	long pidx;
+	float slope_fs, slope_ss;
+
+	num_pix_fs = context->asic_nx * context->nasics_x;
+	ifs = (long)rintf(fs);
+	iss = (long)rintf(ss);
+	pidx = iss * num_pix_fs + ifs;
+
+	slope_fs = 0;
+	if ( ifs % context->asic_nx < context->asic_nx - 1 ) {
+		slope_fs = map[pidx+1] - map[pidx];
+	} else if ( ifs % context->asic_nx > 0 ) {
+		slope_fs = map[pidx] - map[pidx-1];
+	}
+	slope_ss = 0;
+	if ( iss % context->asic_ny < context->asic_ny - 1 ) {
+		slope_ss = map[pidx+num_pix_fs] - map[pidx];
+	} else if ( iss % context->asic_ny > 0 ) {
+		slope_ss = map[pidx] - map[pidx-num_pix_fs];
+	}
+
+	return map[pidx] + (fs - ifs) * slope_fs + (ss - iss) * slope_ss;
+}
+
+
+// Length of the scattering vector and resolution of a peak at r_assembled pixels from
+// the center of the detector. Both are 0 if the beam energy, the detector distance or
+// the pixel size are not known, or if the peak is at the center
+void computePeakResolution(float r_assembled, float pixels_per_meter,
+                           double beam_energy, double detector_distance, float *q,
+                           float *resolution)
+{
+	double wavelength;
+	double theta;
+
+	if ( pixels_per_meter <= 0 || beam_energy <= 0 || detector_distance <= 0
+	  || r_assembled <= 0 ) {
+		*q = 0;
+		*resolution = 0;
+		return;
+	}
+
+	// Wavelength in Angstrom: hc = 12398.42 eV*Angstrom
+	wavelength = 12398.419843320026 / beam_energy;
+	theta = 0.5 * atan2(r_assembled / pixels_per_meter, detector_distance);
+	*q = (float)(2.0 * sin(theta) / wavelength);
+	*resolution = (float)(wavelength / (2.0 * sin(theta)));
+}
+
+
+// Refines the positions of the peaks in the peak list, if requested, and fills their
+// assembled position and resolution. The positions can only be refined when the
+// pixels of the peaks are known
+template <typename T>
+static void finish_peak_list(tPeakfinder8Context *context, const T *data,
+                             const char *mask, int refine)
+{
+	struct peakfinder_peak_data *pkdata;
+	tPeakList *peaklist;
+	float x, y, r;
+	int pki;
+
+	peaklist = &context->peak_list;
+	pkdata = context->pkdata;
+
+	for ( pki=0 ; pki<peaklist->nPeaks ; pki++ ) {
+
+		if ( refine && context->peak_refinement != PF8_PEAK_REFINEMENT_CENTER_OF_MASS ) {
+			refine_peak_position(context, data, mask,
+			                     pkdata->pixels + (long)pki * pkdata->pixel_stride,
+			                     pkdata->npix[pki], pkdata->max_i[pki],
+			                     context->peak_refinement, &peaklist->peak_com_x[pki],
+			                     &peaklist->peak_com_y[pki]);
+		}
+
+		if ( context->geometry_x_map == NULL ) {
+			peaklist->peak_com_x_assembled[pki] = 0;
+			peaklist->peak_com_y_assembled[pki] = 0;
+			peaklist->peak_com_r_assembled[pki] = 0;
+			peaklist->peak_com_q[pki] = 0;
+			peaklist->peak_com_res[pki] = 0;
+			continue;
+		}
+
+		x = interpolate_geometry_map(context, context->geometry_x_map,
+		                             peaklist->peak_com_x[pki],
+		                             peaklist->peak_com_y[pki]);
+		y = interpolate_geometry_map(context, context->geometry_y_map,
+		                             peaklist->peak_com_x[pki],
+		                             peaklist->peak_com_y[pki]);
+		r = sqrtf(x * x + y * y);
+		peaklist->peak_com_x_assembled[pki] = x;
+		peaklist->peak_com_y_assembled[pki] = y;
+		peaklist->peak_com_r_assembled[pki] = r;
+		computePeakResolution(r, context->pixels_per_meter, context->beam_energy,
+		                      context->detector_distance, &peaklist->peak_com_q[pki],
+		                      &peaklist->peak_com_res[pki]);
+	}
+}
+
+
+// Cheetah Peakfinder8, reusing the buffers stored in a persistent context. The data
+// values are converted to float when they are read, so the result is the same as for
+// a float copy of the frame
+template <typename T>
+static int run_peakfinder8_context(tPeakfinder8Context *context, const T *data,
+                                   int data_type, char *mask,
+                                   float ADCthresh, float hitfinderMinSNR,
+                                   long hitfinderMinPixCount, long hitfinderMaxPixCount,
+                                   long hitfinderLocalBGRadius, char* outliersMask)
+{
+	struct peakfinder_peak_data *pkdata;
+	tPeakList *peaklist;
+	int max_num_peaks;
+	int num_found_peaks;
+	int pki;
+	int peaks_to_add;
+	long min_num_pixels;
+	long long frame_start, stage_start;
+	long long radial_stats_ns;
+
+	// The buffer storing the pixels of each peak cannot be resized
+	if ( hitfinderMaxPixCount > context->max_pix_count ) {
+		return 1;
+	}
+
+	frame_start = 0;
+	stage_start = 0;
+	radial_stats_ns = 0;
+	if ( context->collect_stats ) {
+		frame_start = stats_clock_ns();
+	}
+	begin_frame_stats(context);
+
+	peaklist = &context->peak_list;
+	pkdata = context->pkdata;
+	max_num_peaks = context->max_num_peaks;
+
+	// The GPU keeps the radial statistics on the device, so the pre-screen is not
+	// used with it. Frames that the GPU cannot process are searched on the CPU. The
+	// GPU does not return the pixels of each peak
+	context->prescreen_result = PF8_PRESCREEN_NOT_RUN;
+	context->peak_pixels_valid = 0;
+	if ( context->gpu != NULL
+	  && context->background_estimator == PF8_BACKGROUND_SIGMA_CLIPPING ) {
+		context->prescreen_cache_valid = 0;
+		if ( peakfinder_gpu_submit(context->gpu, data, data_type, mask, ADCthresh,
+		                           hitfinderMinSNR, hitfinderMinPixCount,
+		                           hitfinderMaxPixCount, hitfinderLocalBGRadius,
+		                           outliersMask != NULL) == 0
+		  && peakfinder_gpu_wait(context->gpu, peaklist, max_num_peaks,
+		                         outliersMask) == 0 ) {
+			finish_peak_list(context, data, mask, 0);
+			if ( context->collect_stats ) {
+				end_frame_stats(context, frame_start, 0, peaklist->nPeaks);
+			}
+			return 0;
+		}
+	}
+
+	// A mask that does not change between frames is only scanned once
+	update_mask_spans(context->spans, mask, context->mask_generation);
+
+	// The thresholds of the last searched frame can only be reused if they were
+	// computed with the same parameters, and if not too many frames were rejected
+	// since then
+	if ( context->prescreen_min_peaks > 0
+	  && context->prescreen_cache_valid
+	  && context->prescreen_num_consecutive_rejected < context->prescreen_max_rejections
+	  && context->prescreen_adc_thresh == ADCthresh
+	  && context->prescreen_min_snr == hitfinderMinSNR ) {
+
+		min_num_pixels = context->prescreen_min_peaks;
+		if ( hitfinderMinPixCount > 1 ) {
+			min_num_pixels *= hitfinderMinPixCount;
+		}
+		context->prescreen_num_pixels = count_pixels_above_threshold(
+		    data, context->spans, context->r_bin, context->rstats->pthreshold,
+		    min_num_pixels);
+		context->prescreen_num_frames += 1;
+
+		if ( context->prescreen_num_pixels < min_num_pixels ) {
+			context->prescreen_result = PF8_PRESCREEN_NOT_A_HIT;
+			context->prescreen_num_rejected += 1;
+			context->prescreen_num_consecutive_rejected += 1;
+			if ( !context->prescreen_validation ) {
+				peaklist->nPeaks = 0;
+				context->peak_pixels_valid = 1;
+				if ( outliersMask != NULL ) {
+					memset(outliersMask, 0, context->num_pix_tot*sizeof(char));
+				}
+				if ( context->collect_stats ) {
+					end_frame_stats(context, frame_start, 0, 0);
+				}
+				return 0;
+			}
+		} else {
+			context->prescreen_result = PF8_PRESCREEN_CANDIDATE;
+		}
+	}
+
+	// Compute radial statistics as 1 function (O.Y.)
+	if ( context->collect_stats ) {
+		stage_start = stats_clock_ns();
+	}
+	if ( compute_context_radial_stats(context, data, mask, ADCthresh, hitfinderMinSNR,
+	                                  1) != 0 ) {
+		return 1;
+	}
+	if ( context->collect_stats ) {
+		radial_stats_ns = stats_clock_ns() - stage_start;
+	}
+
+	if ( search_context_peaks(context, data, data_type, mask, hitfinderMinSNR,
+	                          hitfinderMinPixCount, hitfinderMaxPixCount,
+	                          hitfinderLocalBGRadius, outliersMask,
+	                          &num_found_peaks) != 0 ) {
+		return 1;
+	}
+
+	// A frame rejected in validation mode is only searched to check the pre-screen,
+	// so the next frames are compared to the same thresholds as without validation
+	if ( context->prescreen_result == PF8_PRESCREEN_NOT_A_HIT ) {
+		if ( num_found_peaks >= context->prescreen_min_peaks ) {
+			context->prescreen_num_false_negatives += 1;
+		}
+	} else if ( context->prescreen_min_peaks > 0 ) {
+		memcpy(context->rstats->pthreshold, context->rstats->rthreshold,
+		       context->num_rad_bins*sizeof(float));
+		context->prescreen_cache_valid = 1;
+		context->prescreen_adc_thresh = ADCthresh;
+		context->prescreen_min_snr = hitfinderMinSNR;
+		context->prescreen_num_consecutive_rejected = 0;
+	}
+
+	peaks_to_add = num_found_peaks;
+
+	if ( num_found_peaks > max_num_peaks ) {
+		peaks_to_add = max_num_peaks;
+	}
+
+	for ( pki=0 ; pki<peaks_to_add ; pki++ ) {
+
+		peaklist->peak_maxintensity[pki] = pkdata->max_i[pki];
+		peaklist->peak_totalintensity[pki] = pkdata->tot_i[pki];
+		peaklist->peak_sigma[pki] = pkdata->sigma[pki];
+		peaklist->peak_snr[pki] = pkdata->snr[pki];
+		peaklist->peak_npix[pki] = pkdata->npix[pki];
+		peaklist->peak_com_x[pki] = pkdata->com_fs[pki];
+		peaklist->peak_com_y[pki] = pkdata->com_ss[pki];
+		peaklist->peak_com_index[pki] = pkdata->com_index[pki];
+	}
+
+	peaklist->nPeaks = peaks_to_add;
+	context->peak_pixels_valid = 1;
+	finish_peak_list(context, data, mask, 1);
+
+	if ( context->collect_stats ) {
+		end_frame_stats(context, frame_start, radial_stats_ns, num_found_peaks);
+	}
+
+	return 0;
+}
+
+
+int peakfinder8_context(tPeakfinder8Context *context, float *data, char *mask,
+                        float ADCthresh, float hitfinderMinSNR,
+                        long hitfinderMinPixCount, long hitfinderMaxPixCount,
+                        long hitfinderLocalBGRadius, char* outliersMask)
+{
+	return run_peakfinder8_context(context, (const float *)data, PF8_DATA_FLOAT32,
+	                               mask, ADCthresh, hitfinderMinSNR,
+	                               hitfinderMinPixCount, hitfinderMaxPixCount,
+	                               hitfinderLocalBGRadius, outliersMask);
+}
+
+
+// Same as peakfinder8_context, for frames stored with any of the PF8_DATA_* types.
+// Returns 1 if the data type is not supported
+int peakfinder8_context_typed(tPeakfinder8Context *context, const void *data,
+                              int data_type, char *mask,
+                              float ADCthresh, float hitfinderMinSNR,
+                              long hitfinderMinPixCount, long hitfinderMaxPixCount,
+                              long hitfinderLocalBGRadius, char* outliersMask)
+{
+	switch ( data_type ) {
+		case PF8_DATA_FLOAT32:
+			return run_peakfinder8_context(context, (const float *)data, data_type,
+			                               mask, ADCthresh, hitfinderMinSNR,
+			                               hitfinderMinPixCount,
+			                               hitfinderMaxPixCount,
+			                               hitfinderLocalBGRadius, outliersMask);
+
+		case PF8_DATA_FLOAT64:
+			return run_peakfinder8_context(context, (const double *)data, data_type,
+			                               mask, ADCthresh, hitfinderMinSNR,
+			                               hitfinderMinPixCount,
+			                               hitfinderMaxPixCount,
+			                               hitfinderLocalBGRadius, outliersMask);
+
+		case PF8_DATA_UINT16:
+			return run_peakfinder8_context(context, (const unsigned short *)data,
+			                               data_type, mask, ADCthresh,
+			                               hitfinderMinSNR, hitfinderMinPixCount,
+			                               hitfinderMaxPixCount,
+			                               hitfinderLocalBGRadius, outliersMask);
+
+		case PF8_DATA_INT32:
+			return run_peakfinder8_context(context, (const int *)data, data_type,
+			                               mask, ADCthresh, hitfinderMinSNR,
+			                               hitfinderMinPixCount,
+			                               hitfinderMaxPixCount,
+			                               hitfinderLocalBGRadius, outliersMask);
+
+		default:
+			return 1;
+	}
+}
+
+
+struct sweep_entry
+{
+	const float *params;
+	long index;
+};
+
+
+// Parameters that must be identical for two parameter sets to share a peak search
+static int same_sweep_search(const float *params, const float *other)
+{
+	return params[PF8_SWEEP_ADC_THRESH] == other[PF8_SWEEP_ADC_THRESH]
+	    && params[PF8_SWEEP_MIN_SNR] == other[PF8_SWEEP_MIN_SNR]
+	    && params[PF8_SWEEP_MAX_PIX_COUNT] == other[PF8_SWEEP_MAX_PIX_COUNT]
+	    && params[PF8_SWEEP_LOCAL_BG_RADIUS] == other[PF8_SWEEP_LOCAL_BG_RADIUS];
+}
+
+
+// Orders the parameter sets so that the sets that share the radial statistics, and
+// then the peak search, follow each other, with the lowest minimum pixel count first
+static int compare_sweep_entries(const void *a, const void *b)
+{
+	static const int fields[] = { PF8_SWEEP_ADC_THRESH, PF8_SWEEP_MIN_SNR,
+	                              PF8_SWEEP_MAX_PIX_COUNT, PF8_SWEEP_LOCAL_BG_RADIUS,
+	                              PF8_SWEEP_MIN_PIX_COUNT };
+	const struct sweep_entry *ea;
+	const struct sweep_entry *eb;
+	int fi;
+
+	ea = (const struct sweep_entry *)a;
+	eb = (const struct sweep_entry *)b;
+	for ( fi=0 ; fi<PF8_NUM_SWEEP_FIELDS ; fi++ ) {
+		if ( ea->params[fields[fi]] < eb->params[fields[fi]] ) {
+			return -1;
+		}
+		if ( ea->params[fields[fi]] > eb->params[fields[fi]] ) {
+			return 1;
+		}
+	}
+	if ( ea->index != eb->index ) {
+		return ea->index < eb->index ? -1 : 1;
+	}
+
+	return 0;
+}
+
+
+// Counts the peaks that each parameter set finds in a frame. The acceptance of a peak
+// does not change how the following ones grow, so the peaks found with the lowest
+// minimum pixel count of a group of sets contain the peaks of all the others
+template <typename T>
+static int run_peakfinder8_sweep(tPeakfinder8Context *context, const T *data,
+                                 int data_type, char *mask, const float *param_table,
+                                 long num_sets, long *num_peaks)
+{
+	struct sweep_entry *entries;
+	const float *params;
+	const float *previous;
+	int collect_stats;
+	int num_found_peaks;
+	int num_set_peaks;
+	long min_pix_count;
+	long si, gi;
+	long pki;
+	long count;
+	int ret;
+
+	entries = (struct sweep_entry *)malloc(num_sets*sizeof(struct sweep_entry));
+	if ( entries == NULL ) {
+		return 1;
+	}
+	for ( si=0 ; si<num_sets ; si++ ) {
+		entries[si].params = param_table + si * PF8_NUM_SWEEP_FIELDS;
+		entries[si].index = si;
+		if ( (long)entries[si].params[PF8_SWEEP_MAX_PIX_COUNT] > context->max_pix_count ) {
+			free(entries);
+			return 1;
+		}
+	}
+	qsort(entries, num_sets, sizeof(struct sweep_entry), compare_sweep_entries);
+
+	// The sweep is not one of the processed frames
+	collect_stats = context->collect_stats;
+	context->collect_stats = 0;
+	begin_frame_stats(context);
+
+	update_mask_spans(context->spans, mask, context->mask_generation);
+
+	ret = 0;
+	previous = NULL;
+	si = 0;
+	while ( si < num_sets ) {
+
+		params = entries[si].params;
+		if ( previous == NULL
+		  || params[PF8_SWEEP_ADC_THRESH] != previous[PF8_SWEEP_ADC_THRESH]
+		  || params[PF8_SWEEP_MIN_SNR] != previous[PF8_SWEEP_MIN_SNR] ) {
+			ret = compute_context_radial_stats(context, data, mask,
+			                                   params[PF8_SWEEP_ADC_THRESH],
+			                                   params[PF8_SWEEP_MIN_SNR], 0);
+			if ( ret != 0 ) {
+				break;
+			}
+		}
+		previous = params;
+
+		ret = search_context_peaks(context, data, data_type, mask,
+		                           params[PF8_SWEEP_MIN_SNR],
+		                           (long)params[PF8_SWEEP_MIN_PIX_COUNT],
+		                           (long)params[PF8_SWEEP_MAX_PIX_COUNT],
+		                           (long)params[PF8_SWEEP_LOCAL_BG_RADIUS], NULL,
+		                           &num_found_peaks);
+		if ( ret != 0 ) {
+			break;
+		}
+		num_peaks[entries[si].index] = num_found_peaks < context->max_num_peaks
+		                               ? num_found_peaks : context->max_num_peaks;
+
+		for ( gi=si+1 ; gi<num_sets && same_sweep_search(entries[gi].params, params) ;
+		      gi++ ) {
+			min_pix_count = (long)entries[gi].params[PF8_SWEEP_MIN_PIX_COUNT];
+
+			// If not all the peaks could be stored, the search must be repeated
+			if ( num_found_peaks > context->max_num_peaks ) {
+				ret = search_context_peaks(context, data, data_type, mask,
+				                           params[PF8_SWEEP_MIN_SNR], min_pix_count,
+				                           (long)params[PF8_SWEEP_MAX_PIX_COUNT],
+				                           (long)params[PF8_SWEEP_LOCAL_BG_RADIUS],
+				                           NULL, &num_set_peaks);
+				if ( ret != 0 ) {
+					break;
+				}
+				count = num_set_peaks < context->max_num_peaks
+				        ? num_set_peaks : context->max_num_peaks;
+			} else {
+				count = 0;
+				for ( pki=0 ; pki<num_found_peaks ; pki++ ) {
+					if ( context->pkdata->npix[pki] >= min_pix_count ) {
+						count += 1;
+					}
+				}
+			}
+			num_peaks[entries[gi].index] = count;
+		}
+		if ( ret != 0 ) {
+			break;
+		}
+		si = gi;
+	}
+
+	// The thresholds and the peaks stored in the context do not belong to any frame
+	context->prescreen_cache_valid = 0;
+	context->peak_list.nPeaks = 0;
+	context->peak_pixels_valid = 0;
+	context->collect_stats = collect_stats;
+	free(entries);
+
+	return ret;
+}
+
+
+// Number of peaks found in a frame by each of num_sets sets of parameters, stored in
+// the rows of a table with PF8_NUM_SWEEP_FIELDS columns. The radial statistics are
+// only computed once for all the sets with the same ADC threshold and minimum
+// signal-to-noise ratio, and the peaks are only searched once for all the sets that
+// only differ in the minimum pixel count. Each count is the number of peaks that
+// peakfinder8_context_typed would return with the same parameters, except that the
+// temporal background is replaced by the iterative estimator and that the GPU and
+// the pre-screen are not used. The peaks stored in the context are discarded. Returns
+// 1 if the data type is not supported or if a maximum pixel count is too large
+int peakfinder8_context_sweep(tPeakfinder8Context *context, const void *data,
+                              int data_type, char *mask, const float *param_table,
+                              long num_sets, long *num_peaks)
+{
+	if ( num_sets < 1 ) {
+		return 0;
+	}
+
+	switch ( data_type ) {
+		case PF8_DATA_FLOAT32:
+			return run_peakfinder8_sweep(context, (const float *)data, data_type,
+			                             mask, param_table, num_sets, num_peaks);
+
+		case PF8_DATA_FLOAT64:
+			return run_peakfinder8_sweep(context, (const double *)data, data_type,
+			                             mask, param_table, num_sets, num_peaks);
+
+		case PF8_DATA_UINT16:
+			return run_peakfinder8_sweep(context, (const unsigned short *)data,
+			                             data_type, mask, param_table, num_sets,
+			                             num_peaks);
+
+		case PF8_DATA_INT32:
+			return run_peakfinder8_sweep(context, (const int *)data, data_type,
+			                             mask, param_table, num_sets, num_peaks);
+
+		default:
+			return 1;
+	}
+}
+
+
+// Writes, for each pixel of the frame last processed by the context, the index
+// plus one of the peak in the peak list that the pixel belongs to, or 0 if it is not
+// part of any stored peak. Returns 1 if the pixels of the peaks are not available,
+// because the frame was processed on the GPU
+int fillPeakfinder8LabelMap(const tPeakfinder8Context *context, int *label_map)
+{
+	const struct peakfinder_peak_data *pkdata;
+	const int *pixels;
+	long pki;
+	int pi;
+
+	if ( !context->peak_pixels_valid ) {
+		return 1;
+	}
+
+	pkdata = context->pkdata;
+	memset(label_map, 0, context->num_pix_tot*sizeof(int));
+	for ( pki=0 ; pki<context->peak_list.nPeaks ; pki++ ) {
+		pixels = pkdata->pixels + pki * pkdata->pixel_stride;
+		for ( pi=0 ; pi<pkdata->npix[pki] ; pi++ ) {
+			label_map[pixels[pi]] = pki + 1;
+		}
+	}
+
+	return 0;
+}
+
+
+// Number of pixels in the peaks stored in the peak list of the frame last processed
+// by the context, or -1 if they are not available
+long countPeakfinder8PeakPixels(const tPeakfinder8Context *context)
+{
+	long num_pixels;
+	long pki;
+
+	if ( !context->peak_pixels_valid ) {
+		return -1;
+	}
+
+	num_pixels = 0;
+	for ( pki=0 ; pki<context->peak_list.nPeaks ; pki++ ) {
+		num_pixels += context->pkdata->npix[pki];
+	}
+
+	return num_pixels;
+}
+
+
+// Copies the index in the frame of each pixel of the stored peaks, and the index of
+// the peak that it belongs to, peak after peak. The arrays must have room for the
+// number of pixels returned by countPeakfinder8PeakPixels. Returns the number of
+// copied pixels, or -1 if they are not available
+long copyPeakfinder8PeakPixels(const tPeakfinder8Context *context, int *pixel_index,
+                               int *peak_index)
+{
+	const struct peakfinder_peak_data *pkdata;
+	long num_pixels;
+	long pki;
+	int pi;
+
+	if ( !context->peak_pixels_valid ) {
+		return -1;
+	}
+
+	pkdata = context->pkdata;
+	num_pixels = 0;
+	for ( pki=0 ; pki<context->peak_list.nPeaks ; pki++ ) {
+		memcpy(pixel_index + num_pixels, pkdata->pixels + pki * pkdata->pixel_stride,
+		       pkdata->npix[pki]*sizeof(int));
+		for ( pi=0 ; pi<pkdata->npix[pki] ; pi++ ) {
+			peak_index[num_pixels + pi] = pki;
+		}
+		num_pixels += pkdata->npix[pki];
+	}
+
+	return num_pixels;
+}
+
+
+// Cheetah Peakfinder8
+// Count peaks by searching for connected pixels above threshold
+// Includes modifications during Cherezov December 2014 LE80
+// Anton Barty
+int peakfinder8(tPeakList *peaklist, float *data, char *mask, float *pix_r,
+                long asic_nx, long asic_ny, long nasics_x, long nasics_y,
+                float ADCthresh, float hitfinderMinSNR,
+                long hitfinderMinPixCount, long hitfinderMaxPixCount,
+                long hitfinderLocalBGRadius, char* outliersMask)
+{
+	tPeakfinder8Context *context;
+	long max_pix_count;
+	int ret;
+	int pki;
+
+	max_pix_count = hitfinderMaxPixCount > 0 ? hitfinderMaxPixCount : 1;
+
+	// One-shot version of peakfinder8_context: the context is thrown away after
+	// processing the frame
+	context = allocatePeakfinder8Context(pix_r, asic_nx, asic_ny, nasics_x,
+	                                     nasics_y, peaklist->nPeaks_max,
+	                                     max_pix_count);
+	if ( context == NULL ) {
+		return 1;
+	}
+
+	// Sorting the pixels by radial bin does not pay off for a single frame. The
+	// sorted order is only built with the first frame, so it is never allocated
+	setPeakfinder8RadialStatsKernel(context, PF8_RADIAL_STATS_SCALAR);
+
+	ret = peakfinder8_context(context, data, mask, ADCthresh,
+	                          hitfinderMinSNR, hitfinderMinPixCount,
+	                          hitfinderMaxPixCount, hitfinderLocalBGRadius,
+	                          outliersMask);
+	if ( ret != 0 ) {
+		freePeakfinder8Context(context);
+		return 1;
+	}
+
+	for ( pki=0 ; pki<context->peak_list.nPeaks ; pki++ ) {
+		peaklist->peak_maxintensity[pki] = context->peak_list.peak_maxintensity[pki];
+		peaklist->peak_totalintensity[pki] = context->peak_list.peak_totalintensity[pki];
+		peaklist->peak_sigma[pki] = context->peak_list.peak_sigma[pki];
+		peaklist->peak_snr[pki] = context->peak_list.peak_snr[pki];
+		peaklist->peak_npix[pki] = context->peak_list.peak_npix[pki];
+		peaklist->peak_com_x[pki] = context->peak_list.peak_com_x[pki];
+		peaklist->peak_com_y[pki] = context->peak_list.peak_com_y[pki];
+		peaklist->peak_com_index[pki] = context->peak_list.peak_com_index[pki];
+	}
+	peaklist->nPeaks = context->peak_list.nPeaks;
 
-	free_radial_stats(rstats);
-	free_peak_data(pkdata);
+	freePeakfinder8Context(context);
 	return 0;
 }
@@ -48,10 +48,466 @@ public:
 void allocatePeakList(tPeakList *peak, long NpeaksMax);
 void freePeakList(tPeakList peak);
 
+// Kernels that can compute the radial background statistics. All kernels except the
+// scalar one process the pixels grouped by radial bin and accumulate the statistics in
+// double precision.
+enum {
+	PF8_RADIAL_STATS_SCALAR = 0,	// Original implementation, float accumulation
+	PF8_RADIAL_STATS_SORTED = 1,	// Portable implementation
+	PF8_RADIAL_STATS_AVX2 = 2,
+	PF8_RADIAL_STATS_AVX512 = 3,
+	PF8_RADIAL_STATS_NEON = 4
+};
+
+// Types of the frame data accepted by peakfinder8_context_typed
+enum {
+	PF8_DATA_FLOAT32 = 0,
+	PF8_DATA_FLOAT64 = 1,
+	PF8_DATA_UINT16 = 2,
+	PF8_DATA_INT32 = 3
+};
+
+// Estimators for the radial background. Sigma clipping is the original peakfinder8
+// estimator. The median and median absolute deviation estimator needs a single pass
+// over the data, and always works on pixels grouped by radial bin.
+enum {
+	PF8_BACKGROUND_SIGMA_CLIPPING = 0,
+	PF8_BACKGROUND_MEDIAN_MAD = 1,
+	PF8_BACKGROUND_TEMPORAL = 2		// Radial profile carried across frames
+};
+
+enum {
+	PF8_SEED_SCAN_PIXEL = 0,		// Tests every pixel of each panel
+	PF8_SEED_SCAN_BITMAP = 1		// Scans a bitmap of the pixels above threshold
+};
+
+// Kernels searching the peaks in each panel. The layout kernels are compiled for the
+// panel sizes of the detectors supported by OM, and the generic kernel is used for
+// any other layout. Both find the same peaks.
+enum {
+	PF8_PANEL_KERNEL_GENERIC = 0,
+	PF8_PANEL_KERNEL_LAYOUT = 1
+};
+
+// Local background of each peak. Both methods use the same pixels: the integral
+// method sums them with precomputed integral images along the rows of the frame.
+enum {
+	PF8_LOCAL_BACKGROUND_RING = 0,
+	PF8_LOCAL_BACKGROUND_INTEGRAL = 1
+};
+
+// Where the peaks are searched. The GPU backend is only available when the extension
+// is built with GPU support, and only implements the sigma clipping background:
+// frames that it cannot process are searched on the CPU.
+enum {
+	PF8_BACKEND_CPU = 0,
+	PF8_BACKEND_GPU = 1
+};
+
+// How the position of each peak is computed. The center of mass is the original
+// peakfinder8 position. The other methods fit a parabola, or a Gaussian above the
+// local background, to the brightest pixel of the peak and its two neighbours along
+// each axis, and keep the center of mass along the axes where the fit fails
+enum {
+	PF8_PEAK_REFINEMENT_CENTER_OF_MASS = 0,
+	PF8_PEAK_REFINEMENT_QUADRATIC = 1,
+	PF8_PEAK_REFINEMENT_GAUSSIAN = 2
+};
+
+enum {
+	PF8_PRESCREEN_NOT_RUN = 0,		// Disabled, or no valid cached thresholds
+	PF8_PRESCREEN_CANDIDATE = 1,	// Possible hit: the full search was performed
+	PF8_PRESCREEN_NOT_A_HIT = 2		// Too few pixels above the cached thresholds
+};
+
+// Default number of frames in a row that the pre-screen can reject before the
+// cached thresholds are computed again
+#define PF8_PRESCREEN_MAX_REJECTIONS 16
+
+// Stages timed, and reasons for rejecting a candidate peak counted, by the statistics
+// of a context. The candidate scan includes everything done on the panels except the
+// growth of the peaks and their local background
+enum {
+	PF8_STAGE_RADIAL_STATS = 0,
+	PF8_STAGE_CANDIDATE_SCAN = 1,
+	PF8_STAGE_PEAK_GROWTH = 2,
+	PF8_STAGE_LOCAL_BACKGROUND = 3,
+	PF8_STAGE_TOTAL = 4,			// Whole frame, wall time
+	PF8_NUM_STAGES = 5
+};
+
+enum {
+	PF8_REJECTED_PIX_COUNT = 0,		// Too few or too many pixels
+	PF8_REJECTED_INTENSITY = 1,		// Zero total intensity
+	PF8_REJECTED_SNR = 2,
+	PF8_REJECTED_BACKGROUND = 3,	// Maximum not above the local background maximum
+	PF8_REJECTED_PANEL_EDGE = 4,	// Center of mass outside the panel
+	PF8_NUM_REJECTIONS = 5
+};
+
+// Statistics of the frames processed by a context since the last reset, collected
+// when enabled with setPeakfinder8CollectStats. The stage times are in nanoseconds,
+// and are summed over the threads that process the panels of a frame. The GPU backend
+// only reports the number of frames and peaks, and the total time
+typedef struct {
+	long		num_frames;
+	long long	stage_ns[PF8_NUM_STAGES];
+	long		num_seeds;				// Pixels from which a peak was grown
+	long		num_candidates;			// Peaks with the right number of pixels
+	long		num_rejected[PF8_NUM_REJECTIONS];
+	long		num_peaks;				// Including the ones that did not fit the list
+	long		max_peak_pixels;		// Largest peak grown, even if rejected
+} tPeakfinder8Stats;
+
+struct radial_stats;
+struct radial_order;
+struct radial_model;
+struct local_background_tables;
+struct mask_spans;
+struct peakfinder_intern_data;
+struct peakfinder_peak_data;
+struct peakfinder_thread_pool;
+struct peakfinder_frame_pool;
+struct peakfinder_gpu;
+struct peakfinder_pipeline;
+struct mapped_frame_reader;
+
+typedef struct peakfinder_pipeline tPeakfinder8Pipeline;
+typedef struct mapped_frame_reader tMappedFrameReader;
+
+// Persistent peakfinder8 state. All scratch buffers are allocated once, when the
+// context is created, and are reused for every processed frame.
+typedef struct {
+public:
+	long		asic_nx;
+	long		asic_ny;
+	long		nasics_x;
+	long		nasics_y;
+	long		num_pix_tot;
+	long		max_num_peaks;
+	long		max_pix_count;
+
+	unsigned short	*r_bin;				// Radial bin index of each pixel
+	int			r_bin_owned;			// 0 if the map is shared, and never written
+	int			num_rad_bins;
+	int			radial_stats_kernel;
+	int			background_estimator;
+	float		background_decay;		// Weight of each frame in the temporal model
+	int			num_threads;
+	int			num_frame_threads;
+	int			seed_scan;
+	int			panel_kernel;
+	int			local_background;
+	int			backend;
+	int			peak_refinement;
+	int			peak_pixels_valid;		// The pixels of the last peaks are stored
+	int			collect_stats;
+	tPeakfinder8Stats	stats;
+
+	// Position of each pixel in the detector reference system, used to fill the
+	// assembled position and the resolution of the peaks. Owned by the caller
+	const float	*geometry_x_map;		// NULL if not set
+	const float	*geometry_y_map;
+	float		pixels_per_meter;
+	double		beam_energy;			// In eV, 0 if not known
+	double		detector_distance;		// In meters, 0 if not known
+
+	unsigned long long	*seed_bitmap;	// Unmasked pixels above threshold, 1 bit each
+	long		seed_bitmap_row_words;
+
+	// Pre-screen (disabled when prescreen_min_peaks is 0) and its statistics
+	int			prescreen_min_peaks;
+	int			prescreen_validation;	// Runs the full search on rejected frames too
+	int			prescreen_max_rejections;	// Rejections in a row before a full search
+	int			prescreen_num_consecutive_rejected;
+	int			prescreen_result;		// PF8_PRESCREEN_* value for the last frame
+	long		prescreen_num_pixels;	// Pixels counted for the last frame
+	long		prescreen_num_frames;
+	long		prescreen_num_rejected;
+	long		prescreen_num_false_negatives;
+	int			prescreen_cache_valid;	// The radial thresholds can be reused
+	float		prescreen_adc_thresh;	// Parameters used to compute the thresholds
+	float		prescreen_min_snr;
+
+	tPeakList	peak_list;				// Peaks found in the last processed frame
+
+	struct radial_stats				*rstats;
+	struct radial_order				*rorder;
+	struct radial_model				*rmodel;	// Only for the temporal background
+	struct local_background_tables	*lbgtab;	// Only for the integral local background
+	struct mask_spans				*spans;		// Unmasked pixels of the last mask
+	long							mask_generation;	// Counts the mask changes
+	struct peakfinder_intern_data	*pfinter;
+	struct peakfinder_peak_data		*pkdata;
+	struct peakfinder_thread_pool	*pool;		// NULL when running on one thread
+	struct peakfinder_frame_pool	*frame_pool;	// Contexts for batch frame threads
+	struct peakfinder_gpu			*gpu;		// Only for the GPU backend
+} tPeakfinder8Context;
+
+// Columns of the peak tables filled by copyPeakListToTable and peakfinder8_context_batch
+enum {
+	PF8_PEAK_FS = 0,
+	PF8_PEAK_SS = 1,
+	PF8_PEAK_INTENSITY = 2,
+	PF8_PEAK_NUM_PIXELS = 3,
+	PF8_PEAK_MAX_PIXEL_INTENSITY = 4,
+	PF8_PEAK_SIGMA = 5,
+	PF8_PEAK_SNR = 6,
+	PF8_PEAK_X_ASSEMBLED = 7,			// In pixels, from the detector center
+	PF8_PEAK_Y_ASSEMBLED = 8,
+	PF8_PEAK_R_ASSEMBLED = 9,
+	PF8_PEAK_Q = 10,					// 1/d, in 1/Angstrom
+	PF8_PEAK_RESOLUTION = 11,			// d, in Angstrom
+	PF8_NUM_PEAK_FIELDS = 12
+};
+
+// Columns of the parameter tables of peakfinder8_context_sweep
+enum {
+	PF8_SWEEP_ADC_THRESH = 0,
+	PF8_SWEEP_MIN_SNR = 1,
+	PF8_SWEEP_MIN_PIX_COUNT = 2,
+	PF8_SWEEP_MAX_PIX_COUNT = 3,
+	PF8_SWEEP_LOCAL_BG_RADIUS = 4,
+	PF8_NUM_SWEEP_FIELDS = 5
+};
+
+// Virtual powder pattern and running hit rate, accumulated by the collecting node
+// from the peak tables of the processed frames
+typedef struct {
+public:
+	long		num_pix_fs;
+	long		num_pix_tot;
+	int			*visual_row;			// Powder image pixel of each frame pixel, or -1
+	int			*visual_col;
+	int			*powder;				// Owned by the caller
+	long		img_nx;
+
+	char		*hit_window;			// Ring buffer with the last window_size frames
+	int			window_size;
+	int			window_pos;
+	long		window_num_hits;
+	long		num_frames;
+	long		num_hits;
+} tPowderAccumulator;
+
+// Position of a CrystFEL geometry panel in the data frame, and its fs and ss
+// vectors and corner coordinates, in pixels, in the detector reference system
+typedef struct {
+public:
+	long		min_fs;
+	long		max_fs;
+	long		min_ss;
+	long		max_ss;
+	double		fsx;
+	double		fsy;
+	double		ssx;
+	double		ssy;
+	double		cnx;
+	double		cny;
+	double		clen;					// Used as the z coordinate of the panel
+} tPixelMapPanel;
+
+// Pixel maps of a detector, stored in a cache file that is mapped read-only, so that
+// all the processes of a machine that open it share the same memory. All the maps
+// have num_pix_ss rows of num_pix_fs pixels
+typedef struct {
+public:
+	char		*map;
+	long		map_size;
+	long		num_pix_fs;
+	long		num_pix_ss;
+	const float	*x;
+	const float	*y;
+	const float	*z;
+	const float	*radius;
+	const float	*phi;
+	const unsigned short	*r_bin;		// As computed by a peakfinder8 context
+	int			num_rad_bins;
+	long		num_spans;
+	const int	*spans;					// First pixel and length of the runs of pixels
+										// covered by the panels
+} tPixelMapCache;
+
+#define PF8_SHARED_CONSTANT_NAME_SIZE 32
+#define PF8_SHARED_CONSTANT_MAX_DIMS 4
+
+// An array stored in a shared constant segment
+typedef struct {
+public:
+	char		name[PF8_SHARED_CONSTANT_NAME_SIZE];
+	char		dtype[8];				// The numpy type string, for example "<f4"
+	int			ndim;
+	long		shape[PF8_SHARED_CONSTANT_MAX_DIMS];
+	long		offset;					// From the start of the segment, in bytes
+	long		size;					// In bytes
+} tSharedConstant;
+
+// Read-only arrays, such as dark data and gain maps, stored in a POSIX shared memory
+// segment, so that all the processes of a machine, or of a NUMA node, that open the
+// segment share the same memory. The first process that opens the segment creates
+// it, and must fill it
+typedef struct {
+public:
+	char		*map;
+	long		map_size;
+	int			created;				// This process must fill the segment
+	int			numa_node;				// -1 if there is one segment per machine
+	int			num_constants;
+	const tSharedConstant	*constants;	// NULL until the segment is filled
+	int			fd;
+	char		shm_name[64];
+} tSharedConstants;
+
+tPeakfinder8Context *allocatePeakfinder8Context(float *pix_r,
+                                                long asic_nx, long asic_ny,
+                                                long nasics_x, long nasics_y,
+                                                long NpeaksMax, long maxPixCount);
+tPeakfinder8Context *allocatePeakfinder8ContextFromBins(const unsigned short *r_bin,
+                                                        int num_rad_bins,
+                                                        long asic_nx, long asic_ny,
+                                                        long nasics_x, long nasics_y,
+                                                        long NpeaksMax, long maxPixCount);
+tPeakfinder8Context *allocatePeakfinder8ContextSharedBins(const unsigned short *r_bin,
+                                                          int num_rad_bins,
+                                                          long asic_nx, long asic_ny,
+                                                          long nasics_x, long nasics_y,
+                                                          long NpeaksMax,
+                                                          long maxPixCount);
+int computePeakfinder8RadialBins(const float *r_map, long num_pix,
+                                 unsigned short *r_bin);
+tPeakfinder8Context *clonePeakfinder8Context(const tPeakfinder8Context *context);
+void freePeakfinder8Context(tPeakfinder8Context *context);
+int setPeakfinder8RadialStatsKernel(tPeakfinder8Context *context, int kernel);
+int setPeakfinder8BackgroundEstimator(tPeakfinder8Context *context, int estimator);
+int setPeakfinder8BackgroundDecay(tPeakfinder8Context *context, float decay);
+void notifyPeakfinder8MaskChanged(tPeakfinder8Context *context);
+void resetPeakfinder8Background(tPeakfinder8Context *context);
+int setPeakfinder8NumThreads(tPeakfinder8Context *context, int num_threads);
+int setPeakfinder8NumFrameThreads(tPeakfinder8Context *context, int num_threads);
+int setPeakfinder8SeedScan(tPeakfinder8Context *context, int seed_scan);
+int setPeakfinder8PanelKernel(tPeakfinder8Context *context, int panel_kernel);
+int setPeakfinder8LocalBackground(tPeakfinder8Context *context, int local_background);
+int setPeakfinder8Backend(tPeakfinder8Context *context, int backend);
+int setPeakfinder8PeakRefinement(tPeakfinder8Context *context, int refinement);
+void setPeakfinder8PeakGeometry(tPeakfinder8Context *context, const float *x_map,
+                                const float *y_map, float pixels_per_meter);
+void setPeakfinder8BeamParameters(tPeakfinder8Context *context, double beam_energy,
+                                  double detector_distance);
+void computePeakResolution(float r_assembled, float pixels_per_meter,
+                           double beam_energy, double detector_distance, float *q,
+                           float *resolution);
+void fillPeakTableResolution(float *peak_table, long num_peaks,
+                             float pixels_per_meter, double beam_energy,
+                             double detector_distance);
+int peakfinder8GpuAvailable(void);
+void setPeakfinder8Prescreen(tPeakfinder8Context *context, int min_num_peaks,
+                             int validation, int max_rejections);
+void resetPeakfinder8PrescreenStats(tPeakfinder8Context *context);
+void setPeakfinder8CollectStats(tPeakfinder8Context *context, int collect_stats);
+void resetPeakfinder8Stats(tPeakfinder8Context *context);
+void addPeakfinder8Stats(tPeakfinder8Stats *total, const tPeakfinder8Stats *stats);
+void freePeakfinder8FramePool(struct peakfinder_frame_pool *frame_pool);
+int copyPeakfinder8Settings(tPeakfinder8Context *context,
+                            const tPeakfinder8Context *source);
+
 int peakfinder8(tPeakList *peaklist, float *data, char *mask, float *pix_r,
                 long asic_nx, long asic_ny, long nasics_x, long nasics_y,
                 float ADCthresh, float hitfinderMinSNR,
 				long hitfinderMinPixCount, long hitfinderMaxPixCount,
 				long hitfinderLocalBGRadius, char* outliersMask);
 
+int peakfinder8_context(tPeakfinder8Context *context, float *data, char *mask,
+                        float ADCthresh, float hitfinderMinSNR,
+                        long hitfinderMinPixCount, long hitfinderMaxPixCount,
+                        long hitfinderLocalBGRadius, char* outliersMask);
+
+int peakfinder8_context_typed(tPeakfinder8Context *context, const void *data,
+                              int data_type, char *mask,
+                              float ADCthresh, float hitfinderMinSNR,
+                              long hitfinderMinPixCount, long hitfinderMaxPixCount,
+                              long hitfinderLocalBGRadius, char* outliersMask);
+int peakfinder8_context_sweep(tPeakfinder8Context *context, const void *data,
+                              int data_type, char *mask, const float *param_table,
+                              long num_sets, long *num_peaks);
+
+long copyPeakListToTable(const tPeakList *peak_list, long max_num_peaks,
+                         float *peak_table);
+
+int fillPeakfinder8LabelMap(const tPeakfinder8Context *context, int *label_map);
+long countPeakfinder8PeakPixels(const tPeakfinder8Context *context);
+long copyPeakfinder8PeakPixels(const tPeakfinder8Context *context, int *pixel_index,
+                               int *peak_index);
+
+int peakfinder8_context_batch(tPeakfinder8Context *context, const void *data,
+                              int data_type, long num_frames, char *mask,
+                              float ADCthresh, float hitfinderMinSNR,
+                              long hitfinderMinPixCount, long hitfinderMaxPixCount,
+                              long hitfinderLocalBGRadius, float *peak_table,
+                              long *num_peaks, long *num_table_rows);
+
+void calibrateJungfrauFrame(const unsigned short *raw, long num_pix, const float *dark,
+                            const double *gain, long plane_size, float *calibrated);
+
+tPowderAccumulator *allocatePowderAccumulator(const int *visual_pix_x,
+                                              const int *visual_pix_y,
+                                              long num_pix_fs, long num_pix_ss,
+                                              int *powder, long img_nx, long img_ny,
+                                              int window_size);
+void freePowderAccumulator(tPowderAccumulator *acc);
+void addPowderFrame(tPowderAccumulator *acc, int frame_is_hit);
+double getPowderHitRate(const tPowderAccumulator *acc);
+long addPowderPeaks(tPowderAccumulator *acc, const float *peak_table, long num_peaks,
+                    int *peak_row, int *peak_col);
+long sparseFrameMaxSize(long num_pix_ss, long num_pix_fs, int bin_size,
+                        long num_peaks, int peak_radius);
+long encodeSparseFrame(const float *data, long num_pix_ss, long num_pix_fs,
+                       const float *peak_table, long num_peaks, int peak_radius,
+                       float step, int bin_size, unsigned char *out);
+int sparseFrameShape(const unsigned char *buffer, long size, long *num_pix_ss,
+                     long *num_pix_fs);
+int decodeSparseFrame(const unsigned char *buffer, long size, float *data);
+
+tPeakfinder8Pipeline *allocatePeakfinder8Pipeline(tPeakfinder8Context *context,
+                                                  char *mask, long num_slots,
+                                                  int num_workers, float ADCthresh,
+                                                  float hitfinderMinSNR,
+                                                  long hitfinderMinPixCount,
+                                                  long hitfinderMaxPixCount,
+                                                  long hitfinderLocalBGRadius);
+void freePeakfinder8Pipeline(tPeakfinder8Pipeline *pipeline);
+int peakfinder8PipelineMemoryPinned(const tPeakfinder8Pipeline *pipeline);
+long acquirePeakfinder8PipelineSlot(tPeakfinder8Pipeline *pipeline);
+float *getPeakfinder8PipelineSlotData(tPeakfinder8Pipeline *pipeline, long slot);
+void publishPeakfinder8PipelineSlot(tPeakfinder8Pipeline *pipeline, long slot);
+void closePeakfinder8Pipeline(tPeakfinder8Pipeline *pipeline);
+long nextPeakfinder8PipelineResult(tPeakfinder8Pipeline *pipeline);
+long getPeakfinder8PipelineSlotPeaks(tPeakfinder8Pipeline *pipeline, long slot,
+                                     const float **peak_table);
+void releasePeakfinder8PipelineSlot(tPeakfinder8Pipeline *pipeline, long slot);
+
+tMappedFrameReader *openMappedFrameReader(const char *filename, long offset,
+                                          long frame_size, long num_frames,
+                                          long prefetch_frames);
+void closeMappedFrameReader(tMappedFrameReader *reader);
+long getMappedFrameReaderNumFrames(const tMappedFrameReader *reader);
+void *getMappedFrame(tMappedFrameReader *reader, long frame);
+int cbfFrameShape(const char *buffer, long size, long *num_pix_fs, long *num_pix_ss);
+int decodeCbfFrame(const char *buffer, long size, int *data, long num_pix);
+
+int pixelMapShape(const tPixelMapPanel *panels, int num_panels, long *num_pix_fs,
+                  long *num_pix_ss);
+int computePixelMaps(const tPixelMapPanel *panels, int num_panels, long num_pix_fs,
+                     long num_pix_ss, float *x_map, float *y_map, float *z_map,
+                     float *r_map, float *phi_map);
+int writePixelMapCache(const char *filename, const char *key,
+                       const tPixelMapPanel *panels, int num_panels);
+tPixelMapCache *openPixelMapCache(const char *filename, const char *key);
+void closePixelMapCache(tPixelMapCache *cache);
+
+int currentNumaNode(void);
+tSharedConstants *openSharedConstants(const char *key, int numa_local, double timeout);
+int fillSharedConstants(tSharedConstants *store, const tSharedConstant *constants,
+                        int num_constants, const void *const *data);
+void closeSharedConstants(tSharedConstants *store);
+
 #endif // PEAKFINDER8_H
@@ -0,0 +1,392 @@
+// This file is part of OM.
+//
+// OM is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// OM is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with OnDA.
+// If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2020 -2021 SLAC National Accelerator Laboratory
+//
+// Based on OnDA - Copyright 2014-2019 Deutsches Elektronen-Synchrotron DESY,
+// a research centre of the Helmholtz Association.
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+
+#include "peakfinder8.hh"
+
+
+// Additional contexts used to process the frames of a batch in parallel. Frame
+// thread 0 always uses the main context, so contexts[0] is not used.
+struct peakfinder_frame_pool
+{
+	int num_contexts;
+	tPeakfinder8Context **contexts;
+};
+
+
+struct peakfinder_batch_job
+{
+	const char *data;
+	int data_type;
+	size_t frame_size;			// In bytes
+	long num_frames;
+	char *mask;
+	float adc_thresh;
+	float min_snr;
+	long min_pix_count;
+	long max_pix_count;
+	long local_bg_radius;
+	float *peak_table;
+	long *num_peaks;
+
+	pthread_mutex_t lock;
+	long next_frame;
+	int failed;
+};
+
+
+struct peakfinder_batch_thread
+{
+	struct peakfinder_batch_job *job;
+	tPeakfinder8Context *context;
+};
+
+
+static size_t data_type_size(int data_type)
+{
+	switch ( data_type ) {
+		case PF8_DATA_FLOAT32:
+			return sizeof(float);
+
+		case PF8_DATA_FLOAT64:
+			return sizeof(double);
+
+		case PF8_DATA_UINT16:
+			return sizeof(unsigned short);
+
+		case PF8_DATA_INT32:
+			return sizeof(int);
+
+		default:
+			return 0;
+	}
+}
+
+
+// Copies the peaks in a peak list into the rows of a table with PF8_NUM_PEAK_FIELDS
+// columns. Returns the number of copied peaks
+long copyPeakListToTable(const tPeakList *peak_list, long max_num_peaks,
+                         float *peak_table)
+{
+	long num_peaks;
+	long pki;
+	float *row;
+
+	num_peaks = peak_list->nPeaks;
+	if ( num_peaks > max_num_peaks ) {
+		num_peaks = max_num_peaks;
+	}
+
+	for ( pki=0 ; pki<num_peaks ; pki++ ) {
+		row = peak_table + pki * PF8_NUM_PEAK_FIELDS;
+		row[PF8_PEAK_FS] = peak_list->peak_com_x[pki];
+		row[PF8_PEAK_SS] = peak_list->peak_com_y[pki];
+		row[PF8_PEAK_INTENSITY] = peak_list->peak_totalintensity[pki];
+		row[PF8_PEAK_NUM_PIXELS] = peak_list->peak_npix[pki];
+		row[PF8_PEAK_MAX_PIXEL_INTENSITY] = peak_list->peak_maxintensity[pki];
+		row[PF8_PEAK_SIGMA] = peak_list->peak_sigma[pki];
+		row[PF8_PEAK_SNR] = peak_list->peak_snr[pki];
+		row[PF8_PEAK_X_ASSEMBLED] = peak_list->peak_com_x_assembled[pki];
+		row[PF8_PEAK_Y_ASSEMBLED] = peak_list->peak_com_y_assembled[pki];
+		row[PF8_PEAK_R_ASSEMBLED] = peak_list->peak_com_r_assembled[pki];
+		row[PF8_PEAK_Q] = peak_list->peak_com_q[pki];
+		row[PF8_PEAK_RESOLUTION] = peak_list->peak_com_res[pki];
+	}
+
+	return num_peaks;
+}
+
+
+// Fills the resolution columns of a peak table from the assembled radius of each
+// peak, for frames whose peaks were searched before the beam energy and detector
+// distance were known
+void fillPeakTableResolution(float *peak_table, long num_peaks,
+                             float pixels_per_meter, double beam_energy,
+                             double detector_distance)
+{
+	long pki;
+	float *row;
+
+	for ( pki=0 ; pki<num_peaks ; pki++ ) {
+		row = peak_table + pki * PF8_NUM_PEAK_FIELDS;
+		computePeakResolution(row[PF8_PEAK_R_ASSEMBLED], pixels_per_meter, beam_energy,
+		                      detector_distance, &row[PF8_PEAK_Q],
+		                      &row[PF8_PEAK_RESOLUTION]);
+	}
+}
+
+
+void freePeakfinder8FramePool(struct peakfinder_frame_pool *frame_pool)
+{
+	int ci;
+
+	for ( ci=1 ; ci<frame_pool->num_contexts ; ci++ ) {
+		freePeakfinder8Context(frame_pool->contexts[ci]);
+	}
+	free(frame_pool->contexts);
+	free(frame_pool);
+}
+
+
+// Sets the number of threads that process the frames of a batch in parallel. Each
+// additional thread needs its own copy of the context buffers. Returns 1 if the
+// memory cannot be allocated
+int setPeakfinder8NumFrameThreads(tPeakfinder8Context *context, int num_threads)
+{
+	struct peakfinder_frame_pool *frame_pool;
+	int ci;
+
+	if ( num_threads < 1 ) {
+		num_threads = 1;
+	}
+	if ( num_threads == context->num_frame_threads ) {
+		return 0;
+	}
+
+	frame_pool = NULL;
+	if ( num_threads > 1 ) {
+		frame_pool = (struct peakfinder_frame_pool *)malloc(sizeof(struct peakfinder_frame_pool));
+		if ( frame_pool == NULL ) {
+			return 1;
+		}
+		frame_pool->contexts = (tPeakfinder8Context **)calloc(num_threads,
+		                                                      sizeof(tPeakfinder8Context *));
+		if ( frame_pool->contexts == NULL ) {
+			free(frame_pool);
+			return 1;
+		}
+		frame_pool->num_contexts = 1;
+		for ( ci=1 ; ci<num_threads ; ci++ ) {
+			frame_pool->contexts[ci] = clonePeakfinder8Context(context);
+			if ( frame_pool->contexts[ci] == NULL ) {
+				freePeakfinder8FramePool(frame_pool);
+				return 1;
+			}
+			frame_pool->num_contexts += 1;
+		}
+	}
+
+	if ( context->frame_pool != NULL ) {
+		freePeakfinder8FramePool(context->frame_pool);
+	}
+	context->frame_pool = frame_pool;
+	context->num_frame_threads = num_threads;
+
+	return 0;
+}
+
+
+// Applies the settings of a context to another one, created with
+// clonePeakfinder8Context. Returns 1 if a setting cannot be applied
+int copyPeakfinder8Settings(tPeakfinder8Context *context,
+                            const tPeakfinder8Context *source)
+{
+	if ( setPeakfinder8RadialStatsKernel(context, source->radial_stats_kernel) != 0
+	  || setPeakfinder8BackgroundEstimator(context, source->background_estimator) != 0
+	  || setPeakfinder8BackgroundDecay(context, source->background_decay) != 0
+	  || setPeakfinder8NumThreads(context, source->num_threads) != 0
+	  || setPeakfinder8SeedScan(context, source->seed_scan) != 0
+	  || setPeakfinder8PanelKernel(context, source->panel_kernel) != 0
+	  || setPeakfinder8LocalBackground(context, source->local_background) != 0
+	  || setPeakfinder8Backend(context, source->backend) != 0 ) {
+		return 1;
+	}
+	setPeakfinder8Prescreen(context, source->prescreen_min_peaks,
+	                        source->prescreen_validation,
+	                        source->prescreen_max_rejections);
+	setPeakfinder8CollectStats(context, source->collect_stats);
+	setPeakfinder8PeakRefinement(context, source->peak_refinement);
+	setPeakfinder8PeakGeometry(context, source->geometry_x_map, source->geometry_y_map,
+	                           source->pixels_per_meter);
+	setPeakfinder8BeamParameters(context, source->beam_energy,
+	                             source->detector_distance);
+	context->mask_generation = source->mask_generation;
+
+	return 0;
+}
+
+
+static void process_batch_frames(struct peakfinder_batch_job *job,
+                                 tPeakfinder8Context *context)
+{
+	long frame;
+	int ret;
+
+	while ( 1 ) {
+
+		pthread_mutex_lock(&job->lock);
+		frame = job->next_frame;
+		job->next_frame += 1;
+		pthread_mutex_unlock(&job->lock);
+
+		if ( frame >= job->num_frames ) {
+			break;
+		}
+
+		ret = peakfinder8_context_typed(context, job->data + frame * job->frame_size,
+		                                job->data_type, job->mask, job->adc_thresh,
+		                                job->min_snr, job->min_pix_count,
+		                                job->max_pix_count, job->local_bg_radius,
+		                                NULL);
+		if ( ret != 0 ) {
+			pthread_mutex_lock(&job->lock);
+			job->failed = 1;
+			pthread_mutex_unlock(&job->lock);
+			job->num_peaks[frame] = 0;
+			continue;
+		}
+
+		job->num_peaks[frame] = copyPeakListToTable(&context->peak_list,
+		                                            context->max_num_peaks,
+		                                            job->peak_table + frame *
+		                                            context->max_num_peaks *
+		                                            PF8_NUM_PEAK_FIELDS);
+	}
+}
+
+
+static void *peakfinder_batch_thread(void *arg)
+{
+	struct peakfinder_batch_thread *thread;
+
+	thread = (struct peakfinder_batch_thread *)arg;
+	process_batch_frames(thread->job, thread->context);
+
+	return NULL;
+}
+
+
+// Cheetah Peakfinder8 on a batch of frames, stored one after the other in the data
+// buffer and sharing the same mask. The peak table must have room for
+// num_frames*max_num_peaks rows of PF8_NUM_PEAK_FIELDS values. On return, the first
+// num_table_rows rows store the peaks of all the frames, in frame order, and
+// num_peaks stores the number of peaks of each frame. The result does not depend on
+// the number of frame threads, unless the pre-screen or the temporal background are
+// used: each thread then reuses the thresholds, or updates the background model, of
+// the frames that it processed. Returns 1 if any of the frames cannot be processed
+int peakfinder8_context_batch(tPeakfinder8Context *context, const void *data,
+                              int data_type, long num_frames, char *mask,
+                              float ADCthresh, float hitfinderMinSNR,
+                              long hitfinderMinPixCount, long hitfinderMaxPixCount,
+                              long hitfinderLocalBGRadius, float *peak_table,
+                              long *num_peaks, long *num_table_rows)
+{
+	struct peakfinder_batch_job job;
+	struct peakfinder_batch_thread *threads;
+	pthread_t *thread_ids;
+	tPeakfinder8Context *frame_context;
+	int num_threads;
+	int num_started;
+	int ti;
+	long frame;
+	long rows;
+	size_t row_size;
+
+	if ( data_type_size(data_type) == 0 ) {
+		return 1;
+	}
+
+	job.data = (const char *)data;
+	job.data_type = data_type;
+	job.frame_size = context->num_pix_tot * data_type_size(data_type);
+	job.num_frames = num_frames;
+	job.mask = mask;
+	job.adc_thresh = ADCthresh;
+	job.min_snr = hitfinderMinSNR;
+	job.min_pix_count = hitfinderMinPixCount;
+	job.max_pix_count = hitfinderMaxPixCount;
+	job.local_bg_radius = hitfinderLocalBGRadius;
+	job.peak_table = peak_table;
+	job.num_peaks = num_peaks;
+	job.next_frame = 0;
+	job.failed = 0;
+	pthread_mutex_init(&job.lock, NULL);
+
+	num_threads = context->num_frame_threads;
+	if ( num_threads > num_frames ) {
+		num_threads = num_frames;
+	}
+
+	threads = NULL;
+	thread_ids = NULL;
+	num_started = 1;
+	if ( num_threads > 1 ) {
+		threads = (struct peakfinder_batch_thread *)malloc(num_threads*sizeof(struct peakfinder_batch_thread));
+		thread_ids = (pthread_t *)malloc(num_threads*sizeof(pthread_t));
+	}
+
+	// If a thread cannot be started, its frames are processed by the others
+	if ( threads != NULL && thread_ids != NULL ) {
+		for ( ti=1 ; ti<num_threads ; ti++ ) {
+
+			// The additional contexts must use the same settings as the main one
+			frame_context = context->frame_pool->contexts[ti];
+			if ( copyPeakfinder8Settings(frame_context, context) != 0 ) {
+				break;
+			}
+
+			threads[ti].job = &job;
+			threads[ti].context = frame_context;
+			if ( pthread_create(&thread_ids[ti], NULL, peakfinder_batch_thread,
+			                    &threads[ti]) != 0 ) {
+				break;
+			}
+			num_started += 1;
+		}
+	}
+
+	process_batch_frames(&job, context);
+
+	for ( ti=1 ; ti<num_started ; ti++ ) {
+		pthread_join(thread_ids[ti], NULL);
+
+		// The pre-screen and frame statistics are collected in the main context
+		frame_context = threads[ti].context;
+		context->prescreen_num_frames += frame_context->prescreen_num_frames;
+		context->prescreen_num_rejected += frame_context->prescreen_num_rejected;
+		context->prescreen_num_false_negatives +=
+		    frame_context->prescreen_num_false_negatives;
+		resetPeakfinder8PrescreenStats(frame_context);
+		addPeakfinder8Stats(&context->stats, &frame_context->stats);
+		resetPeakfinder8Stats(frame_context);
+	}
+	free(threads);
+	free(thread_ids);
+	pthread_mutex_destroy(&job.lock);
+
+	if ( job.failed ) {
+		return 1;
+	}
+
+	// Moves the peaks of each frame right after the peaks of the previous one
+	row_size = PF8_NUM_PEAK_FIELDS * sizeof(float);
+	rows = 0;
+	for ( frame=0 ; frame<num_frames ; frame++ ) {
+		if ( rows != frame * context->max_num_peaks ) {
+			memmove(peak_table + rows * PF8_NUM_PEAK_FIELDS,
+			        peak_table + frame * context->max_num_peaks * PF8_NUM_PEAK_FIELDS,
+			        num_peaks[frame] * row_size);
+		}
+		rows += num_peaks[frame];
+	}
+	*num_table_rows = rows;
+
+	return 0;
+}
@@ -0,0 +1,52 @@
+// This file is part of OM.
+//
+// OM is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// OM is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with OnDA.
+// If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2020 -2021 SLAC National Accelerator Laboratory
+//
+// Based on OnDA - Copyright 2014-2019 Deutsches Elektronen-Synchrotron DESY,
+// a research centre of the Helmholtz Association.
+#include "peakfinder8.hh"
+
+
+// Gain stage of a raw Jungfrau pixel: bit 15 selects stage 2, otherwise bit 14
+// selects stage 1
+static inline int jungfrau_gain_stage(unsigned short raw)
+{
+	if ( raw & 0x8000 ) {
+		return 2;
+	}
+	return (raw >> 14) & 1;
+}
+
+
+// Calibrates a raw Jungfrau frame, or a part of it, in a single pass. The dark and gain
+// arrays store one plane for each of the three gain stages, and consecutive planes are
+// plane_size values apart, so that the pixels of a single panel can be calibrated with
+// pointers into the planes of the whole frame. Each gain value must already be
+// multiplied by the photon energy. Each output pixel is
+// (raw - dark) / gain, using the dark and gain of the stage encoded in the raw value.
+// The difference is computed in single precision and the division in double
+// precision, so that the result matches the original Jungfrau1MCalibration algorithm
+void calibrateJungfrauFrame(const unsigned short *raw, long num_pix, const float *dark,
+                            const double *gain, long plane_size, float *calibrated)
+{
+	long pi;
+	long plane;
+	float value;
+
+	for ( pi=0 ; pi<num_pix ; pi++ ) {
+		plane = jungfrau_gain_stage(raw[pi]) * plane_size + pi;
+		value = (float)raw[pi] - dark[plane];
+		calibrated[pi] = (float)((double)value / gain[plane]);
+	}
+}
@@ -23,7 +23,9 @@ algorithm.
 """
 from libcpp.vector cimport vector
 from libc.stdlib cimport malloc, free
+from libc.string cimport memcpy, memset, strcpy
 from libc.stdint cimport int8_t
+from cpython.buffer cimport PyBuffer_FillInfo
 
 import numpy
 
@@ -57,7 +59,157 @@ cdef extern from "peakfinder8.hh":
     void allocatePeakList(tPeakList* peak_list, long max_num_peaks)
     void freePeakList(tPeakList peak_list)
 
-cdef extern from "peakfinder8.hh":
+    enum:
+        PF8_RADIAL_STATS_SCALAR
+        PF8_RADIAL_STATS_SORTED
+        PF8_RADIAL_STATS_AVX2
+        PF8_RADIAL_STATS_AVX512
+        PF8_RADIAL_STATS_NEON
+
+    enum:
+        PF8_DATA_FLOAT32
+        PF8_DATA_FLOAT64
+        PF8_DATA_UINT16
+        PF8_DATA_INT32
+
+    enum:
+        PF8_BACKGROUND_SIGMA_CLIPPING
+        PF8_BACKGROUND_MEDIAN_MAD
+        PF8_BACKGROUND_TEMPORAL
+
+    enum:
+        PF8_PRESCREEN_NOT_RUN
+        PF8_PRESCREEN_CANDIDATE
+        PF8_PRESCREEN_NOT_A_HIT
+
+    enum:
+        PF8_SEED_SCAN_PIXEL
+        PF8_SEED_SCAN_BITMAP
+
+    enum:
+        PF8_PANEL_KERNEL_GENERIC
+        PF8_PANEL_KERNEL_LAYOUT
+
+    enum:
+        PF8_LOCAL_BACKGROUND_RING
+        PF8_LOCAL_BACKGROUND_INTEGRAL
+
+    enum:
+        PF8_BACKEND_CPU
+        PF8_BACKEND_GPU
+
+    enum:
+        PF8_PEAK_REFINEMENT_CENTER_OF_MASS
+        PF8_PEAK_REFINEMENT_QUADRATIC
+        PF8_PEAK_REFINEMENT_GAUSSIAN
+
+    enum:
+        PF8_NUM_PEAK_FIELDS
+
+    enum:
+        PF8_NUM_SWEEP_FIELDS
+
+    enum:
+        PF8_STAGE_RADIAL_STATS
+        PF8_STAGE_CANDIDATE_SCAN
+        PF8_STAGE_PEAK_GROWTH
+        PF8_STAGE_LOCAL_BACKGROUND
+        PF8_STAGE_TOTAL
+        PF8_NUM_STAGES
+
+    enum:
+        PF8_REJECTED_PIX_COUNT
+        PF8_REJECTED_INTENSITY
+        PF8_REJECTED_SNR
+        PF8_REJECTED_BACKGROUND
+        PF8_REJECTED_PANEL_EDGE
+        PF8_NUM_REJECTIONS
+
+    ctypedef struct tPeakfinder8Stats:
+        long        num_frames
+        long long   stage_ns[PF8_NUM_STAGES]
+        long        num_seeds
+        long        num_candidates
+        long        num_rejected[PF8_NUM_REJECTIONS]
+        long        num_peaks
+        long        max_peak_pixels
+
+    ctypedef struct tPeakfinder8Context:
+        long        asic_nx
+        long        asic_ny
+        long        nasics_x
+        long        nasics_y
+        long        num_pix_tot
+        long        max_num_peaks
+        long        max_pix_count
+        int         num_rad_bins
+        int         radial_stats_kernel
+        int         background_estimator
+        float       background_decay
+        int         num_threads
+        int         num_frame_threads
+        int         prescreen_min_peaks
+        int         prescreen_validation
+        int         prescreen_max_rejections
+        int         prescreen_result
+        long        prescreen_num_pixels
+        long        prescreen_num_frames
+        long        prescreen_num_rejected
+        long        prescreen_num_false_negatives
+        int         seed_scan
+        int         panel_kernel
+        int         local_background
+        int         backend
+        int         peak_refinement
+        int         collect_stats
+        tPeakfinder8Stats stats
+        tPeakList   peak_list
+
+    tPeakfinder8Context *allocatePeakfinder8Context(float *pix_r,
+                                                    long asic_nx, long asic_ny,
+                                                    long nasics_x, long nasics_y,
+                                                    long max_num_peaks,
+                                                    long max_pix_count)
+    tPeakfinder8Context *allocatePeakfinder8ContextFromBins(
+        const unsigned short *r_bin, int num_rad_bins, long asic_nx, long asic_ny,
+        long nasics_x, long nasics_y, long max_num_peaks, long max_pix_count
+    )
+    tPeakfinder8Context *allocatePeakfinder8ContextSharedBins(
+        const unsigned short *r_bin, int num_rad_bins, long asic_nx, long asic_ny,
+        long nasics_x, long nasics_y, long max_num_peaks, long max_pix_count
+    )
+    void freePeakfinder8Context(tPeakfinder8Context *context)
+    int setPeakfinder8RadialStatsKernel(tPeakfinder8Context *context, int kernel)
+    int setPeakfinder8BackgroundEstimator(tPeakfinder8Context *context,
+                                          int estimator)
+    int setPeakfinder8BackgroundDecay(tPeakfinder8Context *context, float decay)
+    void notifyPeakfinder8MaskChanged(tPeakfinder8Context *context)
+    void resetPeakfinder8Background(tPeakfinder8Context *context)
+    int setPeakfinder8NumThreads(tPeakfinder8Context *context, int num_threads)
+    int setPeakfinder8NumFrameThreads(tPeakfinder8Context *context,
+                                      int num_threads)
+    void setPeakfinder8Prescreen(tPeakfinder8Context *context, int min_num_peaks,
+                                 int validation, int max_rejections)
+    void resetPeakfinder8PrescreenStats(tPeakfinder8Context *context)
+    int setPeakfinder8SeedScan(tPeakfinder8Context *context, int seed_scan)
+    int setPeakfinder8PanelKernel(tPeakfinder8Context *context, int panel_kernel)
+    int setPeakfinder8LocalBackground(tPeakfinder8Context *context,
+                                      int local_background)
+    int setPeakfinder8Backend(tPeakfinder8Context *context, int backend)
+    int setPeakfinder8PeakRefinement(tPeakfinder8Context *context, int refinement)
+    void setPeakfinder8PeakGeometry(tPeakfinder8Context *context, const float *x_map,
+                                    const float *y_map, float pixels_per_meter)
+    void setPeakfinder8BeamParameters(tPeakfinder8Context *context,
+                                      double beam_energy, double detector_distance)
+    void fillPeakTableResolution(float *peak_table, long num_peaks,
+                                 float pixels_per_meter, double beam_energy,
+                                 double detector_distance)
+    int peakfinder8GpuAvailable()
+    void setPeakfinder8CollectStats(tPeakfinder8Context *context,
+                                    int collect_stats)
+    void resetPeakfinder8Stats(tPeakfinder8Context *context)
+
+cdef extern from "peakfinder8.hh" nogil:
 
     int peakfinder8(tPeakList *peaklist, float *data, char *mask, float *pix_r,
                     long asic_nx, long asic_ny, long nasics_x, long nasics_y,
@@ -65,6 +217,372 @@ cdef extern from "peakfinder8.hh":
                     long hitfinderMinPixCount, long hitfinderMaxPixCount,
                     long hitfinderLocalBGRadius, char *outliersMask)
 
+    int peakfinder8_context(tPeakfinder8Context *context, float *data, char *mask,
+                            float ADCthresh, float hitfinderMinSNR,
+                            long hitfinderMinPixCount, long hitfinderMaxPixCount,
+                            long hitfinderLocalBGRadius, char *outliersMask)
+
+    int peakfinder8_context_typed(tPeakfinder8Context *context, const void *data,
+                                  int data_type, char *mask,
+                                  float ADCthresh, float hitfinderMinSNR,
+                                  long hitfinderMinPixCount,
+                                  long hitfinderMaxPixCount,
+                                  long hitfinderLocalBGRadius, char *outliersMask)
+
+    long copyPeakListToTable(const tPeakList *peak_list, long max_num_peaks,
+                             float *peak_table)
+
+    int fillPeakfinder8LabelMap(const tPeakfinder8Context *context, int *label_map)
+    long countPeakfinder8PeakPixels(const tPeakfinder8Context *context)
+    long copyPeakfinder8PeakPixels(const tPeakfinder8Context *context,
+                                   int *pixel_index, int *peak_index)
+
+    int peakfinder8_context_batch(tPeakfinder8Context *context, const void *data,
+                                  int data_type, long num_frames, char *mask,
+                                  float ADCthresh, float hitfinderMinSNR,
+                                  long hitfinderMinPixCount,
+                                  long hitfinderMaxPixCount,
+                                  long hitfinderLocalBGRadius, float *peak_table,
+                                  long *num_peaks, long *num_table_rows)
+
+    int peakfinder8_context_sweep(tPeakfinder8Context *context, const void *data,
+                                  int data_type, char *mask,
+                                  const float *param_table, long num_sets,
+                                  long *num_peaks)
+
+    void calibrateJungfrauFrame(const unsigned short *raw, long num_pix,
+                                const float *dark, const double *gain,
+                                long plane_size, float *calibrated)
+
+    ctypedef struct tPeakfinder8Pipeline:
+        pass
+
+    tPeakfinder8Pipeline *allocatePeakfinder8Pipeline(tPeakfinder8Context *context,
+                                                      char *mask, long num_slots,
+                                                      int num_workers,
+                                                      float ADCthresh,
+                                                      float hitfinderMinSNR,
+                                                      long hitfinderMinPixCount,
+                                                      long hitfinderMaxPixCount,
+                                                      long hitfinderLocalBGRadius)
+    void freePeakfinder8Pipeline(tPeakfinder8Pipeline *pipeline)
+    int peakfinder8PipelineMemoryPinned(const tPeakfinder8Pipeline *pipeline)
+    long acquirePeakfinder8PipelineSlot(tPeakfinder8Pipeline *pipeline)
+    float *getPeakfinder8PipelineSlotData(tPeakfinder8Pipeline *pipeline, long slot)
+    void publishPeakfinder8PipelineSlot(tPeakfinder8Pipeline *pipeline, long slot)
+    void closePeakfinder8Pipeline(tPeakfinder8Pipeline *pipeline)
+    long nextPeakfinder8PipelineResult(tPeakfinder8Pipeline *pipeline)
+    long getPeakfinder8PipelineSlotPeaks(tPeakfinder8Pipeline *pipeline, long slot,
+                                         const float **peak_table)
+    void releasePeakfinder8PipelineSlot(tPeakfinder8Pipeline *pipeline, long slot)
+
+    ctypedef struct tPowderAccumulator:
+        long        num_pix_tot
+        int         window_size
+        long        num_frames
+        long        num_hits
+
+    tPowderAccumulator *allocatePowderAccumulator(const int *visual_pix_x,
+                                                  const int *visual_pix_y,
+                                                  long num_pix_fs, long num_pix_ss,
+                                                  int *powder, long img_nx,
+                                                  long img_ny, int window_size)
+    void freePowderAccumulator(tPowderAccumulator *acc)
+    void addPowderFrame(tPowderAccumulator *acc, int frame_is_hit)
+    double getPowderHitRate(const tPowderAccumulator *acc)
+    long addPowderPeaks(tPowderAccumulator *acc, const float *peak_table,
+                        long num_peaks, int *peak_row, int *peak_col)
+
+    long sparseFrameMaxSize(long num_pix_ss, long num_pix_fs, int bin_size,
+                            long num_peaks, int peak_radius)
+    long encodeSparseFrame(const float *data, long num_pix_ss, long num_pix_fs,
+                           const float *peak_table, long num_peaks,
+                           int peak_radius, float step, int bin_size,
+                           unsigned char *out)
+    int sparseFrameShape(const unsigned char *buffer, long size, long *num_pix_ss,
+                         long *num_pix_fs)
+    int decodeSparseFrame(const unsigned char *buffer, long size, float *data)
+
+    ctypedef struct tMappedFrameReader:
+        pass
+
+    tMappedFrameReader *openMappedFrameReader(const char *filename, long offset,
+                                              long frame_size, long num_frames,
+                                              long prefetch_frames)
+    void closeMappedFrameReader(tMappedFrameReader *reader)
+    long getMappedFrameReaderNumFrames(const tMappedFrameReader *reader)
+    void *getMappedFrame(tMappedFrameReader *reader, long frame)
+    int cbfFrameShape(const char *buffer, long size, long *num_pix_fs,
+                      long *num_pix_ss)
+    int decodeCbfFrame(const char *buffer, long size, int *data, long num_pix)
+
+    ctypedef struct tPixelMapPanel:
+        long        min_fs
+        long        max_fs
+        long        min_ss
+        long        max_ss
+        double      fsx
+        double      fsy
+        double      ssx
+        double      ssy
+        double      cnx
+        double      cny
+        double      clen
+
+    ctypedef struct tPixelMapCache:
+        char        *map
+        long        map_size
+        long        num_pix_fs
+        long        num_pix_ss
+        const float *x
+        const float *y
+        const float *z
+        const float *radius
+        const float *phi
+        const unsigned short *r_bin
+        int         num_rad_bins
+        long        num_spans
+        const int   *spans
+
+    int writePixelMapCache(const char *filename, const char *key,
+                           const tPixelMapPanel *panels, int num_panels)
+    tPixelMapCache *openPixelMapCache(const char *filename, const char *key)
+    void closePixelMapCache(tPixelMapCache *cache)
+
+    enum:
+        PF8_SHARED_CONSTANT_NAME_SIZE
+        PF8_SHARED_CONSTANT_MAX_DIMS
+
+    ctypedef struct tSharedConstant:
+        char        name[PF8_SHARED_CONSTANT_NAME_SIZE]
+        char        dtype[8]
+        int         ndim
+        long        shape[PF8_SHARED_CONSTANT_MAX_DIMS]
+        long        offset
+        long        size
+
+    ctypedef struct tSharedConstants:
+        char        *map
+        long        map_size
+        int         created
+        int         numa_node
+        int         num_constants
+        const tSharedConstant *constants
+
+    tSharedConstants *openSharedConstants(const char *key, int numa_local,
+                                          double timeout) nogil
+    int fillSharedConstants(tSharedConstants *store, const tSharedConstant *constants,
+                            int num_constants, const void **data) nogil
+    void closeSharedConstants(tSharedConstants *store)
+
+
+# Frame data types that the context can process without converting them first
+ctypedef fused pf8_data_t:
+    float
+    double
+    unsigned short
+    int
+
+
+_radial_stats_kernels = {
+    "scalar": PF8_RADIAL_STATS_SCALAR,
+    "sorted": PF8_RADIAL_STATS_SORTED,
+    "avx2": PF8_RADIAL_STATS_AVX2,
+    "avx512": PF8_RADIAL_STATS_AVX512,
+    "neon": PF8_RADIAL_STATS_NEON,
+}
+
+_background_estimators = {
+    "sigma_clipping": PF8_BACKGROUND_SIGMA_CLIPPING,
+    "median_mad": PF8_BACKGROUND_MEDIAN_MAD,
+    "temporal": PF8_BACKGROUND_TEMPORAL,
+}
+
+_seed_scans = {
+    "pixel": PF8_SEED_SCAN_PIXEL,
+    "bitmap": PF8_SEED_SCAN_BITMAP,
+}
+
+_panel_kernels = {
+    "generic": PF8_PANEL_KERNEL_GENERIC,
+    "layout": PF8_PANEL_KERNEL_LAYOUT,
+}
+
+_local_backgrounds = {
+    "ring": PF8_LOCAL_BACKGROUND_RING,
+    "integral": PF8_LOCAL_BACKGROUND_INTEGRAL,
+}
+
+_backends = {
+    "cpu": PF8_BACKEND_CPU,
+    "gpu": PF8_BACKEND_GPU,
+}
+
+_peak_refinements = {
+    "center_of_mass": PF8_PEAK_REFINEMENT_CENTER_OF_MASS,
+    "quadratic": PF8_PEAK_REFINEMENT_QUADRATIC,
+    "gaussian": PF8_PEAK_REFINEMENT_GAUSSIAN,
+}
+
+_prescreen_results = {
+    PF8_PRESCREEN_NOT_RUN: "not_run",
+    PF8_PRESCREEN_CANDIDATE: "candidate",
+    PF8_PRESCREEN_NOT_A_HIT: "not_a_hit",
+}
+
+_stages = {
+    "radial_stats": PF8_STAGE_RADIAL_STATS,
+    "candidate_scan": PF8_STAGE_CANDIDATE_SCAN,
+    "peak_growth": PF8_STAGE_PEAK_GROWTH,
+    "local_background": PF8_STAGE_LOCAL_BACKGROUND,
+    "total": PF8_STAGE_TOTAL,
+}
+
+_rejection_reasons = {
+    "pix_count": PF8_REJECTED_PIX_COUNT,
+    "intensity": PF8_REJECTED_INTENSITY,
+    "snr": PF8_REJECTED_SNR,
+    "background": PF8_REJECTED_BACKGROUND,
+    "panel_edge": PF8_REJECTED_PANEL_EDGE,
+}
+
+# Structured array type of the peak lists returned by
+# :func:`Peakfinder8Context.find_peaks_array`. All the fields are float32, so that a
+# peak list can also be seen as a 2D float32 array with one row per peak. The
+# assembled position of the peaks (in pixels, from the center of the detector), its
+# distance from the center, and the scattering vector (in 1/Angstrom) and resolution
+# (in Angstrom) of the peaks are only filled when the geometry and the beam
+# parameters are known, and are zero otherwise.
+peak_list_dtype = numpy.dtype(
+    [
+        ("fs", numpy.float32),
+        ("ss", numpy.float32),
+        ("intensity", numpy.float32),
+        ("num_pixels", numpy.float32),
+        ("max_pixel_intensity", numpy.float32),
+        ("sigma", numpy.float32),
+        ("snr", numpy.float32),
+        ("x_assembled", numpy.float32),
+        ("y_assembled", numpy.float32),
+        ("r_assembled", numpy.float32),
+        ("q", numpy.float32),
+        ("resolution", numpy.float32),
+    ]
+)
+
+
+cdef int _peak_list_to_array(tPeakList *peak_list, int max_num_peaks,
+                             float[:, ::1] peak_array) nogil:
+    # Copies the content of a peak list into the rows of a float32 array, with the
+    # columns in the order of the peak_list_dtype fields. Returns the number of peaks.
+    return copyPeakListToTable(peak_list, max_num_peaks, &peak_array[0, 0])
+
+
+cdef int _pf8_data_type(pf8_data_t *data_ptr) nogil:
+    # Returns the peakfinder8 data type matching the type of the frame data.
+    if pf8_data_t is float:
+        return PF8_DATA_FLOAT32
+    elif pf8_data_t is double:
+        return PF8_DATA_FLOAT64
+    elif pf8_data_t is int:
+        return PF8_DATA_INT32
+    else:
+        return PF8_DATA_UINT16
+
+
+cdef int _check_frame_size(tPeakfinder8Context *context, long num_data_pix,
+                           long num_mask_pix) except -1:
+    # Checks that a data frame and a mask match the layout of the context, before
+    # the native code reads them without holding the GIL.
+    if num_data_pix != context.num_pix_tot:
+        raise ValueError(
+            "The size of the data frame does not match the detector layout."
+        )
+    if num_mask_pix != context.num_pix_tot:
+        raise ValueError("The size of the mask does not match the detector layout.")
+    return 0
+
+
+cdef int _run_peakfinder8_context(tPeakfinder8Context *context,
+                                  pf8_data_t[:, ::1] data, char[:, ::1] mask,
+                                  float adc_thresh, float hitfinder_min_snr,
+                                  long hitfinder_min_pix_count,
+                                  long hitfinder_max_pix_count,
+                                  long hitfinder_local_bg_radius) except -1:
+    # Runs peakfinder8 on a frame of any supported type, without holding the GIL.
+    # The peaks are stored in the peak list of the context.
+    cdef int ret
+    cdef int data_type
+    cdef const void *data_ptr
+    cdef char *mask_ptr
+
+    _check_frame_size(context, data.shape[0] * data.shape[1],
+                      mask.shape[0] * mask.shape[1])
+    data_type = _pf8_data_type(&data[0, 0])
+    data_ptr = &data[0, 0]
+    mask_ptr = &mask[0, 0]
+
+    with nogil:
+        ret = peakfinder8_context_typed(context, data_ptr, data_type, mask_ptr,
+                                        adc_thresh, hitfinder_min_snr,
+                                        hitfinder_min_pix_count,
+                                        hitfinder_max_pix_count,
+                                        hitfinder_local_bg_radius, NULL)
+    if ret != 0 and hitfinder_max_pix_count > context.max_pix_count:
+        raise RuntimeError(
+            "Peakfinder8 failed: the maximum peak size ({0} pixels) is larger "
+            "than the one supported by the context ({1} pixels).".format(
+                hitfinder_max_pix_count, context.max_pix_count
+            )
+        )
+    if ret != 0:
+        # The buffers needed by some kernels are only allocated with the first frame
+        raise MemoryError("Peakfinder8 failed: cannot allocate the required memory.")
+    return 0
+
+
+cdef _peak_list_to_tuple(tPeakList *peak_list, int max_num_peaks):
+    # Copies the content of a peak list into a tuple of vectors, converted by Cython
+    # into python lists.
+    cdef int i
+    cdef float peak_x, peak_y, peak_value
+    cdef vector[double] peak_list_x
+    cdef vector[double] peak_list_y
+    cdef vector[long] peak_list_index
+    cdef vector[double] peak_list_value
+    cdef vector[double] peak_list_npix
+    cdef vector[double] peak_list_maxi
+    cdef vector[double] peak_list_sigma
+    cdef vector[double] peak_list_snr
+
+    num_peaks = peak_list.nPeaks
+
+    if num_peaks > max_num_peaks:
+        num_peaks = max_num_peaks
+
+    for i in range(0, num_peaks):
+
+        peak_x = peak_list.peak_com_x[i]
+        peak_y = peak_list.peak_com_y[i]
+        peak_index = peak_list.peak_com_index[i]
+        peak_value = peak_list.peak_totalintensity[i]
+        peak_npix = peak_list.peak_npix[i]
+        peak_maxi = peak_list.peak_maxintensity[i]
+        peak_sigma = peak_list.peak_sigma[i]
+        peak_snr = peak_list.peak_snr[i]
+
+        peak_list_x.push_back(peak_x)
+        peak_list_y.push_back(peak_y)
+        peak_list_index.push_back(peak_index)
+        peak_list_value.push_back(peak_value)
+        peak_list_npix.push_back(peak_npix)
+        peak_list_maxi.push_back(peak_maxi)
+        peak_list_sigma.push_back(peak_sigma)
+        peak_list_snr.push_back(peak_snr)
+
+    return (peak_list_x, peak_list_y, peak_list_value, peak_list_index,
+            peak_list_npix, peak_list_maxi, peak_list_sigma, peak_list_snr)
+
 
 def peakfinder_8(int max_num_peaks, float[:,::1] data, char[:,::1] mask,
                  float[:,::1] pix_r, long asic_nx, long asic_ny, long nasics_x,
@@ -171,50 +689,2114 @@ List[float], List[float]`: A tuple storing  information about the detected peaks
           detected peak.
     """
     cdef tPeakList peak_list
+    cdef float *data_ptr = &data[0, 0]
+    cdef char *mask_ptr = &mask[0, 0]
+    cdef float *pix_r_ptr = &pix_r[0, 0]
     allocatePeakList(&peak_list, max_num_peaks)
 
-    peakfinder8(&peak_list, &data[0, 0], &mask[0,0], &pix_r[0, 0], asic_nx, asic_ny,
-                nasics_x, nasics_y, adc_thresh, hitfinder_min_snr,
-                hitfinder_min_pix_count, hitfinder_max_pix_count,
-                hitfinder_local_bg_radius, NULL)
+    with nogil:
+        peakfinder8(&peak_list, data_ptr, mask_ptr, pix_r_ptr, asic_nx, asic_ny,
+                    nasics_x, nasics_y, adc_thresh, hitfinder_min_snr,
+                    hitfinder_min_pix_count, hitfinder_max_pix_count,
+                    hitfinder_local_bg_radius, NULL)
 
-    cdef int i
-    cdef float peak_x, peak_y, peak_value
-    cdef vector[double] peak_list_x
-    cdef vector[double] peak_list_y
-    cdef vector[long] peak_list_index
-    cdef vector[double] peak_list_value
-    cdef vector[double] peak_list_npix
-    cdef vector[double] peak_list_maxi
-    cdef vector[double] peak_list_sigma
-    cdef vector[double] peak_list_snr
+    peak_list_tuple = _peak_list_to_tuple(&peak_list, max_num_peaks)
 
-    num_peaks = peak_list.nPeaks
+    freePeakList(peak_list)
 
-    if num_peaks > max_num_peaks:
-        num_peaks = max_num_peaks
+    return peak_list_tuple
 
-    for i in range(0, num_peaks):
 
-        peak_x = peak_list.peak_com_x[i]
-        peak_y = peak_list.peak_com_y[i]
-        peak_index = peak_list.peak_com_index[i]
-        peak_value = peak_list.peak_totalintensity[i]
-        peak_npix = peak_list.peak_npix[i]
-        peak_maxi = peak_list.peak_maxintensity[i]
-        peak_sigma = peak_list.peak_sigma[i]
-        peak_snr = peak_list.peak_snr[i]
+def gpu_available():
+    """
+    gpu_available()
 
-        peak_list_x.push_back(peak_x)
-        peak_list_y.push_back(peak_y)
-        peak_list_index.push_back(peak_index)
-        peak_list_value.push_back(peak_value)
-        peak_list_npix.push_back(peak_npix)
-        peak_list_maxi.push_back(peak_maxi)
-        peak_list_sigma.push_back(peak_sigma)
-        peak_list_snr.push_back(peak_snr)
+    Whether the GPU backend of peakfinder8 can be used.
 
-    freePeakList(peak_list)
+    Returns:
 
-    return (peak_list_x, peak_list_y, peak_list_value, peak_list_index,
-            peak_list_npix, peak_list_maxi, peak_list_sigma, peak_list_snr)
\ No newline at end of file
+        True if the extension was built with GPU support and a GPU device is
+        available, False otherwise.
+    """
+    return peakfinder8GpuAvailable() != 0
+
+
+def jungfrau_calibrate(const unsigned short[:,::1] data, const float[:,:,::1] dark,
+                       const double[:,:,::1] gain, long first_row=0, out=None):
+    """
+    jungfrau_calibrate(data, dark, gain, first_row=0, out=None)
+
+    Calibrates a raw Jungfrau data frame, or a block of rows of it.
+
+    This function determines the gain stage of each pixel from its two highest bits,
+    and computes (raw - dark) / gain with the dark and gain of that stage, in a
+    single pass over the data. A frame stored in several files can be calibrated
+    one panel at a time, straight into the rows of a preallocated frame, without
+    joining the raw panels first.
+
+    Arguments:
+
+        data: The raw detector data (a 2D uint16 array). It stores the rows of the
+            frame starting from the `first_row` row.
+
+        dark: The dark data of the whole frame for the three gain stages (a 3D
+            float32 array, with the gain stage as first index).
+
+        gain: The gain of each pixel of the whole frame for the three gain stages,
+            already multiplied by the photon energy (a 3D float64 array, with the
+            gain stage as first index).
+
+        first_row: The row of the frame that corresponds to the first row of the
+            raw data. Defaults to 0.
+
+        out: An optional C-contiguous 2D float32 array, with the same shape as the
+            raw data, in which the calibrated data is written. If this argument is
+            None, a new array is allocated. Defaults to None.
+
+    Returns:
+
+        The calibrated data (a 2D float32 array with the same shape as the raw
+        data). If the `out` argument is provided, the array itself is returned.
+
+    Raises:
+
+        ValueError: A ValueError is raised if the dark and gain arrays do not have
+            the same shape, if the raw data does not fit in the frame that they
+            describe, or if the `out` array does not have the shape of the raw data.
+    """
+    cdef long num_pix = data.shape[0] * data.shape[1]
+    cdef long plane_size = dark.shape[1] * dark.shape[2]
+    cdef float[:,::1] calibrated_view
+
+    if (
+        dark.shape[0] != 3 or gain.shape[0] != 3
+        or gain.shape[1] != dark.shape[1] or gain.shape[2] != dark.shape[2]
+    ):
+        raise ValueError("The dark and gain arrays must have the same shape (3, ...).")
+    if (
+        first_row < 0 or first_row + data.shape[0] > dark.shape[1]
+        or data.shape[1] != dark.shape[2]
+    ):
+        raise ValueError(
+            "The raw data does not fit in a frame of shape ({0}, {1}), starting "
+            "from row {2}.".format(dark.shape[1], dark.shape[2], first_row)
+        )
+
+    if out is None:
+        calibrated = numpy.empty((data.shape[0], data.shape[1]), dtype=numpy.float32)
+    else:
+        calibrated = out
+    calibrated_view = calibrated
+    if (
+        calibrated_view.shape[0] != data.shape[0]
+        or calibrated_view.shape[1] != data.shape[1]
+    ):
+        raise ValueError("The output array must have the shape of the raw data.")
+    if num_pix > 0:
+        with nogil:
+            calibrateJungfrauFrame(&data[0, 0], num_pix, &dark[0, first_row, 0],
+                                   &gain[0, first_row, 0], plane_size,
+                                   &calibrated_view[0, 0])
+
+    return calibrated
+
+
+def fill_peak_resolution(peak_list, float pixels_per_meter, double beam_energy,
+                         double detector_distance):
+    """
+    fill_peak_resolution(peak_list, pixels_per_meter, beam_energy, detector_distance)
+
+    Fills the scattering vector and the resolution of a list of peaks.
+
+    This function computes the q and resolution fields of each peak in place, from
+    its r_assembled field, for the given beam energy and detector distance. It can be
+    used when the beam parameters are only known after the peaks have been found.
+    The fields are set to zero when the beam energy or the detector distance are not
+    positive.
+
+    Arguments:
+
+        peak_list: The peaks, in a C-contiguous structured array with the
+            :obj:`peak_list_dtype` type, with the r_assembled field already filled.
+
+        pixels_per_meter: The size of the detector pixels, as the number of pixels
+            per meter.
+
+        beam_energy: The beam energy, in eV.
+
+        detector_distance: The distance between the sample and the detector, in
+            meters.
+
+    Raises:
+
+        ValueError: A ValueError is raised if the peak list is not a C-contiguous
+            array of the :obj:`peak_list_dtype` type.
+    """
+    cdef float[:,::1] peak_table
+
+    if (
+        not isinstance(peak_list, numpy.ndarray)
+        or peak_list.dtype != peak_list_dtype
+        or not peak_list.flags.c_contiguous
+    ):
+        raise ValueError(
+            "The peak list must be a C-contiguous array of type peak_list_dtype."
+        )
+    if peak_list.shape[0] == 0:
+        return
+    peak_table = peak_list.view(numpy.float32).reshape(-1, PF8_NUM_PEAK_FIELDS)
+    with nogil:
+        fillPeakTableResolution(&peak_table[0, 0], peak_table.shape[0],
+                                pixels_per_meter, beam_energy, detector_distance)
+
+
+def encode_sparse_frame(float[:,::1] data, peak_list, int peak_radius, float step,
+                        int bin_size):
+    """
+    encode_sparse_frame(data, peak_list, peak_radius, step, bin_size)
+
+    Encodes a data frame around its peaks.
+
+    This function keeps the pixels in a square box around each peak at full
+    precision. The rest of the frame, which only carries background, is averaged
+    over square blocks of pixels and quantized to 16-bit integers.
+
+    Arguments:
+
+        data: The data frame (a 2D float32 array).
+
+        peak_list: The peaks of the frame, in a structured array with the
+            :obj:`peak_list_dtype` type. The fs and ss fields of each peak are its
+            column and its row in the data frame. Peaks with a position that is not
+            finite, or too far outside the frame for their box to overlap it, are
+            skipped.
+
+        peak_radius: The half-size, in pixels, of the box kept around each peak.
+
+        step: The quantization step of the background, in ADUs.
+
+        bin_size: The size, in pixels, of the blocks over which the background is
+            averaged.
+
+    Returns:
+
+        The encoded frame (a 1D uint8 array), which can be decoded with
+        :func:`decode_sparse_frame`.
+
+    Raises:
+
+        ValueError: A ValueError is raised if the peak radius is negative, or if the
+            quantization step or the bin size are not positive.
+    """
+    cdef long num_peaks = len(peak_list)
+    cdef long max_size
+    cdef long size
+    cdef float[:,::1] peak_table
+    cdef const float *peak_table_ptr = NULL
+    cdef unsigned char[::1] encoded_view
+
+    max_size = sparseFrameMaxSize(data.shape[0], data.shape[1], bin_size, num_peaks,
+                                  peak_radius)
+    if max_size < 0 or not step > 0:
+        raise ValueError(
+            "The peak radius must not be negative, and the quantization step and the "
+            "bin size must be positive."
+        )
+
+    if num_peaks > 0:
+        peak_table = numpy.ascontiguousarray(
+            peak_list, dtype=peak_list_dtype
+        ).view(numpy.float32).reshape(-1, PF8_NUM_PEAK_FIELDS)
+        peak_table_ptr = &peak_table[0, 0]
+
+    encoded = numpy.empty(max_size, dtype=numpy.uint8)
+    encoded_view = encoded
+    with nogil:
+        size = encodeSparseFrame(&data[0, 0], data.shape[0], data.shape[1],
+                                 peak_table_ptr, num_peaks, peak_radius, step,
+                                 bin_size, &encoded_view[0])
+    if size < 0:
+        raise MemoryError
+
+    return encoded[:size]
+
+
+def decode_sparse_frame(const unsigned char[::1] encoded):
+    """
+    decode_sparse_frame(encoded)
+
+    Decodes a data frame encoded with :func:`encode_sparse_frame`.
+
+    Arguments:
+
+        encoded: The encoded frame (a 1D uint8 array or a bytes object).
+
+    Returns:
+
+        The decoded data frame (a 2D float32 array). The background pixels store
+        the quantized average of their block.
+
+    Raises:
+
+        ValueError: A ValueError is raised if the buffer does not store an encoded
+            frame.
+    """
+    cdef long num_pix_ss
+    cdef long num_pix_fs
+    cdef long size = encoded.shape[0]
+    cdef int ret
+    cdef float[:,::1] data_view
+
+    if size == 0 or sparseFrameShape(&encoded[0], size, &num_pix_ss,
+                                     &num_pix_fs) != 0:
+        raise ValueError("The buffer does not store an encoded data frame.")
+
+    data = numpy.empty((num_pix_ss, num_pix_fs), dtype=numpy.float32)
+    if num_pix_ss * num_pix_fs == 0:
+        return data
+
+    data_view = data
+    with nogil:
+        ret = decodeSparseFrame(&encoded[0], size, &data_view[0, 0])
+    if ret != 0:
+        raise ValueError("The buffer does not store an encoded data frame.")
+
+    return data
+
+
+def decode_cbf_frame(const unsigned char[::1] buffer):
+    """
+    decode_cbf_frame(buffer)
+
+    Decodes the data frame stored in a CBF file.
+
+    This function decodes, in a single pass, a frame compressed with the byte offset
+    algorithm, which is used by the Pilatus detectors. The content of the file can be
+    passed straight from a memory map of the file, without being copied first.
+
+    Arguments:
+
+        buffer: The content of the CBF file (a 1D uint8 array, a bytes object, or any
+            object that exposes its memory, like a memory map).
+
+    Returns:
+
+        The decoded data frame (a 2D int32 array).
+
+    Raises:
+
+        ValueError: A ValueError is raised if the buffer does not store a frame
+            compressed with the byte offset algorithm.
+    """
+    cdef long size = buffer.shape[0]
+    cdef long num_pix_fs
+    cdef long num_pix_ss
+    cdef int ret
+    cdef int[:,::1] data_view
+
+    if size == 0 or cbfFrameShape(<const char *>&buffer[0], size, &num_pix_fs,
+                                  &num_pix_ss) != 0:
+        raise ValueError(
+            "The buffer does not store a frame compressed with the byte offset "
+            "algorithm."
+        )
+
+    data = numpy.empty((num_pix_ss, num_pix_fs), dtype=numpy.int32)
+    if num_pix_ss * num_pix_fs == 0:
+        return data
+
+    data_view = data
+    with nogil:
+        ret = decodeCbfFrame(<const char *>&buffer[0], size, &data_view[0, 0],
+                             num_pix_ss * num_pix_fs)
+    if ret != 0:
+        raise ValueError(
+            "The buffer does not store a frame compressed with the byte offset "
+            "algorithm."
+        )
+
+    return data
+
+
+def write_pixel_map_cache(str filename, str key, panels):
+    """
+    write_pixel_map_cache(filename, key, panels)
+
+    Computes the pixel maps of a detector and stores them in a cache file.
+
+    This function computes the pixel maps of a detector from the panels of a CrystFEL
+    geometry, like the :func:`~om.utils.crystfel_geometry.compute_pix_maps` function
+    does, together with the radial bin of each pixel used by a
+    :class:`Peakfinder8Context` and the runs of pixels covered by the panels. They are
+    written to a cache file that can then be opened by a :class:`PixelMapCache`.
+    The file is written under a temporary name, and then renamed: processes that
+    write the same cache at the same time do not interfere with each other, and
+    never see an incomplete file.
+
+    Arguments:
+
+        filename (:obj:`str`): The name of the cache file.
+
+        key (:obj:`str`): A string of up to 127 characters that identifies the
+            geometry, usually a hash of the geometry file. The cache can only be
+            opened with the same key.
+
+        panels (:obj:`list`): The panels of the detector, as stored in the 'panels'
+            entry of a :class:`~om.utils.crystfel_geometry.TypeDetector` dictionary.
+
+    Raises:
+
+        RuntimeError: A RuntimeError is raised if the cache file cannot be written.
+    """
+    cdef tPixelMapPanel *panel_table
+    cdef int num_panels = len(panels)
+    cdef int pi
+    cdef int ret
+
+    panel_table = <tPixelMapPanel *>malloc(max(num_panels, 1) * sizeof(tPixelMapPanel))
+    if panel_table is NULL:
+        raise MemoryError("Could not allocate the panel table.")
+
+    for pi, panel in enumerate(panels):
+        panel_table[pi].min_fs = panel["orig_min_fs"]
+        panel_table[pi].max_fs = panel["orig_max_fs"]
+        panel_table[pi].min_ss = panel["orig_min_ss"]
+        panel_table[pi].max_ss = panel["orig_max_ss"]
+        panel_table[pi].fsx = panel["fsx"]
+        panel_table[pi].fsy = panel["fsy"]
+        panel_table[pi].ssx = panel["ssx"]
+        panel_table[pi].ssy = panel["ssy"]
+        panel_table[pi].cnx = panel["cnx"]
+        panel_table[pi].cny = panel["cny"]
+        panel_table[pi].clen = panel.get("clen", 0.0)
+
+    ret = writePixelMapCache(filename.encode(), key.encode(), panel_table, num_panels)
+    free(panel_table)
+    if ret != 0:
+        raise RuntimeError(
+            "Could not write the pixel map cache file {0}.".format(filename)
+        )
+
+
+cdef class PixelMapCache:
+    """
+    PixelMapCache(filename, key)
+
+    Pixel maps stored in a cache file.
+
+    This class maps into memory a cache file written by the
+    :func:`write_pixel_map_cache` function. The map is read-only and shared: all the
+    processes of a machine that open the same cache use the same copy of the pixel
+    maps in memory. The pixel maps are returned as read-only arrays that share their
+    memory with the map, and keep it alive.
+
+    Arguments:
+
+        filename (:obj:`str`): The name of the cache file.
+
+        key (:obj:`str`): The key used to write the cache file.
+
+    Raises:
+
+        RuntimeError: A RuntimeError is raised if the file does not exist, if it was
+            written for a different key or by a different version of OM, or if it is
+            damaged.
+    """
+    cdef tPixelMapCache *_cache
+
+    def __cinit__(self, str filename, str key):
+        self._cache = openPixelMapCache(filename.encode(), key.encode())
+        if self._cache is NULL:
+            raise RuntimeError(
+                "Could not open the pixel map cache file {0}.".format(filename)
+            )
+
+    def __dealloc__(self):
+        if self._cache is not NULL:
+            closePixelMapCache(self._cache)
+
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        PyBuffer_FillInfo(buffer, self, self._cache.map, self._cache.map_size, 1,
+                          flags)
+
+    cdef _section(self, const void *section, long count, dtype):
+        return numpy.frombuffer(
+            self,
+            dtype=dtype,
+            count=count,
+            offset=<const char *>section - <const char *>self._cache.map,
+        )
+
+    cdef _pixel_map(self, const float *section):
+        return self._section(
+            section, self._cache.num_pix_ss * self._cache.num_pix_fs, numpy.float32
+        ).reshape(self._cache.num_pix_ss, self._cache.num_pix_fs)
+
+    def pixel_maps(self):
+        """
+        pixel_maps()
+
+        Returns the pixel maps stored in the cache.
+
+        Returns:
+
+            :obj:`dict`: A :class:`~om.utils.crystfel_geometry.TypePixelMaps`
+            dictionary storing the pixel maps, as read-only arrays.
+        """
+        return {
+            "x": self._pixel_map(self._cache.x),
+            "y": self._pixel_map(self._cache.y),
+            "z": self._pixel_map(self._cache.z),
+            "radius": self._pixel_map(self._cache.radius),
+            "phi": self._pixel_map(self._cache.phi),
+        }
+
+    @property
+    def radial_bins(self):
+        """
+        The radial bin of each pixel used by a :class:`Peakfinder8Context` (a
+        read-only 2D uint16 array).
+        """
+        return self._section(
+            self._cache.r_bin,
+            self._cache.num_pix_ss * self._cache.num_pix_fs,
+            numpy.uint16,
+        ).reshape(self._cache.num_pix_ss, self._cache.num_pix_fs)
+
+    @property
+    def num_radial_bins(self):
+        """
+        The number of radial bins.
+        """
+        return self._cache.num_rad_bins
+
+    @property
+    def panel_spans(self):
+        """
+        The runs of consecutive pixels covered by the panels of the detector (a
+        read-only 2D int32 array). Each row stores the index of the first pixel of a
+        run in the flattened data frame, and the number of pixels in the run. A run
+        never continues on the following row of the data frame.
+        """
+        return self._section(
+            self._cache.spans, self._cache.num_spans * 2, numpy.int32
+        ).reshape(self._cache.num_spans, 2)
+
+
+cdef class SharedConstants:
+    """
+    SharedConstants(key, numa_local=True, timeout=60.0)
+
+    Read-only arrays shared by all the processes of a machine.
+
+    This class opens a POSIX shared memory segment that stores detector constants,
+    such as dark data, gain maps and masks, identified by a key. The first process
+    that opens the segment creates it, and must store the arrays with :func:`fill`:
+    the other processes wait until the arrays are stored, and then read them from the
+    same memory. The arrays are returned as read-only arrays that share their memory
+    with the segment, and keep it alive. If the segment is NUMA-local, each NUMA node
+    has its own copy of the arrays, created and filled by the first process that runs
+    on the node, so that the processes read the arrays from local memory. The process
+    that created the segment removes its name when the segment is closed: the memory
+    is freed when no process uses it anymore.
+
+    Arguments:
+
+        key (:obj:`str`): A string of up to 255 characters that identifies the
+            arrays, usually a hash of the files from which they are read.
+
+        numa_local (:obj:`bool`): Whether each NUMA node has its own copy of the
+            arrays. The processes should be pinned to their CPUs. Defaults to True.
+
+        timeout (:obj:`float`): The time, in seconds, for which the arrays stored by
+            another process are waited for. Defaults to 60.
+
+    Raises:
+
+        RuntimeError: A RuntimeError is raised if the segment cannot be created or
+            mapped, if it stores arrays for a different key, or if the arrays were
+            not stored in time.
+    """
+    cdef tSharedConstants *_store
+
+    def __cinit__(self, str key, bint numa_local=True, double timeout=60.0):
+        cdef bytes key_bytes = key.encode()
+        cdef const char *key_ptr = key_bytes
+
+        with nogil:
+            self._store = openSharedConstants(key_ptr, numa_local, timeout)
+        if self._store is NULL:
+            raise RuntimeError(
+                "Could not open the shared detector constants for key {0}.".format(key)
+            )
+
+    def __dealloc__(self):
+        if self._store is not NULL:
+            closeSharedConstants(self._store)
+
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        PyBuffer_FillInfo(buffer, self, self._store.map, self._store.map_size, 1,
+                          flags)
+
+    @property
+    def created(self):
+        """
+        Whether the segment was created by this process, which must then store the
+        arrays with :func:`fill`.
+        """
+        return self._store.created != 0
+
+    @property
+    def numa_node(self):
+        """
+        The NUMA node of the copy of the arrays, or None if the segment is not
+        NUMA-local.
+        """
+        if self._store.numa_node < 0:
+            return None
+        return self._store.numa_node
+
+    def fill(self, dict arrays):
+        """
+        fill(arrays)
+
+        Stores arrays in a segment created by this process.
+
+        The arrays are copied into the segment, and made available to the other
+        processes that open it.
+
+        Arguments:
+
+            arrays (:obj:`dict`): The arrays to store, with names of up to 31
+                characters as keys. The arrays can have up to 4 dimensions.
+
+        Raises:
+
+            ValueError: A ValueError is raised if a name is too long, or if an array
+                has too many dimensions or stores Python objects.
+
+            RuntimeError: A RuntimeError is raised if the segment was not created by
+                this process, or if the arrays cannot be stored.
+        """
+        cdef tSharedConstant *table
+        cdef const void **data
+        cdef const unsigned char[::1] array_bytes
+        cdef int num_constants = len(arrays)
+        cdef int ci
+        cdef int di
+        cdef int ret
+        cdef bytes name_bytes
+        cdef bytes dtype_bytes
+        cdef list contiguous_arrays = []
+
+        for name, array in arrays.items():
+            array = numpy.ascontiguousarray(array)
+            if (
+                len(name.encode()) >= PF8_SHARED_CONSTANT_NAME_SIZE
+                or len(array.dtype.str) >= 8
+                or array.ndim > PF8_SHARED_CONSTANT_MAX_DIMS
+                or array.dtype.hasobject
+            ):
+                raise ValueError(
+                    "The {0} array cannot be stored in shared memory.".format(name)
+                )
+            contiguous_arrays.append((name.encode(), array.dtype.str.encode(), array))
+
+        table = <tSharedConstant *>malloc(
+            max(num_constants, 1) * sizeof(tSharedConstant)
+        )
+        data = <const void **>malloc(max(num_constants, 1) * sizeof(void *))
+        if table is NULL or data is NULL:
+            free(table)
+            free(data)
+            raise MemoryError("Could not allocate the table of the arrays.")
+
+        # The arrays stay alive in contiguous_arrays until they are copied
+        memset(table, 0, max(num_constants, 1) * sizeof(tSharedConstant))
+        for ci, (name_bytes, dtype_bytes, array) in enumerate(contiguous_arrays):
+            strcpy(table[ci].name, name_bytes)
+            strcpy(table[ci].dtype, dtype_bytes)
+            table[ci].ndim = array.ndim
+            for di in range(array.ndim):
+                table[ci].shape[di] = array.shape[di]
+            table[ci].size = array.nbytes
+            data[ci] = NULL
+            if array.nbytes > 0:
+                array_bytes = array.reshape(-1).view(numpy.uint8)
+                data[ci] = &array_bytes[0]
+
+        with nogil:
+            ret = fillSharedConstants(self._store, table, num_constants, data)
+        free(table)
+        free(data)
+        if ret != 0:
+            raise RuntimeError("Could not store the arrays in shared memory.")
+
+    def arrays(self):
+        """
+        arrays()
+
+        Returns the arrays stored in the segment.
+
+        Returns:
+
+            :obj:`dict`: The arrays, as read-only arrays, with their names as keys.
+            The dictionary is empty if the arrays have not been stored yet.
+        """
+        cdef const tSharedConstant *constant
+        cdef int ci
+        cdef int di
+
+        arrays = {}
+        if self._store.constants is NULL:
+            return arrays
+        for ci in range(self._store.num_constants):
+            constant = &self._store.constants[ci]
+            dtype = numpy.dtype(constant.dtype.decode())
+            shape = []
+            for di in range(constant.ndim):
+                shape.append(constant.shape[di])
+            if constant.size == 0:
+                array = numpy.empty(shape, dtype=dtype)
+                array.flags.writeable = False
+                arrays[constant.name.decode()] = array
+                continue
+            arrays[constant.name.decode()] = numpy.frombuffer(
+                self,
+                dtype=dtype,
+                count=constant.size // dtype.itemsize,
+                offset=constant.offset,
+            ).reshape(shape)
+        return arrays
+
+
+cdef class Peakfinder8Context:
+    """
+    Peakfinder8Context(pix_r, max_num_peaks, asic_nx, asic_ny, nasics_x, nasics_y, \
+        max_pix_count, pixel_map_cache=None)
+
+    Persistent peakfinder8 context.
+
+    This class stores all the buffers needed by the 'peakfinder8' peak detection
+    algorithm. The buffers are allocated once, when the context is created, and are
+    reused for every data frame processed by the context. A context can only process
+    data frames with the layout specified at creation time.
+
+    The radial bin of each pixel is also computed from the radius map when the context
+    is created, and is reused for every frame. If a pixel map cache is provided, the
+    radial bins stored in the cache are used instead.
+
+    By default, the radial background statistics are computed by the fastest
+    vectorized kernel supported by the CPU (AVX-512, AVX2 or NEON), selected at
+    runtime. The vectorized kernels accumulate the statistics in double precision,
+    while the original scalar kernel accumulates them in single precision. The
+    average background values computed by the two kinds of kernels agree to about one
+    part in 10^5. The standard deviations can differ by up to about 1% in bins with a
+    high background level, where the single precision computation loses accuracy.
+    Pixels lying exactly on a threshold can therefore be classified differently.
+
+    Arguments:
+
+        pix_r (:obj:`numpy.ndarray`): A numpy array of float32 with radius information
+            (see the documentation of the :func:`peakfinder_8` function).
+
+        max_num_peaks (:obj:`int`): The maximum number of peaks that will be retrieved
+            from each data frame. Additional peaks will be ignored.
+
+        asic_nx (:obj:`int`):: The fs size in pixels of each detector panel in the data
+            frame.
+
+        asic_ny (:obj:`int`):: The ss size in pixels of each detector panel in the data
+            frame.
+
+        nasics_x (:obj:`int`): The number of panels along the fs axis of the data
+            frame.
+
+        nasics_y (:obj:`int`): The number of panels along the ss axis of the data
+            frame.
+
+        max_pix_count (:obj:`int`): The maximum size of a peak in pixels that the
+            context will be able to process.
+
+        pixel_map_cache (:class:`PixelMapCache`): A pixel map cache, written for
+            the geometry of the radius map, that stores the radial bin of each pixel.
+            The context, and all the copies of the context used by its threads and
+            pipelines, read the radial bins from the cache without copying them, and
+            keep the cache open. Defaults to None.
+    """
+    cdef tPeakfinder8Context *_context
+    cdef long _max_num_peaks
+    cdef object _geometry_maps
+    cdef object _pixel_map_cache
+    cdef object _last_mask
+
+    def __cinit__(self, float[:,::1] pix_r, long max_num_peaks, long asic_nx,
+                  long asic_ny, long nasics_x, long nasics_y, long max_pix_count,
+                  PixelMapCache pixel_map_cache=None):
+        if pix_r.shape[0] != asic_ny * nasics_y or pix_r.shape[1] != asic_nx * nasics_x:
+            raise ValueError(
+                "The shape of the radius map does not match the detector layout."
+            )
+        if pixel_map_cache is None:
+            self._context = allocatePeakfinder8Context(&pix_r[0, 0], asic_nx, asic_ny,
+                                                       nasics_x, nasics_y,
+                                                       max_num_peaks, max_pix_count)
+        else:
+            if (
+                pixel_map_cache._cache.num_pix_ss != pix_r.shape[0]
+                or pixel_map_cache._cache.num_pix_fs != pix_r.shape[1]
+            ):
+                raise ValueError(
+                    "The shape of the pixel maps in the cache does not match the "
+                    "detector layout."
+                )
+            self._context = allocatePeakfinder8ContextSharedBins(
+                pixel_map_cache._cache.r_bin, pixel_map_cache._cache.num_rad_bins,
+                asic_nx, asic_ny, nasics_x, nasics_y, max_num_peaks, max_pix_count
+            )
+            self._pixel_map_cache = pixel_map_cache
+        if self._context is NULL:
+            raise MemoryError(
+                "Could not create the peakfinder8 context: either the memory could "
+                "not be allocated, or the radius map stores values above 65535 "
+                "pixels."
+            )
+        self._max_num_peaks = max_num_peaks
+
+    def __dealloc__(self):
+        freePeakfinder8Context(self._context)
+
+    @property
+    def radial_stats_kernel(self):
+        """
+        The kernel used to compute the radial background statistics.
+
+        One of 'scalar' (the original implementation), 'sorted' (portable
+        implementation working on pixels sorted by radial bin), 'avx2', 'avx512' or
+        'neon'. Setting a kernel that is not supported by the CPU raises a
+        ValueError.
+        """
+        for name, kernel in _radial_stats_kernels.items():
+            if kernel == self._context.radial_stats_kernel:
+                return name
+
+    @radial_stats_kernel.setter
+    def radial_stats_kernel(self, str name):
+        if name not in _radial_stats_kernels:
+            raise ValueError("Unknown radial statistics kernel: {0}.".format(name))
+        if setPeakfinder8RadialStatsKernel(
+            self._context, _radial_stats_kernels[name]
+        ) != 0:
+            raise ValueError(
+                "The {0} radial statistics kernel is not supported on this "
+                "machine.".format(name)
+            )
+
+    @property
+    def background_estimator(self):
+        """
+        The estimator used for the radial background.
+
+        One of 'sigma_clipping' (the original iterative peakfinder8 estimator),
+        'median_mad' (median and median absolute deviation of each radial bin,
+        computed in a single pass) or 'temporal' (radial profile averaged over the
+        frames, see :obj:`background_decay`). Setting an unknown estimator raises a
+        ValueError.
+        """
+        for name, estimator in _background_estimators.items():
+            if estimator == self._context.background_estimator:
+                return name
+
+    @background_estimator.setter
+    def background_estimator(self, str name):
+        if name not in _background_estimators:
+            raise ValueError("Unknown background estimator: {0}.".format(name))
+        if setPeakfinder8BackgroundEstimator(
+            self._context, _background_estimators[name]
+        ) != 0:
+            raise MemoryError(
+                "Cannot allocate the memory required by the {0} background "
+                "estimator.".format(name)
+            )
+
+    @property
+    def background_decay(self):
+        """
+        The weight of each new frame in the temporal background model.
+
+        With the 'temporal' background estimator, the radial background profile is
+        an exponentially weighted average over the processed frames, and each frame
+        only needs one clipped pass over the data to update it. The first frame, and
+        the first frame after :func:`reset_background` is called, initialize the
+        model with the 'sigma_clipping' estimator. A value between 0 (excluded) and
+        1: smaller values give steadier thresholds, but follow changes in the
+        background more slowly. Setting a value out of range raises a ValueError.
+        Defaults to 0.1.
+        """
+        return self._context.background_decay
+
+    @background_decay.setter
+    def background_decay(self, float decay):
+        if setPeakfinder8BackgroundDecay(self._context, decay) != 0:
+            raise ValueError(
+                "The background decay must be larger than 0 and not larger than 1."
+            )
+
+    def reset_background(self):
+        """
+        reset_background()
+
+        Discards the temporal background model.
+
+        This function should be called when the background conditions change
+        abruptly, for example when a new run starts. The next frame initializes a new
+        model.
+        """
+        resetPeakfinder8Background(self._context)
+
+    def mask_changed(self):
+        """
+        mask_changed()
+
+        Reports that the content of the mask changed.
+
+        The unmasked pixels are only found again when a mask stored in a different
+        array is passed to the context. This function must be called after the values
+        of the same mask array are modified in place, before the next frame is
+        processed.
+        """
+        notifyPeakfinder8MaskChanged(self._context)
+
+    @property
+    def seed_scan(self):
+        """
+        How the pixels that can start a peak are found.
+
+        One of 'pixel' (each pixel is compared with the threshold of its radial bin
+        while growing the peaks) or 'bitmap' (a bit-packed map of the pixels above
+        threshold is built first, and the peak search only visits its set bits).
+        Both give the same peaks. Setting an unknown mode raises a ValueError.
+        """
+        for name, seed_scan in _seed_scans.items():
+            if seed_scan == self._context.seed_scan:
+                return name
+
+    @seed_scan.setter
+    def seed_scan(self, str name):
+        if name not in _seed_scans:
+            raise ValueError("Unknown seed scan mode: {0}.".format(name))
+        if setPeakfinder8SeedScan(self._context, _seed_scans[name]) != 0:
+            raise MemoryError("Cannot allocate the memory for the seed bitmap.")
+
+    @property
+    def panel_kernel(self):
+        """
+        The kernel that searches for peaks in each panel.
+
+        One of 'layout' (the default: a kernel compiled for the panel size of the
+        detector, with the index arithmetic fixed at compile time, is used for the
+        layouts supported by OM, and the generic kernel for any other layout) or
+        'generic'. Both give the same peaks. Setting an unknown kernel raises a
+        ValueError.
+        """
+        for name, panel_kernel in _panel_kernels.items():
+            if panel_kernel == self._context.panel_kernel:
+                return name
+
+    @panel_kernel.setter
+    def panel_kernel(self, str name):
+        if name not in _panel_kernels:
+            raise ValueError("Unknown panel kernel: {0}.".format(name))
+        setPeakfinder8PanelKernel(self._context, _panel_kernels[name])
+
+    @property
+    def local_background(self):
+        """
+        How the local background of each peak is computed.
+
+        One of 'ring' (the pixels in the disc around the peak are visited one by
+        one) or 'integral' (the sums over the disc are read from integral images
+        along the rows of each panel, at a cost that grows with the radius of the
+        disc instead of its area). Both use the same background pixels, but the
+        integral images are accumulated in double precision, while the 'ring' method
+        uses single precision, so the two only differ by rounding. Setting an
+        unknown method raises a ValueError.
+        """
+        for name, local_background in _local_backgrounds.items():
+            if local_background == self._context.local_background:
+                return name
+
+    @local_background.setter
+    def local_background(self, str name):
+        if name not in _local_backgrounds:
+            raise ValueError("Unknown local background method: {0}.".format(name))
+        if setPeakfinder8LocalBackground(self._context, _local_backgrounds[name]) != 0:
+            raise MemoryError(
+                "Cannot allocate the memory for the local background integral images."
+            )
+
+    @property
+    def backend(self):
+        """
+        Where the peaks are searched.
+
+        One of 'cpu' or 'gpu'. With the 'gpu' backend, the radial statistics, the
+        labelling of the peak pixels and the evaluation of the peaks are computed on
+        the GPU, and only the peak list is copied back. Only the 'sigma_clipping'
+        background estimator is supported on the GPU: with the other estimators, and
+        for the frames that have more peaks than the GPU can store, the peaks are
+        searched on the CPU. Setting an unknown backend raises a ValueError, and
+        setting the 'gpu' backend when no GPU is available raises a RuntimeError.
+        """
+        for name, backend in _backends.items():
+            if backend == self._context.backend:
+                return name
+
+    @backend.setter
+    def backend(self, str name):
+        if name not in _backends:
+            raise ValueError("Unknown peakfinder8 backend: {0}.".format(name))
+        if setPeakfinder8Backend(self._context, _backends[name]) != 0:
+            raise RuntimeError("The {0} backend cannot be used.".format(name))
+
+    @property
+    def peak_refinement(self):
+        """
+        How the position of each peak is computed.
+
+        One of 'center_of_mass', 'quadratic' or 'gaussian'. The 'center_of_mass'
+        method reports the intensity-weighted center of the peak pixels, like the
+        original peakfinder8 algorithm. The 'quadratic' and 'gaussian' methods fit a
+        parabola, or a Gaussian above the local background, to the brightest pixel of
+        each peak and its two neighbours along each axis, for a sub-pixel position.
+        The position is not refined for the peaks found with the 'gpu' backend.
+        Setting an unknown method raises a ValueError.
+        """
+        for name, refinement in _peak_refinements.items():
+            if refinement == self._context.peak_refinement:
+                return name
+
+    @peak_refinement.setter
+    def peak_refinement(self, str name):
+        if name not in _peak_refinements:
+            raise ValueError("Unknown peak refinement method: {0}.".format(name))
+        setPeakfinder8PeakRefinement(self._context, _peak_refinements[name])
+
+    def set_peak_geometry(self, x_map, y_map, float pixels_per_meter):
+        """
+        set_peak_geometry(x_map, y_map, pixels_per_meter)
+
+        Sets the geometry used to compute the assembled position of the peaks.
+
+        Once the geometry is set, the x_assembled, y_assembled and r_assembled fields
+        of the peaks are filled while the peaks are searched, interpolating the
+        position maps at the position of each peak. The context keeps a reference to
+        the maps. The geometry must be set before a :class:`Peakfinder8Pipeline` is
+        created from the context, and must not be changed while the pipeline is used.
+
+        Arguments:
+
+            x_map: A map storing, for each pixel of the data frame, its x coordinate
+                in the detector reference system, in pixels (a 2D float32 array, with
+                the same shape as the radius map).
+
+            y_map: A map storing, for each pixel of the data frame, its y coordinate
+                in the detector reference system, in pixels.
+
+            pixels_per_meter: The size of the detector pixels, as the number of
+                pixels per meter.
+
+        Raises:
+
+            ValueError: A ValueError is raised if the shape of the maps does not
+                match the detector layout.
+        """
+        cdef float[:,::1] x_view = numpy.ascontiguousarray(x_map, dtype=numpy.float32)
+        cdef float[:,::1] y_view = numpy.ascontiguousarray(y_map, dtype=numpy.float32)
+        cdef long num_pix_ss = self._context.asic_ny * self._context.nasics_y
+        cdef long num_pix_fs = self._context.asic_nx * self._context.nasics_x
+
+        if (
+            x_view.shape[0] != num_pix_ss or x_view.shape[1] != num_pix_fs
+            or y_view.shape[0] != num_pix_ss or y_view.shape[1] != num_pix_fs
+        ):
+            raise ValueError(
+                "The shape of the position maps does not match the detector layout."
+            )
+        self._geometry_maps = (x_view, y_view)
+        setPeakfinder8PeakGeometry(self._context, &x_view[0, 0], &y_view[0, 0],
+                                   pixels_per_meter)
+
+    def set_beam_parameters(self, double beam_energy, double detector_distance):
+        """
+        set_beam_parameters(beam_energy, detector_distance)
+
+        Sets the beam parameters used to compute the resolution of the peaks.
+
+        When the geometry and the beam parameters are known, the q and resolution
+        fields of the peaks are filled while the peaks are searched. The parameters
+        can change from frame to frame. The fields are set to zero when the beam
+        energy or the detector distance are not positive.
+
+        Arguments:
+
+            beam_energy: The beam energy, in eV.
+
+            detector_distance: The distance between the sample and the detector, in
+                meters.
+        """
+        setPeakfinder8BeamParameters(self._context, beam_energy, detector_distance)
+
+    @property
+    def num_threads(self):
+        """
+        The number of threads that search for peaks in the detector panels.
+
+        With more than one thread, the panels of a frame are processed in parallel,
+        and the peaks are then merged in panel order: the result does not depend on
+        the number of threads. The calling thread is one of the threads. Setting a
+        number of threads that cannot be started raises a RuntimeError.
+        """
+        return self._context.num_threads
+
+    @num_threads.setter
+    def num_threads(self, int num_threads):
+        if setPeakfinder8NumThreads(self._context, num_threads) != 0:
+            raise RuntimeError(
+                "Cannot start {0} peakfinder8 threads.".format(num_threads)
+            )
+
+    @property
+    def num_frame_threads(self):
+        """
+        The number of threads that process the frames of a batch in parallel.
+
+        This number is only used by the :func:`find_peaks_batch` function. Each
+        thread after the first one needs its own copy of the context buffers. The
+        number of panel threads (see :obj:`num_threads`) is applied to each frame
+        thread. Setting a number of threads whose buffers cannot be allocated raises
+        a MemoryError.
+        """
+        return self._context.num_frame_threads
+
+    @num_frame_threads.setter
+    def num_frame_threads(self, int num_frame_threads):
+        if setPeakfinder8NumFrameThreads(self._context, num_frame_threads) != 0:
+            raise MemoryError(
+                "Cannot allocate the buffers for {0} peakfinder8 frame "
+                "threads.".format(num_frame_threads)
+            )
+
+    @property
+    def prescreen_min_peaks(self):
+        """
+        The minimum number of peaks of a frame that passes the pre-screen.
+
+        When this number is larger than 0, the pixels of each frame that are above
+        the radial thresholds computed for the last searched frame are counted before
+        searching for peaks. A frame that does not have enough pixels for this number
+        of peaks, each made of at least `hitfinder_min_pix_count` pixels, is
+        rejected: its peak list is empty, and the peak search is skipped. The
+        thresholds of different frames are similar, but not identical, so a rejected
+        frame can occasionally have more peaks than this number (see
+        :obj:`prescreen_validation`). Defaults to 0, which disables the pre-screen.
+        """
+        return self._context.prescreen_min_peaks
+
+    @prescreen_min_peaks.setter
+    def prescreen_min_peaks(self, int min_num_peaks):
+        setPeakfinder8Prescreen(self._context, min_num_peaks,
+                                self._context.prescreen_validation,
+                                self._context.prescreen_max_rejections)
+
+    @property
+    def prescreen_max_rejections(self):
+        """
+        The number of frames in a row that the pre-screen can reject.
+
+        The thresholds used by the pre-screen are only computed when the peaks are
+        searched. After this number of frames in a row are rejected, the peaks are
+        searched in the next frame anyway, so that the thresholds follow the changes
+        in the background. Values smaller than 1 are set to 1. Defaults to 16.
+        """
+        return self._context.prescreen_max_rejections
+
+    @prescreen_max_rejections.setter
+    def prescreen_max_rejections(self, int max_rejections):
+        setPeakfinder8Prescreen(self._context, self._context.prescreen_min_peaks,
+                                self._context.prescreen_validation, max_rejections)
+
+    @property
+    def prescreen_validation(self):
+        """
+        Whether the pre-screen runs in validation mode.
+
+        In validation mode, the peaks are also searched in the frames rejected by the
+        pre-screen, and their full peak lists are returned. The rejected frames that
+        turn out to have at least :obj:`prescreen_min_peaks` peaks are counted as
+        false negatives in :obj:`prescreen_stats`. The thresholds computed for the
+        rejected frames are not used by the pre-screen, so the same frames are
+        rejected as without validation. Defaults to False.
+        """
+        return self._context.prescreen_validation != 0
+
+    @prescreen_validation.setter
+    def prescreen_validation(self, bint validation):
+        setPeakfinder8Prescreen(self._context, self._context.prescreen_min_peaks,
+                                validation, self._context.prescreen_max_rejections)
+
+    @property
+    def prescreen_result(self):
+        """
+        The result of the pre-screen for the last processed frame.
+
+        One of 'not_run' (the pre-screen is disabled, no thresholds from a previous
+        frame with the same parameters are available, or the thresholds are computed
+        again after :obj:`prescreen_max_rejections` rejections), 'candidate' (the
+        frame passed the pre-screen) or 'not_a_hit' (the frame was rejected). After
+        a batch of frames, the result refers to one of the frames of the batch.
+        """
+        return _prescreen_results[self._context.prescreen_result]
+
+    @property
+    def prescreen_stats(self):
+        """
+        Statistics of the pre-screen since the context was created.
+
+        A dictionary with the number of frames checked by the pre-screen
+        ('num_frames'), the number of rejected frames ('num_rejected') and, in
+        validation mode, the number of rejected frames with at least
+        :obj:`prescreen_min_peaks` peaks ('num_false_negatives').
+        """
+        return {
+            "num_frames": self._context.prescreen_num_frames,
+            "num_rejected": self._context.prescreen_num_rejected,
+            "num_false_negatives": self._context.prescreen_num_false_negatives,
+        }
+
+    def reset_prescreen_stats(self):
+        """
+        reset_prescreen_stats()
+
+        Resets the statistics of the pre-screen.
+        """
+        resetPeakfinder8PrescreenStats(self._context)
+
+    @property
+    def collect_stats(self):
+        """
+        Whether the statistics of the peak search are collected.
+
+        When True, the time spent in each stage of the algorithm and the number of
+        seeds, candidate peaks and rejected candidates are accumulated over the
+        processed frames (see :obj:`stats`). Reading the timers has a small cost,
+        so the statistics are not collected by default.
+        """
+        return self._context.collect_stats != 0
+
+    @collect_stats.setter
+    def collect_stats(self, bint collect_stats):
+        setPeakfinder8CollectStats(self._context, collect_stats)
+
+    @property
+    def stats(self):
+        """
+        Statistics of the peak search since they were last reset.
+
+        A dictionary with the number of frames processed while
+        :obj:`collect_stats` was True ('num_frames'), the time, in seconds, spent in
+        each stage of the algorithm ('stage_times', a dictionary with the
+        'radial_stats', 'candidate_scan', 'peak_growth', 'local_background' and
+        'total' keys), the number of pixels that can start a peak ('num_seeds'), the
+        number of grown candidate peaks ('num_candidates'), the number of candidates
+        rejected for each reason ('num_rejected', a dictionary with the 'pix_count',
+        'intensity', 'snr', 'background' and 'panel_edge' keys), the number of
+        detected peaks ('num_peaks') and the number of pixels of the largest grown
+        candidate ('max_peak_pixels'). The stage times of the frames processed in
+        parallel by a batch are summed, and the stages run on the GPU are only
+        included in the total time.
+        """
+        cdef tPeakfinder8Stats *stats = &self._context.stats
+
+        return {
+            "num_frames": stats.num_frames,
+            "stage_times": {
+                name: stats.stage_ns[stage] * 1e-9 for name, stage in _stages.items()
+            },
+            "num_seeds": stats.num_seeds,
+            "num_candidates": stats.num_candidates,
+            "num_rejected": {
+                name: stats.num_rejected[reason]
+                for name, reason in _rejection_reasons.items()
+            },
+            "num_peaks": stats.num_peaks,
+            "max_peak_pixels": stats.max_peak_pixels,
+        }
+
+    def reset_stats(self):
+        """
+        reset_stats()
+
+        Resets the statistics of the peak search.
+        """
+        resetPeakfinder8Stats(self._context)
+
+    def find_peaks(self, pf8_data_t[:,::1] data, char[:,::1] mask,
+                   float adc_thresh, float hitfinder_min_snr,
+                   long hitfinder_min_pix_count, long hitfinder_max_pix_count,
+                   long hitfinder_local_bg_radius):
+        """
+        find_peaks(data, mask, adc_thresh, hitfinder_min_snr, \
+            hitfinder_min_pix_count, hitfinder_max_pix_count, \
+            hitfinder_local_bg_radius)
+
+        Peakfinder8 peak detection using the buffers stored in the context.
+
+        This function behaves exactly like the
+        :func:`peakfinder_8` function, but does not allocate any memory. The GIL is
+        released while the peaks are searched, so other Python threads can run in
+        the meantime. A context must not be used by two threads at the same time.
+
+        Arguments:
+
+            data (:obj:`numpy.ndarray`): The detector data frame on which the peak
+                finding must be performed (as a C-contiguous numpy array of float32,
+                float64, uint16 or int32). The data is not copied: each value is
+                converted to float32 when it is read, so the result is the same as
+                for a float32 copy of the frame.
+
+            mask (:obj:`numpy.ndarray`): A numpy array of int8 storing a mask (see
+                the documentation of the :func:`peakfinder_8` function).
+
+            adc_thresh (:obj:`float`):: The minimum ADC threshold for peak detection.
+
+            hitfinder_min_snr (:obj:`float`): The minimum signal-to-noise ratio for
+                peak detection.
+
+            hitfinder_min_pix_count (:obj:`int`): The minimum size of a peak in pixels.
+
+            hitfinder_max_pixel_count (:obj:`int`): The maximum size of a peak in
+                pixels. It cannot be larger than the maximum size specified when the
+                context was created.
+
+            local_bg_radius: The radius for the estimation of the local background in
+                pixels.
+
+        Returns:
+
+            :obj:`Tuple[int, List[float], List[float], List[float], List[float], \
+List[float], List[float]`: A tuple storing  information about the detected peaks, with
+            the same format as the one returned by the :func:`peakfinder_8` function.
+
+        Raises:
+
+            ValueError: A ValueError is raised if the size of the data frame or of the
+                mask does not match the layout of the context.
+
+            RuntimeError: A RuntimeError is raised if the maximum size of a peak is
+                larger than the one supported by the context.
+        """
+        # The unmasked pixels are cached for the address of the mask, which cannot be
+        # reused by another array while the last mask is referenced
+        self._last_mask = mask
+        _run_peakfinder8_context(self._context, data, mask, adc_thresh,
+                                 hitfinder_min_snr, hitfinder_min_pix_count,
+                                 hitfinder_max_pix_count, hitfinder_local_bg_radius)
+
+        return _peak_list_to_tuple(&self._context.peak_list, self._max_num_peaks)
+
+    def find_peaks_array(self, pf8_data_t[:,::1] data, char[:,::1] mask,
+                         float adc_thresh, float hitfinder_min_snr,
+                         long hitfinder_min_pix_count, long hitfinder_max_pix_count,
+                         long hitfinder_local_bg_radius, out=None):
+        """
+        find_peaks_array(data, mask, adc_thresh, hitfinder_min_snr, \
+            hitfinder_min_pix_count, hitfinder_max_pix_count, \
+            hitfinder_local_bg_radius, out=None)
+
+        Peakfinder8 peak detection, returning the peaks in a structured array.
+
+        This function performs the same peak detection as :func:`find_peaks`, but
+        writes the detected peaks directly into a numpy structured array of type
+        :obj:`peak_list_dtype`, instead of creating Python lists. The GIL is released
+        while the array is filled.
+
+        Arguments:
+
+            data, mask, adc_thresh, hitfinder_min_snr, hitfinder_min_pix_count, \
+hitfinder_max_pix_count, hitfinder_local_bg_radius: See the documentation of the
+                :func:`find_peaks` function.
+
+            out (:obj:`numpy.ndarray`): An optional C-contiguous one-dimensional array
+                of type :obj:`peak_list_dtype`, with room for at least the maximum
+                number of peaks specified when the context was created. If this
+                argument is provided, the peaks are written into this array, and no
+                memory is allocated. Defaults to None.
+
+        Returns:
+
+            :obj:`numpy.ndarray`: A structured array of type :obj:`peak_list_dtype`,
+            with one entry per detected peak. If the `out` argument is provided, the
+            returned array is a view of its first entries.
+
+        Raises:
+
+            ValueError: A ValueError is raised if the size of the data frame or of the
+                mask does not match the layout of the context, or if the `out` array
+                does not have the right type, shape or size.
+        """
+        cdef float[:, ::1] peak_array
+        cdef int num_peaks
+
+        if out is None:
+            out = numpy.empty(self._max_num_peaks, dtype=peak_list_dtype)
+        elif (
+            out.dtype != peak_list_dtype
+            or out.ndim != 1
+            or out.shape[0] < self._max_num_peaks
+            or not out.flags["C_CONTIGUOUS"]
+        ):
+            raise ValueError(
+                "The output array must be a C-contiguous one-dimensional array of "
+                "type peak_list_dtype, with room for at least {0} peaks.".format(
+                    self._max_num_peaks
+                )
+            )
+
+        self._last_mask = mask
+        _run_peakfinder8_context(self._context, data, mask, adc_thresh,
+                                 hitfinder_min_snr, hitfinder_min_pix_count,
+                                 hitfinder_max_pix_count, hitfinder_local_bg_radius)
+
+        peak_array = out.view(numpy.float32).reshape(-1, PF8_NUM_PEAK_FIELDS)
+        with nogil:
+            num_peaks = _peak_list_to_array(&self._context.peak_list,
+                                            self._max_num_peaks, peak_array)
+
+        return out[:num_peaks]
+
+    def find_peaks_batch(self, pf8_data_t[:,:,::1] data, char[:,::1] mask,
+                         float adc_thresh, float hitfinder_min_snr,
+                         long hitfinder_min_pix_count, long hitfinder_max_pix_count,
+                         long hitfinder_local_bg_radius):
+        """
+        find_peaks_batch(data, mask, adc_thresh, hitfinder_min_snr, \
+            hitfinder_min_pix_count, hitfinder_max_pix_count, \
+            hitfinder_local_bg_radius)
+
+        Peakfinder8 peak detection on a batch of data frames.
+
+        This function performs the same peak detection as :func:`find_peaks_array`
+        on each frame of a batch, with a single call. The GIL is released for the
+        whole batch. If the :obj:`num_frame_threads` property is larger than one,
+        the frames are processed in parallel. The result does not depend on the
+        number of threads.
+
+        Arguments:
+
+            data (:obj:`numpy.ndarray`): A C-contiguous three-dimensional numpy array
+                of float32, float64, uint16 or int32 storing the data frames, one
+                after the other along the first axis.
+
+            mask (:obj:`numpy.ndarray`): A numpy array of int8 storing a mask, shared
+                by all the frames (see the documentation of the :func:`peakfinder_8`
+                function).
+
+            adc_thresh, hitfinder_min_snr, hitfinder_min_pix_count, \
+hitfinder_max_pix_count, hitfinder_local_bg_radius: See the documentation of the
+                :func:`find_peaks` function.
+
+        Returns:
+
+            :obj:`Tuple[numpy.ndarray, numpy.ndarray]`: A tuple with two entries:
+
+            * The first entry is a structured array of type :obj:`peak_list_dtype`
+              storing the peaks detected in all the frames, in frame order.
+
+            * The second entry is an array of integers storing the number of peaks
+              detected in each frame. The peak list of each frame can be recovered
+              with `numpy.split(peaks, numpy.cumsum(num_peaks)[:-1])`.
+
+        Raises:
+
+            ValueError: A ValueError is raised if the size of the data frames or of the
+                mask does not match the layout of the context.
+        """
+        cdef long num_frames = data.shape[0]
+        cdef float[:, ::1] peak_table
+        cdef long[::1] num_peaks_view
+        cdef long num_table_rows
+        cdef int data_type
+        cdef const void *data_ptr
+        cdef char *mask_ptr
+        cdef int ret
+
+        _check_frame_size(self._context, data.shape[1] * data.shape[2],
+                          mask.shape[0] * mask.shape[1])
+
+        num_peaks = numpy.zeros(num_frames, dtype=numpy.int_)
+        if num_frames == 0:
+            return numpy.empty(0, dtype=peak_list_dtype), num_peaks
+
+        out = numpy.empty(num_frames * self._max_num_peaks, dtype=peak_list_dtype)
+        peak_table = out.view(numpy.float32).reshape(-1, PF8_NUM_PEAK_FIELDS)
+        num_peaks_view = num_peaks
+        data_type = _pf8_data_type(&data[0, 0, 0])
+        data_ptr = &data[0, 0, 0]
+        mask_ptr = &mask[0, 0]
+        self._last_mask = mask
+
+        with nogil:
+            ret = peakfinder8_context_batch(self._context, data_ptr, data_type,
+                                            num_frames, mask_ptr, adc_thresh,
+                                            hitfinder_min_snr,
+                                            hitfinder_min_pix_count,
+                                            hitfinder_max_pix_count,
+                                            hitfinder_local_bg_radius,
+                                            &peak_table[0, 0], &num_peaks_view[0],
+                                            &num_table_rows)
+        if ret != 0:
+            raise RuntimeError(
+                "Peakfinder8 failed: the maximum peak size ({0} pixels) is larger "
+                "than the one supported by the context ({1} pixels).".format(
+                    hitfinder_max_pix_count, self._context.max_pix_count
+                )
+            )
+
+        return out[:num_table_rows].copy(), num_peaks
+
+    def sweep_peak_counts(self, pf8_data_t[:,::1] data, char[:,::1] mask,
+                          parameter_sets):
+        """
+        sweep_peak_counts(data, mask, parameter_sets)
+
+        Number of peaks found in a data frame by many sets of peakfinder8 parameters.
+
+        This function returns, for each set of parameters, the number of peaks that
+        the :func:`find_peaks` function would detect in the frame. The radial
+        statistics of the frame are computed only once for all the sets with the
+        same ADC threshold and minimum signal-to-noise ratio, and the peaks are
+        searched only once for all the sets that only differ in the minimum peak
+        size. The temporal background estimator is replaced by the iterative one, and
+        the GPU and the pre-screen are not used. The GIL is released during the
+        sweep. The peaks stored in the context are discarded, so the
+        :func:`peak_label_map` and :func:`peak_pixels` functions cannot be called
+        before the next frame is processed.
+
+        Arguments:
+
+            data (:obj:`numpy.ndarray`): A C-contiguous two-dimensional numpy array of
+                float32, float64, uint16 or int32 storing the data frame.
+
+            mask (:obj:`numpy.ndarray`): A numpy array of int8 storing a mask (see the
+                documentation of the :func:`peakfinder_8` function).
+
+            parameter_sets (:obj:`numpy.ndarray`): A two-dimensional array with one
+                row per set of parameters. The columns store, in order, the
+                `adc_thresh`, `hitfinder_min_snr`, `hitfinder_min_pix_count`,
+                `hitfinder_max_pix_count` and `hitfinder_local_bg_radius` parameters
+                (see the documentation of the :func:`find_peaks` function).
+
+        Returns:
+
+            :obj:`numpy.ndarray`: An array of integers storing the number of peaks
+            found by each set of parameters.
+
+        Raises:
+
+            ValueError: A ValueError is raised if the size of the data frame or of the
+                mask does not match the layout of the context, or if the parameter
+                sets do not have the right number of columns.
+        """
+        cdef float[:, ::1] param_table
+        cdef long[::1] num_peaks_view
+        cdef long num_sets
+        cdef int data_type
+        cdef const void *data_ptr
+        cdef char *mask_ptr
+        cdef int ret
+
+        _check_frame_size(self._context, data.shape[0] * data.shape[1],
+                          mask.shape[0] * mask.shape[1])
+        parameter_array = numpy.ascontiguousarray(parameter_sets, dtype=numpy.float32)
+        if (
+            parameter_array.ndim != 2
+            or parameter_array.shape[1] != PF8_NUM_SWEEP_FIELDS
+        ):
+            raise ValueError(
+                "Each parameter set must store {0} values.".format(
+                    PF8_NUM_SWEEP_FIELDS
+                )
+            )
+
+        num_sets = parameter_array.shape[0]
+        num_peaks = numpy.zeros(num_sets, dtype=numpy.int_)
+        if num_sets == 0:
+            return num_peaks
+
+        param_table = parameter_array
+        num_peaks_view = num_peaks
+        data_type = _pf8_data_type(&data[0, 0])
+        data_ptr = &data[0, 0]
+        mask_ptr = &mask[0, 0]
+        self._last_mask = mask
+
+        with nogil:
+            ret = peakfinder8_context_sweep(self._context, data_ptr, data_type,
+                                            mask_ptr, &param_table[0, 0], num_sets,
+                                            &num_peaks_view[0])
+        if ret != 0:
+            raise RuntimeError(
+                "Peakfinder8 failed: the maximum peak size of a parameter set is "
+                "larger than the one supported by the context ({0} pixels).".format(
+                    self._context.max_pix_count
+                )
+            )
+
+        return num_peaks
+
+    def peak_label_map(self, out=None):
+        """
+        peak_label_map(out=None)
+
+        Labels the pixels of the peaks found in the last processed frame.
+
+        This function writes, for each pixel of the last frame processed by the
+        :func:`find_peaks` or :func:`find_peaks_array` functions, the index plus one
+        of the peak that the pixel belongs to, in the order of the returned peak list.
+        Pixels that are not part of any returned peak are labelled 0.
+
+        Arguments:
+
+            out: An optional 2D int32 array, with the shape of the data frames, in
+                which the labels are written. Passing the same array for every frame
+                avoids allocating a new one. If None, a new array is allocated.
+
+        Returns:
+
+            The label map.
+
+        Raises:
+
+            ValueError: A ValueError is raised if the size of the output array does
+                not match the layout of the context.
+
+            RuntimeError: A RuntimeError is raised if the peak pixels are not
+                available, because no frame has been processed yet or because the
+                last frame was processed by the GPU backend.
+        """
+        cdef int[:, ::1] label_view
+
+        if out is None:
+            out = numpy.empty(
+                (
+                    self._context.asic_ny * self._context.nasics_y,
+                    self._context.asic_nx * self._context.nasics_x,
+                ),
+                dtype=numpy.int32,
+            )
+        label_view = out
+        if label_view.shape[0] * label_view.shape[1] != self._context.num_pix_tot:
+            raise ValueError(
+                "The size of the label map does not match the detector layout."
+            )
+        if fillPeakfinder8LabelMap(self._context, &label_view[0, 0]) != 0:
+            raise RuntimeError("The pixels of the peaks are not available.")
+
+        return out
+
+    def peak_pixels(self):
+        """
+        peak_pixels()
+
+        Returns the pixels of the peaks found in the last processed frame.
+
+        This function returns a sparse description of the pixels that make up the
+        peaks found in the last frame processed by the :func:`find_peaks` or
+        :func:`find_peaks_array` functions. The pixels are returned peak after peak,
+        in the order of the returned peak list.
+
+        Returns:
+
+            A tuple with two int32 arrays. The first stores the index of each pixel in
+            the flattened data frame. The second stores the index of the peak, in the
+            peak list, that the pixel belongs to.
+
+        Raises:
+
+            RuntimeError: A RuntimeError is raised if the peak pixels are not
+                available, because no frame has been processed yet or because the
+                last frame was processed by the GPU backend.
+        """
+        cdef int[::1] pixel_index_view
+        cdef int[::1] peak_index_view
+        cdef long num_pixels = countPeakfinder8PeakPixels(self._context)
+
+        if num_pixels < 0:
+            raise RuntimeError("The pixels of the peaks are not available.")
+
+        pixel_index = numpy.empty(num_pixels, dtype=numpy.int32)
+        peak_index = numpy.empty(num_pixels, dtype=numpy.int32)
+        if num_pixels > 0:
+            pixel_index_view = pixel_index
+            peak_index_view = peak_index
+            copyPeakfinder8PeakPixels(self._context, &pixel_index_view[0],
+                                      &peak_index_view[0])
+
+        return pixel_index, peak_index
+
+cdef class PowderAccumulator:
+    """
+    PowderAccumulator(visual_pixelmap_x, visual_pixelmap_y, powder_shape, \
+        window_size)
+
+    Virtual powder pattern and running hit rate accumulator.
+
+    This class accumulates, on the collecting node, the intensities of the peaks
+    detected in each frame into a virtual powder pattern, and keeps the hit rate over
+    a running window of frames. The powder pixel of each frame pixel is computed from
+    the visual pixel maps when the accumulator is created, and the peak tables of each
+    frame are added in bulk, without any loop over the peaks in Python.
+
+    Arguments:
+
+        visual_pixelmap_x: A 2D array with the same shape as the data frames, storing,
+            for each pixel, the column of the powder image on which it is drawn.
+
+        visual_pixelmap_y: A 2D array with the same shape as the data frames, storing,
+            for each pixel, the row of the powder image on which it is drawn.
+
+        powder_shape: The shape of the powder image.
+
+        window_size: The number of frames over which the hit rate is computed.
+
+    Raises:
+
+        ValueError: A ValueError is raised if the shapes of the two pixel maps do not
+            match, or if the window size is not positive.
+    """
+    cdef tPowderAccumulator *_acc
+    cdef readonly object powder
+
+    def __cinit__(self, int[:,::1] visual_pixelmap_x, int[:,::1] visual_pixelmap_y,
+                  tuple powder_shape, int window_size):
+        cdef int[:,::1] powder_view
+
+        if (
+            visual_pixelmap_x.shape[0] != visual_pixelmap_y.shape[0]
+            or visual_pixelmap_x.shape[1] != visual_pixelmap_y.shape[1]
+        ):
+            raise ValueError("The shapes of the visual pixel maps do not match.")
+        if window_size < 1:
+            raise ValueError("The size of the hit rate window must be positive.")
+
+        self.powder = numpy.zeros(powder_shape, dtype=numpy.int32)
+        powder_view = self.powder
+        self._acc = allocatePowderAccumulator(&visual_pixelmap_x[0, 0],
+                                              &visual_pixelmap_y[0, 0],
+                                              visual_pixelmap_x.shape[1],
+                                              visual_pixelmap_x.shape[0],
+                                              &powder_view[0, 0],
+                                              powder_view.shape[1],
+                                              powder_view.shape[0], window_size)
+        if self._acc is NULL:
+            raise MemoryError("Could not create the powder accumulator.")
+
+    def __dealloc__(self):
+        freePowderAccumulator(self._acc)
+
+    @property
+    def hit_rate(self):
+        """
+        The fraction of hits among the frames in the running window.
+
+        The window starts filled with non-hits, as many as its size.
+        """
+        return getPowderHitRate(self._acc)
+
+    @property
+    def num_frames(self):
+        """
+        The number of frames added to the accumulator.
+        """
+        return self._acc.num_frames
+
+    @property
+    def num_hits(self):
+        """
+        The number of hits among the frames added to the accumulator.
+        """
+        return self._acc.num_hits
+
+    def add_frame(self, bint frame_is_hit, peak_list):
+        """
+        add_frame(frame_is_hit, peak_list)
+
+        Adds a frame to the hit rate and its peaks to the powder pattern.
+
+        The intensity of each peak is truncated to an integer, and added to the
+        powder pixel of the frame pixel nearest to the position of the peak.
+
+        Arguments:
+
+            frame_is_hit: Whether the frame is a hit.
+
+            peak_list: The peaks of the frame, in a structured array with the
+                :obj:`peak_list_dtype` type.
+
+        Returns:
+
+            A tuple of two int32 arrays, storing the row and the column of each peak
+            in the powder image. Peaks that fall outside the frame or the image are
+            not added to the powder pattern, and are given a row and a column of -1.
+        """
+        cdef float[:, ::1] peak_table
+        cdef int[::1] peak_row_view
+        cdef int[::1] peak_col_view
+        cdef long num_peaks = len(peak_list)
+
+        addPowderFrame(self._acc, frame_is_hit)
+
+        peak_row = numpy.empty(num_peaks, dtype=numpy.int32)
+        peak_col = numpy.empty(num_peaks, dtype=numpy.int32)
+        if num_peaks == 0:
+            return peak_row, peak_col
+
+        peak_table = numpy.ascontiguousarray(peak_list).view(numpy.float32).reshape(
+            -1, PF8_NUM_PEAK_FIELDS
+        )
+        peak_row_view = peak_row
+        peak_col_view = peak_col
+        addPowderPeaks(self._acc, &peak_table[0, 0], num_peaks, &peak_row_view[0],
+                       &peak_col_view[0])
+
+        return peak_row, peak_col
+
+
+cdef class Peakfinder8Pipeline:
+    """
+    Peakfinder8Pipeline(context, mask, num_slots, num_workers, adc_thresh, \
+        hitfinder_min_snr, hitfinder_min_pix_count, hitfinder_max_pix_count, \
+        hitfinder_local_bg_radius)
+
+    Ring of frame slots processed by peakfinder8 worker threads.
+
+    This class decouples the retrieval of the data frames from the peak search. One
+    producer thread fills the slots of a ring with frames, in order. Native worker
+    threads, which run without the GIL and each use a copy of the context, search the
+    peaks of the filled frames in parallel. A reader thread then reads the peaks of
+    the frames in the order in which they were filled, and releases the slots for new
+    frames. The slots are handed over between the threads without locks, and their
+    memory is allocated once, aligned to cache lines and, if the system allows it,
+    locked in RAM.
+
+    The producer must call :func:`acquire_slot`, fill the array returned by
+    :func:`slot_data`, and call :func:`publish_slot`, one slot at a time, and finally
+    call :func:`close`. The reader must call :func:`next_result`, read the results
+    with :func:`slot_peaks` and :func:`slot_data`, and call :func:`release_slot`, one
+    slot at a time. The frames are stored as float32 values.
+
+    Arguments:
+
+        context (:class:`Peakfinder8Context`): The context whose layout and settings
+            are used by the workers. The statistics of the frames processed by the
+            workers are collected in this context when their slots are released.
+
+        mask (:obj:`numpy.ndarray`): The mask used for all the frames (see the
+            documentation of the :func:`peakfinder_8` function).
+
+        num_slots (:obj:`int`): The number of frame slots in the ring.
+
+        num_workers (:obj:`int`): The number of worker threads.
+
+        adc_thresh, hitfinder_min_snr, hitfinder_min_pix_count, \
+hitfinder_max_pix_count, hitfinder_local_bg_radius: The parameters of the peak
+            search, used for all the frames (see the documentation of the
+            :func:`peakfinder_8` function).
+
+    Raises:
+
+        ValueError: A ValueError is raised if the shape of the mask does not match the
+            layout of the context, or if the number of slots or workers is not
+            positive.
+    """
+    cdef tPeakfinder8Pipeline *_pipeline
+    cdef Peakfinder8Context _context
+    cdef object _mask
+    cdef list _slot_frames
+
+    def __cinit__(self, Peakfinder8Context context, char[:,::1] mask, long num_slots,
+                  int num_workers, float adc_thresh, float hitfinder_min_snr,
+                  long hitfinder_min_pix_count, long hitfinder_max_pix_count,
+                  long hitfinder_local_bg_radius):
+        cdef long num_pix_ss = context._context.asic_ny * context._context.nasics_y
+        cdef long num_pix_fs = context._context.asic_nx * context._context.nasics_x
+        cdef long slot
+
+        if mask.shape[0] != num_pix_ss or mask.shape[1] != num_pix_fs:
+            raise ValueError("The shape of the mask does not match the detector layout.")
+        if num_slots < 1 or num_workers < 1:
+            raise ValueError("The numbers of frame slots and workers must be positive.")
+
+        # The workers read the mask and the context until the pipeline is freed
+        self._context = context
+        self._mask = mask
+        self._pipeline = allocatePeakfinder8Pipeline(context._context, &mask[0, 0],
+                                                     num_slots, num_workers,
+                                                     adc_thresh, hitfinder_min_snr,
+                                                     hitfinder_min_pix_count,
+                                                     hitfinder_max_pix_count,
+                                                     hitfinder_local_bg_radius)
+        if self._pipeline is NULL:
+            raise MemoryError(
+                "Could not create the peakfinder8 pipeline: either the memory could "
+                "not be allocated, or the worker threads could not be started."
+            )
+
+        self._slot_frames = [
+            numpy.asarray(
+                <float[:num_pix_ss, :num_pix_fs]> getPeakfinder8PipelineSlotData(
+                    self._pipeline, slot
+                )
+            )
+            for slot in range(num_slots)
+        ]
+
+    def __dealloc__(self):
+        if self._pipeline is not NULL:
+            freePeakfinder8Pipeline(self._pipeline)
+
+    @property
+    def memory_pinned(self):
+        """
+        Whether the memory of the frame slots is locked in RAM.
+        """
+        return peakfinder8PipelineMemoryPinned(self._pipeline) != 0
+
+    def acquire_slot(self):
+        """
+        acquire_slot()
+
+        Waits until the next slot of the ring can be filled. The GIL is released while
+        waiting.
+
+        Returns:
+
+            :obj:`int`: The index of the slot, or None if the pipeline has been
+            closed.
+        """
+        cdef long slot
+
+        with nogil:
+            slot = acquirePeakfinder8PipelineSlot(self._pipeline)
+        if slot < 0:
+            return None
+        return slot
+
+    def slot_data(self, long slot):
+        """
+        slot_data(slot)
+
+        Returns the frame stored in a slot.
+
+        Arguments:
+
+            slot (:obj:`int`): The index of the slot.
+
+        Returns:
+
+            :obj:`numpy.ndarray`: A float32 array, with the shape of the data frames,
+            that shares its memory with the slot. Its content can change as soon as
+            the slot is released, and it must not be used after the pipeline is
+            freed.
+        """
+        return self._slot_frames[slot]
+
+    def publish_slot(self, long slot):
+        """
+        publish_slot(slot)
+
+        Hands a filled slot over to the workers.
+
+        Arguments:
+
+            slot (:obj:`int`): The index of the slot returned by the last call to
+                :func:`acquire_slot`.
+        """
+        publishPeakfinder8PipelineSlot(self._pipeline, slot)
+
+    def close(self):
+        """
+        close()
+
+        Tells the workers and the reader that no more frames will be published.
+        """
+        closePeakfinder8Pipeline(self._pipeline)
+
+    def next_result(self):
+        """
+        next_result()
+
+        Waits until the peaks of the oldest frame that has not been read yet have been
+        searched. The GIL is released while waiting.
+
+        Returns:
+
+            :obj:`int`: The index of the slot storing the frame, or None if the
+            pipeline has been closed and all its frames have been read.
+        """
+        cdef long slot
+
+        with nogil:
+            slot = nextPeakfinder8PipelineResult(self._pipeline)
+        if slot < 0:
+            return None
+        return slot
+
+    def slot_peaks(self, long slot):
+        """
+        slot_peaks(slot)
+
+        Returns the peaks found in the frame stored in a slot.
+
+        Arguments:
+
+            slot (:obj:`int`): The index of the slot returned by the last call to
+                :func:`next_result`.
+
+        Returns:
+
+            :obj:`numpy.ndarray`: A structured array of type :obj:`peak_list_dtype`,
+            with one entry per detected peak. The array does not share its memory with
+            the slot.
+
+        Raises:
+
+            RuntimeError: A RuntimeError is raised if the peak search failed.
+        """
+        cdef const float *peak_table
+        cdef float[:, ::1] peak_array
+        cdef long num_peaks = getPeakfinder8PipelineSlotPeaks(self._pipeline, slot,
+                                                              &peak_table)
+
+        if num_peaks < 0:
+            raise RuntimeError("The peakfinder8 peak search failed.")
+        peak_list = numpy.empty(num_peaks, dtype=peak_list_dtype)
+        if num_peaks > 0:
+            peak_array = peak_list.view(numpy.float32).reshape(-1, PF8_NUM_PEAK_FIELDS)
+            memcpy(&peak_array[0, 0], peak_table,
+                   num_peaks * PF8_NUM_PEAK_FIELDS * sizeof(float))
+
+        return peak_list
+
+    def release_slot(self, long slot):
+        """
+        release_slot(slot)
+
+        Returns a slot to the producer.
+
+        Arguments:
+
+            slot (:obj:`int`): The index of the slot returned by the last call to
+                :func:`next_result`.
+        """
+        releasePeakfinder8PipelineSlot(self._pipeline, slot)
+
+
+cdef class MappedFrameReader:
+    """
+    MappedFrameReader(filename, offset, num_frames, frame_shape, dtype, \
+        prefetch_frames=16)
+
+    Memory-mapped reader of the data frames stored in a file.
+
+    This class maps into memory frames that are stored one after the other,
+    uncompressed, from a given offset of a file: for example the frames of a
+    contiguous HDF5 dataset. The frames are returned as arrays that share their
+    memory with the map, without being copied, and can be passed straight to the
+    functions of a :class:`Peakfinder8Context`. When a frame is retrieved, the kernel
+    is asked to start reading the following frames, so that they are already in
+    memory when they are needed.
+
+    The map is private: the frames can be modified in place without changing the
+    file.
+
+    Arguments:
+
+        filename (:obj:`str`): The name of the file.
+
+        offset (:obj:`int`): The position, in bytes, of the first frame in the file.
+
+        num_frames (:obj:`int`): The number of frames stored in the file.
+
+        frame_shape (:obj:`tuple`): The shape of each frame.
+
+        dtype (:obj:`numpy.dtype`): The data type of the frames.
+
+        prefetch_frames (:obj:`int`): The number of frames that are read ahead of the
+            retrieved one. Defaults to 16.
+
+    Raises:
+
+        RuntimeError: A RuntimeError is raised if the frames cannot be mapped, for
+            example because the file is shorter than the frames.
+    """
+    cdef tMappedFrameReader *_reader
+    cdef long _frame_size
+    cdef object _dtype
+    cdef tuple _frame_shape
+
+    def __cinit__(self, str filename, long offset, long num_frames, frame_shape,
+                  dtype, long prefetch_frames=16):
+        self._dtype = numpy.dtype(dtype)
+        self._frame_shape = tuple(frame_shape)
+        self._frame_size = int(numpy.prod(self._frame_shape)) * self._dtype.itemsize
+
+        self._reader = openMappedFrameReader(filename.encode(), offset,
+                                             self._frame_size, num_frames,
+                                             prefetch_frames)
+        if self._reader is NULL:
+            raise RuntimeError(
+                "Could not map the frames stored in the {0} file.".format(filename)
+            )
+
+    def __dealloc__(self):
+        if self._reader is not NULL:
+            closeMappedFrameReader(self._reader)
+
+    @property
+    def num_frames(self):
+        """
+        The number of frames stored in the file.
+        """
+        return getMappedFrameReaderNumFrames(self._reader)
+
+    def frame(self, long index):
+        """
+        frame(index)
+
+        Returns a frame stored in the file.
+
+        Arguments:
+
+            index (:obj:`int`): The index of the frame in the file.
+
+        Returns:
+
+            :obj:`numpy.ndarray`: An array, with the shape and data type of the
+            frames, that shares its memory with the map. It must not be used after
+            the reader is freed.
+
+        Raises:
+
+            IndexError: An IndexError is raised if the file does not store the frame.
+        """
+        cdef unsigned char *frame_ptr
+
+        frame_ptr = <unsigned char *>getMappedFrame(self._reader, index)
+        if frame_ptr is NULL:
+            raise IndexError("The file does not store frame {0}.".format(index))
+
+        return numpy.asarray(
+            <unsigned char[:self._frame_size]> frame_ptr
+        ).view(self._dtype).reshape(self._frame_shape)
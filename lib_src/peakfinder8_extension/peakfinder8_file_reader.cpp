@@ -0,0 +1,342 @@
+// This file is part of OM.
+//
+// OM is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// OM is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with OnDA.
+// If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2020 -2021 SLAC National Accelerator Laboratory
+//
+// Based on OnDA - Copyright 2014-2019 Deutsches Elektronen-Synchrotron DESY,
+// a research centre of the Helmholtz Association.
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "peakfinder8.hh"
+
+
+// The frames are mapped privately and with write access, so that they can be
+// modified in place, like any other frame, without changing the file. The pages are
+// only copied if they are written
+struct mapped_frame_reader
+{
+	char *map;
+	size_t map_size;
+	char *frames;
+	size_t frame_size;			// In bytes
+	long num_frames;
+	long prefetch_frames;
+	long prefetched;			// Number of frames already advised
+};
+
+
+// Bytes that start the binary section of a CBF file
+static const unsigned char cbf_binary_marker[4] = { 0x0C, 0x1A, 0x04, 0xD5 };
+
+
+// Maps num_frames frames of frame_size bytes each, stored one after the other from
+// the given offset of a file: for example a contiguous, uncompressed HDF5 dataset.
+// When a frame is retrieved, the following prefetch_frames frames are read ahead.
+// Returns NULL if the file cannot be mapped or is too short
+tMappedFrameReader *openMappedFrameReader(const char *filename, long offset,
+                                          long frame_size, long num_frames,
+                                          long prefetch_frames)
+{
+	tMappedFrameReader *reader;
+	struct stat file_stat;
+	long page_size;
+	long map_offset;
+	int fd;
+
+	if ( offset < 0 || frame_size < 1 || num_frames < 1 || prefetch_frames < 0 ) {
+		return NULL;
+	}
+
+	fd = open(filename, O_RDONLY);
+	if ( fd < 0 ) {
+		return NULL;
+	}
+	if ( fstat(fd, &file_stat) != 0
+	  || file_stat.st_size < offset + frame_size * num_frames ) {
+		close(fd);
+		return NULL;
+	}
+
+	reader = (tMappedFrameReader *)malloc(sizeof(tMappedFrameReader));
+	if ( reader == NULL ) {
+		close(fd);
+		return NULL;
+	}
+
+	// The mapping must start at a page boundary
+	page_size = sysconf(_SC_PAGESIZE);
+	map_offset = offset / page_size * page_size;
+	reader->map_size = offset - map_offset + frame_size * num_frames;
+	reader->map = (char *)mmap(NULL, reader->map_size, PROT_READ | PROT_WRITE,
+	                           MAP_PRIVATE, fd, map_offset);
+	close(fd);
+	if ( reader->map == MAP_FAILED ) {
+		free(reader);
+		return NULL;
+	}
+
+	reader->frames = reader->map + (offset - map_offset);
+	reader->frame_size = frame_size;
+	reader->num_frames = num_frames;
+	reader->prefetch_frames = prefetch_frames;
+	reader->prefetched = 0;
+
+	// The advice is only a hint: the frames can be read even if it is not followed
+	madvise(reader->map, reader->map_size, MADV_SEQUENTIAL);
+
+	return reader;
+}
+
+
+void closeMappedFrameReader(tMappedFrameReader *reader)
+{
+	if ( reader == NULL ) {
+		return;
+	}
+	munmap(reader->map, reader->map_size);
+	free(reader);
+}
+
+
+long getMappedFrameReaderNumFrames(const tMappedFrameReader *reader)
+{
+	return reader->num_frames;
+}
+
+
+// Pointer to a mapped frame, or NULL if the frame does not exist. Asks the kernel to
+// start reading the following frames, if it was not already done
+void *getMappedFrame(tMappedFrameReader *reader, long frame)
+{
+	long page_size;
+	long last;
+	char *start;
+	char *end;
+
+	if ( frame < 0 || frame >= reader->num_frames ) {
+		return NULL;
+	}
+
+	last = frame + 1 + reader->prefetch_frames;
+	if ( last > reader->num_frames ) {
+		last = reader->num_frames;
+	}
+	if ( last > reader->prefetched ) {
+		if ( reader->prefetched < frame ) {
+			reader->prefetched = frame;
+		}
+		page_size = sysconf(_SC_PAGESIZE);
+		start = reader->frames + reader->prefetched * reader->frame_size;
+		start = reader->map + (start - reader->map) / page_size * page_size;
+		end = reader->frames + last * reader->frame_size;
+		madvise(start, end - start, MADV_WILLNEED);
+		reader->prefetched = last;
+	}
+
+	return reader->frames + frame * reader->frame_size;
+}
+
+
+// Position of the first occurrence of a string in the header of a CBF file, or NULL
+static const char *find_in_header(const char *header, long header_size,
+                                  const char *key)
+{
+	long key_size;
+	long pos;
+
+	key_size = strlen(key);
+	for ( pos=0 ; pos+key_size<=header_size ; pos++ ) {
+		if ( header[pos] == key[0] && memcmp(header + pos, key, key_size) == 0 ) {
+			return header + pos;
+		}
+	}
+
+	return NULL;
+}
+
+
+// Value of a numeric keyword of the header of a CBF file, or -1 if the keyword is
+// missing
+static long header_value(const char *header, long header_size, const char *key)
+{
+	const char *value;
+	long number;
+
+	value = find_in_header(header, header_size, key);
+	if ( value == NULL ) {
+		return -1;
+	}
+	value += strlen(key);
+
+	number = 0;
+	while ( value < header + header_size && (*value == ' ' || *value == '\t') ) {
+		value++;
+	}
+	if ( value == header + header_size || *value < '0' || *value > '9' ) {
+		return -1;
+	}
+	while ( value < header + header_size && *value >= '0' && *value <= '9' ) {
+		number = number * 10 + (*value - '0');
+		value++;
+	}
+
+	return number;
+}
+
+
+// Finds the binary section of a CBF file compressed with the byte offset algorithm.
+// Returns the size of the header that precedes it, or -1 if the file does not store
+// such a section
+static long cbf_header_size(const char *buffer, long size)
+{
+	long pos;
+
+	for ( pos=0 ; pos+4<=size ; pos++ ) {
+		if ( memcmp(buffer + pos, cbf_binary_marker, 4) == 0 ) {
+			break;
+		}
+	}
+	if ( pos+4 > size ) {
+		return -1;
+	}
+	if ( find_in_header(buffer, pos, "x-CBF_BYTE_OFFSET") == NULL ) {
+		return -1;
+	}
+
+	return pos;
+}
+
+
+// Shape of the frame stored in a CBF file. Returns 1 if the file does not store a
+// frame compressed with the byte offset algorithm
+int cbfFrameShape(const char *buffer, long size, long *num_pix_fs, long *num_pix_ss)
+{
+	long header_size;
+
+	header_size = cbf_header_size(buffer, size);
+	if ( header_size < 0 ) {
+		return 1;
+	}
+
+	*num_pix_fs = header_value(buffer, header_size,
+	                           "X-Binary-Size-Fastest-Dimension:");
+	*num_pix_ss = header_value(buffer, header_size,
+	                           "X-Binary-Size-Second-Dimension:");
+	if ( *num_pix_fs < 0 || *num_pix_ss < 0 ) {
+		return 1;
+	}
+
+	return 0;
+}
+
+
+// Decodes the frame stored in a CBF file, compressed with the byte offset algorithm,
+// into num_pix signed 32-bit values. Each pixel is stored as the difference from the
+// previous one: in one byte, or, after an escape value, in two, four or eight bytes,
+// always in little-endian order. Returns 1 if the file does not store a frame of
+// num_pix pixels
+int decodeCbfFrame(const char *buffer, long size, int *data, long num_pix)
+{
+	const unsigned char *pos;
+	const unsigned char *end;
+	long header_size;
+	long binary_size;
+	unsigned long long word;
+	long long value;
+	long long delta;
+	long pixel;
+	int bi;
+
+	header_size = cbf_header_size(buffer, size);
+	if ( header_size < 0 ) {
+		return 1;
+	}
+	binary_size = header_value(buffer, header_size, "X-Binary-Size:");
+	if ( binary_size < 0 || header_size + 4 + binary_size > size ) {
+		return 1;
+	}
+	if ( header_value(buffer, header_size,
+	                  "X-Binary-Number-of-Elements:") != num_pix ) {
+		return 1;
+	}
+
+	pos = (const unsigned char *)buffer + header_size + 4;
+	end = pos + binary_size;
+	value = 0;
+	pixel = 0;
+	while ( pixel < num_pix ) {
+
+		// Most differences fit in one byte: eight of them are decoded at a time when
+		// none is the escape value
+		if ( pixel + 8 <= num_pix && end - pos >= 8 ) {
+			memcpy(&word, pos, 8);
+			word ^= 0x8080808080808080ULL;
+			if ( ((word - 0x0101010101010101ULL) & ~word & 0x8080808080808080ULL) == 0 ) {
+				for ( bi=0 ; bi<8 ; bi++ ) {
+					value += (signed char)pos[bi];
+					data[pixel+bi] = (int)value;
+				}
+				pos += 8;
+				pixel += 8;
+				continue;
+			}
+		}
+
+		if ( pos >= end ) {
+			return 1;
+		}
+		delta = (signed char)pos[0];
+		pos += 1;
+
+		if ( delta == SCHAR_MIN ) {
+			if ( end - pos < 2 ) {
+				return 1;
+			}
+			delta = (short)(pos[0] | (pos[1] << 8));
+			pos += 2;
+
+			if ( delta == SHRT_MIN ) {
+				if ( end - pos < 4 ) {
+					return 1;
+				}
+				delta = (int)((unsigned int)pos[0] | ((unsigned int)pos[1] << 8)
+				              | ((unsigned int)pos[2] << 16)
+				              | ((unsigned int)pos[3] << 24));
+				pos += 4;
+
+				if ( delta == INT_MIN ) {
+					if ( end - pos < 8 ) {
+						return 1;
+					}
+					delta = 0;
+					for ( bi=7 ; bi>=0 ; bi-- ) {
+						delta = (long long)(((unsigned long long)delta << 8) | pos[bi]);
+					}
+					pos += 8;
+				}
+			}
+		}
+
+		value += delta;
+		data[pixel] = (int)value;
+		pixel += 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,54 @@
+// This file is part of OM.
+//
+// OM is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// OM is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with OnDA.
+// If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2020 -2021 SLAC National Accelerator Laboratory
+//
+// Based on OnDA - Copyright 2014-2019 Deutsches Elektronen-Synchrotron DESY,
+// a research centre of the Helmholtz Association.
+#include <cstdlib>
+
+#include "peakfinder8_gpu.hh"
+
+
+// Built instead of peakfinder8_gpu.cu when the extension is compiled without GPU
+// support: no GPU context can be created, so every frame is processed on the CPU.
+// The parameters are left unnamed, as the stubs do not use them
+int peakfinder_gpu_available(void)
+{
+	return 0;
+}
+
+
+struct peakfinder_gpu *allocate_peakfinder_gpu(const unsigned short *, int, long, long,
+                                               long, long, long)
+{
+	return NULL;
+}
+
+
+void free_peakfinder_gpu(struct peakfinder_gpu *)
+{
+}
+
+
+int peakfinder_gpu_submit(struct peakfinder_gpu *, const void *, int, const char *,
+                          float, float, long, long, long, int)
+{
+	return 1;
+}
+
+
+int peakfinder_gpu_wait(struct peakfinder_gpu *, tPeakList *, long, char *)
+{
+	return 1;
+}
@@ -0,0 +1,976 @@
+// This file is part of OM.
+//
+// OM is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// OM is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with OnDA.
+// If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2020 -2021 SLAC National Accelerator Laboratory
+//
+// Based on OnDA - Copyright 2014-2019 Deutsches Elektronen-Synchrotron DESY,
+// a research centre of the Helmholtz Association.
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <climits>
+#include <algorithm>
+
+#ifdef __HIPCC__
+#include <hip/hip_runtime.h>
+#define cudaError_t hipError_t
+#define cudaSuccess hipSuccess
+#define cudaStream_t hipStream_t
+#define cudaMalloc hipMalloc
+#define cudaFree hipFree
+#define cudaMallocHost hipHostMalloc
+#define cudaFreeHost hipHostFree
+#define cudaMemcpyAsync hipMemcpyAsync
+#define cudaMemsetAsync hipMemsetAsync
+#define cudaMemcpyHostToDevice hipMemcpyHostToDevice
+#define cudaMemcpyDeviceToHost hipMemcpyDeviceToHost
+#define cudaStreamCreate hipStreamCreate
+#define cudaStreamDestroy hipStreamDestroy
+#define cudaStreamSynchronize hipStreamSynchronize
+#define cudaGetDeviceCount hipGetDeviceCount
+#define cudaGetLastError hipGetLastError
+#else
+#include <cuda_runtime.h>
+#endif
+
+#include "peakfinder8_gpu.hh"
+
+#define PF8_GPU_THREADS 256
+#define PF8_GPU_MAX_BLOCKS 4096
+
+// Label propagation passes queued with each frame. Peaks only have a few pixels, so
+// the labels have usually converged after these passes. If they have not, more
+// passes are run when the peaks are collected
+#define PF8_GPU_LABEL_PASSES 4
+
+// Labels of the pixels below threshold, and of the pixels above threshold that are
+// only connected to pixels where the CPU search never starts a peak (the first and
+// last row and column of each panel)
+#define PF8_GPU_NO_LABEL INT_MAX
+#define PF8_GPU_BORDER_LABEL (INT_MAX - 1)
+
+// All kernels use grid-stride loops, so any number of blocks processes all items
+#define PF8_GPU_LAUNCH(kernel, num_items, stream, ...) \
+	kernel<<<num_blocks(num_items), PF8_GPU_THREADS, 0, stream>>>(__VA_ARGS__)
+
+
+struct gpu_layout
+{
+	int asic_size_fs;
+	int asic_size_ss;
+	int num_asics_fs;
+	int num_pix_fs;
+	long num_pix_tot;
+};
+
+
+struct gpu_search_params
+{
+	float min_snr;
+	int min_pix_count;
+	int max_pix_count;
+	int ring_width;
+};
+
+
+// Sums over the pixels of each connected region, stored at the position of the
+// pixel where the CPU search would start the peak
+struct gpu_peak_sums
+{
+	int *count;
+	float *sum_i;				// Above the radial offset, as in peak_search
+	float *sum_com_fs;
+	float *sum_com_ss;
+	float *sum_raw;
+	float *sum_raw_fs;
+	float *sum_raw_ss;
+	float *max_raw;
+	char *accepted;
+};
+
+
+// One detected peak. The key gives the position of the peak in the CPU peak list
+struct gpu_peak
+{
+	int key;
+	int npix;
+	float com_fs;
+	float com_ss;
+	int com_index;
+	float tot_i;
+	float max_i;
+	float sigma;
+	float snr;
+};
+
+
+struct peakfinder_gpu
+{
+	struct gpu_layout layout;
+	int num_rad_bins;
+	int peak_capacity;
+	cudaStream_t stream;
+	int stream_created;
+	int pending;				// A frame was submitted, and not collected yet
+
+	struct gpu_search_params params;
+	int want_outliers;
+
+	// Device buffers
+	void *d_raw;
+	float *d_data;
+	char *d_mask;
+	unsigned short *d_r_bin;
+	float *d_roffset;
+	float *d_rsigma;
+	float *d_rthreshold;
+	float *d_lthreshold;
+	int *d_rcount;
+	int *d_label;
+	struct gpu_peak_sums sums;
+	struct gpu_peak *d_peaks;
+	int *d_status;				// Number of peaks, and label changes in last pass
+	char *d_outliers;
+
+	// Pinned host buffers
+	void *h_raw;
+	char *h_mask;
+	int mask_valid;
+	struct gpu_peak *h_peaks;
+	int *h_status;
+	char *h_outliers;
+};
+
+
+static int num_blocks(long num_items)
+{
+	long blocks;
+
+	blocks = (num_items + PF8_GPU_THREADS - 1) / PF8_GPU_THREADS;
+	if ( blocks < 1 ) {
+		blocks = 1;
+	}
+	if ( blocks > PF8_GPU_MAX_BLOCKS ) {
+		blocks = PF8_GPU_MAX_BLOCKS;
+	}
+	return (int)blocks;
+}
+
+
+static size_t data_type_size(int data_type)
+{
+	switch ( data_type ) {
+		case PF8_DATA_FLOAT32:
+			return sizeof(float);
+
+		case PF8_DATA_FLOAT64:
+			return sizeof(double);
+
+		case PF8_DATA_UINT16:
+			return sizeof(unsigned short);
+
+		case PF8_DATA_INT32:
+			return sizeof(int);
+
+		default:
+			return 0;
+	}
+}
+
+
+// Position of a pixel in the order followed by the CPU search: panel by panel, and
+// row by row within each panel
+__device__ static inline int panel_key(struct gpu_layout layout, long pidx)
+{
+	int fs, ss;
+	int panel;
+
+	fs = pidx % layout.num_pix_fs;
+	ss = pidx / layout.num_pix_fs;
+	panel = (ss / layout.asic_size_ss) * layout.num_asics_fs + fs / layout.asic_size_fs;
+
+	return (panel * layout.asic_size_ss + ss % layout.asic_size_ss)
+	     * layout.asic_size_fs + fs % layout.asic_size_fs;
+}
+
+
+__device__ static inline long key_pixel(struct gpu_layout layout, int key)
+{
+	int panel;
+	int panel_pix;
+	int ss, fs;
+
+	panel_pix = layout.asic_size_fs * layout.asic_size_ss;
+	panel = key / panel_pix;
+	ss = (panel / layout.num_asics_fs) * layout.asic_size_ss
+	   + (key % panel_pix) / layout.asic_size_fs;
+	fs = (panel % layout.num_asics_fs) * layout.asic_size_fs
+	   + (key % panel_pix) % layout.asic_size_fs;
+
+	return (long)ss * layout.num_pix_fs + fs;
+}
+
+
+__device__ static inline void atomic_max_float(float *address, float value)
+{
+	int *address_as_int;
+	int old, assumed;
+
+	address_as_int = (int *)address;
+	old = *address_as_int;
+	while ( __int_as_float(old) < value ) {
+		assumed = old;
+		old = atomicCAS(address_as_int, assumed, __float_as_int(value));
+		if ( old == assumed ) {
+			break;
+		}
+	}
+}
+
+
+template <typename T>
+__global__ static void convert_frame(const T *raw, float *data, long num_pix)
+{
+	long i;
+
+	for ( i=blockIdx.x*blockDim.x+threadIdx.x ; i<num_pix ; i+=blockDim.x*gridDim.x ) {
+		data[i] = (float)raw[i];
+	}
+}
+
+
+__global__ static void init_radial_thresholds(float *rthreshold, float *lthreshold,
+                                              int num_rad_bins)
+{
+	int ri;
+
+	for ( ri=blockIdx.x*blockDim.x+threadIdx.x ; ri<num_rad_bins ;
+	      ri+=blockDim.x*gridDim.x ) {
+		rthreshold[ri] = 1e9;
+		lthreshold[ri] = -1e9;
+	}
+}
+
+
+// Same as fill_radial_bins in peakfinder8.cpp
+__global__ static void fill_radial_bins(const float *data, const char *mask,
+                                        const unsigned short *r_bin,
+                                        const float *rthreshold,
+                                        const float *lthreshold, float *roffset,
+                                        float *rsigma, int *rcount, long num_pix)
+{
+	long i;
+	int curr_r;
+	float value;
+
+	for ( i=blockIdx.x*blockDim.x+threadIdx.x ; i<num_pix ; i+=blockDim.x*gridDim.x ) {
+		if ( mask[i] != 0 ) {
+			curr_r = r_bin[i];
+			value = data[i];
+			if ( value < rthreshold[curr_r] && value > lthreshold[curr_r] ) {
+				atomicAdd(&roffset[curr_r], value);
+				atomicAdd(&rsigma[curr_r], value * value);
+				atomicAdd(&rcount[curr_r], 1);
+			}
+		}
+	}
+}
+
+
+// Same as compute_radial_stats in peakfinder8.cpp
+__global__ static void compute_radial_stats(float *rthreshold, float *lthreshold,
+                                            float *roffset, float *rsigma,
+                                            const int *rcount, int num_rad_bins,
+                                            float min_snr, float acd_threshold)
+{
+	int ri;
+	float this_offset, this_sigma;
+
+	for ( ri=blockIdx.x*blockDim.x+threadIdx.x ; ri<num_rad_bins ;
+	      ri+=blockDim.x*gridDim.x ) {
+
+		if ( rcount[ri] == 0 ) {
+			roffset[ri] = 0;
+			rsigma[ri] = 0;
+			rthreshold[ri] = FLT_MAX;
+			lthreshold[ri] = FLT_MIN;
+		} else {
+			this_offset = roffset[ri] / rcount[ri];
+			this_sigma = rsigma[ri] / rcount[ri] - (this_offset * this_offset);
+			if ( this_sigma >= 0 ) {
+				this_sigma = sqrtf(this_sigma);
+			}
+
+			roffset[ri] = this_offset;
+			rsigma[ri] = this_sigma;
+			rthreshold[ri] = roffset[ri] + min_snr*rsigma[ri];
+			lthreshold[ri] = roffset[ri] - min_snr*rsigma[ri];
+
+			if ( rthreshold[ri] < acd_threshold ) {
+				rthreshold[ri] = acd_threshold;
+			}
+		}
+	}
+}
+
+
+// Each pixel above threshold starts with its own key as label, and the connected
+// regions are then labelled with the smallest key that they contain. This is the
+// pixel where the CPU search starts the peak, and the peaks are finally sorted by
+// key to get the CPU order
+__global__ static void init_labels(const float *data, const char *mask,
+                                   const unsigned short *r_bin,
+                                   const float *rthreshold, int *label,
+                                   struct gpu_layout layout)
+{
+	long i;
+	int fs, ss;
+
+	for ( i=blockIdx.x*blockDim.x+threadIdx.x ; i<layout.num_pix_tot ;
+	      i+=blockDim.x*gridDim.x ) {
+
+		if ( data[i] > rthreshold[r_bin[i]] && mask[i] != 0 ) {
+			fs = (i % layout.num_pix_fs) % layout.asic_size_fs;
+			ss = (i / layout.num_pix_fs) % layout.asic_size_ss;
+			if ( fs >= 1 && fs < layout.asic_size_fs - 1
+			  && ss >= 1 && ss < layout.asic_size_ss - 1 ) {
+				label[i] = panel_key(layout, i);
+			} else {
+				label[i] = PF8_GPU_BORDER_LABEL;
+			}
+		} else {
+			label[i] = PF8_GPU_NO_LABEL;
+		}
+	}
+}
+
+
+// Takes the smallest label among the 8 neighbours in the same panel, as the
+// search pattern of peak_search. The label of the pixel that the new label points
+// to is also read, which lets labels jump across the region
+__global__ static void propagate_labels(int *label, struct gpu_layout layout,
+                                        int *status)
+{
+	long i;
+	int fs, ss;
+	int panel_fs, panel_ss;
+	int dfs, dss;
+	int curr_label, best_label;
+	int jumped_label;
+
+	for ( i=blockIdx.x*blockDim.x+threadIdx.x ; i<layout.num_pix_tot ;
+	      i+=blockDim.x*gridDim.x ) {
+
+		curr_label = label[i];
+		if ( curr_label == PF8_GPU_NO_LABEL ) continue;
+
+		fs = i % layout.num_pix_fs;
+		ss = i / layout.num_pix_fs;
+		panel_fs = fs % layout.asic_size_fs;
+		panel_ss = ss % layout.asic_size_ss;
+
+		best_label = curr_label;
+		for ( dss=-1 ; dss<=1 ; dss++ ) {
+			if ( panel_ss + dss < 0 || panel_ss + dss >= layout.asic_size_ss ) continue;
+			for ( dfs=-1 ; dfs<=1 ; dfs++ ) {
+				if ( panel_fs + dfs < 0 || panel_fs + dfs >= layout.asic_size_fs ) {
+					continue;
+				}
+				best_label = min(best_label,
+				                 label[(ss + dss) * (long)layout.num_pix_fs + fs + dfs]);
+			}
+		}
+
+		if ( best_label < PF8_GPU_BORDER_LABEL ) {
+			jumped_label = label[key_pixel(layout, best_label)];
+			best_label = min(best_label, jumped_label);
+		}
+
+		if ( best_label < curr_label ) {
+			label[i] = best_label;
+			status[1] = 1;
+		}
+	}
+}
+
+
+__global__ static void reset_peak_sums(struct gpu_peak_sums sums, long num_pix)
+{
+	long i;
+
+	for ( i=blockIdx.x*blockDim.x+threadIdx.x ; i<num_pix ; i+=blockDim.x*gridDim.x ) {
+		sums.count[i] = 0;
+		sums.sum_i[i] = 0;
+		sums.sum_com_fs[i] = 0;
+		sums.sum_com_ss[i] = 0;
+		sums.sum_raw[i] = 0;
+		sums.sum_raw_fs[i] = 0;
+		sums.sum_raw_ss[i] = 0;
+		sums.max_raw[i] = -FLT_MAX;
+		sums.accepted[i] = 0;
+	}
+}
+
+
+// Sums computed by the flood fill of process_panel, and by the re-integration with
+// the local background: the latter only need the raw intensities
+__global__ static void accumulate_peaks(const float *data,
+                                        const unsigned short *r_bin,
+                                        const float *roffset, const int *label,
+                                        struct gpu_peak_sums sums,
+                                        struct gpu_layout layout)
+{
+	long i;
+	long first;
+	float curr_i, curr_i_raw;
+	float curr_fs, curr_ss;
+
+	for ( i=blockIdx.x*blockDim.x+threadIdx.x ; i<layout.num_pix_tot ;
+	      i+=blockDim.x*gridDim.x ) {
+
+		if ( label[i] >= PF8_GPU_BORDER_LABEL ) continue;
+
+		first = key_pixel(layout, label[i]);
+		curr_i_raw = data[i];
+		curr_i = curr_i_raw - roffset[r_bin[i]];
+		curr_fs = (float)(i % layout.num_pix_fs);
+		curr_ss = (float)(i / layout.num_pix_fs);
+
+		atomicAdd(&sums.count[first], 1);
+		atomicAdd(&sums.sum_i[first], curr_i);
+		atomicAdd(&sums.sum_com_fs[first], curr_i * curr_fs);
+		atomicAdd(&sums.sum_com_ss[first], curr_i * curr_ss);
+		atomicAdd(&sums.sum_raw[first], curr_i_raw);
+		atomicAdd(&sums.sum_raw_fs[first], curr_i_raw * curr_fs);
+		atomicAdd(&sums.sum_raw_ss[first], curr_i_raw * curr_ss);
+		atomic_max_float(&sums.max_raw[first], curr_i_raw);
+	}
+}
+
+
+// Same as search_in_ring in peakfinder8.cpp. The pixels in a peak are always above
+// threshold, so the peak map does not need to be checked
+__device__ static void ring_background(int ring_width, int com_fs_int, int com_ss_int,
+                                       const float *data, const char *mask,
+                                       const unsigned short *r_bin,
+                                       const float *rthreshold, const float *roffset,
+                                       int aifs, int aiss, struct gpu_layout layout,
+                                       int com_idx, float *local_sigma,
+                                       float *local_offset, float *background_max_i)
+{
+	int ssj, fsi;
+	long pi;
+	float curr_i;
+	float sum_i, sum_i_squared;
+	int np_sigma;
+
+	sum_i = 0;
+	sum_i_squared = 0;
+	np_sigma = 0;
+	*background_max_i = 0;
+
+	for ( ssj=-ring_width ; ssj<ring_width ; ssj++ ) {
+		if ( com_ss_int + ssj < 0 || com_ss_int + ssj >= layout.asic_size_ss ) continue;
+		for ( fsi=-ring_width ; fsi<ring_width ; fsi++ ) {
+			if ( com_fs_int + fsi < 0 || com_fs_int + fsi >= layout.asic_size_fs ) {
+				continue;
+			}
+			if ( fsi * fsi + ssj * ssj > ring_width * ring_width ) continue;
+
+			pi = (long)(com_ss_int + ssj + aiss * layout.asic_size_ss) * layout.num_pix_fs
+			   + com_fs_int + fsi + aifs * layout.asic_size_fs;
+			curr_i = data[pi];
+			if ( curr_i < rthreshold[r_bin[pi]] && mask[pi] != 0 ) {
+				np_sigma++;
+				sum_i += curr_i;
+				sum_i_squared += (curr_i * curr_i);
+				if ( curr_i > *background_max_i ) {
+					*background_max_i = curr_i;
+				}
+			}
+		}
+	}
+
+	if ( np_sigma != 0 ) {
+		*local_offset = sum_i / np_sigma;
+		*local_sigma = sum_i_squared / np_sigma - (*local_offset * *local_offset);
+		if ( *local_sigma >= 0 ) {
+			*local_sigma = sqrtf(*local_sigma);
+		} else {
+			*local_sigma = 0.01;
+		}
+	} else {
+		*local_offset = roffset[r_bin[com_idx]];
+		*local_sigma = 0.01;
+	}
+}
+
+
+// Applies the peak criteria of process_panel to each connected region
+__global__ static void evaluate_peaks(const float *data, const char *mask,
+                                      const unsigned short *r_bin,
+                                      const float *rthreshold, const float *roffset,
+                                      const int *label, struct gpu_peak_sums sums,
+                                      struct gpu_layout layout,
+                                      struct gpu_search_params params,
+                                      struct gpu_peak *peaks, int *status,
+                                      int peak_capacity)
+{
+	long i;
+	int key;
+	int num_pix_in_peak;
+	int aifs, aiss;
+	float peak_com_fs, peak_com_ss;
+	int com_fs_int, com_ss_int;
+	int com_idx;
+	float local_sigma, local_offset, background_max_i;
+	float peak_tot_i, pk_tot_i_raw, peak_max_i;
+	float peak_snr;
+	int slot;
+
+	for ( i=blockIdx.x*blockDim.x+threadIdx.x ; i<layout.num_pix_tot ;
+	      i+=blockDim.x*gridDim.x ) {
+
+		key = label[i];
+		if ( key >= PF8_GPU_BORDER_LABEL || key != panel_key(layout, i) ) continue;
+
+		num_pix_in_peak = sums.count[i];
+		if ( num_pix_in_peak < params.min_pix_count
+		  || num_pix_in_peak > params.max_pix_count ) continue;
+		if ( fabsf(sums.sum_i[i]) < 1e-10 ) continue;
+
+		aifs = (i % layout.num_pix_fs) / layout.asic_size_fs;
+		aiss = (i / layout.num_pix_fs) / layout.asic_size_ss;
+
+		peak_com_fs = sums.sum_com_fs[i] / fabsf(sums.sum_i[i]);
+		peak_com_ss = sums.sum_com_ss[i] / fabsf(sums.sum_i[i]);
+		com_idx = (int)rintf(peak_com_fs) + (int)rintf(peak_com_ss) * layout.num_pix_fs;
+		com_fs_int = (int)rintf(peak_com_fs) - aifs * layout.asic_size_fs;
+		com_ss_int = (int)rintf(peak_com_ss) - aiss * layout.asic_size_ss;
+
+		ring_background(params.ring_width, com_fs_int, com_ss_int, data, mask, r_bin,
+		                rthreshold, roffset, aifs, aiss, layout, com_idx,
+		                &local_sigma, &local_offset, &background_max_i);
+
+		// Re-integration with the local background
+		pk_tot_i_raw = sums.sum_raw[i];
+		peak_tot_i = pk_tot_i_raw - num_pix_in_peak * local_offset;
+		peak_max_i = fmaxf(sums.max_raw[i] - local_offset, 0);
+		if ( fabsf(pk_tot_i_raw) < 1e-10 ) continue;
+
+		peak_com_fs = sums.sum_raw_fs[i] / fabsf(pk_tot_i_raw);
+		peak_com_ss = sums.sum_raw_ss[i] / fabsf(pk_tot_i_raw);
+
+		if ( fabsf(local_sigma) > 1e-10 ) {
+			peak_snr = peak_tot_i / local_sigma;
+		} else {
+			peak_snr = 0;
+		}
+		if ( peak_snr < params.min_snr ) continue;
+		if ( peak_max_i < background_max_i - local_offset ) continue;
+
+		if ( peak_com_fs < aifs*layout.asic_size_fs
+		  || peak_com_fs > (aifs+1)*layout.asic_size_fs-1
+		  || peak_com_ss < aiss*layout.asic_size_ss
+		  || peak_com_ss > (aiss+1)*layout.asic_size_ss-1 ) {
+			continue;
+		}
+
+		sums.accepted[i] = 1;
+		slot = atomicAdd(&status[0], 1);
+		if ( slot < peak_capacity ) {
+			peaks[slot].key = key;
+			peaks[slot].npix = num_pix_in_peak;
+			peaks[slot].com_fs = peak_com_fs;
+			peaks[slot].com_ss = peak_com_ss;
+			peaks[slot].com_index = (int)rintf(peak_com_fs)
+			                      + (int)rintf(peak_com_ss) * layout.num_pix_fs;
+			peaks[slot].tot_i = peak_tot_i;
+			peaks[slot].max_i = peak_max_i;
+			peaks[slot].sigma = local_sigma;
+			peaks[slot].snr = peak_snr;
+		}
+	}
+}
+
+
+// Same values as the peak map of the CPU search: 1 for the pixels of the searched
+// regions, and 2 for the pixels of the detected peaks
+__global__ static void fill_outliers_mask(const int *label, struct gpu_peak_sums sums,
+                                          struct gpu_layout layout, char *outliers)
+{
+	long i;
+
+	for ( i=blockIdx.x*blockDim.x+threadIdx.x ; i<layout.num_pix_tot ;
+	      i+=blockDim.x*gridDim.x ) {
+		if ( label[i] >= PF8_GPU_BORDER_LABEL ) {
+			outliers[i] = 0;
+		} else if ( sums.accepted[key_pixel(layout, label[i])] ) {
+			outliers[i] = 2;
+		} else {
+			outliers[i] = 1;
+		}
+	}
+}
+
+
+int peakfinder_gpu_available(void)
+{
+	int num_devices;
+
+	if ( cudaGetDeviceCount(&num_devices) != cudaSuccess ) {
+		return 0;
+	}
+	return num_devices > 0;
+}
+
+
+static int device_alloc(void **ptr, size_t size)
+{
+	return cudaMalloc(ptr, size) != cudaSuccess;
+}
+
+
+static int host_alloc(void **ptr, size_t size)
+{
+	return cudaMallocHost(ptr, size) != cudaSuccess;
+}
+
+
+void free_peakfinder_gpu(struct peakfinder_gpu *gpu)
+{
+	if ( gpu == NULL ) {
+		return;
+	}
+	if ( gpu->stream_created ) {
+		cudaStreamSynchronize(gpu->stream);
+		cudaStreamDestroy(gpu->stream);
+	}
+	cudaFree(gpu->d_raw);
+	cudaFree(gpu->d_data);
+	cudaFree(gpu->d_mask);
+	cudaFree(gpu->d_r_bin);
+	cudaFree(gpu->d_roffset);
+	cudaFree(gpu->d_rsigma);
+	cudaFree(gpu->d_rthreshold);
+	cudaFree(gpu->d_lthreshold);
+	cudaFree(gpu->d_rcount);
+	cudaFree(gpu->d_label);
+	cudaFree(gpu->sums.count);
+	cudaFree(gpu->sums.sum_i);
+	cudaFree(gpu->sums.sum_com_fs);
+	cudaFree(gpu->sums.sum_com_ss);
+	cudaFree(gpu->sums.sum_raw);
+	cudaFree(gpu->sums.sum_raw_fs);
+	cudaFree(gpu->sums.sum_raw_ss);
+	cudaFree(gpu->sums.max_raw);
+	cudaFree(gpu->sums.accepted);
+	cudaFree(gpu->d_peaks);
+	cudaFree(gpu->d_status);
+	cudaFree(gpu->d_outliers);
+	cudaFreeHost(gpu->h_raw);
+	cudaFreeHost(gpu->h_mask);
+	cudaFreeHost(gpu->h_peaks);
+	cudaFreeHost(gpu->h_status);
+	cudaFreeHost(gpu->h_outliers);
+	free(gpu);
+}
+
+
+// Returns NULL if there is no GPU, or if device memory cannot be allocated
+struct peakfinder_gpu *allocate_peakfinder_gpu(const unsigned short *r_bin,
+                                               int num_rad_bins, long asic_nx,
+                                               long asic_ny, long nasics_x,
+                                               long nasics_y, long max_num_peaks)
+{
+	struct peakfinder_gpu *gpu;
+	long num_pix;
+	size_t rad_size;
+
+	num_pix = asic_nx * nasics_x * asic_ny * nasics_y;
+
+	// Labels are pixel positions, and must not collide with the special labels
+	if ( num_pix >= PF8_GPU_BORDER_LABEL || !peakfinder_gpu_available() ) {
+		return NULL;
+	}
+
+	gpu = (struct peakfinder_gpu *)calloc(1, sizeof(struct peakfinder_gpu));
+	if ( gpu == NULL ) {
+		return NULL;
+	}
+
+	gpu->layout.asic_size_fs = asic_nx;
+	gpu->layout.asic_size_ss = asic_ny;
+	gpu->layout.num_asics_fs = nasics_x;
+	gpu->layout.num_pix_fs = asic_nx * nasics_x;
+	gpu->layout.num_pix_tot = num_pix;
+	gpu->num_rad_bins = num_rad_bins;
+	gpu->peak_capacity = std::max(4 * max_num_peaks, 4096L);
+
+	if ( cudaStreamCreate(&gpu->stream) != cudaSuccess ) {
+		free(gpu);
+		return NULL;
+	}
+	gpu->stream_created = 1;
+
+	rad_size = num_rad_bins * sizeof(float);
+	if ( device_alloc(&gpu->d_raw, num_pix*sizeof(double))
+	  || device_alloc((void **)&gpu->d_data, num_pix*sizeof(float))
+	  || device_alloc((void **)&gpu->d_mask, num_pix*sizeof(char))
+	  || device_alloc((void **)&gpu->d_r_bin, num_pix*sizeof(unsigned short))
+	  || device_alloc((void **)&gpu->d_roffset, rad_size)
+	  || device_alloc((void **)&gpu->d_rsigma, rad_size)
+	  || device_alloc((void **)&gpu->d_rthreshold, rad_size)
+	  || device_alloc((void **)&gpu->d_lthreshold, rad_size)
+	  || device_alloc((void **)&gpu->d_rcount, num_rad_bins*sizeof(int))
+	  || device_alloc((void **)&gpu->d_label, num_pix*sizeof(int))
+	  || device_alloc((void **)&gpu->sums.count, num_pix*sizeof(int))
+	  || device_alloc((void **)&gpu->sums.sum_i, num_pix*sizeof(float))
+	  || device_alloc((void **)&gpu->sums.sum_com_fs, num_pix*sizeof(float))
+	  || device_alloc((void **)&gpu->sums.sum_com_ss, num_pix*sizeof(float))
+	  || device_alloc((void **)&gpu->sums.sum_raw, num_pix*sizeof(float))
+	  || device_alloc((void **)&gpu->sums.sum_raw_fs, num_pix*sizeof(float))
+	  || device_alloc((void **)&gpu->sums.sum_raw_ss, num_pix*sizeof(float))
+	  || device_alloc((void **)&gpu->sums.max_raw, num_pix*sizeof(float))
+	  || device_alloc((void **)&gpu->sums.accepted, num_pix*sizeof(char))
+	  || device_alloc((void **)&gpu->d_peaks, gpu->peak_capacity*sizeof(struct gpu_peak))
+	  || device_alloc((void **)&gpu->d_status, 2*sizeof(int))
+	  || device_alloc((void **)&gpu->d_outliers, num_pix*sizeof(char))
+	  || host_alloc(&gpu->h_raw, num_pix*sizeof(double))
+	  || host_alloc((void **)&gpu->h_mask, num_pix*sizeof(char))
+	  || host_alloc((void **)&gpu->h_peaks, gpu->peak_capacity*sizeof(struct gpu_peak))
+	  || host_alloc((void **)&gpu->h_status, 2*sizeof(int))
+	  || host_alloc((void **)&gpu->h_outliers, num_pix*sizeof(char)) ) {
+		free_peakfinder_gpu(gpu);
+		return NULL;
+	}
+
+	// The radial bin map stays on the device for the lifetime of the context
+	if ( cudaMemcpyAsync(gpu->d_r_bin, r_bin, num_pix*sizeof(unsigned short),
+	                     cudaMemcpyHostToDevice, gpu->stream) != cudaSuccess
+	  || cudaStreamSynchronize(gpu->stream) != cudaSuccess ) {
+		free_peakfinder_gpu(gpu);
+		return NULL;
+	}
+
+	return gpu;
+}
+
+
+// Queues label propagation passes. The change flag is cleared before the last pass,
+// so that it tells whether the labels have converged
+static void queue_label_passes(struct peakfinder_gpu *gpu)
+{
+	int pass;
+
+	for ( pass=0 ; pass<PF8_GPU_LABEL_PASSES ; pass++ ) {
+		if ( pass == PF8_GPU_LABEL_PASSES - 1 ) {
+			cudaMemsetAsync(gpu->d_status + 1, 0, sizeof(int), gpu->stream);
+		}
+		PF8_GPU_LAUNCH(propagate_labels, gpu->layout.num_pix_tot, gpu->stream,
+		               gpu->d_label, gpu->layout, gpu->d_status);
+	}
+}
+
+
+// Queues the evaluation of the peaks, and the copy of the results to the host
+static void queue_peak_evaluation(struct peakfinder_gpu *gpu)
+{
+	long num_pix;
+
+	num_pix = gpu->layout.num_pix_tot;
+
+	cudaMemsetAsync(gpu->d_status, 0, sizeof(int), gpu->stream);
+	PF8_GPU_LAUNCH(reset_peak_sums, num_pix, gpu->stream, gpu->sums, num_pix);
+	PF8_GPU_LAUNCH(accumulate_peaks, num_pix, gpu->stream, gpu->d_data, gpu->d_r_bin,
+	               gpu->d_roffset, gpu->d_label, gpu->sums, gpu->layout);
+	PF8_GPU_LAUNCH(evaluate_peaks, num_pix, gpu->stream, gpu->d_data, gpu->d_mask,
+	               gpu->d_r_bin, gpu->d_rthreshold, gpu->d_roffset, gpu->d_label,
+	               gpu->sums, gpu->layout, gpu->params, gpu->d_peaks, gpu->d_status,
+	               gpu->peak_capacity);
+
+	cudaMemcpyAsync(gpu->h_status, gpu->d_status, 2*sizeof(int),
+	                cudaMemcpyDeviceToHost, gpu->stream);
+	cudaMemcpyAsync(gpu->h_peaks, gpu->d_peaks,
+	                gpu->peak_capacity*sizeof(struct gpu_peak),
+	                cudaMemcpyDeviceToHost, gpu->stream);
+
+	if ( gpu->want_outliers ) {
+		PF8_GPU_LAUNCH(fill_outliers_mask, num_pix, gpu->stream, gpu->d_label,
+		               gpu->sums, gpu->layout, gpu->d_outliers);
+		cudaMemcpyAsync(gpu->h_outliers, gpu->d_outliers, num_pix*sizeof(char),
+		                cudaMemcpyDeviceToHost, gpu->stream);
+	}
+}
+
+
+// Queues the whole search of a frame on the stream of the GPU context, and returns
+// without waiting for it. The frame data is copied, so the buffer can be reused as
+// soon as the function returns. Returns 1 if the data type is not supported, or if
+// a frame was already submitted and not collected
+int peakfinder_gpu_submit(struct peakfinder_gpu *gpu, const void *data,
+                          int data_type, const char *mask, float ADCthresh,
+                          float hitfinderMinSNR, long hitfinderMinPixCount,
+                          long hitfinderMaxPixCount, long hitfinderLocalBGRadius,
+                          int want_outliers)
+{
+	long num_pix;
+	size_t frame_size;
+	int it_counter;
+
+	if ( gpu->pending || data_type_size(data_type) == 0 ) {
+		return 1;
+	}
+
+	num_pix = gpu->layout.num_pix_tot;
+	frame_size = num_pix * data_type_size(data_type);
+
+	gpu->params.min_snr = hitfinderMinSNR;
+	gpu->params.min_pix_count = hitfinderMinPixCount;
+	gpu->params.max_pix_count = hitfinderMaxPixCount;
+	gpu->params.ring_width = 2 * hitfinderLocalBGRadius;
+	gpu->want_outliers = want_outliers;
+
+	memcpy(gpu->h_raw, data, frame_size);
+	cudaMemcpyAsync(gpu->d_raw, gpu->h_raw, frame_size, cudaMemcpyHostToDevice,
+	                gpu->stream);
+
+	// The mask usually does not change from frame to frame
+	if ( !gpu->mask_valid || memcmp(gpu->h_mask, mask, num_pix) != 0 ) {
+		memcpy(gpu->h_mask, mask, num_pix);
+		cudaMemcpyAsync(gpu->d_mask, gpu->h_mask, num_pix, cudaMemcpyHostToDevice,
+		                gpu->stream);
+		gpu->mask_valid = 1;
+	}
+
+	switch ( data_type ) {
+		case PF8_DATA_FLOAT32:
+			PF8_GPU_LAUNCH(convert_frame<float>, num_pix, gpu->stream,
+			               (const float *)gpu->d_raw, gpu->d_data, num_pix);
+			break;
+
+		case PF8_DATA_FLOAT64:
+			PF8_GPU_LAUNCH(convert_frame<double>, num_pix, gpu->stream,
+			               (const double *)gpu->d_raw, gpu->d_data, num_pix);
+			break;
+
+		case PF8_DATA_UINT16:
+			PF8_GPU_LAUNCH(convert_frame<unsigned short>, num_pix, gpu->stream,
+			               (const unsigned short *)gpu->d_raw, gpu->d_data, num_pix);
+			break;
+
+		case PF8_DATA_INT32:
+			PF8_GPU_LAUNCH(convert_frame<int>, num_pix, gpu->stream,
+			               (const int *)gpu->d_raw, gpu->d_data, num_pix);
+			break;
+	}
+
+	// Same iterations as compute_radial_bins
+	PF8_GPU_LAUNCH(init_radial_thresholds, gpu->num_rad_bins, gpu->stream,
+	               gpu->d_rthreshold, gpu->d_lthreshold, gpu->num_rad_bins);
+	for ( it_counter=0 ; it_counter<5 ; it_counter++ ) {
+		cudaMemsetAsync(gpu->d_roffset, 0, gpu->num_rad_bins*sizeof(float),
+		                gpu->stream);
+		cudaMemsetAsync(gpu->d_rsigma, 0, gpu->num_rad_bins*sizeof(float),
+		                gpu->stream);
+		cudaMemsetAsync(gpu->d_rcount, 0, gpu->num_rad_bins*sizeof(int),
+		                gpu->stream);
+		PF8_GPU_LAUNCH(fill_radial_bins, num_pix, gpu->stream, gpu->d_data,
+		               gpu->d_mask, gpu->d_r_bin, gpu->d_rthreshold,
+		               gpu->d_lthreshold, gpu->d_roffset, gpu->d_rsigma,
+		               gpu->d_rcount, num_pix);
+		PF8_GPU_LAUNCH(compute_radial_stats, gpu->num_rad_bins, gpu->stream,
+		               gpu->d_rthreshold, gpu->d_lthreshold, gpu->d_roffset,
+		               gpu->d_rsigma, gpu->d_rcount, gpu->num_rad_bins,
+		               hitfinderMinSNR, ADCthresh);
+	}
+
+	PF8_GPU_LAUNCH(init_labels, num_pix, gpu->stream, gpu->d_data, gpu->d_mask,
+	               gpu->d_r_bin, gpu->d_rthreshold, gpu->d_label, gpu->layout);
+	queue_label_passes(gpu);
+	queue_peak_evaluation(gpu);
+
+	if ( cudaGetLastError() != cudaSuccess ) {
+		cudaStreamSynchronize(gpu->stream);
+		return 1;
+	}
+
+	gpu->pending = 1;
+	return 0;
+}
+
+
+static bool peak_before(const struct gpu_peak &a, const struct gpu_peak &b)
+{
+	return a.key < b.key;
+}
+
+
+// Waits for the frame submitted with peakfinder_gpu_submit, and stores its peaks in
+// the peak list, in the same order as the CPU search. Returns PF8_GPU_TABLE_FULL if
+// the frame has too many peaks for the device table, and 1 if the device fails
+int peakfinder_gpu_wait(struct peakfinder_gpu *gpu, tPeakList *peak_list,
+                        long max_num_peaks, char *outliersMask)
+{
+	int num_peaks;
+	int pki;
+	struct gpu_peak *peak;
+
+	if ( !gpu->pending ) {
+		return 1;
+	}
+	gpu->pending = 0;
+
+	if ( cudaStreamSynchronize(gpu->stream) != cudaSuccess ) {
+		return 1;
+	}
+
+	// Large connected regions need more passes to converge
+	while ( gpu->h_status[1] ) {
+		queue_label_passes(gpu);
+		queue_peak_evaluation(gpu);
+		if ( cudaStreamSynchronize(gpu->stream) != cudaSuccess ) {
+			return 1;
+		}
+	}
+
+	num_peaks = gpu->h_status[0];
+	if ( num_peaks > gpu->peak_capacity ) {
+		return PF8_GPU_TABLE_FULL;
+	}
+
+	std::sort(gpu->h_peaks, gpu->h_peaks + num_peaks, peak_before);
+	if ( num_peaks > max_num_peaks ) {
+		num_peaks = max_num_peaks;
+	}
+
+	for ( pki=0 ; pki<num_peaks ; pki++ ) {
+		peak = &gpu->h_peaks[pki];
+		peak_list->peak_maxintensity[pki] = peak->max_i;
+		peak_list->peak_totalintensity[pki] = peak->tot_i;
+		peak_list->peak_sigma[pki] = peak->sigma;
+		peak_list->peak_snr[pki] = peak->snr;
+		peak_list->peak_npix[pki] = peak->npix;
+		peak_list->peak_com_x[pki] = peak->com_fs;
+		peak_list->peak_com_y[pki] = peak->com_ss;
+		peak_list->peak_com_index[pki] = peak->com_index;
+	}
+	peak_list->nPeaks = num_peaks;
+
+	if ( outliersMask != NULL && gpu->want_outliers ) {
+		memcpy(outliersMask, gpu->h_outliers, gpu->layout.num_pix_tot*sizeof(char));
+	}
+
+	return 0;
+}
@@ -0,0 +1,55 @@
+// This file is part of OM.
+//
+// OM is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// OM is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with OnDA.
+// If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2020 -2021 SLAC National Accelerator Laboratory
+//
+// Based on OnDA - Copyright 2014-2019 Deutsches Elektronen-Synchrotron DESY,
+// a research centre of the Helmholtz Association.
+#ifndef PEAKFINDER8_GPU_H
+#define PEAKFINDER8_GPU_H
+
+#include "peakfinder8.hh"
+
+// GPU implementation of the peakfinder8 search, with the sigma clipping radial
+// background and the ring local background. It is implemented in
+// peakfinder8_gpu.cu when the extension is built with OM_USE_CUDA, and by
+// peakfinder8_gpu.cpp, which reports that no GPU is available, otherwise.
+//
+// Each GPU context owns a stream and a set of device buffers. The radial bin map is
+// copied to the device when the context is created, and the mask is only copied
+// again when it changes. A frame is queued with peakfinder_gpu_submit, which returns
+// without waiting for the device, and its peaks are collected with
+// peakfinder_gpu_wait. Different GPU contexts can process frames at the same time.
+struct peakfinder_gpu;
+
+// Returned by peakfinder_gpu_wait when the frame has more peaks than the device
+// table can store. The frame must then be processed on the CPU
+enum {
+	PF8_GPU_TABLE_FULL = 2
+};
+
+int peakfinder_gpu_available(void);
+struct peakfinder_gpu *allocate_peakfinder_gpu(const unsigned short *r_bin,
+                                               int num_rad_bins, long asic_nx,
+                                               long asic_ny, long nasics_x,
+                                               long nasics_y, long max_num_peaks);
+void free_peakfinder_gpu(struct peakfinder_gpu *gpu);
+int peakfinder_gpu_submit(struct peakfinder_gpu *gpu, const void *data,
+                          int data_type, const char *mask, float ADCthresh,
+                          float hitfinderMinSNR, long hitfinderMinPixCount,
+                          long hitfinderMaxPixCount, long hitfinderLocalBGRadius,
+                          int want_outliers);
+int peakfinder_gpu_wait(struct peakfinder_gpu *gpu, tPeakList *peak_list,
+                        long max_num_peaks, char *outliersMask);
+
+#endif // PEAKFINDER8_GPU_H
@@ -0,0 +1,429 @@
+// This file is part of OM.
+//
+// OM is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// OM is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with OnDA.
+// If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2020 -2021 SLAC National Accelerator Laboratory
+//
+// Based on OnDA - Copyright 2014-2019 Deutsches Elektronen-Synchrotron DESY,
+// a research centre of the Helmholtz Association.
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "peakfinder8.hh"
+
+
+#define PIPELINE_CACHE_LINE 64
+
+
+// A ring of frame slots between one producer, which fills the slots with frames,
+// several workers, which search the peaks in the filled slots, and one reader, which
+// reads the peaks of the frames in the order in which they were filled. The slots are
+// handed over with sequence numbers, without locks: the slot at position pos of the
+// ring can be filled when its sequence number is 2*pos, and its frame can be
+// processed when the sequence number is 2*pos+1. When the reader releases the slot,
+// its sequence number becomes 2*(pos+num_slots), for the next frame that it will
+// store. Doubling the positions keeps the two states distinct even with one slot.
+struct pipeline_slot
+{
+	long		sequence;
+	int			done;					// The peaks of the frame have been searched
+	long		num_peaks;				// -1 if the peak search failed
+	float		*data;
+	float		*peak_table;
+	tPeakfinder8Stats	stats;			// Statistics of the frame, if collected
+} __attribute__((aligned(PIPELINE_CACHE_LINE)));
+
+
+struct pipeline_worker
+{
+	struct peakfinder_pipeline *pipeline;
+	tPeakfinder8Context *context;
+	pthread_t thread_id;
+};
+
+
+// The positions written by different threads are kept on different cache lines
+struct peakfinder_pipeline
+{
+	long		head __attribute__((aligned(PIPELINE_CACHE_LINE)));		// Producer
+	long		num_published __attribute__((aligned(PIPELINE_CACHE_LINE)));
+	long		claim __attribute__((aligned(PIPELINE_CACHE_LINE)));	// Workers
+	long		drain __attribute__((aligned(PIPELINE_CACHE_LINE)));	// Reader
+	int			closed __attribute__((aligned(PIPELINE_CACHE_LINE)));
+	int			stopped;
+
+	tPeakfinder8Context	*context;
+	char		*mask;
+	float		adc_thresh;
+	float		min_snr;
+	long		min_pix_count;
+	long		max_pix_count;
+	long		local_bg_radius;
+
+	long		num_slots;
+	struct pipeline_slot	*slots;
+	void		*slot_memory;			// Frames and peak tables of all the slots
+	size_t		slot_memory_size;
+	int			pinned;
+
+	int			num_workers;
+	int			num_started;
+	struct pipeline_worker	*workers;
+};
+
+
+static size_t align_to_cache_line(size_t size)
+{
+	return (size + PIPELINE_CACHE_LINE - 1) / PIPELINE_CACHE_LINE * PIPELINE_CACHE_LINE;
+}
+
+
+// Waits a little longer at each call: the thread first spins, then yields the CPU,
+// and finally sleeps
+static void pipeline_backoff(int *num_waits)
+{
+	struct timespec pause;
+
+	if ( *num_waits < 64 ) {
+		*num_waits += 1;
+		return;
+	}
+	if ( *num_waits < 128 ) {
+		*num_waits += 1;
+		sched_yield();
+		return;
+	}
+	pause.tv_sec = 0;
+	pause.tv_nsec = 20000;
+	nanosleep(&pause, NULL);
+}
+
+
+static void process_pipeline_slot(struct peakfinder_pipeline *pipeline,
+                                  tPeakfinder8Context *context,
+                                  struct pipeline_slot *slot)
+{
+	int ret;
+
+	ret = peakfinder8_context(context, slot->data, pipeline->mask,
+	                          pipeline->adc_thresh, pipeline->min_snr,
+	                          pipeline->min_pix_count, pipeline->max_pix_count,
+	                          pipeline->local_bg_radius, NULL);
+	if ( ret != 0 ) {
+		slot->num_peaks = -1;
+	} else {
+		slot->num_peaks = copyPeakListToTable(&context->peak_list,
+		                                      context->max_num_peaks,
+		                                      slot->peak_table);
+	}
+
+	// The statistics are collected in the main context when the slot is released
+	if ( context->collect_stats ) {
+		slot->stats = context->stats;
+		resetPeakfinder8Stats(context);
+	}
+	__atomic_store_n(&slot->done, 1, __ATOMIC_RELEASE);
+}
+
+
+// Claims the published slots one at a time, until the pipeline is closed and all
+// its frames have been claimed, or until the pipeline is stopped
+static void *pipeline_worker_thread(void *arg)
+{
+	struct pipeline_worker *worker;
+	struct peakfinder_pipeline *pipeline;
+	struct pipeline_slot *slot;
+	long pos;
+	long sequence;
+	int num_waits;
+
+	worker = (struct pipeline_worker *)arg;
+	pipeline = worker->pipeline;
+	num_waits = 0;
+
+	while ( !__atomic_load_n(&pipeline->stopped, __ATOMIC_ACQUIRE) ) {
+
+		pos = __atomic_load_n(&pipeline->claim, __ATOMIC_RELAXED);
+		slot = &pipeline->slots[pos % pipeline->num_slots];
+		sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+		if ( sequence == 2 * pos + 1 ) {
+			if ( __atomic_compare_exchange_n(&pipeline->claim, &pos, pos + 1, 0,
+			                                 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) ) {
+				process_pipeline_slot(pipeline, worker->context, slot);
+				num_waits = 0;
+			}
+			continue;
+		}
+
+		// The closed flag is set after the last frame is published
+		if ( __atomic_load_n(&pipeline->closed, __ATOMIC_ACQUIRE)
+		  && pos == __atomic_load_n(&pipeline->num_published, __ATOMIC_ACQUIRE) ) {
+			break;
+		}
+		pipeline_backoff(&num_waits);
+	}
+
+	return NULL;
+}
+
+
+static void stop_pipeline_workers(struct peakfinder_pipeline *pipeline)
+{
+	int wi;
+
+	__atomic_store_n(&pipeline->stopped, 1, __ATOMIC_RELEASE);
+	for ( wi=0 ; wi<pipeline->num_started ; wi++ ) {
+		pthread_join(pipeline->workers[wi].thread_id, NULL);
+	}
+	pipeline->num_started = 0;
+}
+
+
+void freePeakfinder8Pipeline(tPeakfinder8Pipeline *pipeline)
+{
+	int wi;
+
+	stop_pipeline_workers(pipeline);
+
+	if ( pipeline->workers != NULL ) {
+		for ( wi=0 ; wi<pipeline->num_workers ; wi++ ) {
+			if ( pipeline->workers[wi].context != NULL ) {
+				freePeakfinder8Context(pipeline->workers[wi].context);
+			}
+		}
+	}
+	free(pipeline->workers);
+
+	if ( pipeline->pinned ) {
+		munlock(pipeline->slot_memory, pipeline->slot_memory_size);
+	}
+	free(pipeline->slot_memory);
+	free(pipeline->slots);
+	free(pipeline);
+}
+
+
+// Creates a pipeline with num_slots frame slots, and starts num_workers threads that
+// search the peaks of the frames in the slots, each with its own copy of the context.
+// The frames use the layout of the context, and are stored as float32 values. The
+// mask and the search parameters are shared by all the frames. The memory of the
+// slots is locked in RAM, if the system allows it. Returns NULL if the memory cannot
+// be allocated or the threads cannot be started
+tPeakfinder8Pipeline *allocatePeakfinder8Pipeline(tPeakfinder8Context *context,
+                                                  char *mask, long num_slots,
+                                                  int num_workers, float ADCthresh,
+                                                  float hitfinderMinSNR,
+                                                  long hitfinderMinPixCount,
+                                                  long hitfinderMaxPixCount,
+                                                  long hitfinderLocalBGRadius)
+{
+	struct peakfinder_pipeline *pipeline;
+	void *memory;
+	size_t data_size;
+	size_t peak_table_size;
+	char *slot_memory;
+	long si;
+	int wi;
+
+	if ( num_slots < 1 || num_workers < 1 ) {
+		return NULL;
+	}
+
+	if ( posix_memalign(&memory, PIPELINE_CACHE_LINE,
+	                    sizeof(struct peakfinder_pipeline)) != 0 ) {
+		return NULL;
+	}
+	pipeline = (struct peakfinder_pipeline *)memory;
+	memset(pipeline, 0, sizeof(struct peakfinder_pipeline));
+	pipeline->context = context;
+	pipeline->mask = mask;
+	pipeline->adc_thresh = ADCthresh;
+	pipeline->min_snr = hitfinderMinSNR;
+	pipeline->min_pix_count = hitfinderMinPixCount;
+	pipeline->max_pix_count = hitfinderMaxPixCount;
+	pipeline->local_bg_radius = hitfinderLocalBGRadius;
+	pipeline->num_slots = num_slots;
+	pipeline->num_workers = num_workers;
+
+	data_size = align_to_cache_line(context->num_pix_tot * sizeof(float));
+	peak_table_size = align_to_cache_line(context->max_num_peaks *
+	                                      PF8_NUM_PEAK_FIELDS * sizeof(float));
+	pipeline->slot_memory_size = num_slots * (data_size + peak_table_size);
+	if ( posix_memalign(&memory, PIPELINE_CACHE_LINE,
+	                    num_slots * sizeof(struct pipeline_slot)) == 0 ) {
+		pipeline->slots = (struct pipeline_slot *)memory;
+	}
+	if ( posix_memalign(&memory, PIPELINE_CACHE_LINE,
+	                    pipeline->slot_memory_size) == 0 ) {
+		pipeline->slot_memory = memory;
+	}
+	pipeline->workers = (struct pipeline_worker *)calloc(num_workers,
+	                                                     sizeof(struct pipeline_worker));
+	if ( pipeline->slots == NULL || pipeline->slot_memory == NULL
+	  || pipeline->workers == NULL ) {
+		freePeakfinder8Pipeline(pipeline);
+		return NULL;
+	}
+
+	// The pages are touched here, so that no page fault happens while the frames are
+	// being retrieved
+	memset(pipeline->slot_memory, 0, pipeline->slot_memory_size);
+	pipeline->pinned = mlock(pipeline->slot_memory, pipeline->slot_memory_size) == 0;
+
+	slot_memory = (char *)pipeline->slot_memory;
+	memset(pipeline->slots, 0, num_slots * sizeof(struct pipeline_slot));
+	for ( si=0 ; si<num_slots ; si++ ) {
+		pipeline->slots[si].sequence = 2 * si;
+		pipeline->slots[si].data = (float *)slot_memory;
+		pipeline->slots[si].peak_table = (float *)(slot_memory + data_size);
+		slot_memory += data_size + peak_table_size;
+	}
+
+	for ( wi=0 ; wi<num_workers ; wi++ ) {
+		pipeline->workers[wi].pipeline = pipeline;
+		pipeline->workers[wi].context = clonePeakfinder8Context(context);
+		if ( pipeline->workers[wi].context == NULL
+		  || copyPeakfinder8Settings(pipeline->workers[wi].context, context) != 0 ) {
+			freePeakfinder8Pipeline(pipeline);
+			return NULL;
+		}
+	}
+	for ( wi=0 ; wi<num_workers ; wi++ ) {
+		if ( pthread_create(&pipeline->workers[wi].thread_id, NULL,
+		                    pipeline_worker_thread, &pipeline->workers[wi]) != 0 ) {
+			freePeakfinder8Pipeline(pipeline);
+			return NULL;
+		}
+		pipeline->num_started += 1;
+	}
+
+	return pipeline;
+}
+
+
+// Returns 1 if the memory of the slots is locked in RAM
+int peakfinder8PipelineMemoryPinned(const tPeakfinder8Pipeline *pipeline)
+{
+	return pipeline->pinned;
+}
+
+
+// Waits until the next slot of the ring can be filled, and returns it. Must only be
+// called by the producer, and each acquired slot must be published before another
+// one is acquired. Returns -1 if the pipeline has been closed
+long acquirePeakfinder8PipelineSlot(tPeakfinder8Pipeline *pipeline)
+{
+	struct pipeline_slot *slot;
+	long pos;
+	int num_waits;
+
+	if ( __atomic_load_n(&pipeline->closed, __ATOMIC_ACQUIRE) ) {
+		return -1;
+	}
+
+	pos = pipeline->head;
+	slot = &pipeline->slots[pos % pipeline->num_slots];
+	num_waits = 0;
+	while ( __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != 2 * pos ) {
+		pipeline_backoff(&num_waits);
+	}
+
+	return pos % pipeline->num_slots;
+}
+
+
+// Returns the frame buffer of a slot, with room for one frame of float32 values
+float *getPeakfinder8PipelineSlotData(tPeakfinder8Pipeline *pipeline, long slot)
+{
+	return pipeline->slots[slot].data;
+}
+
+
+// Hands a filled slot over to the workers
+void publishPeakfinder8PipelineSlot(tPeakfinder8Pipeline *pipeline, long slot)
+{
+	long pos;
+
+	pos = pipeline->head;
+	pipeline->slots[slot].done = 0;
+	__atomic_store_n(&pipeline->slots[slot].sequence, 2 * pos + 1, __ATOMIC_RELEASE);
+	pipeline->head = pos + 1;
+	__atomic_store_n(&pipeline->num_published, pos + 1, __ATOMIC_RELEASE);
+}
+
+
+// Tells the workers and the reader that no more frames will be published. Must be
+// called by the producer
+void closePeakfinder8Pipeline(tPeakfinder8Pipeline *pipeline)
+{
+	__atomic_store_n(&pipeline->closed, 1, __ATOMIC_RELEASE);
+}
+
+
+// Waits until the peaks of the oldest frame that has not been read yet have been
+// searched, and returns its slot, which must be released before this function is
+// called again. Returns -1 when the pipeline has been closed and all its frames have
+// been read
+long nextPeakfinder8PipelineResult(tPeakfinder8Pipeline *pipeline)
+{
+	struct pipeline_slot *slot;
+	long pos;
+	int num_waits;
+
+	pos = pipeline->drain;
+	slot = &pipeline->slots[pos % pipeline->num_slots];
+	num_waits = 0;
+	while ( 1 ) {
+		if ( __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == 2 * pos + 1
+		  && __atomic_load_n(&slot->done, __ATOMIC_ACQUIRE) ) {
+			return pos % pipeline->num_slots;
+		}
+		if ( __atomic_load_n(&pipeline->closed, __ATOMIC_ACQUIRE)
+		  && pos == __atomic_load_n(&pipeline->num_published, __ATOMIC_ACQUIRE) ) {
+			return -1;
+		}
+		pipeline_backoff(&num_waits);
+	}
+}
+
+
+// Returns the number of peaks found in the frame of a slot, or -1 if the peak search
+// failed, and stores in peak_table the address of the peak table of the slot, with
+// PF8_NUM_PEAK_FIELDS columns
+long getPeakfinder8PipelineSlotPeaks(tPeakfinder8Pipeline *pipeline, long slot,
+                                     const float **peak_table)
+{
+	*peak_table = pipeline->slots[slot].peak_table;
+	return pipeline->slots[slot].num_peaks;
+}
+
+
+// Returns a slot returned by nextPeakfinder8PipelineResult to the producer, and adds
+// the statistics of its frame to the ones of the main context
+void releasePeakfinder8PipelineSlot(tPeakfinder8Pipeline *pipeline, long slot)
+{
+	long pos;
+
+	pos = pipeline->drain;
+	if ( pipeline->context->collect_stats ) {
+		addPeakfinder8Stats(&pipeline->context->stats, &pipeline->slots[slot].stats);
+	}
+	pipeline->slots[slot].done = 0;
+	__atomic_store_n(&pipeline->slots[slot].sequence,
+	                 2 * (pos + pipeline->num_slots), __ATOMIC_RELEASE);
+	pipeline->drain = pos + 1;
+}
@@ -0,0 +1,426 @@
+// This file is part of OM.
+//
+// OM is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// OM is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with OnDA.
+// If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2020 -2021 SLAC National Accelerator Laboratory
+//
+// Based on OnDA - Copyright 2014-2019 Deutsches Elektronen-Synchrotron DESY,
+// a research centre of the Helmholtz Association.
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "peakfinder8.hh"
+
+
+#define PIXEL_MAP_CACHE_VERSION 1
+#define PIXEL_MAP_CACHE_KEY_SIZE 128
+#define PIXEL_MAP_CACHE_ALIGNMENT 64
+
+
+// Sections of a cache file, stored one after the other after the header
+enum {
+	CACHE_X = 0,
+	CACHE_Y = 1,
+	CACHE_Z = 2,
+	CACHE_RADIUS = 3,
+	CACHE_PHI = 4,
+	CACHE_R_BIN = 5,
+	CACHE_SPANS = 6,
+	CACHE_NUM_SECTIONS = 7
+};
+
+
+struct pixel_map_cache_header
+{
+	char magic[8];
+	int version;
+	int num_rad_bins;
+	long num_pix_fs;
+	long num_pix_ss;
+	long num_spans;
+	char key[PIXEL_MAP_CACHE_KEY_SIZE];		// Identifies the geometry
+};
+
+
+static const char pixel_map_cache_magic[8] = { 'O', 'M', 'P', 'I', 'X', 'M', 'A', 'P' };
+
+
+// Offsets of the sections of a cache file. offsets[CACHE_NUM_SECTIONS] is the size
+// of the file. Each section starts at a cache line boundary
+static void cache_layout(long num_pix, long num_spans,
+                         size_t offsets[CACHE_NUM_SECTIONS+1])
+{
+	size_t sizes[CACHE_NUM_SECTIONS];
+	size_t offset;
+	int si;
+
+	sizes[CACHE_X] = num_pix * sizeof(float);
+	sizes[CACHE_Y] = num_pix * sizeof(float);
+	sizes[CACHE_Z] = num_pix * sizeof(float);
+	sizes[CACHE_RADIUS] = num_pix * sizeof(float);
+	sizes[CACHE_PHI] = num_pix * sizeof(float);
+	sizes[CACHE_R_BIN] = num_pix * sizeof(unsigned short);
+	sizes[CACHE_SPANS] = num_spans * 2 * sizeof(int);
+
+	offset = sizeof(struct pixel_map_cache_header);
+	for ( si=0 ; si<CACHE_NUM_SECTIONS ; si++ ) {
+		offset = (offset + PIXEL_MAP_CACHE_ALIGNMENT - 1) / PIXEL_MAP_CACHE_ALIGNMENT
+		         * PIXEL_MAP_CACHE_ALIGNMENT;
+		offsets[si] = offset;
+		offset += sizes[si];
+	}
+	offsets[CACHE_NUM_SECTIONS] = offset;
+}
+
+
+// Size of the pixel maps of a detector: the panels must fit in them. Returns 1 if a
+// panel has a negative or inverted pixel range
+int pixelMapShape(const tPixelMapPanel *panels, int num_panels, long *num_pix_fs,
+                  long *num_pix_ss)
+{
+	int pi;
+
+	if ( num_panels < 1 ) {
+		return 1;
+	}
+
+	*num_pix_fs = 0;
+	*num_pix_ss = 0;
+	for ( pi=0 ; pi<num_panels ; pi++ ) {
+		if ( panels[pi].min_fs < 0 || panels[pi].max_fs < panels[pi].min_fs
+		  || panels[pi].min_ss < 0 || panels[pi].max_ss < panels[pi].min_ss ) {
+			return 1;
+		}
+		if ( panels[pi].max_fs + 1 > *num_pix_fs ) {
+			*num_pix_fs = panels[pi].max_fs + 1;
+		}
+		if ( panels[pi].max_ss + 1 > *num_pix_ss ) {
+			*num_pix_ss = panels[pi].max_ss + 1;
+		}
+	}
+
+	return 0;
+}
+
+
+// Computes the x, y and z coordinates of each pixel, its distance from the center
+// of the reference system and its angle from the x axis. The coordinates are
+// computed in double precision and then stored in single precision, like the
+// pixel maps computed in Python. Pixels not covered by any panel lie at the center.
+// Returns 1 if a panel does not fit in the maps
+int computePixelMaps(const tPixelMapPanel *panels, int num_panels, long num_pix_fs,
+                     long num_pix_ss, float *x_map, float *y_map, float *z_map,
+                     float *r_map, float *phi_map)
+{
+	const tPixelMapPanel *panel;
+	long num_pix;
+	long pidx;
+	long ifs, iss;
+	double fs, ss;
+	int pi;
+
+	num_pix = num_pix_fs * num_pix_ss;
+	memset(x_map, 0, num_pix*sizeof(float));
+	memset(y_map, 0, num_pix*sizeof(float));
+	memset(z_map, 0, num_pix*sizeof(float));
+
+	for ( pi=0 ; pi<num_panels ; pi++ ) {
+		panel = &panels[pi];
+		if ( panel->min_fs < 0 || panel->max_fs >= num_pix_fs
+		  || panel->min_ss < 0 || panel->max_ss >= num_pix_ss ) {
+			return 1;
+		}
+		for ( iss=panel->min_ss ; iss<=panel->max_ss ; iss++ ) {
+			ss = (double)(iss - panel->min_ss);
+			for ( ifs=panel->min_fs ; ifs<=panel->max_fs ; ifs++ ) {
+				fs = (double)(ifs - panel->min_fs);
+				pidx = iss * num_pix_fs + ifs;
+				x_map[pidx] = (float)(ss * panel->ssx + fs * panel->fsx + panel->cnx);
+				y_map[pidx] = (float)(ss * panel->ssy + fs * panel->fsy + panel->cny);
+				z_map[pidx] = (float)panel->clen;
+			}
+		}
+	}
+
+	for ( pidx=0 ; pidx<num_pix ; pidx++ ) {
+		r_map[pidx] = sqrtf(x_map[pidx] * x_map[pidx] + y_map[pidx] * y_map[pidx]);
+		phi_map[pidx] = atan2f(y_map[pidx], x_map[pidx]);
+	}
+
+	return 0;
+}
+
+
+// Marks the pixels covered by the panels, and counts the runs of consecutive marked
+// pixels. If spans is not NULL, it is filled with the first pixel and the length of
+// each run
+static long find_panel_spans(const tPixelMapPanel *panels, int num_panels,
+                             long num_pix_fs, long num_pix_ss, char *covered,
+                             int *spans)
+{
+	long num_spans;
+	long pidx;
+	long start;
+	long ifs, iss;
+	int pi;
+
+	memset(covered, 0, num_pix_fs*num_pix_ss);
+	for ( pi=0 ; pi<num_panels ; pi++ ) {
+		for ( iss=panels[pi].min_ss ; iss<=panels[pi].max_ss ; iss++ ) {
+			memset(covered + iss * num_pix_fs + panels[pi].min_fs, 1,
+			       panels[pi].max_fs - panels[pi].min_fs + 1);
+		}
+	}
+
+	// A run never continues on the following row
+	num_spans = 0;
+	for ( iss=0 ; iss<num_pix_ss ; iss++ ) {
+		ifs = 0;
+		while ( ifs < num_pix_fs ) {
+			pidx = iss * num_pix_fs + ifs;
+			if ( covered[pidx] == 0 ) {
+				ifs++;
+				continue;
+			}
+			start = pidx;
+			while ( ifs < num_pix_fs && covered[iss*num_pix_fs+ifs] != 0 ) {
+				ifs++;
+			}
+			if ( spans != NULL ) {
+				spans[2*num_spans] = (int)start;
+				spans[2*num_spans+1] = (int)(iss * num_pix_fs + ifs - start);
+			}
+			num_spans += 1;
+		}
+	}
+
+	return num_spans;
+}
+
+
+static int write_all(int fd, const char *buffer, size_t size)
+{
+	ssize_t written;
+
+	while ( size > 0 ) {
+		written = write(fd, buffer, size);
+		if ( written < 0 ) {
+			if ( errno == EINTR ) {
+				continue;
+			}
+			return 1;
+		}
+		buffer += written;
+		size -= written;
+	}
+
+	return 0;
+}
+
+
+// Computes the pixel maps of a detector, the radial bin map used by the peakfinder8
+// contexts and the runs of pixels covered by the panels, and stores them in a cache
+// file, identified by a key of up to 127 characters. The file is first written
+// under a temporary name and then renamed, so that other processes never open an
+// incomplete file, even if they write the same cache at the same time. Returns 1
+// if the cache cannot be written
+int writePixelMapCache(const char *filename, const char *key,
+                       const tPixelMapPanel *panels, int num_panels)
+{
+	struct pixel_map_cache_header *header;
+	size_t offsets[CACHE_NUM_SECTIONS+1];
+	char *image;
+	char *covered;
+	float *r_map;
+	char *tmp_filename;
+	long num_pix_fs, num_pix_ss;
+	long num_pix;
+	long num_spans;
+	int num_rad_bins;
+	int fd;
+	int ret;
+
+	if ( strlen(key) >= PIXEL_MAP_CACHE_KEY_SIZE ) {
+		return 1;
+	}
+	if ( pixelMapShape(panels, num_panels, &num_pix_fs, &num_pix_ss) != 0 ) {
+		return 1;
+	}
+
+	// The runs store pixel indexes as 32-bit integers
+	num_pix = num_pix_fs * num_pix_ss;
+	if ( num_pix > INT_MAX ) {
+		return 1;
+	}
+
+	covered = (char *)malloc(num_pix);
+	if ( covered == NULL ) {
+		return 1;
+	}
+	num_spans = find_panel_spans(panels, num_panels, num_pix_fs, num_pix_ss, covered,
+	                             NULL);
+
+	cache_layout(num_pix, num_spans, offsets);
+	image = (char *)calloc(offsets[CACHE_NUM_SECTIONS], 1);
+	if ( image == NULL ) {
+		free(covered);
+		return 1;
+	}
+	find_panel_spans(panels, num_panels, num_pix_fs, num_pix_ss, covered,
+	                 (int *)(image + offsets[CACHE_SPANS]));
+	free(covered);
+
+	r_map = (float *)(image + offsets[CACHE_RADIUS]);
+	computePixelMaps(panels, num_panels, num_pix_fs, num_pix_ss,
+	                 (float *)(image + offsets[CACHE_X]),
+	                 (float *)(image + offsets[CACHE_Y]),
+	                 (float *)(image + offsets[CACHE_Z]), r_map,
+	                 (float *)(image + offsets[CACHE_PHI]));
+	num_rad_bins = computePeakfinder8RadialBins(r_map, num_pix,
+	                                            (unsigned short *)(image +
+	                                                               offsets[CACHE_R_BIN]));
+	if ( num_rad_bins < 0 ) {
+		free(image);
+		return 1;
+	}
+
+	header = (struct pixel_map_cache_header *)image;
+	memcpy(header->magic, pixel_map_cache_magic, sizeof(header->magic));
+	header->version = PIXEL_MAP_CACHE_VERSION;
+	header->num_rad_bins = num_rad_bins;
+	header->num_pix_fs = num_pix_fs;
+	header->num_pix_ss = num_pix_ss;
+	header->num_spans = num_spans;
+	strcpy(header->key, key);
+
+	tmp_filename = (char *)malloc(strlen(filename) + 32);
+	if ( tmp_filename == NULL ) {
+		free(image);
+		return 1;
+	}
+	sprintf(tmp_filename, "%s.%ld.tmp", filename, (long)getpid());
+
+	fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ( fd < 0 ) {
+		free(tmp_filename);
+		free(image);
+		return 1;
+	}
+	ret = write_all(fd, image, offsets[CACHE_NUM_SECTIONS]);
+	if ( close(fd) != 0 ) {
+		ret = 1;
+	}
+	if ( ret == 0 && rename(tmp_filename, filename) != 0 ) {
+		ret = 1;
+	}
+	if ( ret != 0 ) {
+		unlink(tmp_filename);
+	}
+
+	free(tmp_filename);
+	free(image);
+
+	return ret;
+}
+
+
+// Maps a cache file written by writePixelMapCache. The map is read-only and shared,
+// so the kernel keeps a single copy of the file in memory for all the processes
+// that open it. Returns NULL if the file does not exist, was written for a
+// different key or by a different version of this code, or is damaged
+tPixelMapCache *openPixelMapCache(const char *filename, const char *key)
+{
+	const struct pixel_map_cache_header *header;
+	tPixelMapCache *cache;
+	size_t offsets[CACHE_NUM_SECTIONS+1];
+	struct stat file_stat;
+	char *map;
+	int fd;
+
+	if ( strlen(key) >= PIXEL_MAP_CACHE_KEY_SIZE ) {
+		return NULL;
+	}
+
+	fd = open(filename, O_RDONLY);
+	if ( fd < 0 ) {
+		return NULL;
+	}
+	if ( fstat(fd, &file_stat) != 0
+	  || file_stat.st_size < (off_t)sizeof(struct pixel_map_cache_header) ) {
+		close(fd);
+		return NULL;
+	}
+	map = (char *)mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED ) {
+		return NULL;
+	}
+
+	header = (const struct pixel_map_cache_header *)map;
+	if ( memcmp(header->magic, pixel_map_cache_magic, sizeof(header->magic)) != 0
+	  || header->version != PIXEL_MAP_CACHE_VERSION
+	  || header->num_rad_bins < 1 || header->num_rad_bins > USHRT_MAX + 1
+	  || strncmp(header->key, key, PIXEL_MAP_CACHE_KEY_SIZE) != 0
+	  || header->num_pix_fs < 1 || header->num_pix_ss < 1
+	  || header->num_pix_fs * header->num_pix_ss > INT_MAX
+	  || header->num_spans < 0
+	  || header->num_spans > header->num_pix_fs * header->num_pix_ss ) {
+		munmap(map, file_stat.st_size);
+		return NULL;
+	}
+	cache_layout(header->num_pix_fs * header->num_pix_ss, header->num_spans,
+	             offsets);
+	if ( offsets[CACHE_NUM_SECTIONS] != (size_t)file_stat.st_size ) {
+		munmap(map, file_stat.st_size);
+		return NULL;
+	}
+
+	cache = (tPixelMapCache *)malloc(sizeof(tPixelMapCache));
+	if ( cache == NULL ) {
+		munmap(map, file_stat.st_size);
+		return NULL;
+	}
+
+	cache->map = map;
+	cache->map_size = file_stat.st_size;
+	cache->num_pix_fs = header->num_pix_fs;
+	cache->num_pix_ss = header->num_pix_ss;
+	cache->x = (const float *)(map + offsets[CACHE_X]);
+	cache->y = (const float *)(map + offsets[CACHE_Y]);
+	cache->z = (const float *)(map + offsets[CACHE_Z]);
+	cache->radius = (const float *)(map + offsets[CACHE_RADIUS]);
+	cache->phi = (const float *)(map + offsets[CACHE_PHI]);
+	cache->r_bin = (const unsigned short *)(map + offsets[CACHE_R_BIN]);
+	cache->num_rad_bins = header->num_rad_bins;
+	cache->num_spans = header->num_spans;
+	cache->spans = (const int *)(map + offsets[CACHE_SPANS]);
+
+	return cache;
+}
+
+
+void closePixelMapCache(tPixelMapCache *cache)
+{
+	if ( cache == NULL ) {
+		return;
+	}
+	munmap(cache->map, cache->map_size);
+	free(cache);
+}
@@ -0,0 +1,161 @@
+// This file is part of OM.
+//
+// OM is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// OM is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with OnDA.
+// If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2020 -2021 SLAC National Accelerator Laboratory
+//
+// Based on OnDA - Copyright 2014-2019 Deutsches Elektronen-Synchrotron DESY,
+// a research centre of the Helmholtz Association.
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "peakfinder8.hh"
+
+
+// Creates an accumulator for frames with num_pix_fs*num_pix_ss pixels. The visual
+// pixel maps store, for each pixel of a frame, the column and row of the pixel of the
+// powder image on which it is drawn. The powder image, with img_nx*img_ny values, is
+// owned by the caller and is not cleared. Returns NULL if the memory cannot be
+// allocated, or if the window size is not positive
+tPowderAccumulator *allocatePowderAccumulator(const int *visual_pix_x,
+                                              const int *visual_pix_y,
+                                              long num_pix_fs, long num_pix_ss,
+                                              int *powder, long img_nx, long img_ny,
+                                              int window_size)
+{
+	tPowderAccumulator *acc;
+	long pi;
+
+	if ( window_size < 1 ) {
+		return NULL;
+	}
+
+	acc = (tPowderAccumulator *)malloc(sizeof(tPowderAccumulator));
+	if ( acc == NULL ) {
+		return NULL;
+	}
+
+	acc->num_pix_fs = num_pix_fs;
+	acc->num_pix_tot = num_pix_fs * num_pix_ss;
+	acc->visual_row = (int *)malloc(acc->num_pix_tot*sizeof(int));
+	acc->visual_col = (int *)malloc(acc->num_pix_tot*sizeof(int));
+	acc->hit_window = (char *)calloc(window_size, sizeof(char));
+	if ( acc->visual_row == NULL || acc->visual_col == NULL
+	  || acc->hit_window == NULL ) {
+		freePowderAccumulator(acc);
+		return NULL;
+	}
+
+	// The pixels that are not drawn inside the image are marked once, here, so
+	// that the peaks on them can be skipped without testing both coordinates
+	for ( pi=0 ; pi<acc->num_pix_tot ; pi++ ) {
+		if ( visual_pix_x[pi] < 0 || visual_pix_x[pi] >= img_nx
+		  || visual_pix_y[pi] < 0 || visual_pix_y[pi] >= img_ny ) {
+			acc->visual_row[pi] = -1;
+			acc->visual_col[pi] = -1;
+		} else {
+			acc->visual_row[pi] = visual_pix_y[pi];
+			acc->visual_col[pi] = visual_pix_x[pi];
+		}
+	}
+
+	acc->powder = powder;
+	acc->img_nx = img_nx;
+	acc->window_size = window_size;
+	acc->window_pos = 0;
+	acc->window_num_hits = 0;
+	acc->num_frames = 0;
+	acc->num_hits = 0;
+
+	return acc;
+}
+
+
+void freePowderAccumulator(tPowderAccumulator *acc)
+{
+	if ( acc == NULL ) {
+		return;
+	}
+	free(acc->visual_row);
+	free(acc->visual_col);
+	free(acc->hit_window);
+	free(acc);
+}
+
+
+// Adds one frame to the running hit rate. The window starts filled with non-hits, so
+// the hit rate only reaches its steady state after window_size frames
+void addPowderFrame(tPowderAccumulator *acc, int frame_is_hit)
+{
+	frame_is_hit = frame_is_hit != 0;
+
+	acc->window_num_hits += frame_is_hit - acc->hit_window[acc->window_pos];
+	acc->hit_window[acc->window_pos] = frame_is_hit;
+	acc->window_pos += 1;
+	if ( acc->window_pos == acc->window_size ) {
+		acc->window_pos = 0;
+	}
+	acc->num_frames += 1;
+	acc->num_hits += frame_is_hit;
+}
+
+
+// Fraction of hits among the last window_size frames
+double getPowderHitRate(const tPowderAccumulator *acc)
+{
+	return (double)acc->window_num_hits / acc->window_size;
+}
+
+
+// Adds the intensities of the peaks stored in a table with PF8_NUM_PEAK_FIELDS
+// columns to the powder image. Each peak is drawn on the powder pixel of the frame
+// pixel nearest to its position, and its intensity is truncated to an integer. If
+// peak_row and peak_col are not NULL, they receive the position of each peak in the
+// powder image, or -1 for the peaks that fall outside the frame or the image.
+// Returns the number of peaks that were added
+long addPowderPeaks(tPowderAccumulator *acc, const float *peak_table, long num_peaks,
+                    int *peak_row, int *peak_col)
+{
+	long pki;
+	long pi;
+	long num_added;
+	int row, col;
+	const float *peak;
+
+	num_added = 0;
+	for ( pki=0 ; pki<num_peaks ; pki++ ) {
+		peak = peak_table + pki * PF8_NUM_PEAK_FIELDS;
+		pi = (long)rintf(peak[PF8_PEAK_SS]) * acc->num_pix_fs
+		   + (long)rintf(peak[PF8_PEAK_FS]);
+
+		row = -1;
+		col = -1;
+		if ( pi >= 0 && pi < acc->num_pix_tot ) {
+			row = acc->visual_row[pi];
+			col = acc->visual_col[pi];
+		}
+		if ( row >= 0 ) {
+			acc->powder[row * acc->img_nx + col] += (int)peak[PF8_PEAK_INTENSITY];
+			num_added += 1;
+		}
+
+		if ( peak_row != NULL ) {
+			peak_row[pki] = row;
+		}
+		if ( peak_col != NULL ) {
+			peak_col[pki] = col;
+		}
+	}
+
+	return num_added;
+}
@@ -0,0 +1,514 @@
+// This file is part of OM.
+//
+// OM is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// OM is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with OnDA.
+// If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2020 -2021 SLAC National Accelerator Laboratory
+//
+// Based on OnDA - Copyright 2014-2019 Deutsches Elektronen-Synchrotron DESY,
+// a research centre of the Helmholtz Association.
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PF8_HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#define PF8_HAVE_NEON_KERNEL
+#include <arm_neon.h>
+#endif
+
+#include "peakfinder8.hh"
+#include "peakfinder8_radial_stats.hh"
+
+
+struct radial_order *allocate_radial_order(unsigned short *r_bin, int num_pix,
+                                           int num_rad_bins)
+{
+	struct radial_order *rorder;
+	int *next_position;
+	int pidx;
+	int ri;
+
+	rorder = (struct radial_order *)malloc(sizeof(struct radial_order));
+	if ( rorder == NULL ) {
+		return NULL;
+	}
+
+	rorder->bin_start = (int *)calloc(num_rad_bins + 1, sizeof(int));
+	if ( rorder->bin_start == NULL ) {
+		free(rorder);
+		return NULL;
+	}
+
+	rorder->position = (int *)malloc(num_pix*sizeof(int));
+	if ( rorder->position == NULL ) {
+		free(rorder->bin_start);
+		free(rorder);
+		return NULL;
+	}
+
+	rorder->values = (float *)malloc(num_pix*sizeof(float));
+	if ( rorder->values == NULL ) {
+		free(rorder->position);
+		free(rorder->bin_start);
+		free(rorder);
+		return NULL;
+	}
+
+	next_position = (int *)malloc(num_rad_bins*sizeof(int));
+	if ( next_position == NULL ) {
+		free(rorder->values);
+		free(rorder->position);
+		free(rorder->bin_start);
+		free(rorder);
+		return NULL;
+	}
+
+	// Counting sort. Pixels in the same bin keep their relative order, so that the
+	// sorted buffer is filled by as many sequential streams as there are bins
+	for ( pidx=0 ; pidx<num_pix ; pidx++ ) {
+		rorder->bin_start[r_bin[pidx] + 1] += 1;
+	}
+	for ( ri=0 ; ri<num_rad_bins ; ri++ ) {
+		rorder->bin_start[ri + 1] += rorder->bin_start[ri];
+		next_position[ri] = rorder->bin_start[ri];
+	}
+	for ( pidx=0 ; pidx<num_pix ; pidx++ ) {
+		rorder->position[pidx] = next_position[r_bin[pidx]];
+		next_position[r_bin[pidx]] += 1;
+	}
+	free(next_position);
+
+	rorder->max_bin_size = 0;
+	for ( ri=0 ; ri<num_rad_bins ; ri++ ) {
+		if ( rorder->bin_start[ri + 1] - rorder->bin_start[ri] > rorder->max_bin_size ) {
+			rorder->max_bin_size = rorder->bin_start[ri + 1] - rorder->bin_start[ri];
+		}
+	}
+
+	rorder->scratch = (float *)malloc((rorder->max_bin_size + 1)*sizeof(float));
+	if ( rorder->scratch == NULL ) {
+		free(rorder->values);
+		free(rorder->position);
+		free(rorder->bin_start);
+		free(rorder);
+		return NULL;
+	}
+
+	rorder->num_pix = num_pix;
+	rorder->num_rad_bins = num_rad_bins;
+
+	return rorder;
+}
+
+
+void free_radial_order(struct radial_order *rorder)
+{
+	free(rorder->bin_start);
+	free(rorder->position);
+	free(rorder->values);
+	free(rorder->scratch);
+	free(rorder);
+}
+
+
+template <typename T>
+static void fill_radial_order_typed(struct radial_order *rorder, const T *data,
+                                    char *mask)
+{
+	int pidx;
+	float masked_value;
+
+	// Masked pixels are stored as NaN: all ordered comparisons with a NaN are false,
+	// so they never fall between the thresholds of their bin
+	masked_value = NAN;
+
+	for ( pidx=0 ; pidx<rorder->num_pix ; pidx++ ) {
+		rorder->values[rorder->position[pidx]] = mask[pidx] != 0 ? (float)data[pidx] :
+		                                                       masked_value;
+	}
+}
+
+
+void fill_radial_order(struct radial_order *rorder, const float *data, char *mask)
+{
+	fill_radial_order_typed(rorder, data, mask);
+}
+
+
+void fill_radial_order(struct radial_order *rorder, const double *data, char *mask)
+{
+	fill_radial_order_typed(rorder, data, mask);
+}
+
+
+void fill_radial_order(struct radial_order *rorder, const unsigned short *data,
+                       char *mask)
+{
+	fill_radial_order_typed(rorder, data, mask);
+}
+
+
+void fill_radial_order(struct radial_order *rorder, const int *data, char *mask)
+{
+	fill_radial_order_typed(rorder, data, mask);
+}
+
+
+static void radial_sums_generic(const float *values, int num_values,
+                                float lthreshold, float rthreshold,
+                                double *sum, double *sum_sq, int *count)
+{
+	int i;
+	double value;
+
+	*sum = 0;
+	*sum_sq = 0;
+	*count = 0;
+
+	for ( i=0 ; i<num_values ; i++ ) {
+		if ( values[i] < rthreshold && values[i] > lthreshold ) {
+			value = values[i];
+			*sum += value;
+			*sum_sq += value * value;
+			*count += 1;
+		}
+	}
+}
+
+
+// Median and median absolute deviation of the unmasked values in a slice. The
+// values are copied into the scratch buffer, which must be able to hold all of them
+void radial_median_mad(const float *values, int num_values, float *scratch,
+                       double *median, double *mad, int *count)
+{
+	int i;
+	int num_valid;
+	float *middle;
+
+	num_valid = 0;
+	for ( i=0 ; i<num_values ; i++ ) {
+		if ( !std::isnan(values[i]) ) {
+			scratch[num_valid] = values[i];
+			num_valid += 1;
+		}
+	}
+
+	*count = num_valid;
+	if ( num_valid == 0 ) {
+		*median = 0;
+		*mad = 0;
+		return;
+	}
+
+	middle = scratch + num_valid / 2;
+	std::nth_element(scratch, middle, scratch + num_valid);
+	*median = *middle;
+
+	for ( i=0 ; i<num_valid ; i++ ) {
+		scratch[i] = fabs(scratch[i] - *median);
+	}
+	std::nth_element(scratch, middle, scratch + num_valid);
+	*mad = *middle;
+}
+
+
+static void seed_bitmap_row_generic(const float *data, const char *mask,
+                                    const unsigned short *r_bin,
+                                    const float *rthreshold, int num_pix,
+                                    unsigned long long *words)
+{
+	int i;
+
+	memset(words, 0, ((num_pix + 63) / 64) * sizeof(unsigned long long));
+	for ( i=0 ; i<num_pix ; i++ ) {
+		if ( data[i] > rthreshold[r_bin[i]] && mask[i] != 0 ) {
+			words[i >> 6] |= 1ULL << (i & 63);
+		}
+	}
+}
+
+
+#ifdef PF8_HAVE_X86_KERNELS
+
+// The thresholds are gathered 8 at a time. Groups of 8 pixels never straddle two
+// words, since each row starts at bit 0
+__attribute__((target("avx2")))
+static void seed_bitmap_row_avx2(const float *data, const char *mask,
+                                 const unsigned short *r_bin,
+                                 const float *rthreshold, int num_pix,
+                                 unsigned long long *words)
+{
+	__m128i zero;
+	unsigned int bits;
+	int i;
+
+	memset(words, 0, ((num_pix + 63) / 64) * sizeof(unsigned long long));
+	zero = _mm_setzero_si128();
+
+	for ( i=0 ; i+8<=num_pix ; i+=8 ) {
+		__m256 value, threshold;
+		__m256i bin;
+		__m128i masked;
+
+		value = _mm256_loadu_ps(data + i);
+		bin = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(r_bin + i)));
+		threshold = _mm256_i32gather_ps(rthreshold, bin, 4);
+		masked = _mm_cmpeq_epi8(_mm_loadl_epi64((const __m128i *)(mask + i)), zero);
+
+		bits = _mm256_movemask_ps(_mm256_cmp_ps(value, threshold, _CMP_GT_OQ))
+		     & ~_mm_movemask_epi8(masked) & 0xff;
+		words[i >> 6] |= (unsigned long long)bits << (i & 63);
+	}
+
+	for ( ; i<num_pix ; i++ ) {
+		if ( data[i] > rthreshold[r_bin[i]] && mask[i] != 0 ) {
+			words[i >> 6] |= 1ULL << (i & 63);
+		}
+	}
+}
+
+
+__attribute__((target("avx2")))
+static void radial_sums_avx2(const float *values, int num_values,
+                             float lthreshold, float rthreshold,
+                             double *sum, double *sum_sq, int *count)
+{
+	__m256 lth, rth;
+	__m256d sum_lo, sum_hi, sum_sq_lo, sum_sq_hi;
+	__m256i counts;
+	double partial[4];
+	int partial_count[8];
+	double tail_sum, tail_sum_sq;
+	int tail_count;
+	int i, j;
+
+	lth = _mm256_set1_ps(lthreshold);
+	rth = _mm256_set1_ps(rthreshold);
+	sum_lo = _mm256_setzero_pd();
+	sum_hi = _mm256_setzero_pd();
+	sum_sq_lo = _mm256_setzero_pd();
+	sum_sq_hi = _mm256_setzero_pd();
+	counts = _mm256_setzero_si256();
+
+	for ( i=0 ; i+8<=num_values ; i+=8 ) {
+		__m256 value, in_range;
+		__m256d value_lo, value_hi;
+
+		value = _mm256_loadu_ps(values + i);
+		in_range = _mm256_and_ps(_mm256_cmp_ps(value, rth, _CMP_LT_OQ),
+		                         _mm256_cmp_ps(value, lth, _CMP_GT_OQ));
+		value = _mm256_and_ps(value, in_range);
+
+		value_lo = _mm256_cvtps_pd(_mm256_castps256_ps128(value));
+		value_hi = _mm256_cvtps_pd(_mm256_extractf128_ps(value, 1));
+		sum_lo = _mm256_add_pd(sum_lo, value_lo);
+		sum_hi = _mm256_add_pd(sum_hi, value_hi);
+		sum_sq_lo = _mm256_add_pd(sum_sq_lo, _mm256_mul_pd(value_lo, value_lo));
+		sum_sq_hi = _mm256_add_pd(sum_sq_hi, _mm256_mul_pd(value_hi, value_hi));
+
+		// Lanes in range are all ones, i.e. -1
+		counts = _mm256_sub_epi32(counts, _mm256_castps_si256(in_range));
+	}
+
+	radial_sums_generic(values + i, num_values - i, lthreshold, rthreshold,
+	                    &tail_sum, &tail_sum_sq, &tail_count);
+
+	_mm256_storeu_pd(partial, _mm256_add_pd(sum_lo, sum_hi));
+	*sum = tail_sum + partial[0] + partial[1] + partial[2] + partial[3];
+	_mm256_storeu_pd(partial, _mm256_add_pd(sum_sq_lo, sum_sq_hi));
+	*sum_sq = tail_sum_sq + partial[0] + partial[1] + partial[2] + partial[3];
+	_mm256_storeu_si256((__m256i *)partial_count, counts);
+	*count = tail_count;
+	for ( j=0 ; j<8 ; j++ ) {
+		*count += partial_count[j];
+	}
+}
+
+
+// Adds the lanes in the same order as _mm512_reduce_add_pd, whose 256-bit extraction
+// GCC reports as reading an uninitialized pass-through operand
+__attribute__((target("avx512f")))
+static double reduce_add_pd_avx512(__m512d value)
+{
+	double lane[8];
+
+	_mm512_storeu_pd(lane, value);
+	return ((lane[0] + lane[4]) + (lane[2] + lane[6]))
+	     + ((lane[1] + lane[5]) + (lane[3] + lane[7]));
+}
+
+
+__attribute__((target("avx512f")))
+static void radial_sums_avx512(const float *values, int num_values,
+                               float lthreshold, float rthreshold,
+                               double *sum, double *sum_sq, int *count)
+{
+	__m512 lth, rth;
+	__m512d sum_lo, sum_hi, sum_sq_lo, sum_sq_hi;
+	double tail_sum, tail_sum_sq;
+	int tail_count;
+	int num_in_range;
+	int i;
+
+	lth = _mm512_set1_ps(lthreshold);
+	rth = _mm512_set1_ps(rthreshold);
+	sum_lo = _mm512_setzero_pd();
+	sum_hi = _mm512_setzero_pd();
+	sum_sq_lo = _mm512_setzero_pd();
+	sum_sq_hi = _mm512_setzero_pd();
+	num_in_range = 0;
+
+	for ( i=0 ; i+16<=num_values ; i+=16 ) {
+		__m512 value;
+		__m512d value_lo, value_hi;
+		__mmask16 in_range;
+
+		value = _mm512_loadu_ps(values + i);
+		in_range = _mm512_cmp_ps_mask(value, rth, _CMP_LT_OQ) &
+		           _mm512_cmp_ps_mask(value, lth, _CMP_GT_OQ);
+
+		// The two halves are loaded again rather than extracted from the full
+		// register, as the unmasked conversion and extraction intrinsics also
+		// leave their pass-through operand undefined
+		value_lo = _mm512_maskz_cvtps_pd((__mmask8)in_range,
+		                                 _mm256_loadu_ps(values + i));
+		value_hi = _mm512_maskz_cvtps_pd((__mmask8)(in_range >> 8),
+		                                 _mm256_loadu_ps(values + i + 8));
+		sum_lo = _mm512_add_pd(sum_lo, value_lo);
+		sum_hi = _mm512_add_pd(sum_hi, value_hi);
+		sum_sq_lo = _mm512_add_pd(sum_sq_lo, _mm512_mul_pd(value_lo, value_lo));
+		sum_sq_hi = _mm512_add_pd(sum_sq_hi, _mm512_mul_pd(value_hi, value_hi));
+
+		num_in_range += __builtin_popcount((unsigned int)in_range);
+	}
+
+	radial_sums_generic(values + i, num_values - i, lthreshold, rthreshold,
+	                    &tail_sum, &tail_sum_sq, &tail_count);
+
+	*sum = tail_sum + reduce_add_pd_avx512(_mm512_add_pd(sum_lo, sum_hi));
+	*sum_sq = tail_sum_sq + reduce_add_pd_avx512(_mm512_add_pd(sum_sq_lo, sum_sq_hi));
+	*count = tail_count + num_in_range;
+}
+
+#endif // PF8_HAVE_X86_KERNELS
+
+
+#ifdef PF8_HAVE_NEON_KERNEL
+
+static void radial_sums_neon(const float *values, int num_values,
+                             float lthreshold, float rthreshold,
+                             double *sum, double *sum_sq, int *count)
+{
+	float32x4_t lth, rth;
+	float64x2_t sum_lo, sum_hi, sum_sq_lo, sum_sq_hi;
+	uint32x4_t counts;
+	double tail_sum, tail_sum_sq;
+	int tail_count;
+	int i;
+
+	lth = vdupq_n_f32(lthreshold);
+	rth = vdupq_n_f32(rthreshold);
+	sum_lo = vdupq_n_f64(0);
+	sum_hi = vdupq_n_f64(0);
+	sum_sq_lo = vdupq_n_f64(0);
+	sum_sq_hi = vdupq_n_f64(0);
+	counts = vdupq_n_u32(0);
+
+	for ( i=0 ; i+4<=num_values ; i+=4 ) {
+		float32x4_t value;
+		float64x2_t value_lo, value_hi;
+		uint32x4_t in_range;
+
+		value = vld1q_f32(values + i);
+		in_range = vandq_u32(vcltq_f32(value, rth), vcgtq_f32(value, lth));
+		value = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(value),
+		                                        in_range));
+
+		value_lo = vcvt_f64_f32(vget_low_f32(value));
+		value_hi = vcvt_high_f64_f32(value);
+		sum_lo = vaddq_f64(sum_lo, value_lo);
+		sum_hi = vaddq_f64(sum_hi, value_hi);
+		sum_sq_lo = vaddq_f64(sum_sq_lo, vmulq_f64(value_lo, value_lo));
+		sum_sq_hi = vaddq_f64(sum_sq_hi, vmulq_f64(value_hi, value_hi));
+
+		counts = vsubq_u32(counts, in_range);
+	}
+
+	radial_sums_generic(values + i, num_values - i, lthreshold, rthreshold,
+	                    &tail_sum, &tail_sum_sq, &tail_count);
+
+	*sum = tail_sum + vaddvq_f64(vaddq_f64(sum_lo, sum_hi));
+	*sum_sq = tail_sum_sq + vaddvq_f64(vaddq_f64(sum_sq_lo, sum_sq_hi));
+	*count = tail_count + (int)vaddvq_u32(counts);
+}
+
+#endif // PF8_HAVE_NEON_KERNEL
+
+
+// Returns the fastest kernel supported by the CPU on which the code is running
+int detect_radial_stats_kernel(void)
+{
+#ifdef PF8_HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports("avx512f") ) {
+		return PF8_RADIAL_STATS_AVX512;
+	}
+	if ( __builtin_cpu_supports("avx2") ) {
+		return PF8_RADIAL_STATS_AVX2;
+	}
+#endif
+#ifdef PF8_HAVE_NEON_KERNEL
+	return PF8_RADIAL_STATS_NEON;
+#endif
+	return PF8_RADIAL_STATS_SORTED;
+}
+
+
+// Returns the fastest function supported by the CPU to build the seed bitmap
+seed_bitmap_row_function get_seed_bitmap_row_function(void)
+{
+#ifdef PF8_HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports("avx2") ) {
+		return seed_bitmap_row_avx2;
+	}
+#endif
+	return seed_bitmap_row_generic;
+}
+
+
+// Returns NULL for the scalar kernel, which does not use the sorted pixel order, and
+// for kernels that were not compiled in
+radial_sums_function get_radial_sums_function(int kernel)
+{
+	switch ( kernel ) {
+		case PF8_RADIAL_STATS_SORTED:
+			return radial_sums_generic;
+#ifdef PF8_HAVE_X86_KERNELS
+		case PF8_RADIAL_STATS_AVX2:
+			return radial_sums_avx2;
+		case PF8_RADIAL_STATS_AVX512:
+			return radial_sums_avx512;
+#endif
+#ifdef PF8_HAVE_NEON_KERNEL
+		case PF8_RADIAL_STATS_NEON:
+			return radial_sums_neon;
+#endif
+		default:
+			return NULL;
+	}
+}
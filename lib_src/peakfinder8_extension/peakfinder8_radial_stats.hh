@@ -0,0 +1,65 @@
+// This file is part of OM.
+//
+// OM is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// OM is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with OnDA.
+// If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2020 -2021 SLAC National Accelerator Laboratory
+//
+// Based on OnDA - Copyright 2014-2019 Deutsches Elektronen-Synchrotron DESY,
+// a research centre of the Helmholtz Association.
+#ifndef PEAKFINDER8_RADIAL_STATS_H
+#define PEAKFINDER8_RADIAL_STATS_H
+
+// Pixels of a frame grouped by radial bin. The grouping only depends on the radial
+// bin map, so it is computed once per geometry. The values of each frame are then
+// copied into the sorted buffer, where each bin occupies a contiguous slice.
+struct radial_order
+{
+	int *bin_start;			// First sorted position of each bin (num_rad_bins + 1)
+	int *position;			// Sorted position of each pixel
+	float *values;			// Frame values in sorted order (NaN if masked)
+	float *scratch;			// Room for the largest bin
+	int num_pix;
+	int num_rad_bins;
+	int max_bin_size;
+};
+
+// Sum, sum of squares and number of the values in a slice that lie strictly between
+// the two thresholds. The sums are always accumulated in double precision.
+typedef void (*radial_sums_function)(const float *values, int num_values,
+                                     float lthreshold, float rthreshold,
+                                     double *sum, double *sum_sq, int *count);
+
+struct radial_order *allocate_radial_order(unsigned short *r_bin, int num_pix,
+                                           int num_rad_bins);
+void free_radial_order(struct radial_order *rorder);
+// The frame values are always stored as float, whatever the type of the input data
+void fill_radial_order(struct radial_order *rorder, const float *data, char *mask);
+void fill_radial_order(struct radial_order *rorder, const double *data, char *mask);
+void fill_radial_order(struct radial_order *rorder, const unsigned short *data,
+                       char *mask);
+void fill_radial_order(struct radial_order *rorder, const int *data, char *mask);
+
+void radial_median_mad(const float *values, int num_values, float *scratch,
+                       double *median, double *mad, int *count);
+
+// Sets one bit for each unmasked pixel in a frame row whose value is above the
+// threshold of its radial bin. The row starts at bit 0 of the first word.
+typedef void (*seed_bitmap_row_function)(const float *data, const char *mask,
+                                         const unsigned short *r_bin,
+                                         const float *rthreshold, int num_pix,
+                                         unsigned long long *words);
+
+int detect_radial_stats_kernel(void);
+radial_sums_function get_radial_sums_function(int kernel);
+seed_bitmap_row_function get_seed_bitmap_row_function(void);
+
+#endif // PEAKFINDER8_RADIAL_STATS_H
@@ -0,0 +1,373 @@
+// This file is part of OM.
+//
+// OM is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// OM is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with OnDA.
+// If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2020 -2021 SLAC National Accelerator Laboratory
+//
+// Based on OnDA - Copyright 2014-2019 Deutsches Elektronen-Synchrotron DESY,
+// a research centre of the Helmholtz Association.
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "peakfinder8.hh"
+
+
+#define SHARED_CONSTANTS_VERSION 1
+#define SHARED_CONSTANTS_KEY_SIZE 256
+#define SHARED_CONSTANTS_ALIGNMENT 64
+
+
+// The header of a segment is followed by the table of its arrays, and then by the
+// arrays, each starting at a cache line boundary
+struct shared_constants_header
+{
+	char magic[8];
+	int version;
+	int ready;							// Set, last, by the process that fills it
+	long creator_pid;					// 0 until the header is written
+	long size;
+	int num_constants;
+	char key[SHARED_CONSTANTS_KEY_SIZE];
+};
+
+
+static const char shared_constants_magic[8] = { 'O', 'M', 'S', 'H', 'C', 'O', 'N',
+                                                'S' };
+
+
+// NUMA node of the CPU on which the calling thread runs, or 0 if it cannot be found.
+// The processes should be pinned to their CPUs, otherwise the node can change
+int currentNumaNode(void)
+{
+#ifdef SYS_getcpu
+	unsigned int cpu;
+	unsigned int node;
+
+	if ( syscall(SYS_getcpu, &cpu, &node, NULL) == 0 ) {
+		return (int)node;
+	}
+#endif
+	return 0;
+}
+
+
+// Name of the segment that stores the arrays of a key: a hash of the key, which is
+// also stored in the segment and compared on opening
+static void segment_name(const char *key, int numa_node, char *name)
+{
+	unsigned long long hash;
+	const char *ch;
+
+	// FNV-1a
+	hash = 14695981039346656037ULL;
+	for ( ch=key ; *ch!='\0' ; ch++ ) {
+		hash ^= (unsigned char)*ch;
+		hash *= 1099511628211ULL;
+	}
+
+	if ( numa_node < 0 ) {
+		sprintf(name, "/om-%016llx", hash);
+	} else {
+		sprintf(name, "/om-%016llx-n%d", hash, numa_node);
+	}
+}
+
+
+static double elapsed_seconds(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - start->tv_sec)
+	       + (double)(now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+
+// Creates an empty segment, with only its header. Returns 1 if the segment already
+// exists, and -1 if it cannot be created
+static int create_segment(tSharedConstants *store, const char *key)
+{
+	struct shared_constants_header *header;
+	int fd;
+
+	fd = shm_open(store->shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if ( fd < 0 ) {
+		return errno == EEXIST ? 1 : -1;
+	}
+	if ( ftruncate(fd, sizeof(struct shared_constants_header)) != 0 ) {
+		close(fd);
+		shm_unlink(store->shm_name);
+		return -1;
+	}
+	header = (struct shared_constants_header *)mmap(
+		NULL, sizeof(struct shared_constants_header), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0
+	);
+	if ( header == MAP_FAILED ) {
+		close(fd);
+		shm_unlink(store->shm_name);
+		return -1;
+	}
+
+	memcpy(header->magic, shared_constants_magic, sizeof(header->magic));
+	header->version = SHARED_CONSTANTS_VERSION;
+	header->size = sizeof(struct shared_constants_header);
+	header->num_constants = 0;
+	strcpy(header->key, key);
+	__atomic_store_n(&header->creator_pid, (long)getpid(), __ATOMIC_RELEASE);
+
+	store->fd = fd;
+	store->map = (char *)header;
+	store->map_size = sizeof(struct shared_constants_header);
+	store->created = 1;
+
+	return 0;
+}
+
+
+// Maps a segment created by another process. Returns 1 if the segment is not filled
+// yet, 2 if it was left behind by a process that no longer exists, and -1 if it
+// cannot be used
+static int attach_segment(tSharedConstants *store, const char *key)
+{
+	const struct shared_constants_header *header;
+	struct stat segment_stat;
+	long creator_pid;
+	long size;
+	char *map;
+	int ready;
+	int fd;
+
+	fd = shm_open(store->shm_name, O_RDONLY, 0);
+	if ( fd < 0 ) {
+		// Removed after the creation failed: it can be created again
+		return errno == ENOENT ? 1 : -1;
+	}
+	if ( fstat(fd, &segment_stat) != 0 ) {
+		close(fd);
+		return -1;
+	}
+	if ( segment_stat.st_size < (off_t)sizeof(struct shared_constants_header) ) {
+		close(fd);
+		return 1;
+	}
+
+	header = (const struct shared_constants_header *)mmap(
+		NULL, sizeof(struct shared_constants_header), PROT_READ, MAP_SHARED, fd, 0
+	);
+	if ( header == MAP_FAILED ) {
+		close(fd);
+		return -1;
+	}
+	creator_pid = __atomic_load_n(&header->creator_pid, __ATOMIC_ACQUIRE);
+	ready = __atomic_load_n(&header->ready, __ATOMIC_ACQUIRE);
+	size = header->size;
+	if ( creator_pid != 0 && kill((pid_t)creator_pid, 0) != 0 && errno == ESRCH ) {
+		munmap((void *)header, sizeof(struct shared_constants_header));
+		close(fd);
+		return 2;
+	}
+	if ( creator_pid == 0 || ready == 0 ) {
+		munmap((void *)header, sizeof(struct shared_constants_header));
+		close(fd);
+		return 1;
+	}
+	if ( memcmp(header->magic, shared_constants_magic, sizeof(header->magic)) != 0
+	  || header->version != SHARED_CONSTANTS_VERSION
+	  || strncmp(header->key, key, SHARED_CONSTANTS_KEY_SIZE) != 0
+	  || size != (long)segment_stat.st_size ) {
+		munmap((void *)header, sizeof(struct shared_constants_header));
+		close(fd);
+		return -1;
+	}
+	munmap((void *)header, sizeof(struct shared_constants_header));
+
+	map = (char *)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED ) {
+		return -1;
+	}
+
+	header = (const struct shared_constants_header *)map;
+	store->map = map;
+	store->map_size = size;
+	store->created = 0;
+	store->num_constants = header->num_constants;
+	store->constants = (const tSharedConstant *)(map +
+	                                             sizeof(struct shared_constants_header));
+
+	return 0;
+}
+
+
+// Opens the shared segment that stores the arrays of a key, of up to 255 characters.
+// If numa_local is not 0, each NUMA node has its own copy of the segment. If the
+// segment does not exist, it is created, empty, and the calling process must fill
+// it with fillSharedConstants. Otherwise, the arrays stored by the process that
+// created it are mapped read-only, waiting up to timeout seconds for them to be
+// stored. A segment left behind by a process that no longer exists is replaced.
+// Returns NULL if the segment cannot be created or mapped, or if it was not filled in
+// time
+tSharedConstants *openSharedConstants(const char *key, int numa_local, double timeout)
+{
+	tSharedConstants *store;
+	struct timespec start;
+	struct timespec pause;
+	int ret;
+
+	if ( strlen(key) >= SHARED_CONSTANTS_KEY_SIZE ) {
+		return NULL;
+	}
+
+	store = (tSharedConstants *)malloc(sizeof(tSharedConstants));
+	if ( store == NULL ) {
+		return NULL;
+	}
+	store->map = NULL;
+	store->map_size = 0;
+	store->created = 0;
+	store->numa_node = numa_local ? currentNumaNode() : -1;
+	store->num_constants = 0;
+	store->constants = NULL;
+	store->fd = -1;
+	segment_name(key, store->numa_node, store->shm_name);
+
+	pause.tv_sec = 0;
+	pause.tv_nsec = 10000000;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ( 1 ) {
+		ret = create_segment(store, key);
+		if ( ret == 0 ) {
+			return store;
+		}
+		if ( ret == 1 ) {
+			ret = attach_segment(store, key);
+			if ( ret == 0 ) {
+				return store;
+			}
+			if ( ret == 2 ) {
+				shm_unlink(store->shm_name);
+				continue;
+			}
+		}
+		if ( ret < 0 || elapsed_seconds(&start) > timeout ) {
+			free(store);
+			return NULL;
+		}
+		nanosleep(&pause, NULL);
+	}
+}
+
+
+// Stores arrays in a segment created by openSharedConstants, and makes them
+// available to the other processes. The arrays are written by the calling process,
+// so, with the default memory policy, their pages are allocated on its NUMA node.
+// The offsets and sizes of the constants are computed here, from their shapes. On
+// return, the segment is mapped read-only. Returns 1 if the segment was not created
+// by the calling process, or if the arrays cannot be stored: the segment is then
+// removed, so that another process can create it again
+int fillSharedConstants(tSharedConstants *store, const tSharedConstant *constants,
+                        int num_constants, const void *const *data)
+{
+	struct shared_constants_header *header;
+	tSharedConstant *table;
+	long offset;
+	char *map;
+	int ci;
+
+	if ( !store->created || store->constants != NULL || num_constants < 0 ) {
+		return 1;
+	}
+
+	offset = sizeof(struct shared_constants_header)
+	         + num_constants * sizeof(tSharedConstant);
+	for ( ci=0 ; ci<num_constants ; ci++ ) {
+		if ( constants[ci].size < 0 ) {
+			return 1;
+		}
+		offset = (offset + SHARED_CONSTANTS_ALIGNMENT - 1) / SHARED_CONSTANTS_ALIGNMENT
+		         * SHARED_CONSTANTS_ALIGNMENT;
+		offset += constants[ci].size;
+	}
+
+	munmap(store->map, store->map_size);
+	store->map = NULL;
+	if ( ftruncate(store->fd, offset) != 0 ) {
+		shm_unlink(store->shm_name);
+		store->created = 0;
+		return 1;
+	}
+	map = (char *)mmap(NULL, offset, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd,
+	                   0);
+	if ( map == MAP_FAILED ) {
+		shm_unlink(store->shm_name);
+		store->created = 0;
+		return 1;
+	}
+	store->map = map;
+	store->map_size = offset;
+
+	header = (struct shared_constants_header *)map;
+	table = (tSharedConstant *)(map + sizeof(struct shared_constants_header));
+	offset = sizeof(struct shared_constants_header)
+	         + num_constants * sizeof(tSharedConstant);
+	for ( ci=0 ; ci<num_constants ; ci++ ) {
+		offset = (offset + SHARED_CONSTANTS_ALIGNMENT - 1) / SHARED_CONSTANTS_ALIGNMENT
+		         * SHARED_CONSTANTS_ALIGNMENT;
+		table[ci] = constants[ci];
+		table[ci].offset = offset;
+		memcpy(map + offset, data[ci], constants[ci].size);
+		offset += constants[ci].size;
+	}
+	header->size = store->map_size;
+	header->num_constants = num_constants;
+	__atomic_store_n(&header->ready, 1, __ATOMIC_RELEASE);
+
+	// The segment is never written again
+	mprotect(map, store->map_size, PROT_READ);
+	close(store->fd);
+	store->fd = -1;
+	store->num_constants = num_constants;
+	store->constants = table;
+
+	return 0;
+}
+
+
+// Unmaps a segment. The process that created the segment also removes its name, so
+// that the memory is freed when the last process that uses it unmaps it, and the
+// following processes create it again
+void closeSharedConstants(tSharedConstants *store)
+{
+	if ( store == NULL ) {
+		return;
+	}
+	if ( store->map != NULL ) {
+		munmap(store->map, store->map_size);
+	}
+	if ( store->fd >= 0 ) {
+		close(store->fd);
+	}
+	if ( store->created ) {
+		shm_unlink(store->shm_name);
+	}
+	free(store);
+}
@@ -0,0 +1,286 @@
+// This file is part of OM.
+//
+// OM is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// OM is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with OnDA.
+// If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2020 -2021 SLAC National Accelerator Laboratory
+//
+// Based on OnDA - Copyright 2014-2019 Deutsches Elektronen-Synchrotron DESY,
+// a research centre of the Helmholtz Association.
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "peakfinder8.hh"
+
+
+// An encoded frame starts with this header. It is followed by the background, one
+// int16 value for each bin_size x bin_size block of pixels, in row-major order, then
+// by the indexes (int32) and by the values (float32) of the pixels stored at full
+// precision. All values are stored in the byte order of the encoding machine
+struct sparse_frame_header
+{
+	char magic[4];
+	int version;
+	int num_pix_ss;
+	int num_pix_fs;
+	int bin_size;
+	int num_full_pixels;
+	float step;					// Background quantization step
+	int reserved;
+};
+
+static const char sparse_frame_magic[4] = { 'P', 'F', '8', 'S' };
+
+
+static long num_blocks(long num_pix, int bin_size)
+{
+	return (num_pix + bin_size - 1) / bin_size;
+}
+
+
+// Size of the background section, rounded up so that the pixel indexes that follow
+// it are aligned
+static long background_size(long num_pix_ss, long num_pix_fs, int bin_size)
+{
+	long size;
+
+	size = num_blocks(num_pix_ss, bin_size) * num_blocks(num_pix_fs, bin_size)
+	       * sizeof(short);
+	return (size + 3) / 4 * 4;
+}
+
+
+// Largest size of a frame encoded with encodeSparseFrame, in bytes
+long sparseFrameMaxSize(long num_pix_ss, long num_pix_fs, int bin_size,
+                        long num_peaks, int peak_radius)
+{
+	long max_full_pixels;
+	long box_size;
+
+	if ( bin_size < 1 || peak_radius < 0 ) {
+		return -1;
+	}
+
+	box_size = 2 * peak_radius + 1;
+	max_full_pixels = num_peaks * box_size * box_size;
+	if ( max_full_pixels > num_pix_ss * num_pix_fs ) {
+		max_full_pixels = num_pix_ss * num_pix_fs;
+	}
+
+	return sizeof(struct sparse_frame_header)
+	       + background_size(num_pix_ss, num_pix_fs, bin_size)
+	       + max_full_pixels * (sizeof(int) + sizeof(float));
+}
+
+
+static short quantize(double value, float step)
+{
+	double q;
+
+	if ( value != value ) {
+		return 0;
+	}
+	q = rint(value / step);
+	if ( q > 32767 ) {
+		return 32767;
+	}
+	if ( q < -32768 ) {
+		return -32768;
+	}
+	return (short)q;
+}
+
+
+// Encodes a frame, keeping the pixels within peak_radius pixels (along each axis) of
+// each peak in the peak table at full precision. Peaks with a position that is not
+// finite, or whose box does not overlap the frame, are skipped. The rest of the frame
+// is averaged over blocks of bin_size x bin_size pixels and quantized with the given
+// step. The output buffer must have room for sparseFrameMaxSize bytes. Returns the
+// size of the encoded frame, or -1 if the parameters are not valid or the memory
+// cannot be allocated
+long encodeSparseFrame(const float *data, long num_pix_ss, long num_pix_fs,
+                       const float *peak_table, long num_peaks, int peak_radius,
+                       float step, int bin_size, unsigned char *out)
+{
+	struct sparse_frame_header header;
+	short *background;
+	int *full_index;
+	float *full_value;
+	char *is_full;
+	long blocks_fs, blocks_ss;
+	long bss, bfs;
+	long ss, fs, ss_first, ss_last, fs_first, fs_last;
+	long pki, pi;
+	float peak_ss, peak_fs;
+	long num_full;
+	int count;
+	double sum;
+
+	if ( bin_size < 1 || peak_radius < 0 || !(step > 0) ) {
+		return -1;
+	}
+
+	is_full = (char *)calloc(num_pix_ss * num_pix_fs, sizeof(char));
+	if ( is_full == NULL && num_pix_ss * num_pix_fs > 0 ) {
+		return -1;
+	}
+
+	memcpy(header.magic, sparse_frame_magic, 4);
+	header.version = 1;
+	header.num_pix_ss = num_pix_ss;
+	header.num_pix_fs = num_pix_fs;
+	header.bin_size = bin_size;
+	header.step = step;
+	header.reserved = 0;
+
+	background = (short *)(out + sizeof(struct sparse_frame_header));
+	full_index = (int *)(out + sizeof(struct sparse_frame_header)
+	                     + background_size(num_pix_ss, num_pix_fs, bin_size));
+
+	// The boxes of nearby peaks overlap, so each pixel is only listed once
+	num_full = 0;
+	for ( pki=0 ; pki<num_peaks ; pki++ ) {
+
+		// The position is checked before it is converted, since the peak table can
+		// come from the caller, and converting a value that does not fit in a long
+		// is undefined
+		peak_ss = peak_table[pki * PF8_NUM_PEAK_FIELDS + PF8_PEAK_SS];
+		peak_fs = peak_table[pki * PF8_NUM_PEAK_FIELDS + PF8_PEAK_FS];
+		if ( !std::isfinite(peak_ss) || !std::isfinite(peak_fs)
+		  || peak_ss < -peak_radius - 1 || peak_ss > num_pix_ss + peak_radius
+		  || peak_fs < -peak_radius - 1 || peak_fs > num_pix_fs + peak_radius ) {
+			continue;
+		}
+		ss = (long)rintf(peak_ss);
+		fs = (long)rintf(peak_fs);
+		ss_first = ss - peak_radius < 0 ? 0 : ss - peak_radius;
+		ss_last = ss + peak_radius >= num_pix_ss ? num_pix_ss - 1 : ss + peak_radius;
+		fs_first = fs - peak_radius < 0 ? 0 : fs - peak_radius;
+		fs_last = fs + peak_radius >= num_pix_fs ? num_pix_fs - 1 : fs + peak_radius;
+		for ( ss=ss_first ; ss<=ss_last ; ss++ ) {
+			for ( fs=fs_first ; fs<=fs_last ; fs++ ) {
+				pi = ss * num_pix_fs + fs;
+				if ( !is_full[pi] ) {
+					is_full[pi] = 1;
+					full_index[num_full] = pi;
+					num_full += 1;
+				}
+			}
+		}
+	}
+	header.num_full_pixels = num_full;
+
+	full_value = (float *)(full_index + num_full);
+	for ( pi=0 ; pi<num_full ; pi++ ) {
+		full_value[pi] = data[full_index[pi]];
+	}
+
+	// The pixels stored at full precision are left out of the block averages, so
+	// that a bright peak does not raise the background around it
+	blocks_ss = num_blocks(num_pix_ss, bin_size);
+	blocks_fs = num_blocks(num_pix_fs, bin_size);
+	for ( bss=0 ; bss<blocks_ss ; bss++ ) {
+		for ( bfs=0 ; bfs<blocks_fs ; bfs++ ) {
+			sum = 0;
+			count = 0;
+			for ( ss=bss*bin_size ; ss<(bss+1)*bin_size && ss<num_pix_ss ; ss++ ) {
+				for ( fs=bfs*bin_size ; fs<(bfs+1)*bin_size && fs<num_pix_fs ; fs++ ) {
+					pi = ss * num_pix_fs + fs;
+					if ( !is_full[pi] ) {
+						sum += data[pi];
+						count += 1;
+					}
+				}
+			}
+			background[bss * blocks_fs + bfs] = count > 0 ?
+			                                    quantize(sum / count, step) : 0;
+		}
+	}
+
+	memcpy(out, &header, sizeof(struct sparse_frame_header));
+	free(is_full);
+
+	return (unsigned char *)(full_value + num_full) - out;
+}
+
+
+// Reads the shape of an encoded frame. Returns 1 if the buffer does not store an
+// encoded frame
+int sparseFrameShape(const unsigned char *buffer, long size, long *num_pix_ss,
+                     long *num_pix_fs)
+{
+	struct sparse_frame_header header;
+
+	if ( size < (long)sizeof(struct sparse_frame_header) ) {
+		return 1;
+	}
+	memcpy(&header, buffer, sizeof(struct sparse_frame_header));
+	if ( memcmp(header.magic, sparse_frame_magic, 4) != 0 || header.version != 1
+	  || header.bin_size < 1 || header.num_pix_ss < 0 || header.num_pix_fs < 0
+	  || header.num_full_pixels < 0 ) {
+		return 1;
+	}
+	if ( size < (long)sizeof(struct sparse_frame_header)
+	            + background_size(header.num_pix_ss, header.num_pix_fs,
+	                              header.bin_size)
+	            + (long)header.num_full_pixels * (long)(sizeof(int) + sizeof(float)) ) {
+		return 1;
+	}
+
+	*num_pix_ss = header.num_pix_ss;
+	*num_pix_fs = header.num_pix_fs;
+	return 0;
+}
+
+
+// Decodes a frame encoded with encodeSparseFrame into a float buffer with the shape
+// returned by sparseFrameShape. Returns 1 if the buffer does not store a valid
+// encoded frame
+int decodeSparseFrame(const unsigned char *buffer, long size, float *data)
+{
+	struct sparse_frame_header header;
+	const short *background;
+	const int *full_index;
+	const float *full_value;
+	long num_pix_ss, num_pix_fs;
+	long blocks_fs;
+	long ss, fs, pi;
+	const short *row;
+
+	if ( sparseFrameShape(buffer, size, &num_pix_ss, &num_pix_fs) != 0 ) {
+		return 1;
+	}
+	memcpy(&header, buffer, sizeof(struct sparse_frame_header));
+
+	background = (const short *)(buffer + sizeof(struct sparse_frame_header));
+	full_index = (const int *)(buffer + sizeof(struct sparse_frame_header)
+	                           + background_size(num_pix_ss, num_pix_fs,
+	                                             header.bin_size));
+	full_value = (const float *)(full_index + header.num_full_pixels);
+
+	blocks_fs = num_blocks(num_pix_fs, header.bin_size);
+	for ( ss=0 ; ss<num_pix_ss ; ss++ ) {
+		row = background + (ss / header.bin_size) * blocks_fs;
+		for ( fs=0 ; fs<num_pix_fs ; fs++ ) {
+			data[ss * num_pix_fs + fs] = row[fs / header.bin_size] * header.step;
+		}
+	}
+
+	for ( pi=0 ; pi<header.num_full_pixels ; pi++ ) {
+		if ( full_index[pi] < 0 || full_index[pi] >= num_pix_ss * num_pix_fs ) {
+			return 1;
+		}
+		data[full_index[pi]] = full_value[pi];
+	}
+
+	return 0;
+}
@@ -22,38 +22,84 @@ setup.py file for OM
 import os
 
 import numpy
+from Cython.Build import cythonize
 from setuptools import Extension, find_packages, setup
+from setuptools.command.build_ext import build_ext
 
-OM_USE_CYTHON = os.getenv("OM_USE_CYTHON")
+# The GPU backend of peakfinder8 is built with OM_USE_CUDA=1 (NVIDIA GPUs) or
+# OM_USE_HIP=1 (AMD GPUs). Otherwise, the extension only supports the CPU.
+OM_USE_CUDA = os.getenv("OM_USE_CUDA")
+OM_USE_HIP = os.getenv("OM_USE_HIP")
 
-if OM_USE_CYTHON:
-    ext = ".pyx"
+gpu_include_dirs = []
+gpu_library_dirs = []
+gpu_libraries = []
+if OM_USE_HIP:
+    gpu_home = os.getenv("ROCM_PATH", "/opt/rocm")
+    gpu_compiler = [os.path.join(gpu_home, "bin", "hipcc"), "-x", "hip", "-fPIC"]
+    gpu_libraries = ["amdhip64"]
+elif OM_USE_CUDA:
+    gpu_home = os.getenv("CUDA_HOME", "/usr/local/cuda")
+    gpu_compiler = [os.path.join(gpu_home, "bin", "nvcc"), "-Xcompiler", "-fPIC"]
+    gpu_libraries = ["cudart"]
+if OM_USE_HIP or OM_USE_CUDA:
+    gpu_include_dirs = [os.path.join(gpu_home, "include")]
+    gpu_library_dirs = [os.path.join(gpu_home, "lib64"), os.path.join(gpu_home, "lib")]
+    gpu_sources = ["lib_src/peakfinder8_extension/peakfinder8_gpu.cu"]
 else:
-    ext = ".c"
+    gpu_sources = ["lib_src/peakfinder8_extension/peakfinder8_gpu.cpp"]
+
+
+class BuildExtWithGpu(build_ext):
+    """
+    Compiles the .cu sources with the GPU compiler, and all other sources as usual.
+    """
+
+    def build_extensions(self):
+        self.compiler.src_extensions.append(".cu")
+        default_compile = self.compiler._compile
+
+        def _compile(obj, src, ext, cc_args, extra_postargs, pp_opts):
+            if os.path.splitext(src)[1] == ".cu":
+                self.spawn(
+                    gpu_compiler
+                    + ["-O3", "-std=c++11", "-c", src, "-o", obj]
+                    + pp_opts
+                    + os.getenv("OM_GPU_FLAGS", "").split()
+                )
+            else:
+                default_compile(obj, src, ext, cc_args, extra_postargs, pp_opts)
+
+        self.compiler._compile = _compile
+        super().build_extensions()
+
 
 peakfinder8_ext = Extension(
     name="om.lib.peakfinder8_extension",
-    include_dirs=[numpy.get_include()],
-    libraries=["stdc++"],
+    include_dirs=[numpy.get_include()] + gpu_include_dirs,
+    library_dirs=gpu_library_dirs,
+    libraries=["stdc++", "pthread", "rt"] + gpu_libraries,
     sources=[
         "lib_src/peakfinder8_extension/peakfinder8.cpp",
+        "lib_src/peakfinder8_extension/peakfinder8_radial_stats.cpp",
+        "lib_src/peakfinder8_extension/peakfinder8_batch.cpp",
+        "lib_src/peakfinder8_extension/peakfinder8_calibration.cpp",
+        "lib_src/peakfinder8_extension/peakfinder8_powder.cpp",
+        "lib_src/peakfinder8_extension/peakfinder8_sparse_frame.cpp",
+        "lib_src/peakfinder8_extension/peakfinder8_pipeline.cpp",
+        "lib_src/peakfinder8_extension/peakfinder8_file_reader.cpp",
+        "lib_src/peakfinder8_extension/peakfinder8_pixel_maps.cpp",
+        "lib_src/peakfinder8_extension/peakfinder8_shared_constants.cpp",
         "lib_src/peakfinder8_extension/peakfinder8_extension.pyx",
     ]
-    if OM_USE_CYTHON
-    else [
-        "lib_src/peakfinder8_extension/peakfinder8_extension.cpp",
-        "lib_src/peakfinder8_extension/peakfinder8.cpp",
-    ],
+    + gpu_sources,
     language="c++",
 )
 peakfinder8_ext.cython_directives = {"embedsignature": True}
 
-if OM_USE_CYTHON:
-    from Cython.Build import cythonize
-
-    extensions = cythonize(peakfinder8_ext)
-else:
-    extensions = [peakfinder8_ext]
+# The extension module is always generated from the .pyx file, so that it matches
+# the native sources it is compiled with
+extensions = cythonize(peakfinder8_ext)
 
 version_fh = open("src/om/__init__.py", "r")
 version = version_fh.readlines()[-1].split("=")[1].strip().split('"')[1]
@@ -130,6 +176,7 @@ setup(
         ],
     },
     ext_modules=extensions,
+    cmdclass={"build_ext": BuildExtWithGpu},
     packages=find_packages(where="src"),
     package_dir={"": "src"},
     include_package_data=True,
@@ -21,11 +21,14 @@ Algorithms for detector calibration.
 This module contains algorithms that can be used to calibrate raw detector data. Each
 algorithm deals with a specific detector.
 """
-from typing import Any, BinaryIO, List
+from typing import Any, BinaryIO, Dict, List
 
 import h5py  # type: ignore
 import numpy  # type: ignore
 
+from om.algorithms.generic import load_shared_constants, shared_constants_key
+from om.lib.peakfinder8_extension import jungfrau_calibrate  # type: ignore
+
 
 class Jungfrau1MCalibration:
     """
@@ -37,6 +40,7 @@ class Jungfrau1MCalibration:
         dark_filenames: List[str],
         gain_filenames: List[str],
         photon_energy_kev: float,
+        shared_constants: str = "none",
     ) -> None:
         """
         Calibration of the Jungfrau 1M detector.
@@ -53,14 +57,41 @@ class Jungfrau1MCalibration:
                 gain data for the calibration of the detector.
 
             photon_energy_kev: the photon energy at which the detector will be operated.
+
+            shared_constants: How the dark data and the gain maps are shared between
+                the processes of a machine. One of 'none', 'node' or 'numa' (see the
+                documentation of the [load_shared_constants]
+                [om.algorithms.generic.load_shared_constants] function). Defaults to
+                'none'.
         """
+        # TODO: Energy should be in eV
+        self._photon_energy_kev: float = photon_energy_kev
+
+        constants: Dict[str, numpy.ndarray] = load_shared_constants(
+            shared_constants_key(
+                "jungfrau1m",
+                dark_filenames + gain_filenames,
+                len(dark_filenames),
+                photon_energy_kev,
+            ),
+            lambda: self._load_dark_and_gain(dark_filenames, gain_filenames),
+            shared_constants,
+        )
+        self._dark: numpy.ndarray = constants["dark"]
+        self._gain: numpy.ndarray = constants["gain"]
+
+    def _load_dark_and_gain(
+        self, dark_filenames: List[str], gain_filenames: List[str]
+    ) -> Dict[str, numpy.ndarray]:
+        # Reads the dark data and the gain maps of the three gain stages of all the
+        # panels.
         # 2 for Jungfrau 1M
         num_panels: int = len(dark_filenames)
 
-        self._dark: numpy.ndarray = numpy.ndarray(
+        dark: numpy.ndarray = numpy.ndarray(
             (3, 512 * num_panels, 1024), dtype=numpy.float32
         )
-        self._gain: numpy.ndarray = numpy.ndarray(
+        gain_map: numpy.ndarray = numpy.ndarray(
             (3, 512 * num_panels, 1024), dtype=numpy.float64
         )
         panel_id: int
@@ -69,10 +100,10 @@ class Jungfrau1MCalibration:
             dark_file: Any = h5py.File(dark_filenames[panel_id], "r")
             gain: int
             for gain in range(3):
-                self._dark[gain, 512 * panel_id : 512 * (panel_id + 1), :] = dark_file[
+                dark[gain, 512 * panel_id : 512 * (panel_id + 1), :] = dark_file[
                     "gain%d" % gain
                 ][:]
-                self._gain[
+                gain_map[
                     gain, 512 * panel_id : 512 * (panel_id + 1), :
                 ] = numpy.fromfile(
                     gain_file, dtype=numpy.float64, count=1024 * 512
@@ -82,8 +113,11 @@ class Jungfrau1MCalibration:
             gain_file.close()
             dark_file.close()
 
-        # TODO: Energy should be in eV
-        self._photon_energy_kev: float = photon_energy_kev
+        # The gain is multiplied by the photon energy only once, here, instead of for
+        # each frame.
+        gain_map *= self._photon_energy_kev
+
+        return {"dark": dark, "gain": gain_map}
 
     def apply_calibration(self, data: numpy.ndarray) -> numpy.ndarray:
         """
@@ -100,19 +134,52 @@ class Jungfrau1MCalibration:
 
             The corrected data frame.
         """
-        corrected_data: numpy.ndarray = data.astype(numpy.float32)
-
-        where_gain: List[numpy.ndarray] = [
-            numpy.where(data & 2 ** 14 == 0),
-            numpy.where((data & (2 ** 14) > 0) & (data & 2 ** 15 == 0)),
-            numpy.where(data & 2 ** 15 > 0),
-        ]
-
-        gain: int
-        for gain in range(3):
-            corrected_data[where_gain[gain]] -= self._dark[gain][where_gain[gain]]
-            corrected_data[where_gain[gain]] /= (
-                self._gain[gain][where_gain[gain]] * self._photon_energy_kev
+        # The gain stages are decoded, and the corrections applied, in a single pass
+        # over the frame.
+        return jungfrau_calibrate(
+            numpy.ascontiguousarray(data, dtype=numpy.uint16), self._dark, self._gain
+        )
+
+    def apply_calibration_to_panels(self, panels: List[numpy.ndarray]) -> numpy.ndarray:
+        """
+        Applies the calibration to a detector data frame stored in separate panels.
+
+        This function behaves like the [apply_calibration]
+        [om.algorithms.calibration.Jungfrau1MCalibration.apply_calibration] function,
+        but takes the panels of the frame, in order, as separate arrays. Each panel is
+        calibrated straight into its rows of the corrected frame, so the raw panels
+        are not joined into a single frame first.
+
+        Arguments:
+
+            panels: The raw data of the panels of the detector data frame, in the
+                order in which they are stacked along the slow scan axis.
+
+        Returns:
+
+            The corrected data frame.
+
+        Raises:
+
+            RuntimeError: A RuntimeError is raised if the panels do not cover the whole
+                detector data frame.
+        """
+        calibrated_data: numpy.ndarray = numpy.empty(
+            self._dark.shape[1:], dtype=numpy.float32
+        )
+        first_row: int = 0
+        panel: numpy.ndarray
+        for panel in panels:
+            last_row: int = first_row + panel.shape[0]
+            jungfrau_calibrate(
+                numpy.ascontiguousarray(panel, dtype=numpy.uint16),
+                self._dark,
+                self._gain,
+                first_row=first_row,
+                out=calibrated_data[first_row:last_row],
             )
+            first_row = last_row
+        if first_row != calibrated_data.shape[0]:
+            raise RuntimeError("The panels do not cover the whole detector data frame.")
 
-        return corrected_data
+        return calibrated_data
@@ -22,12 +22,23 @@ This module contains algorithms that perform crystallography-related data proces
 (peak finding, etc.). In addition, it also contains several typed dictionaries that
 store data needed or produced by these algorithms.
 """
-from typing import List, Tuple, Union
+import zlib
+from typing import Any, Dict, List, Tuple, Union
 
 import numpy  # type: ignore
 from mypy_extensions import TypedDict
 
-from om.lib.peakfinder8_extension import peakfinder_8  # type: ignore
+from om.lib.peakfinder8_extension import (  # type: ignore
+    Peakfinder8Context,
+    Peakfinder8Pipeline,
+    PixelMapCache,
+    PowderAccumulator,
+    decode_sparse_frame,
+    encode_sparse_frame,
+    fill_peak_resolution,
+    peak_list_dtype,
+)
+from om.utils import exceptions
 
 
 class TypePeakfinder8Info(TypedDict, total=True):
@@ -102,7 +113,11 @@ def get_peakfinder8_info(detector_type: str) -> TypePeakfinder8Info:
 
     This function retrieves, for a supported detector type, the data layout information
     required by the [Peakfinder8PeakDetection]
-    [om.algorithms.crystallography.Peakfinder8PeakDetection] algorithm.
+    [om.algorithms.crystallography.Peakfinder8PeakDetection] algorithm. The
+    peakfinder8 extension compiles specialized kernels for each of these layouts (see
+    the [panel_kernel]
+    [om.lib.peakfinder8_extension_stub.Peakfinder8Context.panel_kernel] property of
+    the extension): new layouts should be added there too.
 
     Arguments:
 
@@ -204,6 +219,21 @@ class Peakfinder8PeakDetection:
         max_res: int,
         bad_pixel_map: Union[numpy.ndarray, None],
         radius_pixel_map: numpy.ndarray,
+        background_estimator: str = "sigma_clipping",
+        background_decay: float = 0.1,
+        num_threads: int = 1,
+        num_frame_threads: int = 1,
+        prescreen_min_peaks: int = 0,
+        prescreen_validation: bool = False,
+        seed_scan: str = "pixel",
+        local_background: str = "ring",
+        backend: str = "cpu",
+        collect_stats: bool = False,
+        pixel_map_cache: Union[PixelMapCache, None] = None,
+        x_pixel_map: Union[numpy.ndarray, None] = None,
+        y_pixel_map: Union[numpy.ndarray, None] = None,
+        pixels_per_meter: Union[float, None] = None,
+        peak_refinement: str = "center_of_mass",
     ) -> None:
         """
         Peakfinder8 algorithm for peak detection.
@@ -279,6 +309,94 @@ class Peakfinder8PeakDetection:
                   the data frame, the distance in pixels from the origin
                   of the detector reference system (usually the center of the
                   detector).
+
+            background_estimator: The estimator used for the radial background.
+                One of 'sigma_clipping', the iterative estimator described in the
+                publication above, 'median_mad', which uses the median and the
+                median absolute deviation of the pixels at each radius, or
+                'temporal', which averages the radial background over the frames.
+                Defaults to 'sigma_clipping'.
+
+            background_decay: The weight of each new frame in the background model of
+                the 'temporal' estimator, between 0 (excluded) and 1. Smaller values
+                give steadier thresholds, but follow changes in the background more
+                slowly. Defaults to 0.1.
+
+            num_threads: The number of threads used to search for peaks. The detector
+                panels are processed in parallel when this number is larger than 1.
+                Defaults to 1.
+
+            num_frame_threads: The number of threads used to process the frames of a
+                batch (see the [find_peaks_batch]
+                [om.algorithms.crystallography.Peakfinder8PeakDetection.find_peaks_batch]
+                function). The frames are processed in parallel when this number is
+                larger than 1. Defaults to 1.
+
+            prescreen_min_peaks: The minimum number of peaks of a frame that passes
+                the pre-screen. When this number is larger than 0, frames that do not
+                have enough pixels above the background thresholds of the previous
+                frame to contain this number of peaks are rejected without searching
+                for peaks, and an empty peak list is returned for them. Defaults to 0,
+                which disables the pre-screen.
+
+            prescreen_validation: Whether the pre-screen runs in validation mode. In
+                validation mode, peaks are searched in all frames, and the rejected
+                frames that turn out to have enough peaks are counted as false
+                negatives (see the [get_prescreen_stats]
+                [om.algorithms.crystallography.Peakfinder8PeakDetection.get_prescreen_stats]
+                function). Defaults to False.
+
+            seed_scan: How the pixels that can start a peak are found. One of
+                'pixel', which compares each pixel with its threshold while growing
+                the peaks, or 'bitmap', which first builds a bit-packed map of the
+                pixels above threshold. Both give the same peaks. Defaults to 'pixel'.
+
+            local_background: How the local background of each peak is computed. One
+                of 'ring', which visits each pixel around the peak, or 'integral',
+                which reads the sums from integral images. The 'integral' method is
+                faster with large local background radii. Defaults to 'ring'.
+
+            backend: Where the peaks are searched. One of 'cpu' or 'gpu'. The 'gpu'
+                backend requires OM to be built with GPU support, and only supports
+                the 'sigma_clipping' background estimator: the frames that it cannot
+                process are processed on the CPU. If no GPU can be used, a warning
+                is printed and the peaks are searched on the CPU. Defaults to 'cpu'.
+
+            collect_stats: Whether the time spent in each stage of the algorithm,
+                and the number of candidate peaks rejected for each reason, are
+                collected (see the [get_stats]
+                [om.algorithms.crystallography.Peakfinder8PeakDetection.get_stats]
+                function). Defaults to False.
+
+            pixel_map_cache: A pixel map cache opened for the detector geometry (see
+                the [load_pix_maps_cache]
+                [om.utils.crystfel_geometry.load_pix_maps_cache] function). If the
+                value of this argument is not None, the radial bin of each pixel is
+                taken from the cache, instead of being computed from the radius map.
+                Defaults to None.
+
+            x_pixel_map: A pixel map storing the x coordinate of each pixel in the
+                detector reference system, in pixels. If this argument, the
+                y_pixel_map argument and the pixels_per_meter argument are not None,
+                the assembled position of the peaks, and their resolution once the
+                beam parameters are set (see the [set_beam_parameters]
+                [om.algorithms.crystallography.Peakfinder8PeakDetection.set_beam_parameters]
+                function), are computed while the peaks are searched. Defaults to
+                None.
+
+            y_pixel_map: A pixel map storing the y coordinate of each pixel in the
+                detector reference system, in pixels. Defaults to None.
+
+            pixels_per_meter: The size of the detector pixels, as the number of
+                pixels per meter (the 'res' entry of the CrystFEL geometry). Defaults
+                to None.
+
+            peak_refinement: How the position of each peak is computed. One of
+                'center_of_mass', the original peakfinder8 position, 'quadratic' or
+                'gaussian', which fit a parabola or a Gaussian to the brightest pixel
+                of each peak and its neighbours, for a sub-pixel position. The
+                position is not refined for the peaks found on the GPU. Defaults to
+                'center_of_mass'.
         """
         self._max_num_peaks: int = max_num_peaks
         self._asic_nx: int = asic_nx
@@ -289,12 +407,125 @@ class Peakfinder8PeakDetection:
         self._minimum_snr: float = minimum_snr
         self._min_pixel_count: int = min_pixel_count
         self._max_pixel_count: int = max_pixel_count
+        self._context_max_pixel_count: int = max_pixel_count
         self._local_bg_radius: int = local_bg_radius
         self._radius_pixel_map: numpy.ndarray = radius_pixel_map
         self._min_res: int = min_res
         self._max_res: int = max_res
-        self._mask: numpy.ndarray = bad_pixel_map
-        self._mask_initialized: bool = False
+        self._bad_pixel_map: Union[numpy.ndarray, None] = bad_pixel_map
+        self._mask: Union[numpy.ndarray, None] = None
+
+        # The context keeps all the peakfinder8 buffers alive between frames, and
+        # caches the radial bin index of each pixel.
+        self._peakfinder8_context: Peakfinder8Context = Peakfinder8Context(
+            pix_r=numpy.ascontiguousarray(
+                self._radius_pixel_map, dtype=numpy.float32
+            ),
+            max_num_peaks=self._max_num_peaks,
+            asic_nx=self._asic_nx,
+            asic_ny=self._asic_ny,
+            nasics_x=self._nasics_x,
+            nasics_y=self._nasics_y,
+            max_pix_count=self._max_pixel_count,
+            pixel_map_cache=pixel_map_cache,
+        )
+        try:
+            self._peakfinder8_context.background_estimator = background_estimator
+        except ValueError as exc:
+            raise exceptions.OmConfigurationFileSyntaxError(
+                "The {0} background estimator is not supported. Supported "
+                "estimators are 'sigma_clipping', 'median_mad' and "
+                "'temporal'.".format(background_estimator)
+            ) from exc
+        try:
+            self._peakfinder8_context.background_decay = background_decay
+        except ValueError as exc:
+            raise exceptions.OmConfigurationFileSyntaxError(
+                "The background decay must be larger than 0 and not larger than 1."
+            ) from exc
+        if num_threads > 1:
+            self._peakfinder8_context.num_threads = num_threads
+        if num_frame_threads > 1:
+            self._peakfinder8_context.num_frame_threads = num_frame_threads
+        self._peakfinder8_context.prescreen_min_peaks = prescreen_min_peaks
+        self._peakfinder8_context.prescreen_validation = prescreen_validation
+        try:
+            self._peakfinder8_context.seed_scan = seed_scan
+        except ValueError as exc:
+            raise exceptions.OmConfigurationFileSyntaxError(
+                "The {0} seed scan mode is not supported. Supported modes are 'pixel' "
+                "and 'bitmap'.".format(seed_scan)
+            ) from exc
+        try:
+            self._peakfinder8_context.local_background = local_background
+        except ValueError as exc:
+            raise exceptions.OmConfigurationFileSyntaxError(
+                "The {0} local background method is not supported. Supported "
+                "methods are 'ring' and 'integral'.".format(local_background)
+            ) from exc
+        try:
+            self._peakfinder8_context.backend = backend
+        except ValueError as exc:
+            raise exceptions.OmConfigurationFileSyntaxError(
+                "The {0} peakfinder8 backend is not supported. Supported backends "
+                "are 'cpu' and 'gpu'.".format(backend)
+            ) from exc
+        except RuntimeError:
+            print(
+                "OM Warning: The GPU cannot be used for the peakfinder8 peak search. "
+                "Peaks will be searched on the CPU."
+            )
+        self._peakfinder8_context.collect_stats = collect_stats
+        try:
+            self._peakfinder8_context.peak_refinement = peak_refinement
+        except ValueError as exc:
+            raise exceptions.OmConfigurationFileSyntaxError(
+                "The {0} peak refinement method is not supported. Supported methods "
+                "are 'center_of_mass', 'quadratic' and 'gaussian'.".format(
+                    peak_refinement
+                )
+            ) from exc
+        self._pixels_per_meter: Union[float, None] = None
+        if (
+            x_pixel_map is not None
+            and y_pixel_map is not None
+            and pixels_per_meter is not None
+        ):
+            self._peakfinder8_context.set_peak_geometry(
+                x_pixel_map, y_pixel_map, pixels_per_meter
+            )
+            self._pixels_per_meter = pixels_per_meter
+
+    def _initialize_mask(self) -> None:
+        # Combines the bad pixel map and the resolution limits into the mask read by
+        # the peakfinder8 context. This is done only for the first frame, and after
+        # the resolution limits change: the context then keeps the unmasked pixels of
+        # this array for all the frames.
+        if self._mask is None:
+            mask: numpy.ndarray
+            if self._bad_pixel_map is None:
+                mask = numpy.ones(shape=self._radius_pixel_map.shape, dtype=numpy.int8)
+            else:
+                mask = self._bad_pixel_map.astype(numpy.int8)
+            mask[self._radius_pixel_map < self._min_res] = 0
+            mask[self._radius_pixel_map > self._max_res] = 0
+            self._mask = numpy.ascontiguousarray(mask)
+
+    def _prepare_frame(self, data: numpy.ndarray) -> numpy.ndarray:
+        # Initializes the mask, if needed, and returns the frame (or the batch of
+        # frames) in a form that the peakfinder8 context can read.
+        self._initialize_mask()
+
+        # The peakfinder8 context reads these types directly, without a conversion
+        # copy. Any other frame is converted to float32.
+        if data.dtype not in (
+            numpy.float32,
+            numpy.float64,
+            numpy.uint16,
+            numpy.int32,
+        ):
+            data = data.astype(numpy.float32)
+        return numpy.ascontiguousarray(data)
 
     def find_peaks(self, data: numpy.ndarray) -> TypePeakList:
         """
@@ -312,28 +543,9 @@ class Peakfinder8PeakDetection:
             A [TypePeakList][om.algorithms.crystallography.TypePeakList] dictionary
             with information about the detected peaks.
         """
-        if not self._mask_initialized:
-            if self._mask is None:
-                self._mask = numpy.ones_like(data, dtype=numpy.int8)
-            else:
-                self._mask = self._mask.astype(numpy.int8)
-
-            res_mask: numpy.ndarray = numpy.ones(
-                shape=self._mask.shape, dtype=numpy.int8
-            )
-            res_mask[numpy.where(self._radius_pixel_map < self._min_res)] = 0
-            res_mask[numpy.where(self._radius_pixel_map > self._max_res)] = 0
-            self._mask *= res_mask
-
-        peak_list: Tuple[List[float], ...] = peakfinder_8(
-            self._max_num_peaks,
-            data.astype(numpy.float32),
+        peak_list: Tuple[List[float], ...] = self._peakfinder8_context.find_peaks(
+            self._prepare_frame(data),
             self._mask,
-            self._radius_pixel_map,
-            self._asic_nx,
-            self._asic_ny,
-            self._nasics_x,
-            self._nasics_y,
             self._adc_thresh,
             self._minimum_snr,
             self._min_pixel_count,
@@ -350,3 +562,492 @@ class Peakfinder8PeakDetection:
             "max_pixel_intensity": peak_list[5],
             "snr": peak_list[6],
         }
+
+    def find_peaks_array(
+        self, data: numpy.ndarray, out: Union[numpy.ndarray, None] = None
+    ) -> numpy.ndarray:
+        """
+        Finds peaks in a detector data frame, returning them in a structured array.
+
+        This function detects peaks in a data frame, like the [find_peaks]
+        [om.algorithms.crystallography.Peakfinder8PeakDetection.find_peaks] function.
+        The information about the peaks is however written directly into a numpy
+        structured array, which can be sent to other nodes without being converted
+        to Python lists.
+
+        Arguments:
+
+            data: The detector data frame on which the peak finding must be performed.
+
+            out: An optional array in which the peaks are written (see the
+                documentation of the [find_peaks_array]
+                [om.lib.peakfinder8_extension_stub.Peakfinder8Context.find_peaks_array]
+                function of the peakfinder8 extension). Defaults to None.
+
+        Returns:
+
+            A numpy structured array of type [peak_list_dtype]
+            [om.lib.peakfinder8_extension_stub.peak_list_dtype], with one entry per
+            detected peak.
+        """
+        return self._peakfinder8_context.find_peaks_array(
+            self._prepare_frame(data),
+            self._mask,
+            self._adc_thresh,
+            self._minimum_snr,
+            self._min_pixel_count,
+            self._max_pixel_count,
+            self._local_bg_radius,
+            out,
+        )
+
+    def set_beam_parameters(
+        self, beam_energy: Union[float, None], detector_distance: Union[float, None]
+    ) -> None:
+        """
+        Sets the beam parameters used to compute the resolution of the peaks.
+
+        The resolution of the peaks found in the following frames is computed with
+        these parameters, if the geometry of the detector is known. The peaks found
+        by a pipeline that was already created are not affected (see the
+        [fill_peak_resolution]
+        [om.algorithms.crystallography.Peakfinder8PeakDetection.fill_peak_resolution]
+        function).
+
+        Arguments:
+
+            beam_energy: The beam energy, in eV, or None if it is not known.
+
+            detector_distance: The distance between the sample and the detector, in
+                meters, or None if it is not known.
+        """
+        self._peakfinder8_context.set_beam_parameters(
+            beam_energy if beam_energy is not None else 0.0,
+            detector_distance if detector_distance is not None else 0.0,
+        )
+
+    def fill_peak_resolution(
+        self,
+        peak_list: numpy.ndarray,
+        beam_energy: Union[float, None],
+        detector_distance: Union[float, None],
+    ) -> None:
+        """
+        Fills the resolution of peaks that have already been found.
+
+        This function computes, in place, the scattering vector and the resolution of
+        a list of peaks returned by the [find_peaks_array]
+        [om.algorithms.crystallography.Peakfinder8PeakDetection.find_peaks_array]
+        function or by a pipeline, from their assembled position. Nothing is done if
+        the geometry of the detector is not known.
+
+        Arguments:
+
+            peak_list: A numpy structured array of type [peak_list_dtype]
+                [om.lib.peakfinder8_extension_stub.peak_list_dtype].
+
+            beam_energy: The beam energy, in eV, or None if it is not known.
+
+            detector_distance: The distance between the sample and the detector, in
+                meters, or None if it is not known.
+        """
+        if self._pixels_per_meter is None:
+            return
+        fill_peak_resolution(
+            peak_list,
+            self._pixels_per_meter,
+            beam_energy if beam_energy is not None else 0.0,
+            detector_distance if detector_distance is not None else 0.0,
+        )
+
+    def set_parameters(
+        self,
+        adc_threshold: float,
+        minimum_snr: float,
+        min_pixel_count: int,
+        max_pixel_count: int,
+        local_bg_radius: int,
+        min_res: int,
+        max_res: int,
+    ) -> None:
+        """
+        Changes the peak detection parameters.
+
+        This function changes the parameters of the peak search without allocating
+        a new peakfinder8 context, so that all the buffers and settings of the
+        context are kept. The mask is only computed again if the resolution limits
+        change. The parameters have the same meaning as the ones with the same name
+        in the constructor. The maximum size of a peak cannot be larger than the one
+        specified when the algorithm was created.
+
+        Arguments:
+
+            adc_threshold: The minimum ADC threshold for peak detection.
+
+            minimum_snr: The minimum signal-to-noise ratio for peak detection.
+
+            min_pixel_count: The minimum size of a peak in pixels.
+
+            max_pixel_count: The maximum size of a peak in pixels.
+
+            local_bg_radius: The radius for the estimation of the local background in
+                pixels.
+
+            min_res: The minimum resolution for a peak in pixels.
+
+            max_res: The maximum resolution for a peak in pixels.
+
+        Raises:
+
+            ValueError: A ValueError is raised if the maximum size of a peak is larger
+                than the one specified when the algorithm was created.
+        """
+        if max_pixel_count > self._context_max_pixel_count:
+            raise ValueError(
+                "The maximum size of a peak cannot be larger than {0} "
+                "pixels.".format(self._context_max_pixel_count)
+            )
+        self._adc_thresh = adc_threshold
+        self._minimum_snr = minimum_snr
+        self._min_pixel_count = min_pixel_count
+        self._max_pixel_count = max_pixel_count
+        self._local_bg_radius = local_bg_radius
+        if min_res != self._min_res or max_res != self._max_res:
+            self._min_res = min_res
+            self._max_res = max_res
+            self._mask = None
+
+    def reset_background(self) -> None:
+        """
+        Discards the background model of the 'temporal' estimator.
+
+        This function should be called when the background conditions change
+        abruptly, for example when a new run starts. The next data frame initializes
+        a new background model.
+        """
+        self._peakfinder8_context.reset_background()
+
+    def get_prescreen_stats(self) -> Dict[str, int]:
+        """
+        Returns the statistics of the pre-screen.
+
+        This function returns the number of frames checked by the pre-screen, the
+        number of rejected frames and, in validation mode, the number of rejected
+        frames that turned out to have enough peaks to pass the pre-screen.
+
+        Returns:
+
+            A dictionary with the 'num_frames', 'num_rejected' and
+            'num_false_negatives' keys (see the documentation of the
+            [prescreen_stats]
+            [om.lib.peakfinder8_extension_stub.Peakfinder8Context.prescreen_stats]
+            property of the peakfinder8 extension).
+        """
+        return self._peakfinder8_context.prescreen_stats
+
+    def create_pipeline(self, num_slots: int, num_workers: int) -> Peakfinder8Pipeline:
+        """
+        Creates a pipeline that searches for peaks in frames on worker threads.
+
+        This function creates a ring of frame slots whose frames are processed, with
+        the parameters of this algorithm, by native worker threads that run without
+        the GIL (see the documentation of the [Peakfinder8Pipeline]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Pipeline] class of the
+        peakfinder8 extension). A thread can then fill the slots with frames while
+        the peaks of the previous frames are searched. The workers use the settings
+        that the algorithm has when the pipeline is created, and their statistics are
+        collected by the algorithm (see the [get_stats]
+        [om.algorithms.crystallography.Peakfinder8PeakDetection.get_stats] function).
+
+        Arguments:
+
+            num_slots: The number of frame slots in the ring.
+
+            num_workers: The number of worker threads.
+
+        Returns:
+
+            A [Peakfinder8Pipeline]
+            [om.lib.peakfinder8_extension_stub.Peakfinder8Pipeline] object.
+        """
+        self._initialize_mask()
+        return Peakfinder8Pipeline(
+            self._peakfinder8_context,
+            self._mask,
+            num_slots,
+            num_workers,
+            self._adc_thresh,
+            self._minimum_snr,
+            self._min_pixel_count,
+            self._max_pixel_count,
+            self._local_bg_radius,
+        )
+
+    def get_stats(self) -> Dict[str, Any]:
+        """
+        Returns the statistics of the peak search.
+
+        This function returns the time spent in each stage of the algorithm, and the
+        number of seeds, candidate peaks and rejected candidates, accumulated over
+        the frames processed since the statistics were last reset. The statistics
+        are only collected if the algorithm was created with the `collect_stats`
+        argument set to True.
+
+        Returns:
+
+            A dictionary with the statistics of the peak search (see the
+            documentation of the [stats]
+            [om.lib.peakfinder8_extension_stub.Peakfinder8Context.stats] property of
+            the peakfinder8 extension).
+        """
+        return self._peakfinder8_context.stats
+
+    def reset_stats(self) -> None:
+        """
+        Resets the statistics of the peak search.
+        """
+        self._peakfinder8_context.reset_stats()
+
+    def get_peak_label_map(
+        self, out: Union[numpy.ndarray, None] = None
+    ) -> numpy.ndarray:
+        """
+        Returns a map of the pixels of the peaks found in the last frame.
+
+        This function labels each pixel of the last frame processed by the
+        [find_peaks][om.algorithms.crystallography.Peakfinder8PeakDetection.find_peaks]
+        or [find_peaks_array]
+        [om.algorithms.crystallography.Peakfinder8PeakDetection.find_peaks_array]
+        functions with the index plus one of the peak that it belongs to, or with 0
+        if it is not part of any peak.
+
+        Arguments:
+
+            out: An optional 2D int32 array, with the shape of the data frames, in
+                which the labels are written, and which can be reused for every frame.
+                Defaults to None.
+
+        Returns:
+
+            The label map (see the documentation of the [peak_label_map]
+            [om.lib.peakfinder8_extension_stub.Peakfinder8Context.peak_label_map]
+            function of the peakfinder8 extension).
+        """
+        return self._peakfinder8_context.peak_label_map(out)
+
+    def get_peak_pixels(self) -> Tuple[numpy.ndarray, numpy.ndarray]:
+        """
+        Returns the pixels of the peaks found in the last frame.
+
+        This function returns the index, in the flattened data frame, of each pixel of
+        the peaks found in the last frame processed by the [find_peaks]
+        [om.algorithms.crystallography.Peakfinder8PeakDetection.find_peaks] or
+        [find_peaks_array]
+        [om.algorithms.crystallography.Peakfinder8PeakDetection.find_peaks_array]
+        functions, together with the index of the peak that the pixel belongs to.
+
+        Returns:
+
+            A tuple with two int32 arrays, storing the pixel and peak indexes (see the
+            documentation of the [peak_pixels]
+            [om.lib.peakfinder8_extension_stub.Peakfinder8Context.peak_pixels]
+            function of the peakfinder8 extension).
+        """
+        return self._peakfinder8_context.peak_pixels()
+
+    def find_peaks_batch(
+        self, data: numpy.ndarray
+    ) -> Tuple[numpy.ndarray, numpy.ndarray]:
+        """
+        Finds peaks in a batch of detector data frames.
+
+        This function detects peaks in each frame of a batch, like the
+        [find_peaks_array]
+        [om.algorithms.crystallography.Peakfinder8PeakDetection.find_peaks_array]
+        function, with a single call to the peakfinder8 extension. The frames are
+        processed in parallel if the algorithm was created with more than one frame
+        thread.
+
+        Arguments:
+
+            data: A three-dimensional array storing the detector data frames, one
+                after the other along the first axis.
+
+        Returns:
+
+            A tuple storing the peaks detected in all the frames, in a numpy
+            structured array of type [peak_list_dtype]
+            [om.lib.peakfinder8_extension_stub.peak_list_dtype], and the number of
+            peaks detected in each frame (see the documentation of the
+            [find_peaks_batch]
+            [om.lib.peakfinder8_extension_stub.Peakfinder8Context.find_peaks_batch]
+            function of the peakfinder8 extension).
+        """
+        return self._peakfinder8_context.find_peaks_batch(
+            self._prepare_frame(data),
+            self._mask,
+            self._adc_thresh,
+            self._minimum_snr,
+            self._min_pixel_count,
+            self._max_pixel_count,
+            self._local_bg_radius,
+        )
+
+    def sweep_peak_counts(
+        self, data: numpy.ndarray, parameter_sets: List[Dict[str, float]]
+    ) -> numpy.ndarray:
+        """
+        Counts the peaks found in a detector data frame by many sets of parameters.
+
+        This function returns, for each set of parameters, the number of peaks that
+        the [find_peaks]
+        [om.algorithms.crystallography.Peakfinder8PeakDetection.find_peaks] function
+        would detect in the data frame if the algorithm had been created with those
+        parameters. The work shared by the different sets is performed
+        only once, so the function is much faster than a separate peak search for
+        each set. It can be used, for example, to compute how the number of peaks,
+        and hence the hit rate, changes with a parameter. The resolution limits and
+        the bad pixel map of the algorithm are used for all the sets.
+
+        Arguments:
+
+            data: The detector data frame on which the peak finding must be performed.
+
+            parameter_sets: A list of dictionaries, one per set of parameters. Each
+                dictionary can store the 'adc_threshold', 'minimum_snr',
+                'min_pixel_count', 'max_pixel_count' and 'local_bg_radius' keys. The
+                parameters that are not stored in a dictionary take the values used
+                by the algorithm.
+
+        Returns:
+
+            An array of integers storing the number of peaks found with each set of
+            parameters (see the documentation of the [sweep_peak_counts]
+            [om.lib.peakfinder8_extension_stub.Peakfinder8Context.sweep_peak_counts]
+            function of the peakfinder8 extension).
+        """
+        parameter_table: numpy.ndarray = numpy.array(
+            [
+                (
+                    parameter_set.get("adc_threshold", self._adc_thresh),
+                    parameter_set.get("minimum_snr", self._minimum_snr),
+                    parameter_set.get("min_pixel_count", self._min_pixel_count),
+                    parameter_set.get("max_pixel_count", self._max_pixel_count),
+                    parameter_set.get("local_bg_radius", self._local_bg_radius),
+                )
+                for parameter_set in parameter_sets
+            ],
+            dtype=numpy.float32,
+        ).reshape(-1, 5)
+
+        return self._peakfinder8_context.sweep_peak_counts(
+            self._prepare_frame(data), self._mask, parameter_table
+        )
+
+
+class SparseFrameCompression:
+    """
+    See documentation of the `__init__` function.
+    """
+
+    def __init__(
+        self,
+        peak_radius: int = 4,
+        quantization_step: float = 1.0,
+        bin_size: int = 1,
+        zlib_level: int = 0,
+    ) -> None:
+        """
+        Peak-centric compression of detector data frames.
+
+        This algorithm compresses data frames before they are sent over the network.
+        The pixels around each Bragg peak are kept at full precision, while the
+        background, which is only used for display, is averaged over square blocks of
+        pixels and quantized to 16-bit integers. The result can optionally be
+        compressed further with zlib.
+
+        Arguments:
+
+            peak_radius: The half-size, in pixels, of the square box kept at full
+                precision around each peak. Defaults to 4.
+
+            quantization_step: The quantization step of the background, in ADUs.
+                Defaults to 1.0.
+
+            bin_size: The size, in pixels, of the blocks over which the background is
+                averaged. Defaults to 1 (no binning).
+
+            zlib_level: The zlib compression level applied to the encoded frame, from
+                0 (no zlib compression) to 9. Defaults to 0.
+
+        Raises:
+
+            OmConfigurationFileSyntaxError: An exception is raised if the compression
+                parameters are not valid.
+        """
+        if peak_radius < 0 or not quantization_step > 0 or bin_size < 1:
+            raise exceptions.OmConfigurationFileSyntaxError(
+                "The peak radius of the frame compression must not be negative, and "
+                "its quantization step and bin size must be positive."
+            )
+        if not 0 <= zlib_level <= 9:
+            raise exceptions.OmConfigurationFileSyntaxError(
+                "The zlib level of the frame compression must be between 0 and 9."
+            )
+        self._peak_radius: int = peak_radius
+        self._quantization_step: float = quantization_step
+        self._bin_size: int = bin_size
+        self._zlib_level: int = zlib_level
+
+    def compress(self, data: numpy.ndarray, peak_list: numpy.ndarray) -> bytes:
+        """
+        Compresses a detector data frame.
+
+        Arguments:
+
+            data: The detector data frame to compress.
+
+            peak_list: The peaks of the frame, in a numpy structured array of type
+                [peak_list_dtype][om.lib.peakfinder8_extension_stub.peak_list_dtype].
+                The fs and ss fields of each peak must be its column and its row in
+                the data frame.
+
+        Returns:
+
+            The compressed frame, which can be decompressed with the
+            [decompress_frame][om.algorithms.crystallography.decompress_frame]
+            function.
+        """
+        encoded: numpy.ndarray = encode_sparse_frame(
+            numpy.ascontiguousarray(data, dtype=numpy.float32),
+            peak_list,
+            self._peak_radius,
+            self._quantization_step,
+            self._bin_size,
+        )
+        if self._zlib_level > 0:
+            return zlib.compress(encoded, self._zlib_level)
+        return encoded.tobytes()
+
+
+def decompress_frame(compressed_data: bytes) -> numpy.ndarray:
+    """
+    Decompresses a detector data frame.
+
+    This function decompresses a frame compressed by the [SparseFrameCompression]
+    [om.algorithms.crystallography.SparseFrameCompression] algorithm. Whether zlib
+    was used is recognized from the data itself.
+
+    Arguments:
+
+        compressed_data: The compressed frame.
+
+    Returns:
+
+        The decompressed data frame, as a 2D float32 array.
+    """
+    # Encoded frames start with the 'PF8S' marker, which is never the start of a
+    # zlib stream.
+    if compressed_data[:4] != b"PF8S":
+        compressed_data = zlib.decompress(compressed_data)
+    return decode_sparse_frame(compressed_data)
@@ -22,15 +22,138 @@ This module contains algorithms that perform generic processing the data: common
 operations that are not tied to a specific experimental technique (e.g.: detector frame
 masking and correction, data accumulation, etc.).
 """
+import hashlib
+import os
 import sys
-from typing import Any, Dict, List, Union
+from typing import Any, Callable, Dict, List, Tuple, Union
 
 import h5py  # type:ignore
 import numpy  # type: ignore
 
+from om.lib.peakfinder8_extension import SharedConstants  # type: ignore
 from om.utils import exceptions
 
 
+def shared_constants_key(
+    prefix: str, filenames: List[Union[str, None]], *parameters: Any
+) -> str:
+    """
+    Computes the key that identifies detector constants in shared memory.
+
+    This function computes a key from the files from which the constants are read,
+    and from the parameters used to compute them. The key changes when a file is
+    modified, so that constants read from old files are never used.
+
+    Arguments:
+
+        prefix: A short string that identifies the kind of constants.
+
+        filenames: The relative or absolute paths to the files from which the
+            constants are read. The entries that are None are ignored.
+
+        *parameters: The parameters used to compute the constants.
+
+    Returns:
+
+        The key, which can be used to open a [SharedConstants]
+        [om.lib.peakfinder8_extension_stub.SharedConstants] object.
+    """
+    identity: List[str] = []
+    filename: Union[str, None]
+    for filename in filenames:
+        if filename is None:
+            continue
+        # A file that cannot be read is reported when the constants are loaded
+        try:
+            file_stat: os.stat_result = os.stat(filename)
+        except OSError:
+            identity.append(filename)
+            continue
+        identity.append(
+            "{0}:{1}:{2}".format(
+                os.path.realpath(filename), file_stat.st_size, file_stat.st_mtime_ns
+            )
+        )
+    identity.extend(repr(parameter) for parameter in parameters)
+
+    return "{0}-{1}".format(
+        prefix, hashlib.sha256("\n".join(identity).encode()).hexdigest()
+    )
+
+
+def load_shared_constants(
+    key: str,
+    load_function: Callable[[], Dict[str, numpy.ndarray]],
+    shared_constants: str,
+) -> Dict[str, numpy.ndarray]:
+    """
+    Loads detector constants, sharing them between the processes of a machine.
+
+    This function returns read-only detector constants, such as dark data and gain
+    maps, stored in shared memory (see the documentation of the [SharedConstants]
+    [om.lib.peakfinder8_extension_stub.SharedConstants] class). Only the first process
+    of the machine, or of each NUMA node, that needs the constants loads them: all the
+    other processes read the same copy of the constants. If the shared memory cannot
+    be used, a warning is printed, and each process loads its own copy.
+
+    Arguments:
+
+        key: The key that identifies the constants (see the [shared_constants_key]
+            [om.algorithms.generic.shared_constants_key] function).
+
+        load_function: A function that loads the constants, and returns them in a
+            dictionary, with names of up to 31 characters as keys.
+
+        shared_constants: How the constants are shared. One of 'none', where each
+            process loads its own copy of the constants, 'node', where the processes
+            of a machine share one copy, or 'numa', where the processes of each NUMA
+            node share one copy.
+
+    Returns:
+
+        A dictionary storing the constants. Unless the value of the
+        `shared_constants` argument is 'none', the constants are read-only.
+
+    Raises:
+
+        OmConfigurationFileSyntaxError: An OmConfigurationFileSyntaxError is raised if
+            the value of the `shared_constants` argument is not supported.
+    """
+    if shared_constants == "none":
+        return load_function()
+    if shared_constants not in ("node", "numa"):
+        raise exceptions.OmConfigurationFileSyntaxError(
+            "The {0} sharing of the detector constants is not supported. Supported "
+            "values are 'none', 'node' and 'numa'.".format(shared_constants)
+        )
+
+    try:
+        store: SharedConstants = SharedConstants(
+            key, numa_local=shared_constants == "numa"
+        )
+    except RuntimeError as exc:
+        print(
+            "OM Warning: The detector constants cannot be shared ({0}). Each "
+            "process will load its own copy.".format(exc)
+        )
+        sys.stdout.flush()
+        return load_function()
+
+    if store.created:
+        constants: Dict[str, numpy.ndarray] = load_function()
+        try:
+            store.fill(constants)
+        except (RuntimeError, ValueError) as exc:
+            print(
+                "OM Warning: The detector constants cannot be shared ({0}). Each "
+                "process will load its own copy.".format(exc)
+            )
+            sys.stdout.flush()
+            return constants
+
+    return store.arrays()
+
+
 class Correction:
     """
     See documentation of the `__init__` function.
@@ -44,6 +167,7 @@ class Correction:
         mask_hdf5_path: Union[str, None] = None,
         gain_filename: Union[str, None] = None,
         gain_hdf5_path: Union[str, None] = None,
+        shared_constants: str = "none",
     ) -> None:
         """
         Detector data frame correction.
@@ -106,13 +230,76 @@ class Correction:
 
                 * If the 'gain_filename' argument is not None, this argument must also
                   be provided, and cannot be None. Otherwise it is ignored.
+
+            shared_constants: How the combined mask, dark data and gain map are
+                shared between the processes of a machine. One of 'none', 'node' or
+                'numa' (see the documentation of the [load_shared_constants]
+                [om.algorithms.generic.load_shared_constants] function). Defaults to
+                'none'.
         """
+        self._scale: Union[numpy.ndarray, bool]
+        self._offset: Union[numpy.ndarray, bool]
+        if shared_constants == "none":
+            self._scale, self._offset = self._load_scale_and_offset(
+                dark_filename,
+                dark_hdf5_path,
+                mask_filename,
+                mask_hdf5_path,
+                gain_filename,
+                gain_hdf5_path,
+            )
+        else:
+
+            def load_constants() -> Dict[str, numpy.ndarray]:
+                # Only the arrays are shared: a missing scale or offset means that
+                # the corresponding step of the correction is skipped.
+                scale, offset = self._load_scale_and_offset(
+                    dark_filename,
+                    dark_hdf5_path,
+                    mask_filename,
+                    mask_hdf5_path,
+                    gain_filename,
+                    gain_hdf5_path,
+                )
+                arrays: Dict[str, numpy.ndarray] = {}
+                if scale is not True:
+                    arrays["scale"] = scale
+                if offset is not False:
+                    arrays["offset"] = offset
+                return arrays
+
+            constants: Dict[str, numpy.ndarray] = load_shared_constants(
+                shared_constants_key(
+                    "correction",
+                    [dark_filename, mask_filename, gain_filename],
+                    dark_hdf5_path,
+                    mask_hdf5_path,
+                    gain_hdf5_path,
+                ),
+                load_constants,
+                shared_constants,
+            )
+            self._scale = constants.get("scale", True)
+            self._offset = constants.get("offset", False)
+
+    def _load_scale_and_offset(  # noqa: C901
+        self,
+        dark_filename: Union[str, None],
+        dark_hdf5_path: Union[str, None],
+        mask_filename: Union[str, None],
+        mask_hdf5_path: Union[str, None],
+        gain_filename: Union[str, None],
+        gain_hdf5_path: Union[str, None],
+    ) -> Tuple[Union[numpy.ndarray, bool], Union[numpy.ndarray, bool]]:
+        # Loads the mask, the dark data and the gain map, and combines them into the
+        # scale and the offset applied to each frame. True and False stand for an
+        # all-one scale and an all-zero offset.
         if mask_filename is not None:
             if mask_hdf5_path is not None:
                 try:
                     mask_hdf5_file_handle: Any
                     with h5py.File(mask_filename, "r") as mask_hdf5_file_handle:
-                        self._mask: Union[numpy.ndarray, None] = mask_hdf5_file_handle[
+                        mask: Union[numpy.ndarray, None] = mask_hdf5_file_handle[
                             mask_hdf5_path
                         ][:]
                 except (IOError, OSError, KeyError) as exc:
@@ -133,15 +320,15 @@ class Correction:
                 )
         else:
             # True here is equivalent to an all-one mask.
-            self._mask = True
+            mask = True
 
         if dark_filename is not None:
             if dark_hdf5_path is not None:
                 try:
                     dark_hdf5_file_handle: Any
                     with h5py.File(dark_filename, "r") as dark_hdf5_file_handle:
-                        self._dark: Union[numpy.ndarray, None] = (
-                            dark_hdf5_file_handle[dark_hdf5_path][:] * self._mask
+                        dark: Union[numpy.ndarray, None] = (
+                            dark_hdf5_file_handle[dark_hdf5_path][:] * mask
                         )
                 except (IOError, OSError, KeyError) as exc:
                     exc_type, exc_value = sys.exc_info()[:2]
@@ -161,15 +348,15 @@ class Correction:
                 )
         else:
             # False here is equivalent to an all-zero mask.
-            self._dark = False
+            dark = False
 
         if gain_filename is not None:
             if gain_hdf5_path is not None:
                 try:
                     gain_hdf5_file_handle: Any
                     with h5py.File(gain_filename, "r") as gain_hdf5_file_handle:
-                        self._gain: Union[numpy.ndarray, None] = (
-                            gain_hdf5_file_handle[gain_hdf5_path][:] * self._mask
+                        gain_map: Union[numpy.ndarray, bool] = (
+                            gain_hdf5_file_handle[gain_hdf5_path][:] * mask
                         )
                 except (IOError, OSError, KeyError) as exc:
                     exc_type, exc_value = sys.exc_info()[:2]
@@ -189,9 +376,23 @@ class Correction:
                 )
         else:
             # True here is equivalent to an all-one map.
-            self._gain_map = True
-
-    def apply_correction(self, data: numpy.ndarray) -> numpy.ndarray:
+            gain_map = True
+
+        # The mask, the dark data and the gain map are combined once, here, so that
+        # each frame only needs a multiplication and a subtraction, which are skipped
+        # when they would not change the data.
+        scale: Union[numpy.ndarray, bool] = mask
+        offset: Union[numpy.ndarray, bool] = dark
+        if gain_map is not True:
+            scale = mask * gain_map
+            if dark is not False:
+                offset = dark * gain_map
+
+        return scale, offset
+
+    def apply_correction(
+        self, data: numpy.ndarray, out: Union[numpy.ndarray, None] = None
+    ) -> numpy.ndarray:
         """
         Applies the correction to a detector data frame.
 
@@ -203,11 +404,31 @@ class Correction:
 
             data: The detector data frame on which the correction must be applied.
 
+            out: An optional array, with the same shape as the data frame, in which
+                the corrected data is written. The result of each step of the
+                correction is cast to the type of this array. Defaults to None.
+
         Returns:
 
-            The corrected data.
+            The corrected data. If the `out` argument is provided, this is the `out`
+            array. Otherwise, if no mask, dark data or gain map were provided, this is
+            the data frame itself.
         """
-        return (data * self._mask - self._dark) * self._gain_map
+        if out is not None:
+            if self._scale is not True:
+                numpy.multiply(data, self._scale, out=out, casting="unsafe")
+            else:
+                numpy.copyto(out, data, casting="unsafe")
+            if self._offset is not False:
+                numpy.subtract(out, self._offset, out=out, casting="unsafe")
+            return out
+
+        corrected_data: numpy.ndarray = data
+        if self._scale is not True:
+            corrected_data = corrected_data * self._scale
+        if self._offset is not False:
+            corrected_data = corrected_data - self._offset
+        return corrected_data
 
 
 class DataAccumulator:
@@ -22,13 +22,49 @@ This module contains base abstract classes for OM's Data Extraction Layer.
 """
 import sys
 from abc import ABC, abstractmethod, abstractproperty
-from typing import Any, Callable, Dict, Generator, List
+from typing import Any, Callable, Dict, Generator, List, Sequence, Tuple, Union
 
+import numpy  # type: ignore
 from typing_extensions import final
 
 from om.utils import exceptions, parameters
 
 
+class OmEventScheduler(ABC):
+    """
+    See documentation of the `__init__` function.
+
+    Base class: `ABC`
+    """
+
+    @abstractmethod
+    def claim_events(self, num_events: int) -> Union[Tuple[int, int], None]:
+        """
+        Claims the next batch of events for the calling processing node.
+
+        This function hands out, to the processing node calling it, the next batch of
+        consecutive events from a list shared by all the processing nodes. Each event
+        in the list is assigned to exactly one node. The size of the batch is decided
+        by the scheduler.
+
+        The list can grow between two calls to this function, as long as new events
+        are only appended at its end, and all the processing nodes see the same list.
+        After this function has reported that all the events have been claimed, it can
+        be called again, with a larger number of events, to claim the new ones.
+
+        Arguments:
+
+            num_events: The current number of events in the list.
+
+        Returns:
+
+            A tuple with the index of the first event in the batch and the index
+            following the last one, or None if all the events currently in the list
+            have already been claimed.
+        """
+        pass
+
+
 class OmDataEventHandler(ABC):
     """
     See documentation of the `__init__` function.
@@ -70,6 +106,7 @@ class OmDataEventHandler(ABC):
         self._monitor_params: parameters.MonitorParams = monitor_parameters
         self._source: str = source
         self._additional_info: Dict[str, Any] = additional_info
+        self._event_scheduler: Union[OmEventScheduler, None] = None
 
     @abstractproperty
     def data_extraction_funcs(
@@ -271,6 +308,81 @@ class OmDataEventHandler(ABC):
 
         return data
 
+    @final
+    def set_event_scheduler(
+        self, event_scheduler: Union[OmEventScheduler, None]
+    ) -> None:
+        """
+        Sets the scheduler that distributes the events across the processing nodes.
+
+        When a scheduler is set, the Data Event Handlers that retrieve their events
+        from a list known in advance (files, frames, or offline runs) let the
+        processing nodes claim batches of events from the list as they need them,
+        instead of splitting the list evenly across the nodes. The Data Event Handlers
+        that retrieve events from live data streams ignore the scheduler. OM calls
+        this function on each processing node before the [event_generator]
+        [om.data_retrieval_layer.base.OmDataEventHandler.event_generator] function.
+
+        Arguments:
+
+            event_scheduler: An [OmEventScheduler]
+                [om.data_retrieval_layer.base.OmEventScheduler] object, or None to
+                split the events evenly across the processing nodes.
+        """
+        self._event_scheduler = event_scheduler
+
+    @final
+    def select_events(
+        self,
+        events: Sequence[Any],
+        node_rank: int,
+        node_pool_size: int,
+    ) -> Generator[Any, None, None]:
+        """
+        Selects the events that the calling processing node should process.
+
+        This function selects, from a list of events shared by all the processing
+        nodes, the events that the calling node should process. If no event scheduler
+        has been set, the list is split as equally as possible amongst the processing
+        nodes, with the last processing node getting a smaller number of events if the
+        number of events cannot be exactly divided by the number of processing nodes.
+        Otherwise, the events are claimed from the scheduler in batches, while the
+        node retrieves them. Each event generator should select its events from a
+        single list.
+
+        Arguments:
+
+            events: The list of all the events to process.
+
+            node_rank: The rank, in the OM pool, of the processing node calling the
+                function.
+
+            node_pool_size: The total number of nodes in the OM pool, including all the
+                processing nodes and the collecting node.
+
+        Yields:
+
+            The events that the calling node should process, in order.
+        """
+        if self._event_scheduler is None:
+            num_events_curr_node: int = int(
+                numpy.ceil(len(events) / float(node_pool_size - 1))
+            )
+            yield from events[
+                ((node_rank - 1) * num_events_curr_node) : (
+                    node_rank * num_events_curr_node
+                )
+            ]
+            return
+
+        while True:
+            batch: Union[Tuple[int, int], None] = self._event_scheduler.claim_events(
+                len(events)
+            )
+            if batch is None:
+                return
+            yield from events[batch[0] : batch[1]]
+
 
 def filter_data_extraction_funcs(
     data_extraction_funcs: Dict[str, Callable[[Dict[str, Dict[str, Any]]], Any]],
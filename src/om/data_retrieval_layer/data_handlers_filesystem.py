@@ -21,9 +21,22 @@ Retrieval and handling of data events from a filesystem.
 This module contains Data Event Handlers for files saved in a filesystem (on a physical
 or virtual disk).
 """
+import mmap
+import os
 import pathlib
 import re
-from typing import Any, Callable, Dict, Generator, List, TextIO, Tuple
+from typing import (
+    Any,
+    BinaryIO,
+    Callable,
+    Dict,
+    Generator,
+    Iterable,
+    List,
+    TextIO,
+    Tuple,
+    Union,
+)
 
 import h5py  # type: ignore
 import numpy  # type: ignore
@@ -31,6 +44,10 @@ import numpy  # type: ignore
 from om.algorithms import calibration as calib_algs
 from om.data_retrieval_layer import base as drl_base
 from om.data_retrieval_layer import functions_jungfrau1M, functions_pilatus
+from om.lib.peakfinder8_extension import (  # type: ignore
+    MappedFrameReader,
+    decode_cbf_frame,
+)
 from om.utils import exceptions, parameters
 
 try:
@@ -41,6 +58,63 @@ except ImportError:
     )
 
 
+def _prefetch_files(entries: Iterable[str]) -> Generator[str, None, None]:
+    # Yields the entries of a file list, one at a time. Before yielding an entry, asks
+    # the kernel to start reading the file of the next one, so that the file is
+    # already in memory when it is opened.
+    previous_entry: Union[str, None] = None
+    entry: str
+    for entry in entries:
+        if hasattr(os, "posix_fadvise"):
+            try:
+                fd: int = os.open(entry.strip(), os.O_RDONLY)
+                os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_WILLNEED)
+                os.close(fd)
+            except OSError:
+                pass
+        if previous_entry is not None:
+            yield previous_entry
+        previous_entry = entry
+    if previous_entry is not None:
+        yield previous_entry
+
+
+def _read_cbf_frame(filename: str) -> numpy.ndarray:
+    # Decodes the frame stored in a CBF file straight from a memory map of the file.
+    fhandle: BinaryIO
+    with open(filename, "rb") as fhandle:
+        cbf_map: mmap.mmap = mmap.mmap(fhandle.fileno(), 0, access=mmap.ACCESS_READ)
+    try:
+        return decode_cbf_frame(cbf_map)
+    finally:
+        cbf_map.close()
+
+
+def _map_dataset_frames(h5file: Any, h5_data_path: str) -> Any:
+    # Maps into memory the frames of a HDF5 dataset, if they are stored contiguously,
+    # uncompressed and in the byte order of the machine. Returns None otherwise.
+    dataset: Any = h5file[h5_data_path]
+    offset: Union[int, None] = dataset.id.get_offset()
+    if (
+        offset is None
+        or dataset.chunks is not None
+        or not dataset.dtype.isnative
+        or len(dataset.shape) < 2
+        or dataset.shape[0] == 0
+    ):
+        return None
+    try:
+        return MappedFrameReader(
+            str(pathlib.Path(h5file.filename).resolve()),
+            offset,
+            dataset.shape[0],
+            dataset.shape[1:],
+            dataset.dtype,
+        )
+    except RuntimeError:
+        return None
+
+
 class FilesBaseDataEventHandler(drl_base.OmDataEventHandler):
     """
     See documentation of the `__init__` function.
@@ -210,6 +284,13 @@ class PilatusFilesDataEventHandler(FilesBaseDataEventHandler):
         )
         self._event_info_to_append["calibration"] = calibration
 
+        memory_mapped_files: Union[bool, None] = self._monitor_params.get_param(
+            group="data_retrieval_layer",
+            parameter="memory_mapped_files",
+            parameter_type=bool,
+        )
+        self._memory_mapped_files: bool = memory_mapped_files is True
+
         if "beam_energy" in required_data:
             self._event_info_to_append["beam_energy"] = self._monitor_params.get_param(
                 group="data_retrieval_layer",
@@ -241,7 +322,11 @@ class PilatusFilesDataEventHandler(FilesBaseDataEventHandler):
         This Data Event Handler distributes the files from the data source as evenly as
         possible across all the processing nodes. Each node ideally retrieves the same
         number of files from the source. Only the last node might retrieve fewer files,
-        depending on how evenly the total number can be split.
+        depending on how evenly the total number can be split. If an event scheduler
+        has been set, the nodes instead claim batches of files from the scheduler.
+
+        When the files are memory-mapped, the kernel starts reading each file while
+        the previous one is being processed.
 
         This generator function yields a dictionary storing the data for the current
         event.
@@ -254,10 +339,6 @@ class PilatusFilesDataEventHandler(FilesBaseDataEventHandler):
             node_pool_size: The total number of nodes in the OM pool, including all the
                 processing nodes and the collecting node.
         """
-        # Computes how many files the current processing node should process. Splits
-        # the files as equally as possible amongst the processing nodes with the last
-        # processing node getting a smaller number of files if the number of files to
-        # be processed cannot be exactly divided by the number of processing nodes.
         try:
             fhandle: TextIO
             with open(self._source, "r") as fhandle:
@@ -266,20 +347,20 @@ class PilatusFilesDataEventHandler(FilesBaseDataEventHandler):
             raise RuntimeError(
                 "Error reading the {0} source file.".format(self._source)
             ) from exc
-        num_files_curr_node: int = int(
-            numpy.ceil(len(filelist) / float(node_pool_size - 1))
-        )
-        files_curr_node: List[str] = filelist[
-            ((node_rank - 1) * num_files_curr_node) : (node_rank * num_files_curr_node)
-        ]
 
         data_event: Dict[str, Dict[str, Any]] = {}
         data_event["data_extraction_funcs"] = self._required_data_extraction_funcs
         data_event["additional_info"] = {}
         data_event["additional_info"].update(self._event_info_to_append)
 
+        entries: Iterable[str] = self.select_events(
+            filelist, node_rank, node_pool_size
+        )
+        if self._memory_mapped_files:
+            entries = _prefetch_files(entries)
+
         entry: str
-        for entry in files_curr_node:
+        for entry in entries:
             stripped_entry: str = entry.strip()
             data_event["additional_info"]["full_path"] = stripped_entry
 
@@ -301,10 +382,21 @@ class PilatusFilesDataEventHandler(FilesBaseDataEventHandler):
         This function opens each CBF file and associates its content with the 'data'
         key of the 'event' dictionary.
 
+        When the files are memory-mapped, the frame is instead decoded straight from a
+        memory map of the file, and the decoded frame is associated with the key. The
+        files that are not compressed with the byte offset algorithm are still opened
+        as usual.
+
         Arguments:
 
             event: A dictionary storing the event data.
         """
+        if self._memory_mapped_files:
+            try:
+                event["data"] = _read_cbf_frame(event["additional_info"]["full_path"])
+                return
+            except ValueError:
+                pass
         event["data"] = fabio.open(event["additional_info"]["full_path"])
 
     def close_event(self, event: Dict[str, Any]) -> None:
@@ -451,6 +543,13 @@ class Jungfrau1MFilesDataEventHandler(FilesBaseDataEventHandler):
             required=True,
         )
         self._event_info_to_append["calibration"] = calibration
+
+        memory_mapped_files: Union[bool, None] = self._monitor_params.get_param(
+            group="data_retrieval_layer",
+            parameter="memory_mapped_files",
+            parameter_type=bool,
+        )
+        self._memory_mapped_files: bool = memory_mapped_files is True
         if calibration is True:
             calibration_dark_filenames: List[str] = self._monitor_params.get_param(
                 group="data_retrieval_layer",
@@ -470,12 +569,20 @@ class Jungfrau1MFilesDataEventHandler(FilesBaseDataEventHandler):
                 parameter_type=float,
                 required=True,
             )
+            shared_detector_constants: Union[
+                str, None
+            ] = self._monitor_params.get_param(
+                group="om", parameter="shared_detector_constants", parameter_type=str
+            )
+            if shared_detector_constants is None:
+                shared_detector_constants = "none"
             self._event_info_to_append[
                 "calibration_algorithm"
             ] = calib_algs.Jungfrau1MCalibration(
                 calibration_dark_filenames,
                 calibration_gain_filenames,
                 calibration_photon_energy_kev,
+                shared_constants=shared_detector_constants,
             )
 
         if "beam_energy" in required_data:
@@ -510,7 +617,13 @@ class Jungfrau1MFilesDataEventHandler(FilesBaseDataEventHandler):
         separate event. The frames retrieved from the data source are split as evenly
         as possible across all the processing nodes. Each node ideally retrieves the
         same number of frames from the source. Only the last node might retrieve fewer
-        frames, depending on how evenly the total number can be split.
+        frames, depending on how evenly the total number can be split. If an event
+        scheduler has been set, the nodes instead claim batches of frames from the
+        scheduler.
+
+        When the files are memory-mapped, the frames stored contiguously and
+        uncompressed in the HDF5 files are read straight from memory maps of the files,
+        and the kernel reads ahead the frames that follow the current one.
 
         This generator function yields a dictionary storing the data for the current
         event.
@@ -523,10 +636,6 @@ class Jungfrau1MFilesDataEventHandler(FilesBaseDataEventHandler):
             node_pool_size: The total number of nodes in the OM pool, including all the
                 processing nodes and the collecting node.
         """
-        # Computes how many events the current processing node should process. Splits
-        # the events as equally as possible amongst the processing nodes with the last
-        # processing node getting a smaller number of events if the number of events to
-        # be processed cannot be exactly divided by the number of processing nodes.
         try:
             fhandle: TextIO
             with open(self._source, "r") as fhandle:
@@ -553,6 +662,23 @@ class Jungfrau1MFilesDataEventHandler(FilesBaseDataEventHandler):
 
             h5_data_path: str = "/data_" + re.findall(r"_(f\d+)_", filename)[0]
 
+            # When the files are memory-mapped, the frames are read from the maps
+            # instead of through the HDF5 library, if both datasets can be mapped.
+            frame_readers: Union[Tuple[Any, Any], None] = None
+            if self._memory_mapped_files:
+                frame_readers = (
+                    _map_dataset_frames(h5files[0], h5_data_path),
+                    _map_dataset_frames(h5files[1], h5_data_path),
+                )
+                if frame_readers[0] is None or frame_readers[1] is None:
+                    print(
+                        "OM Warning: The frames in {0} cannot be memory-mapped. "
+                        "They will be read through the HDF5 library.".format(
+                            filename_d0
+                        )
+                    )
+                    frame_readers = None
+
             frame_numbers: List[numpy.ndarray] = [
                 h5file["/frameNumber"][:] for h5file in h5files
             ]
@@ -568,6 +694,7 @@ class Jungfrau1MFilesDataEventHandler(FilesBaseDataEventHandler):
                 frame_list.append(
                     {
                         "h5files": h5files,
+                        "frame_readers": frame_readers,
                         "index": (ind0, ind1),
                         "h5_data_path": h5_data_path,
                         "frame_number": frame_number,
@@ -579,16 +706,24 @@ class Jungfrau1MFilesDataEventHandler(FilesBaseDataEventHandler):
                     }
                 )
 
-        num_frames_curr_node: int = int(
-            numpy.ceil(len(frame_list) / float(node_pool_size - 1))
-        )
-        frames_curr_node: List[Dict[str, Any]] = frame_list[
-            ((node_rank - 1) * num_frames_curr_node) : (
-                node_rank * num_frames_curr_node
+        # With an event scheduler, the number of frames that the current node will
+        # process is not known in advance, and the total number of frames is reported
+        # instead.
+        if self._event_scheduler is None:
+            num_frames_per_node: int = int(
+                numpy.ceil(len(frame_list) / float(node_pool_size - 1))
             )
-        ]
-
-        print("Num frames current node:", node_rank, num_frames_curr_node)
+            print("Num frames current node:", node_rank, num_frames_per_node)
+            num_frames_curr_node: int = len(
+                frame_list[
+                    ((node_rank - 1) * num_frames_per_node) : (
+                        node_rank * num_frames_per_node
+                    )
+                ]
+            )
+        else:
+            num_frames_curr_node = len(frame_list)
+            print("Num frames all nodes:", node_rank, num_frames_curr_node)
 
         data_event: Dict[str, Dict[str, Any]] = {}
         data_event["data_extraction_funcs"] = self._required_data_extraction_funcs
@@ -596,11 +731,11 @@ class Jungfrau1MFilesDataEventHandler(FilesBaseDataEventHandler):
         data_event["additional_info"].update(self._event_info_to_append)
 
         entry: Dict[str, Any]
-        for entry in frames_curr_node:
+        for entry in self.select_events(frame_list, node_rank, node_pool_size):
             data_event["additional_info"].update(entry)
-            data_event["additional_info"]["num_frames_curr_node"] = len(
-                frames_curr_node
-            )
+            data_event["additional_info"][
+                "num_frames_curr_node"
+            ] = num_frames_curr_node
 
             yield data_event
 
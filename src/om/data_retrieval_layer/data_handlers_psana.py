@@ -21,7 +21,7 @@ Retrieval and handling of data events from psana.
 This module contains Data Event Handlers for events retrieved from the psana software
 framework (used at the LCLS facility).
 """
-from typing import Any, Callable, Dict, Generator, List
+from typing import Any, Callable, Dict, Generator, List, Tuple, Union
 
 import numpy  # type: ignore
 from om.data_retrieval_layer import base as drl_base
@@ -43,13 +43,38 @@ except ImportError:
 
 
 def _psana_offline_event_generator(
-    psana_source: Any, node_rank: int, mpi_pool_size: int
+    psana_source: Any,
+    node_rank: int,
+    mpi_pool_size: int,
+    event_scheduler: Union[drl_base.OmEventScheduler, None],
 ) -> Any:
     # Computes how many events the current processing node should process. Splits the
     # events as equally as possible amongst the processing nodes. If the number of
     # events cannot be exactly divided by the number of processing nodes, an additional
     # processing node is assigned the residual events.
+    #
+    # With an event scheduler, the runs are processed one at a time, and the events of
+    # each run are appended to a single list, from which the processing nodes claim
+    # batches of events. Each event is retrieved while its run is the current one.
     run: Any
+    if event_scheduler is not None:
+        num_events: int = 0
+        for run in psana_source.runs():
+            run_times: Any = run.times()
+            run_start: int = num_events
+            num_events += len(run_times)
+            while True:
+                batch: Union[Tuple[int, int], None] = event_scheduler.claim_events(
+                    num_events
+                )
+                if batch is None:
+                    break
+                evt: Any
+                for evt in run_times[batch[0] - run_start : batch[1] - run_start]:
+
+                    yield run.event(evt)
+        return
+
     for run in psana_source.runs():
         times: Any = run.times()
         num_events_curr_node: int = int(
@@ -58,7 +83,6 @@ def _psana_offline_event_generator(
         events_curr_node: Any = times[
             (node_rank - 1) * num_events_curr_node : node_rank * num_events_curr_node
         ]
-        evt: Any
         for evt in events_curr_node:
 
             yield run.event(evt)
@@ -243,7 +267,9 @@ class LclsBaseDataEventHandler(drl_base.OmDataEventHandler):
         Handler distributes the data events as evenly as possible across all the
         processing nodes. Each node ideally retrieves the same number of events from
         psana. Only the last node might retrieve fewer events, depending on how evenly
-        the total number can be split.
+        the total number can be split. If an event scheduler has been set, the nodes
+        instead go through the runs one at a time, and claim batches of the events of
+        each run from the scheduler.
 
         Each retrieved psana event contains a single detector frame, along with all the
         data whose timestamp matches the timestamp of the frame. This is also true for
@@ -306,6 +332,7 @@ class LclsBaseDataEventHandler(drl_base.OmDataEventHandler):
                 psana_source=psana_source,
                 node_rank=node_rank,
                 mpi_pool_size=node_pool_size,
+                event_scheduler=self._event_scheduler,
             )
         else:
             psana_events = psana_source.events()
@@ -21,7 +21,7 @@ Retrieval of Jungfrau 1M detector data from files.
 This module contains functions that retrieve Jungfrau 1M detector data from HDF5 files
 written by the detector itself.
 """
-from typing import Any, Dict, Tuple, cast
+from typing import Any, Dict, List, Tuple, Union, cast
 
 import numpy  # type: ignore
 
@@ -41,20 +41,29 @@ def detector_data(event: Dict[str, Any]) -> numpy.ndarray:
 
         One frame of detector data.
     """
-    # Returns the data from the Jungfrau HDF5 files
+    # Returns the data from the Jungfrau HDF5 files, or from their memory maps if the
+    # files are memory-mapped.
     h5files: Tuple[Any, Any] = event["additional_info"]["h5files"]
     h5_data_path: str = event["additional_info"]["h5_data_path"]
     index: Tuple[int, int] = event["additional_info"]["index"]
+    frame_readers: Union[Tuple[Any, Any], None] = event["additional_info"][
+        "frame_readers"
+    ]
 
-    data: numpy.ndarray = numpy.concatenate(
-        [h5files[i][h5_data_path][index[i]] for i in range(len(h5files))]
-    )
+    panels: List[numpy.ndarray]
+    if frame_readers is not None:
+        panels = [frame_readers[i].frame(index[i]) for i in range(len(frame_readers))]
+    else:
+        panels = [h5files[i][h5_data_path][index[i]] for i in range(len(h5files))]
+
+    # When the data is calibrated, each panel is calibrated straight into its rows of
+    # the frame, so that the memory-mapped panels are never joined into a raw frame.
     if event["additional_info"]["calibration"]:
         calibrated_data: numpy.ndarray = event["additional_info"][
             "calibration_algorithm"
-        ].apply_calibration(data)
+        ].apply_calibration_to_panels(panels)
     else:
-        calibrated_data = data
+        calibrated_data = numpy.concatenate(panels)
 
     return calibrated_data
 
@@ -42,7 +42,10 @@ def detector_data(event: Dict[str, Any]) -> numpy.ndarray:
 
         One frame of detector data.
     """
-    # Returns the data from the fabio cbf_obj object previously stored in the event.
+    # Returns the data from the fabio cbf_obj object previously stored in the event,
+    # or the frame itself, if it was decoded from a memory map of the file.
+    if isinstance(event["data"], numpy.ndarray):
+        return event["data"]
     return event["data"].data
 
 
@@ -30,6 +30,7 @@ from typing import Any, Deque, Dict, Union
 
 import click
 import numpy  # type: ignore
+from om.algorithms import crystallography as cryst_algs
 from om.graphical_interfaces import base as graph_interfaces_base
 from om.utils import exceptions
 
@@ -197,6 +198,12 @@ class CrystallographyFrameViewer(graph_interfaces_base.OmGui):
             # If no data has been received, returns without drawing anything.
             return
 
+        if "compressed_frame_data" in local_data:
+            # Compressed frames are decompressed only once, when they are received.
+            local_data["frame_data"] = cryst_algs.decompress_frame(
+                local_data.pop("compressed_frame_data")
+            )
+
         self._frame_list.append(copy.deepcopy(local_data))
         self._current_frame_index = len(self._frame_list) - 1
 
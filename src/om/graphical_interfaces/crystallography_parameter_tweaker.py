@@ -77,7 +77,8 @@ class CrystallographyParameterTweaker(graph_interfaces_base.OmGui):
         to each received frame. FInally, it displays the frame together with the
         detected peaks. A data buffer allows the GUI to stop receiving data from the
         monitor but still keep in memory the last 10 received frames to inspect and
-        operate on.
+        operate on. The GUI can also sweep one of the peak-finding parameters, and plot
+        how the hit rate of the frames in the buffer changes with it.
 
         Arguments:
 
@@ -210,6 +211,28 @@ class CrystallographyParameterTweaker(graph_interfaces_base.OmGui):
             required=True,
         )
 
+        self._min_num_peaks_for_hit: int = self._monitor_params.get_param(
+            group="crystallography",
+            parameter="min_num_peaks_for_hit",
+            parameter_type=int,
+            required=True,
+        )
+        self._max_num_peaks_for_hit: int = self._monitor_params.get_param(
+            group="crystallography",
+            parameter="max_num_peaks_for_hit",
+            parameter_type=int,
+            required=True,
+        )
+
+        pf8_background_estimator: Union[str, None] = self._monitor_params.get_param(
+            group="peakfinder8_peak_detection",
+            parameter="background_estimator",
+            parameter_type=str,
+        )
+        if pf8_background_estimator is None:
+            pf8_background_estimator = "sigma_clipping"
+        self._pf8_background_estimator: str = pf8_background_estimator
+
         pf8_bad_pixel_map_fname: Union[str, None] = self._monitor_params.get_param(
             group="peakfinder8_peak_detection",
             parameter="bad_pixel_map_filename",
@@ -249,6 +272,10 @@ class CrystallographyParameterTweaker(graph_interfaces_base.OmGui):
         else:
             self._pf8_bad_pixel_map = None
 
+        # The peak detection algorithm is created with the first search, and is
+        # reused as long as the maximum peak size fits in its buffers.
+        self._peak_detection: Union[cryst_algs.Peakfinder8PeakDetection, None] = None
+
         pyqtgraph.setConfigOption("background", 0.2)
 
         self._ring_pen: Any = pyqtgraph.mkPen("r", width=2)
@@ -357,6 +384,31 @@ class CrystallographyParameterTweaker(graph_interfaces_base.OmGui):
         self._horizontal_layout8.addWidget(self._max_res_label)
         self._horizontal_layout8.addWidget(self._max_res_lineedit)
 
+        self._sweep_label: Any = QtGui.QLabel(self)
+        self._sweep_label.setText("<b>Parameter Sweep:</b>")
+        self._sweep_parameter_combobox: Any = QtGui.QComboBox(self)
+        self._sweep_parameter_combobox.addItems(
+            [
+                "minimum_snr",
+                "adc_threshold",
+                "min_pixel_count",
+                "max_pixel_count",
+                "local_bg_radius",
+            ]
+        )
+        self._sweep_button: Any = QtGui.QPushButton(text="Sweep")
+        self._sweep_button.clicked.connect(self._sweep_button_clicked)
+        self._horizontal_layout9: Any = QtGui.QHBoxLayout()
+        self._horizontal_layout9.addWidget(self._sweep_parameter_combobox)
+        self._horizontal_layout9.addWidget(self._sweep_button)
+
+        self._sweep_plot_widget: Any = pyqtgraph.PlotWidget()
+        self._sweep_plot_widget.setTitle("Hit Rate vs. Parameter")
+        self._sweep_plot_widget.setLabel(axis="left", text="Hit Rate")
+        self._sweep_plot_widget.showGrid(x=True, y=True)
+        self._sweep_plot_widget.setYRange(0, 100.0)
+        self._sweep_plot: Any = self._sweep_plot_widget.plot([], [], symbol="o")
+
         self._splitter: Any = QtGui.QSplitter(QtCore.Qt.Horizontal)
         self._horizontal_layout1: Any = QtGui.QHBoxLayout()
         self._horizontal_layout1.addWidget(self._back_button)
@@ -375,6 +427,9 @@ class CrystallographyParameterTweaker(graph_interfaces_base.OmGui):
         self._vertical_layout_1.insertLayout(0, self._horizontal_layout3)
         self._vertical_layout_1.insertLayout(0, self._horizontal_layout2)
         self._vertical_layout_1.insertWidget(0, self._param_label)
+        self._vertical_layout_1.addWidget(self._sweep_label)
+        self._vertical_layout_1.addLayout(self._horizontal_layout9)
+        self._vertical_layout_1.addWidget(self._sweep_plot_widget)
         self._vertical_layout_1.addStretch(1)
         self._vertical_layout_0_widget: Any = QtGui.QWidget()
         self._vertical_layout_0_widget.setLayout(self._vertical_layout_0)
@@ -408,14 +463,13 @@ class CrystallographyParameterTweaker(graph_interfaces_base.OmGui):
             pxMode=False,
         )
 
-    def _update_peak_detection(self) -> None:
-        # Performs peak detection with the current parameters
-
-        try:
-            current_data: numpy.ndarray = self._frame_list[self._current_frame_index]
-        except IndexError:
-            # If the framebuffer is empty, returns without drawing anything.
-            return
+    def _get_peak_detection(
+        self,
+    ) -> Union[cryst_algs.Peakfinder8PeakDetection, None]:
+        # Returns the peak detection algorithm, with the current parameters. The
+        # parameters of the existing algorithm are changed in place, and a new one is
+        # only created when the maximum peak size does not fit in its buffers. Returns
+        # None if any of the parameters is not a valid number.
         try:
             pf8_adc_threshold: float = float(self._adc_threshold_lineedit.text())
             pf8_minimum_snr: float = float(self._min_snr_lineedit.text())
@@ -425,27 +479,59 @@ class CrystallographyParameterTweaker(graph_interfaces_base.OmGui):
             pf8_min_res: int = int(self._min_res_lineedit.text())
             pf8_max_res: int = int(self._max_res_lineedit.text())
         except ValueError:
-            return
+            return None
 
-        peak_detection: cryst_algs.Peakfinder8PeakDetection = (
-            cryst_algs.Peakfinder8PeakDetection(
-                max_num_peaks=self._pf8_max_num_peaks,
-                asic_nx=self._pf8_detector_info["asic_nx"],
-                asic_ny=self._pf8_detector_info["asic_ny"],
-                nasics_x=self._pf8_detector_info["nasics_x"],
-                nasics_y=self._pf8_detector_info["nasics_y"],
-                adc_threshold=pf8_adc_threshold,
-                minimum_snr=pf8_minimum_snr,
-                min_pixel_count=pf8_min_pixel_count,
-                max_pixel_count=pf8_max_pixel_count,
-                local_bg_radius=pf8_local_bg_radius,
-                min_res=pf8_min_res,
-                max_res=pf8_max_res,
-                bad_pixel_map=self._pf8_bad_pixel_map,
-                radius_pixel_map=self._pixelmaps["radius"],
-            )
+        if self._peak_detection is not None:
+            try:
+                self._peak_detection.set_parameters(
+                    adc_threshold=pf8_adc_threshold,
+                    minimum_snr=pf8_minimum_snr,
+                    min_pixel_count=pf8_min_pixel_count,
+                    max_pixel_count=pf8_max_pixel_count,
+                    local_bg_radius=pf8_local_bg_radius,
+                    min_res=pf8_min_res,
+                    max_res=pf8_max_res,
+                )
+                return self._peak_detection
+            except ValueError:
+                pass
+
+        self._peak_detection = cryst_algs.Peakfinder8PeakDetection(
+            max_num_peaks=self._pf8_max_num_peaks,
+            asic_nx=self._pf8_detector_info["asic_nx"],
+            asic_ny=self._pf8_detector_info["asic_ny"],
+            nasics_x=self._pf8_detector_info["nasics_x"],
+            nasics_y=self._pf8_detector_info["nasics_y"],
+            adc_threshold=pf8_adc_threshold,
+            minimum_snr=pf8_minimum_snr,
+            min_pixel_count=pf8_min_pixel_count,
+            max_pixel_count=pf8_max_pixel_count,
+            local_bg_radius=pf8_local_bg_radius,
+            min_res=pf8_min_res,
+            max_res=pf8_max_res,
+            bad_pixel_map=self._pf8_bad_pixel_map,
+            radius_pixel_map=self._pixelmaps["radius"],
+            background_estimator=self._pf8_background_estimator,
         )
+        return self._peak_detection
+
+    def _update_peak_detection(self) -> None:
+        # Performs peak detection with the current parameters
+
+        try:
+            current_data: numpy.ndarray = self._frame_list[self._current_frame_index]
+        except IndexError:
+            # If the framebuffer is empty, returns without drawing anything.
+            return
+        peak_detection: Union[
+            cryst_algs.Peakfinder8PeakDetection, None
+        ] = self._get_peak_detection()
+        if peak_detection is None:
+            return
 
+        # Each frame is shown as if it were the first one processed by a new
+        # algorithm, without the background model of the frames shown before.
+        peak_detection.reset_background()
         peak_list: cryst_algs.TypePeakList = peak_detection.find_peaks(
             current_data["detector_data"]
         )
@@ -475,6 +561,55 @@ class CrystallographyParameterTweaker(graph_interfaces_base.OmGui):
             peak_list_y_in_frame=peak_list_y_in_frame,
         )
 
+    def _sweep_button_clicked(self) -> None:
+        # Computes how the hit rate of the frames in the buffer changes with the
+        # parameter chosen for the sweep, keeping the other parameters fixed. The
+        # peaks are searched only once per frame for all the values of the parameter.
+        if len(self._frame_list) == 0:
+            return
+        peak_detection: Union[
+            cryst_algs.Peakfinder8PeakDetection, None
+        ] = self._get_peak_detection()
+        if peak_detection is None:
+            return
+
+        parameter: str = self._sweep_parameter_combobox.currentText()
+        min_pixel_count: int = int(self._min_pixel_count_lineedit.text())
+        max_pixel_count: int = int(self._max_pixel_count_lineedit.text())
+        values: numpy.ndarray
+        if parameter == "adc_threshold":
+            values = numpy.linspace(0.25, 2.0, num=15) * float(
+                self._adc_threshold_lineedit.text()
+            )
+        elif parameter == "minimum_snr":
+            values = numpy.linspace(0.25, 2.0, num=15) * float(
+                self._min_snr_lineedit.text()
+            )
+        elif parameter == "min_pixel_count":
+            values = numpy.arange(1, max_pixel_count + 1)
+        elif parameter == "max_pixel_count":
+            # The peak detection cannot store peaks larger than its maximum size
+            values = numpy.arange(min_pixel_count, max_pixel_count + 1)
+        else:
+            values = numpy.arange(1, 2 * int(self._local_bg_radius_lineedit.text()) + 1)
+        parameter_sets: List[Dict[str, float]] = [
+            {parameter: value} for value in values
+        ]
+
+        num_hits: numpy.ndarray = numpy.zeros(len(values))
+        frame: Dict[str, Any]
+        for frame in self._frame_list:
+            num_peaks: numpy.ndarray = peak_detection.sweep_peak_counts(
+                frame["detector_data"], parameter_sets
+            )
+            num_hits += (num_peaks > self._min_num_peaks_for_hit) & (
+                num_peaks < self._max_num_peaks_for_hit
+            )
+            QtGui.QApplication.processEvents()
+
+        self._sweep_plot_widget.setLabel(axis="bottom", text=parameter)
+        self._sweep_plot.setData(values, 100.0 * num_hits / len(self._frame_list))
+
     def _update_image_and_peaks(self) -> None:
         # Updates the image and Bragg peaks shown by the viewer.
 
@@ -537,6 +672,12 @@ class CrystallographyParameterTweaker(graph_interfaces_base.OmGui):
             # If no data has been received, returns without drawing anything.
             return
 
+        if "compressed_detector_data" in local_data:
+            # Compressed frames are decompressed only once, when they are received.
+            local_data["detector_data"] = cryst_algs.decompress_frame(
+                local_data.pop("compressed_detector_data")
+            )
+
         self._frame_list.append(copy.deepcopy(local_data))
         self._current_frame_index = len(self._frame_list) - 1
 
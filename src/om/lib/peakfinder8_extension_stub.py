@@ -21,10 +21,66 @@ Peakfinder8 extension.
 This extension contains an implementation of Cheetah's 'peakfinder8' peak detection
 algorithm.
 """
-from typing import List, Tuple
+from typing import Any, Dict, List, Tuple, Union
 
 import numpy  # type: ignore
 
+peak_list_dtype: numpy.dtype = numpy.dtype(
+    [
+        ("fs", numpy.float32),
+        ("ss", numpy.float32),
+        ("intensity", numpy.float32),
+        ("num_pixels", numpy.float32),
+        ("max_pixel_intensity", numpy.float32),
+        ("sigma", numpy.float32),
+        ("snr", numpy.float32),
+        ("x_assembled", numpy.float32),
+        ("y_assembled", numpy.float32),
+        ("r_assembled", numpy.float32),
+        ("q", numpy.float32),
+        ("resolution", numpy.float32),
+    ]
+)
+"""
+Structured array type of the peak lists returned by the [find_peaks_array]
+[om.lib.peakfinder8_extension_stub.Peakfinder8Context.find_peaks_array] function.
+
+All the fields are float32, so that a peak list can also be seen as a 2D float32 array
+with one row per peak:
+
+* `fs`: the fractional fs index of the peak in the data frame.
+
+* `ss`: the fractional ss index of the peak in the data frame.
+
+* `intensity`: the integrated intensity of the peak.
+
+* `num_pixels`: the number of pixels that make up the peak.
+
+* `max_pixel_intensity`: the value of the pixel with the maximum intensity.
+
+* `sigma`: the standard deviation of the local background.
+
+* `snr`: the signal-to-noise ratio of the peak.
+
+* `x_assembled`: the x coordinate of the peak in the detector reference system, in
+  pixels.
+
+* `y_assembled`: the y coordinate of the peak in the detector reference system, in
+  pixels.
+
+* `r_assembled`: the distance of the peak from the center of the detector, in pixels.
+
+* `q`: the modulus of the scattering vector of the peak, in 1/Angstrom.
+
+* `resolution`: the resolution of the peak, in Angstrom.
+
+The assembled position of the peaks is only filled when the geometry has been set
+with the [set_peak_geometry]
+[om.lib.peakfinder8_extension_stub.Peakfinder8Context.set_peak_geometry] function,
+and the scattering vector and the resolution only when the beam parameters are also
+known. Otherwise, the fields are zero.
+"""
+
 
 def peakfinder_8(
     max_num_peaks: int,
@@ -138,3 +194,1578 @@ def peakfinder_8(
           detected peak.
     """
     pass
+
+
+def gpu_available() -> bool:
+    """
+    Whether the GPU backend of peakfinder8 can be used.
+
+    Returns:
+
+        True if the extension was built with GPU support and a GPU device is
+        available, False otherwise.
+    """
+    pass
+
+
+def jungfrau_calibrate(
+    data: numpy.ndarray,
+    dark: numpy.ndarray,
+    gain: numpy.ndarray,
+    first_row: int = 0,
+    out: Union[numpy.ndarray, None] = None,
+) -> numpy.ndarray:
+    """
+    Calibrates a raw Jungfrau data frame, or a block of rows of it.
+
+    This function determines the gain stage of each pixel from its two highest bits,
+    and computes (raw - dark) / gain with the dark and gain of that stage, in a single
+    pass over the data. A frame stored in several files can be calibrated one panel at
+    a time, straight into the rows of a preallocated frame, without joining the raw
+    panels first.
+
+    Arguments:
+
+        data: The raw detector data (a 2D uint16 array). It stores the rows of the
+            frame starting from the `first_row` row.
+
+        dark: The dark data of the whole frame for the three gain stages (a 3D float32
+            array, with the gain stage as first index).
+
+        gain: The gain of each pixel of the whole frame for the three gain stages,
+            already multiplied by the photon energy (a 3D float64 array, with the gain
+            stage as first index).
+
+        first_row: The row of the frame that corresponds to the first row of the raw
+            data. Defaults to 0.
+
+        out: An optional C-contiguous 2D float32 array, with the same shape as the raw
+            data, in which the calibrated data is written. If this argument is None, a
+            new array is allocated. Defaults to None.
+
+    Returns:
+
+        The calibrated data (a 2D float32 array with the same shape as the raw data).
+        If the `out` argument is provided, the array itself is returned.
+
+    Raises:
+
+        ValueError: A ValueError is raised if the dark and gain arrays do not have the
+            same shape, if the raw data does not fit in the frame that they describe,
+            or if the `out` array does not have the shape of the raw data.
+    """
+    pass
+
+
+def fill_peak_resolution(
+    peak_list: numpy.ndarray,
+    pixels_per_meter: float,
+    beam_energy: float,
+    detector_distance: float,
+) -> None:
+    """
+    Fills the scattering vector and the resolution of a list of peaks.
+
+    This function computes the `q` and `resolution` fields of each peak in place, from
+    its `r_assembled` field, for the given beam energy and detector distance. It can
+    be used when the beam parameters are only known after the peaks have been found.
+    The fields are set to zero when the beam energy or the detector distance are not
+    positive.
+
+    Arguments:
+
+        peak_list: The peaks, in a C-contiguous structured array with the
+            [peak_list_dtype][om.lib.peakfinder8_extension_stub.peak_list_dtype]
+            type, with the `r_assembled` field already filled.
+
+        pixels_per_meter: The size of the detector pixels, as the number of pixels
+            per meter.
+
+        beam_energy: The beam energy, in eV.
+
+        detector_distance: The distance between the sample and the detector, in
+            meters.
+
+    Raises:
+
+        ValueError: A ValueError is raised if the peak list is not a C-contiguous
+            array of the [peak_list_dtype]
+            [om.lib.peakfinder8_extension_stub.peak_list_dtype] type.
+    """
+    pass
+
+
+def encode_sparse_frame(
+    data: numpy.ndarray,
+    peak_list: numpy.ndarray,
+    peak_radius: int,
+    step: float,
+    bin_size: int,
+) -> numpy.ndarray:
+    """
+    Encodes a data frame around its peaks.
+
+    This function keeps the pixels in a square box around each peak at full
+    precision. The rest of the frame, which only carries background, is averaged over
+    square blocks of pixels and quantized to 16-bit integers.
+
+    Arguments:
+
+        data: The data frame (a 2D float32 array).
+
+        peak_list: The peaks of the frame, in a structured array with the
+            [peak_list_dtype][om.lib.peakfinder8_extension_stub.peak_list_dtype]
+            type. The fs and ss fields of each peak are its column and its row in the
+            data frame. Peaks with a position that is not finite, or too far outside
+            the frame for their box to overlap it, are skipped.
+
+        peak_radius: The half-size, in pixels, of the box kept around each peak.
+
+        step: The quantization step of the background, in ADUs.
+
+        bin_size: The size, in pixels, of the blocks over which the background is
+            averaged.
+
+    Returns:
+
+        The encoded frame (a 1D uint8 array), which can be decoded with the
+        [decode_sparse_frame][om.lib.peakfinder8_extension_stub.decode_sparse_frame]
+        function.
+
+    Raises:
+
+        ValueError: A ValueError is raised if the peak radius is negative, or if the
+            quantization step or the bin size are not positive.
+    """
+    pass
+
+
+def decode_sparse_frame(encoded: Union[numpy.ndarray, bytes]) -> numpy.ndarray:
+    """
+    Decodes a data frame encoded with the [encode_sparse_frame]
+    [om.lib.peakfinder8_extension_stub.encode_sparse_frame] function.
+
+    Arguments:
+
+        encoded: The encoded frame (a 1D uint8 array or a bytes object).
+
+    Returns:
+
+        The decoded data frame (a 2D float32 array). The background pixels store the
+        quantized average of their block.
+
+    Raises:
+
+        ValueError: A ValueError is raised if the buffer does not store an encoded
+            frame.
+    """
+    pass
+
+
+def decode_cbf_frame(buffer: Any) -> numpy.ndarray:
+    """
+    Decodes the data frame stored in a CBF file.
+
+    This function decodes, in a single pass, a frame compressed with the byte offset
+    algorithm, which is used by the Pilatus detectors. The content of the file can be
+    passed straight from a memory map of the file, without being copied first.
+
+    Arguments:
+
+        buffer: The content of the CBF file (a 1D uint8 array, a bytes object, or any
+            object that exposes its memory, like a memory map).
+
+    Returns:
+
+        The decoded data frame (a 2D int32 array).
+
+    Raises:
+
+        ValueError: A ValueError is raised if the buffer does not store a frame
+            compressed with the byte offset algorithm.
+    """
+    pass
+
+
+def write_pixel_map_cache(
+    filename: str, key: str, panels: List[Dict[str, Any]]
+) -> None:
+    """
+    Computes the pixel maps of a detector and stores them in a cache file.
+
+    This function computes the pixel maps of a detector from the panels of a CrystFEL
+    geometry, like the [compute_pix_maps]
+    [om.utils.crystfel_geometry.compute_pix_maps] function does, together with the
+    radial bin of each pixel used by a [Peakfinder8Context]
+    [om.lib.peakfinder8_extension_stub.Peakfinder8Context] and the runs of pixels
+    covered by the panels. They are written to a cache file that can then be opened
+    by a [PixelMapCache][om.lib.peakfinder8_extension_stub.PixelMapCache]. The file
+    is written under a temporary name, and then renamed: processes that write the
+    same cache at the same time do not interfere with each other, and never see an
+    incomplete file.
+
+    Arguments:
+
+        filename: The name of the cache file.
+
+        key: A string of up to 127 characters that identifies the geometry, usually a
+            hash of the geometry file. The cache can only be opened with the same key.
+
+        panels: The panels of the detector, as stored in the 'panels' entry of a
+            [TypeDetector][om.utils.crystfel_geometry.TypeDetector] dictionary.
+
+    Raises:
+
+        RuntimeError: A RuntimeError is raised if the cache file cannot be written.
+    """
+    pass
+
+
+class PixelMapCache:
+    """
+    See documentation of the `__init__` function.
+    """
+
+    def __init__(self, filename: str, key: str) -> None:
+        """
+        Pixel maps stored in a cache file.
+
+        This class maps into memory a cache file written by the
+        [write_pixel_map_cache]
+        [om.lib.peakfinder8_extension_stub.write_pixel_map_cache] function. The map is
+        read-only and shared: all the processes of a machine that open the same cache
+        use the same copy of the pixel maps in memory. The pixel maps are returned as
+        read-only arrays that share their memory with the map, and keep it alive.
+
+        Arguments:
+
+            filename: The name of the cache file.
+
+            key: The key used to write the cache file.
+
+        Raises:
+
+            RuntimeError: A RuntimeError is raised if the file does not exist, if it
+                was written for a different key or by a different version of OM, or
+                if it is damaged.
+        """
+        pass
+
+    def pixel_maps(self) -> Dict[str, numpy.ndarray]:
+        """
+        Returns the pixel maps stored in the cache.
+
+        Returns:
+
+            A [TypePixelMaps][om.utils.crystfel_geometry.TypePixelMaps] dictionary
+            storing the pixel maps, as read-only arrays.
+        """
+        pass
+
+    @property
+    def radial_bins(self) -> numpy.ndarray:
+        """
+        The radial bin of each pixel used by a [Peakfinder8Context]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context] (a read-only 2D uint16
+        array).
+        """
+        pass
+
+    @property
+    def num_radial_bins(self) -> int:
+        """
+        The number of radial bins.
+        """
+        pass
+
+    @property
+    def panel_spans(self) -> numpy.ndarray:
+        """
+        The runs of consecutive pixels covered by the panels of the detector (a
+        read-only 2D int32 array). Each row stores the index of the first pixel of a
+        run in the flattened data frame, and the number of pixels in the run. A run
+        never continues on the following row of the data frame.
+        """
+        pass
+
+
+class SharedConstants:
+    """
+    See documentation of the `__init__` function.
+    """
+
+    def __init__(
+        self, key: str, numa_local: bool = True, timeout: float = 60.0
+    ) -> None:
+        """
+        Read-only arrays shared by all the processes of a machine.
+
+        This class opens a POSIX shared memory segment that stores detector constants,
+        such as dark data, gain maps and masks, identified by a key. The first process
+        that opens the segment creates it, and must store the arrays with the [fill]
+        [om.lib.peakfinder8_extension_stub.SharedConstants.fill] function: the other
+        processes wait until the arrays are stored, and then read them from the same
+        memory. The arrays are returned as read-only arrays that share their memory
+        with the segment, and keep it alive. If the segment is NUMA-local, each NUMA
+        node has its own copy of the arrays, created and filled by the first process
+        that runs on the node, so that the processes read the arrays from local
+        memory. The process that created the segment removes its name when the
+        segment is closed: the memory is freed when no process uses it anymore.
+
+        Arguments:
+
+            key: A string of up to 255 characters that identifies the arrays, usually
+                a hash of the files from which they are read.
+
+            numa_local: Whether each NUMA node has its own copy of the arrays. The
+                processes should be pinned to their CPUs. Defaults to True.
+
+            timeout: The time, in seconds, for which the arrays stored by another
+                process are waited for. Defaults to 60.
+
+        Raises:
+
+            RuntimeError: A RuntimeError is raised if the segment cannot be created or
+                mapped, if it stores arrays for a different key, or if the arrays were
+                not stored in time.
+        """
+        pass
+
+    @property
+    def created(self) -> bool:
+        """
+        Whether the segment was created by this process, which must then store the
+        arrays with the [fill][om.lib.peakfinder8_extension_stub.SharedConstants.fill]
+        function.
+        """
+        pass
+
+    @property
+    def numa_node(self) -> Union[int, None]:
+        """
+        The NUMA node of the copy of the arrays, or None if the segment is not
+        NUMA-local.
+        """
+        pass
+
+    def fill(self, arrays: Dict[str, numpy.ndarray]) -> None:
+        """
+        Stores arrays in a segment created by this process.
+
+        The arrays are copied into the segment, and made available to the other
+        processes that open it.
+
+        Arguments:
+
+            arrays: The arrays to store, with names of up to 31 characters as keys.
+                The arrays can have up to 4 dimensions.
+
+        Raises:
+
+            ValueError: A ValueError is raised if a name is too long, or if an array
+                has too many dimensions or stores Python objects.
+
+            RuntimeError: A RuntimeError is raised if the segment was not created by
+                this process, or if the arrays cannot be stored.
+        """
+        pass
+
+    def arrays(self) -> Dict[str, numpy.ndarray]:
+        """
+        Returns the arrays stored in the segment.
+
+        Returns:
+
+            The arrays, as read-only arrays, with their names as keys. The dictionary
+            is empty if the arrays have not been stored yet.
+        """
+        pass
+
+
+class Peakfinder8Context:
+    """
+    See documentation of the `__init__` function.
+    """
+
+    def __init__(
+        self,
+        pix_r: numpy.ndarray,
+        max_num_peaks: int,
+        asic_nx: int,
+        asic_ny: int,
+        nasics_x: int,
+        nasics_y: int,
+        max_pix_count: int,
+        pixel_map_cache: Union[PixelMapCache, None] = None,
+    ) -> None:
+        """
+        Persistent peakfinder8 context.
+
+        This class stores all the buffers needed by the 'peakfinder8' peak detection
+        algorithm. The buffers are allocated once, when the context is created, and
+        are reused for every data frame processed by the context. A context can only
+        process data frames with the layout specified at creation time.
+
+        The radial bin of each pixel is also computed from the radius map when the
+        context is created, and is reused for every frame. If a pixel map cache is
+        provided, the radial bins stored in the cache are used instead.
+
+        By default, the radial background statistics are computed by the fastest
+        vectorized kernel supported by the CPU (AVX-512, AVX2 or NEON), selected at
+        runtime. The vectorized kernels accumulate the statistics in double precision,
+        while the original scalar kernel accumulates them in single precision. The
+        average background values computed by the two kinds of kernels agree to about
+        one part in 10^5. The standard deviations can differ by up to about 1% in bins
+        with a high background level, where the single precision computation loses
+        accuracy. Pixels lying exactly on a threshold can therefore be classified
+        differently.
+
+        Arguments:
+
+            pix_r: A numpy array of float32 with radius information (see the
+                documentation of the [peakfinder_8]
+                [om.lib.peakfinder8_extension_stub.peakfinder_8] function).
+
+            max_num_peaks: The maximum number of peaks that will be retrieved from each
+                data frame. Additional peaks will be ignored.
+
+            asic_nx: The fs size in pixels of each detector panel in the data frame.
+
+            asic_ny: The ss size in pixels of each detector panel in the data frame.
+
+            nasics_x: The number of panels along the fs axis of the data frame.
+
+            nasics_y: The number of panels along the ss axis of the data frame.
+
+            max_pix_count: The maximum size of a peak in pixels that the context will
+                be able to process.
+
+            pixel_map_cache: A pixel map cache, written for the geometry of the
+                radius map, that stores the radial bin of each pixel. The context,
+                and all the copies of the context used by its threads and pipelines,
+                read the radial bins from the cache without copying them, and keep the
+                cache open. Defaults to None.
+
+        Raises:
+
+            ValueError: A ValueError is raised if the shape of the radius map, or of
+                the pixel maps in the cache, does not match the detector layout.
+
+            MemoryError: A MemoryError is raised if the context cannot be created,
+                because the memory cannot be allocated, or because the radius map
+                stores values above 65535 pixels.
+        """
+        pass
+
+    @property
+    def radial_stats_kernel(self) -> str:
+        """
+        The kernel used to compute the radial background statistics.
+
+        One of 'scalar' (the original implementation), 'sorted' (portable
+        implementation working on pixels sorted by radial bin), 'avx2', 'avx512' or
+        'neon'.
+
+        Raises:
+
+            ValueError: A ValueError is raised when setting a kernel that is not
+                supported by the CPU.
+        """
+        pass
+
+    @radial_stats_kernel.setter
+    def radial_stats_kernel(self, name: str) -> None:
+        pass
+
+    @property
+    def background_estimator(self) -> str:
+        """
+        The estimator used for the radial background.
+
+        One of 'sigma_clipping' (the original iterative peakfinder8 estimator),
+        'median_mad' (median and median absolute deviation of each radial bin,
+        computed in a single pass) or 'temporal' (radial profile averaged over the
+        frames, see [background_decay]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.background_decay]).
+
+        Raises:
+
+            ValueError: A ValueError is raised when setting an unknown estimator.
+
+            MemoryError: A MemoryError is raised if the memory required by the
+                estimator cannot be allocated.
+        """
+        pass
+
+    @background_estimator.setter
+    def background_estimator(self, name: str) -> None:
+        pass
+
+    @property
+    def background_decay(self) -> float:
+        """
+        The weight of each new frame in the temporal background model.
+
+        With the 'temporal' background estimator, the radial background profile is
+        an exponentially weighted average over the processed frames, and each frame
+        only needs one clipped pass over the data to update it. The first frame, and
+        the first frame after the [reset_background]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.reset_background]
+        function is called, initialize the model with the 'sigma_clipping'
+        estimator. A value between 0 (excluded) and 1: smaller values give steadier
+        thresholds, but follow changes in the background more slowly. Defaults to
+        0.1.
+
+        Raises:
+
+            ValueError: A ValueError is raised when setting a value out of range.
+        """
+        pass
+
+    @background_decay.setter
+    def background_decay(self, decay: float) -> None:
+        pass
+
+    def reset_background(self) -> None:
+        """
+        Discards the temporal background model.
+
+        This function should be called when the background conditions change
+        abruptly, for example when a new run starts. The next frame initializes a new
+        model.
+        """
+        pass
+
+    def mask_changed(self) -> None:
+        """
+        Reports that the content of the mask changed.
+
+        The unmasked pixels are only found again when a mask stored in a different
+        array is passed to the context. This function must be called after the values
+        of the same mask array are modified in place, before the next frame is
+        processed.
+        """
+        pass
+
+    @property
+    def seed_scan(self) -> str:
+        """
+        How the pixels that can start a peak are found.
+
+        One of 'pixel' (each pixel is compared with the threshold of its radial bin
+        while growing the peaks) or 'bitmap' (a bit-packed map of the pixels above
+        threshold is built first, and the peak search only visits its set bits).
+        Both give the same peaks.
+
+        Raises:
+
+            ValueError: A ValueError is raised when setting an unknown mode.
+
+            MemoryError: A MemoryError is raised if the memory required by the
+                seed bitmap cannot be allocated.
+        """
+        pass
+
+    @seed_scan.setter
+    def seed_scan(self, name: str) -> None:
+        pass
+
+    @property
+    def panel_kernel(self) -> str:
+        """
+        The kernel that searches for peaks in each panel.
+
+        One of 'layout' (the default: a kernel compiled for the panel size of the
+        detector, with the index arithmetic fixed at compile time, is used for the
+        layouts supported by OM, and the generic kernel for any other layout) or
+        'generic'. Both give the same peaks.
+
+        Raises:
+
+            ValueError: A ValueError is raised when setting an unknown kernel.
+        """
+        pass
+
+    @panel_kernel.setter
+    def panel_kernel(self, name: str) -> None:
+        pass
+
+    @property
+    def local_background(self) -> str:
+        """
+        How the local background of each peak is computed.
+
+        One of 'ring' (the pixels in the disc around the peak are visited one by
+        one) or 'integral' (the sums over the disc are read from integral images
+        along the rows of each panel, at a cost that grows with the radius of the
+        disc instead of its area). Both use the same background pixels, but the
+        integral images are accumulated in double precision, while the 'ring' method
+        uses single precision, so the two only differ by rounding.
+
+        Raises:
+
+            ValueError: A ValueError is raised when setting an unknown method.
+
+            MemoryError: A MemoryError is raised if the memory required by the
+                integral images cannot be allocated.
+        """
+        pass
+
+    @local_background.setter
+    def local_background(self, name: str) -> None:
+        pass
+
+    @property
+    def backend(self) -> str:
+        """
+        Where the peaks are searched.
+
+        One of 'cpu' or 'gpu'. With the 'gpu' backend, the radial statistics, the
+        labelling of the peak pixels and the evaluation of the peaks are computed on
+        the GPU, and only the peak list is copied back. Only the 'sigma_clipping'
+        background estimator is supported on the GPU: with the other estimators, and
+        for the frames that have more peaks than the GPU can store, the peaks are
+        searched on the CPU.
+
+        Raises:
+
+            ValueError: A ValueError is raised when setting an unknown backend.
+
+            RuntimeError: A RuntimeError is raised when setting the 'gpu' backend and
+                the extension was built without GPU support, no GPU device is
+                available, or the GPU memory cannot be allocated.
+        """
+        pass
+
+    @backend.setter
+    def backend(self, name: str) -> None:
+        pass
+
+    @property
+    def peak_refinement(self) -> str:
+        """
+        How the position of each peak is computed.
+
+        One of 'center_of_mass', 'quadratic' or 'gaussian'. The 'center_of_mass'
+        method reports the intensity-weighted center of the peak pixels, like the
+        original peakfinder8 algorithm. The 'quadratic' and 'gaussian' methods fit a
+        parabola, or a Gaussian above the local background, to the brightest pixel of
+        each peak and its two neighbours along each axis, for a sub-pixel position.
+        The position is not refined for the peaks found with the 'gpu' backend.
+
+        Raises:
+
+            ValueError: A ValueError is raised when setting an unknown method.
+        """
+        pass
+
+    @peak_refinement.setter
+    def peak_refinement(self, name: str) -> None:
+        pass
+
+    def set_peak_geometry(
+        self, x_map: numpy.ndarray, y_map: numpy.ndarray, pixels_per_meter: float
+    ) -> None:
+        """
+        Sets the geometry used to compute the assembled position of the peaks.
+
+        Once the geometry is set, the `x_assembled`, `y_assembled` and `r_assembled`
+        fields of the peaks are filled while the peaks are searched, interpolating the
+        position maps at the position of each peak. The context keeps a reference to
+        the maps. The geometry must be set before a [Peakfinder8Pipeline]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Pipeline] is created from the
+        context, and must not be changed while the pipeline is used.
+
+        Arguments:
+
+            x_map: A map storing, for each pixel of the data frame, its x coordinate
+                in the detector reference system, in pixels (a 2D float32 array, with
+                the same shape as the radius map).
+
+            y_map: A map storing, for each pixel of the data frame, its y coordinate
+                in the detector reference system, in pixels.
+
+            pixels_per_meter: The size of the detector pixels, as the number of
+                pixels per meter.
+
+        Raises:
+
+            ValueError: A ValueError is raised if the shape of the maps does not
+                match the detector layout.
+        """
+        pass
+
+    def set_beam_parameters(self, beam_energy: float, detector_distance: float) -> None:
+        """
+        Sets the beam parameters used to compute the resolution of the peaks.
+
+        When the geometry and the beam parameters are known, the `q` and `resolution`
+        fields of the peaks are filled while the peaks are searched. The parameters
+        can change from frame to frame. The fields are set to zero when the beam
+        energy or the detector distance are not positive.
+
+        Arguments:
+
+            beam_energy: The beam energy, in eV.
+
+            detector_distance: The distance between the sample and the detector, in
+                meters.
+        """
+        pass
+
+    @property
+    def num_threads(self) -> int:
+        """
+        The number of threads that search for peaks in the detector panels.
+
+        With more than one thread, the panels of a frame are processed in parallel,
+        and the peaks are then merged in panel order: the result does not depend on
+        the number of threads. The calling thread is one of the threads.
+
+        Raises:
+
+            RuntimeError: A RuntimeError is raised if the requested number of threads
+                cannot be started.
+        """
+        pass
+
+    @num_threads.setter
+    def num_threads(self, num_threads: int) -> None:
+        pass
+
+    @property
+    def num_frame_threads(self) -> int:
+        """
+        The number of threads that process the frames of a batch in parallel.
+
+        This number is only used by the [find_peaks_batch]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.find_peaks_batch]
+        function. Each thread after the first one needs its own copy of the context
+        buffers. The number of panel threads (see [num_threads]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.num_threads]) is
+        applied to each frame thread.
+
+        Raises:
+
+            MemoryError: A MemoryError is raised if the buffers for the requested
+                number of threads cannot be allocated.
+        """
+        pass
+
+    @num_frame_threads.setter
+    def num_frame_threads(self, num_frame_threads: int) -> None:
+        pass
+
+    @property
+    def prescreen_min_peaks(self) -> int:
+        """
+        The minimum number of peaks of a frame that passes the pre-screen.
+
+        When this number is larger than 0, the pixels of each frame that are above
+        the radial thresholds computed for the last searched frame are counted before
+        searching for peaks. A frame that does not have enough pixels for this number
+        of peaks, each made of at least `hitfinder_min_pix_count` pixels, is
+        rejected: its peak list is empty, and the peak search is skipped. The
+        thresholds of different frames are similar, but not identical, so a rejected
+        frame can occasionally have more peaks than this number (see
+        [prescreen_validation]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.prescreen_validation]).
+        Defaults to 0, which disables the pre-screen.
+        """
+        pass
+
+    @prescreen_min_peaks.setter
+    def prescreen_min_peaks(self, min_num_peaks: int) -> None:
+        pass
+
+    @property
+    def prescreen_max_rejections(self) -> int:
+        """
+        The number of frames in a row that the pre-screen can reject.
+
+        The thresholds used by the pre-screen are only computed when the peaks are
+        searched. After this number of frames in a row are rejected, the peaks are
+        searched in the next frame anyway, so that the thresholds follow the changes
+        in the background. Values smaller than 1 are set to 1. Defaults to 16.
+        """
+        pass
+
+    @prescreen_max_rejections.setter
+    def prescreen_max_rejections(self, max_rejections: int) -> None:
+        pass
+
+    @property
+    def prescreen_validation(self) -> bool:
+        """
+        Whether the pre-screen runs in validation mode.
+
+        In validation mode, the peaks are also searched in the frames rejected by the
+        pre-screen, and their full peak lists are returned. The rejected frames that
+        turn out to have at least [prescreen_min_peaks]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.prescreen_min_peaks]
+        peaks are counted as false negatives in [prescreen_stats]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.prescreen_stats]. The
+        thresholds computed for the rejected frames are not used by the pre-screen,
+        so the same frames are rejected as without validation. Defaults to False.
+        """
+        pass
+
+    @prescreen_validation.setter
+    def prescreen_validation(self, validation: bool) -> None:
+        pass
+
+    @property
+    def prescreen_result(self) -> str:
+        """
+        The result of the pre-screen for the last processed frame.
+
+        One of 'not_run' (the pre-screen is disabled, no thresholds from a previous
+        frame with the same parameters are available, or the thresholds are computed
+        again after [prescreen_max_rejections]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.prescreen_max_rejections]
+        rejections), 'candidate' (the frame passed the pre-screen) or 'not_a_hit'
+        (the frame was rejected). After a batch of frames, the result refers to one
+        of the frames of the batch.
+        """
+        pass
+
+    @property
+    def prescreen_stats(self) -> Dict[str, int]:
+        """
+        Statistics of the pre-screen since the context was created.
+
+        A dictionary with the number of frames checked by the pre-screen
+        ('num_frames'), the number of rejected frames ('num_rejected') and, in
+        validation mode, the number of rejected frames with at least
+        [prescreen_min_peaks]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.prescreen_min_peaks]
+        peaks ('num_false_negatives').
+        """
+        pass
+
+    def reset_prescreen_stats(self) -> None:
+        """
+        Resets the statistics of the pre-screen.
+        """
+        pass
+
+    @property
+    def collect_stats(self) -> bool:
+        """
+        Whether the statistics of the peak search are collected.
+
+        When True, the time spent in each stage of the algorithm and the number of
+        seeds, candidate peaks and rejected candidates are accumulated over the
+        processed frames (see [stats]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.stats]). Reading the
+        timers has a small cost, so the statistics are not collected by default.
+        """
+        pass
+
+    @collect_stats.setter
+    def collect_stats(self, collect_stats: bool) -> None:
+        pass
+
+    @property
+    def stats(self) -> Dict[str, Any]:
+        """
+        Statistics of the peak search since they were last reset.
+
+        A dictionary with the number of frames processed while [collect_stats]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.collect_stats] was
+        True ('num_frames'), the time, in seconds, spent in each stage of the
+        algorithm ('stage_times', a dictionary with the 'radial_stats',
+        'candidate_scan', 'peak_growth', 'local_background' and 'total' keys), the
+        number of pixels that can start a peak ('num_seeds'), the number of grown
+        candidate peaks ('num_candidates'), the number of candidates rejected for
+        each reason ('num_rejected', a dictionary with the 'pix_count', 'intensity',
+        'snr', 'background' and 'panel_edge' keys), the number of detected peaks
+        ('num_peaks') and the number of pixels of the largest grown candidate
+        ('max_peak_pixels'). The stage times of the frames processed in parallel by
+        a batch are summed, and the stages run on the GPU are only included in the
+        total time.
+        """
+        pass
+
+    def reset_stats(self) -> None:
+        """
+        Resets the statistics of the peak search.
+        """
+        pass
+
+    def find_peaks(
+        self,
+        data: numpy.ndarray,
+        mask: numpy.ndarray,
+        adc_thresh: float,
+        hitfinder_min_snr: float,
+        hitfinder_min_pix_count: int,
+        hitfinder_max_pix_count: int,
+        hitfinder_local_bg_radius: int,
+    ) -> Tuple[
+        int,
+        List[float],
+        List[float],
+        List[float],
+        List[float],
+        List[float],
+        List[float],
+    ]:
+        """
+        Peakfinder8 peak detection using the buffers stored in the context.
+
+        This function behaves exactly like the [peakfinder_8]
+        [om.lib.peakfinder8_extension_stub.peakfinder_8] function, but does not
+        allocate any memory. The GIL is released while the peaks are searched, so
+        other Python threads can run in the meantime. A context must not be used by
+        two threads at the same time.
+
+        Arguments:
+
+            data: The detector data frame on which the peak finding must be performed
+                (as a C-contiguous numpy array of float32, float64, uint16 or int32).
+                The data is not copied: each value is converted to float32 when it is
+                read, so the result is the same as for a float32 copy of the frame.
+
+            mask: A numpy array of int8 storing a mask (see the documentation of the
+                [peakfinder_8][om.lib.peakfinder8_extension_stub.peakfinder_8]
+                function).
+
+            adc_thresh: The minimum ADC threshold for peak detection.
+
+            hitfinder_min_snr: The minimum signal-to-noise ratio for peak detection.
+
+            hitfinder_min_pix_count: The minimum size of a peak in pixels.
+
+            hitfinder_max_pix_count: The maximum size of a peak in pixels. It cannot be
+                larger than the maximum size specified when the context was created.
+
+            hitfinder_local_bg_radius: The radius for the estimation of the local
+                background in pixels.
+
+        Returns:
+
+            A tuple storing information about the detected peaks, with the same format
+            as the one returned by the [peakfinder_8]
+            [om.lib.peakfinder8_extension_stub.peakfinder_8] function.
+
+        Raises:
+
+            ValueError: A ValueError is raised if the size of the data frame or of the
+                mask does not match the layout of the context.
+
+            RuntimeError: A RuntimeError is raised if the maximum size of a peak is
+                larger than the one supported by the context.
+        """
+        pass
+
+    def find_peaks_array(
+        self,
+        data: numpy.ndarray,
+        mask: numpy.ndarray,
+        adc_thresh: float,
+        hitfinder_min_snr: float,
+        hitfinder_min_pix_count: int,
+        hitfinder_max_pix_count: int,
+        hitfinder_local_bg_radius: int,
+        out: Union[numpy.ndarray, None] = None,
+    ) -> numpy.ndarray:
+        """
+        Peakfinder8 peak detection, returning the peaks in a structured array.
+
+        This function performs the same peak detection as the [find_peaks]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.find_peaks] function,
+        but writes the detected peaks directly into a numpy structured array of type
+        [peak_list_dtype][om.lib.peakfinder8_extension_stub.peak_list_dtype],
+        instead of creating Python lists. The GIL is released while the array is
+        filled.
+
+        Arguments:
+
+            data: The detector data frame on which the peak finding must be performed
+                (see the documentation of the [find_peaks]
+                [om.lib.peakfinder8_extension_stub.Peakfinder8Context.find_peaks]
+                function).
+
+            mask: A numpy array of int8 storing a mask (see the documentation of the
+                [peakfinder_8][om.lib.peakfinder8_extension_stub.peakfinder_8]
+                function).
+
+            adc_thresh: The minimum ADC threshold for peak detection.
+
+            hitfinder_min_snr: The minimum signal-to-noise ratio for peak detection.
+
+            hitfinder_min_pix_count: The minimum size of a peak in pixels.
+
+            hitfinder_max_pix_count: The maximum size of a peak in pixels. It cannot be
+                larger than the maximum size specified when the context was created.
+
+            hitfinder_local_bg_radius: The radius for the estimation of the local
+                background in pixels.
+
+            out: An optional C-contiguous one-dimensional array of type
+                [peak_list_dtype][om.lib.peakfinder8_extension_stub.peak_list_dtype],
+                with room for at least the maximum number of peaks specified when the
+                context was created. If this argument is provided, the peaks are
+                written into this array, and no memory is allocated. Defaults to None.
+
+        Returns:
+
+            A structured array of type
+            [peak_list_dtype][om.lib.peakfinder8_extension_stub.peak_list_dtype], with
+            one entry per detected peak. If the `out` argument is provided, the
+            returned array is a view of its first entries.
+
+        Raises:
+
+            ValueError: A ValueError is raised if the size of the data frame or of the
+                mask does not match the layout of the context, or if the `out` array
+                does not have the right type, shape or size.
+
+            RuntimeError: A RuntimeError is raised if the maximum size of a peak is
+                larger than the one supported by the context.
+        """
+        pass
+
+    def find_peaks_batch(
+        self,
+        data: numpy.ndarray,
+        mask: numpy.ndarray,
+        adc_thresh: float,
+        hitfinder_min_snr: float,
+        hitfinder_min_pix_count: int,
+        hitfinder_max_pix_count: int,
+        hitfinder_local_bg_radius: int,
+    ) -> Tuple[numpy.ndarray, numpy.ndarray]:
+        """
+        Peakfinder8 peak detection on a batch of data frames.
+
+        This function performs the same peak detection as the [find_peaks_array]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.find_peaks_array]
+        function on each frame of a batch, with a single call. The GIL is released
+        for the whole batch. If the [num_frame_threads]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.num_frame_threads]
+        property is larger than one, the frames are processed in parallel. The result
+        does not depend on the number of threads.
+
+        Arguments:
+
+            data: A C-contiguous three-dimensional numpy array of float32, float64,
+                uint16 or int32 storing the data frames, one after the other along the
+                first axis.
+
+            mask: A numpy array of int8 storing a mask, shared by all the frames (see
+                the documentation of the
+                [peakfinder_8][om.lib.peakfinder8_extension_stub.peakfinder_8]
+                function).
+
+            adc_thresh: The minimum ADC threshold for peak detection.
+
+            hitfinder_min_snr: The minimum signal-to-noise ratio for peak detection.
+
+            hitfinder_min_pix_count: The minimum size of a peak in pixels.
+
+            hitfinder_max_pix_count: The maximum size of a peak in pixels. It cannot be
+                larger than the maximum size specified when the context was created.
+
+            hitfinder_local_bg_radius: The radius for the estimation of the local
+                background in pixels.
+
+        Returns:
+
+            A tuple with two entries:
+
+            * The first entry is a structured array of type
+              [peak_list_dtype][om.lib.peakfinder8_extension_stub.peak_list_dtype]
+              storing the peaks detected in all the frames, in frame order.
+
+            * The second entry is an array of integers storing the number of peaks
+              detected in each frame. The peak list of each frame can be recovered
+              with `numpy.split(peaks, numpy.cumsum(num_peaks)[:-1])`.
+
+        Raises:
+
+            ValueError: A ValueError is raised if the size of the data frames or of the
+                mask does not match the layout of the context.
+
+            RuntimeError: A RuntimeError is raised if the maximum size of a peak is
+                larger than the one supported by the context.
+        """
+        pass
+
+    def sweep_peak_counts(
+        self,
+        data: numpy.ndarray,
+        mask: numpy.ndarray,
+        parameter_sets: numpy.ndarray,
+    ) -> numpy.ndarray:
+        """
+        Number of peaks found in a data frame by many sets of peakfinder8 parameters.
+
+        This function returns, for each set of parameters, the number of peaks that
+        the [find_peaks]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.find_peaks] function
+        would detect in the frame. The radial statistics of the frame are
+        computed only once for all the sets with the same ADC threshold and minimum
+        signal-to-noise ratio, and the peaks are searched only once for all the sets
+        that only differ in the minimum peak size. The temporal background estimator
+        is replaced by the iterative one, and the GPU and the pre-screen are not used.
+        The GIL is released during the sweep. The peaks stored in the context are
+        discarded, so the [peak_label_map]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.peak_label_map] and
+        [peak_pixels][om.lib.peakfinder8_extension_stub.Peakfinder8Context.peak_pixels]
+        functions cannot be called before the next frame is processed.
+
+        Arguments:
+
+            data: A C-contiguous two-dimensional numpy array of float32, float64,
+                uint16 or int32 storing the data frame.
+
+            mask: A numpy array of int8 storing a mask (see the documentation of the
+                [peakfinder_8][om.lib.peakfinder8_extension_stub.peakfinder_8]
+                function).
+
+            parameter_sets: A two-dimensional array with one row per set of
+                parameters. The columns store, in order, the `adc_thresh`,
+                `hitfinder_min_snr`, `hitfinder_min_pix_count`,
+                `hitfinder_max_pix_count` and `hitfinder_local_bg_radius` parameters
+                (see the documentation of the [find_peaks]
+                [om.lib.peakfinder8_extension_stub.Peakfinder8Context.find_peaks]
+                function).
+
+        Returns:
+
+            An array of integers storing the number of peaks found by each set of
+            parameters.
+
+        Raises:
+
+            ValueError: A ValueError is raised if the size of the data frame or of the
+                mask does not match the layout of the context, or if the parameter
+                sets do not have the right number of columns.
+
+            RuntimeError: A RuntimeError is raised if the maximum size of a peak of
+                any of the sets is larger than the one supported by the context.
+        """
+        pass
+
+    def peak_label_map(
+        self, out: Union[numpy.ndarray, None] = None
+    ) -> numpy.ndarray:
+        """
+        Labels the pixels of the peaks found in the last processed frame.
+
+        This function writes, for each pixel of the last frame processed by the
+        [find_peaks][om.lib.peakfinder8_extension_stub.Peakfinder8Context.find_peaks]
+        or [find_peaks_array]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.find_peaks_array]
+        functions, the index plus one of the peak that the pixel belongs to, in the
+        order of the returned peak list. Pixels that are not part of any returned peak
+        are labelled 0.
+
+        Arguments:
+
+            out: An optional 2D int32 array, with the shape of the data frames, in
+                which the labels are written. Passing the same array for every frame
+                avoids allocating a new one. If None, a new array is allocated.
+
+        Returns:
+
+            The label map.
+
+        Raises:
+
+            ValueError: A ValueError is raised if the size of the output array does not
+                match the layout of the context.
+
+            RuntimeError: A RuntimeError is raised if the peak pixels are not
+                available, because no frame has been processed yet or because the last
+                frame was processed by the GPU backend.
+        """
+        pass
+
+    def peak_pixels(self) -> Tuple[numpy.ndarray, numpy.ndarray]:
+        """
+        Returns the pixels of the peaks found in the last processed frame.
+
+        This function returns a sparse description of the pixels that make up the
+        peaks found in the last frame processed by the [find_peaks]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.find_peaks] or
+        [find_peaks_array]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context.find_peaks_array]
+        functions. The pixels are returned peak after peak, in the order of the
+        returned peak list.
+
+        Returns:
+
+            A tuple with two int32 arrays. The first stores the index of each pixel in
+            the flattened data frame. The second stores the index of the peak, in the
+            peak list, that the pixel belongs to.
+
+        Raises:
+
+            RuntimeError: A RuntimeError is raised if the peak pixels are not
+                available, because no frame has been processed yet or because the last
+                frame was processed by the GPU backend.
+        """
+        pass
+
+
+class PowderAccumulator:
+    """
+    See documentation of the `__init__` function.
+    """
+
+    powder: numpy.ndarray
+    """
+    The virtual powder pattern (a 2D int32 array), updated in place.
+    """
+
+    def __init__(
+        self,
+        visual_pixelmap_x: numpy.ndarray,
+        visual_pixelmap_y: numpy.ndarray,
+        powder_shape: Tuple[int, int],
+        window_size: int,
+    ) -> None:
+        """
+        Virtual powder pattern and running hit rate accumulator.
+
+        This class accumulates, on the collecting node, the intensities of the peaks
+        detected in each frame into a virtual powder pattern, and keeps the hit rate
+        over a running window of frames. The powder pixel of each frame pixel is
+        computed from the visual pixel maps when the accumulator is created, and the
+        peak tables of each frame are added in bulk, without any loop over the peaks
+        in Python.
+
+        Arguments:
+
+            visual_pixelmap_x: A 2D int32 array with the same shape as the data frames,
+                storing, for each pixel, the column of the powder image on which it is
+                drawn.
+
+            visual_pixelmap_y: A 2D int32 array with the same shape as the data frames,
+                storing, for each pixel, the row of the powder image on which it is
+                drawn.
+
+            powder_shape: The shape of the powder image.
+
+            window_size: The number of frames over which the hit rate is computed.
+
+        Raises:
+
+            ValueError: A ValueError is raised if the shapes of the two pixel maps do
+                not match, or if the window size is not positive.
+
+            MemoryError: A MemoryError is raised if the memory required by the
+                accumulator cannot be allocated.
+        """
+        pass
+
+    @property
+    def hit_rate(self) -> float:
+        """
+        The fraction of hits among the frames in the running window.
+
+        The window starts filled with non-hits, as many as its size.
+        """
+        pass
+
+    @property
+    def num_frames(self) -> int:
+        """
+        The number of frames added to the accumulator.
+        """
+        pass
+
+    @property
+    def num_hits(self) -> int:
+        """
+        The number of hits among the frames added to the accumulator.
+        """
+        pass
+
+    def add_frame(
+        self, frame_is_hit: bool, peak_list: numpy.ndarray
+    ) -> Tuple[numpy.ndarray, numpy.ndarray]:
+        """
+        Adds a frame to the hit rate and its peaks to the powder pattern.
+
+        The intensity of each peak is truncated to an integer, and added to the powder
+        pixel of the frame pixel nearest to the position of the peak.
+
+        Arguments:
+
+            frame_is_hit: Whether the frame is a hit.
+
+            peak_list: The peaks of the frame, in a structured array with the
+                [peak_list_dtype][om.lib.peakfinder8_extension_stub.peak_list_dtype]
+                type.
+
+        Returns:
+
+            A tuple of two int32 arrays, storing the row and the column of each peak in
+            the powder image. Peaks that fall outside the frame or the image are not
+            added to the powder pattern, and are given a row and a column of -1.
+        """
+        pass
+
+
+class Peakfinder8Pipeline:
+    """
+    See documentation of the `__init__` function.
+    """
+
+    def __init__(
+        self,
+        context: Peakfinder8Context,
+        mask: numpy.ndarray,
+        num_slots: int,
+        num_workers: int,
+        adc_thresh: float,
+        hitfinder_min_snr: float,
+        hitfinder_min_pix_count: int,
+        hitfinder_max_pix_count: int,
+        hitfinder_local_bg_radius: int,
+    ) -> None:
+        """
+        Ring of frame slots processed by peakfinder8 worker threads.
+
+        This class decouples the retrieval of the data frames from the peak search.
+        One producer thread fills the slots of a ring with frames, in order. Native
+        worker threads, which run without the GIL and each use a copy of the context,
+        search the peaks of the filled frames in parallel. A reader thread then reads
+        the peaks of the frames in the order in which they were filled, and releases
+        the slots for new frames. The slots are handed over between the threads
+        without locks, and their memory is allocated once, aligned to cache lines
+        and, if the system allows it, locked in RAM.
+
+        The producer must call [acquire_slot]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Pipeline.acquire_slot], fill
+        the array returned by [slot_data]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Pipeline.slot_data], and call
+        [publish_slot]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Pipeline.publish_slot], one
+        slot at a time, and finally call [close]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Pipeline.close]. The reader
+        must call [next_result]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Pipeline.next_result], read the
+        results, and call [release_slot]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Pipeline.release_slot], one
+        slot at a time. The frames are stored as float32 values.
+
+        Arguments:
+
+            context: The context whose layout and settings are used by the workers.
+                The statistics of the frames processed by the workers are collected in
+                this context when their slots are released.
+
+            mask: The mask used for all the frames (see the documentation of the
+                [peakfinder_8][om.lib.peakfinder8_extension_stub.peakfinder_8]
+                function).
+
+            num_slots: The number of frame slots in the ring.
+
+            num_workers: The number of worker threads.
+
+            adc_thresh: See the documentation of the [peakfinder_8]
+                [om.lib.peakfinder8_extension_stub.peakfinder_8] function.
+
+            hitfinder_min_snr: See the documentation of the [peakfinder_8]
+                [om.lib.peakfinder8_extension_stub.peakfinder_8] function.
+
+            hitfinder_min_pix_count: See the documentation of the [peakfinder_8]
+                [om.lib.peakfinder8_extension_stub.peakfinder_8] function.
+
+            hitfinder_max_pix_count: See the documentation of the [peakfinder_8]
+                [om.lib.peakfinder8_extension_stub.peakfinder_8] function.
+
+            hitfinder_local_bg_radius: See the documentation of the [peakfinder_8]
+                [om.lib.peakfinder8_extension_stub.peakfinder_8] function.
+
+        Raises:
+
+            ValueError: A ValueError is raised if the shape of the mask does not match
+                the layout of the context, or if the number of slots or workers is not
+                positive.
+
+            MemoryError: A MemoryError is raised if the memory required by the
+                pipeline cannot be allocated, or if the worker threads cannot be
+                started.
+        """
+        pass
+
+    @property
+    def memory_pinned(self) -> bool:
+        """
+        Whether the memory of the frame slots is locked in RAM.
+        """
+        pass
+
+    def acquire_slot(self) -> Union[int, None]:
+        """
+        Waits until the next slot of the ring can be filled.
+
+        The GIL is released while waiting.
+
+        Returns:
+
+            The index of the slot, or None if the pipeline has been closed.
+        """
+        pass
+
+    def slot_data(self, slot: int) -> numpy.ndarray:
+        """
+        Returns the frame stored in a slot.
+
+        Arguments:
+
+            slot: The index of the slot.
+
+        Returns:
+
+            A float32 array, with the shape of the data frames, that shares its memory
+            with the slot. Its content can change as soon as the slot is released, and
+            it must not be used after the pipeline is freed.
+        """
+        pass
+
+    def publish_slot(self, slot: int) -> None:
+        """
+        Hands a filled slot over to the workers.
+
+        Arguments:
+
+            slot: The index of the slot returned by the last call to [acquire_slot]
+                [om.lib.peakfinder8_extension_stub.Peakfinder8Pipeline.acquire_slot].
+        """
+        pass
+
+    def close(self) -> None:
+        """
+        Tells the workers and the reader that no more frames will be published.
+        """
+        pass
+
+    def next_result(self) -> Union[int, None]:
+        """
+        Waits until the peaks of the oldest frame not read yet have been searched.
+
+        The GIL is released while waiting.
+
+        Returns:
+
+            The index of the slot storing the frame, or None if the pipeline has been
+            closed and all its frames have been read.
+        """
+        pass
+
+    def slot_peaks(self, slot: int) -> numpy.ndarray:
+        """
+        Returns the peaks found in the frame stored in a slot.
+
+        Arguments:
+
+            slot: The index of the slot returned by the last call to [next_result]
+                [om.lib.peakfinder8_extension_stub.Peakfinder8Pipeline.next_result].
+
+        Returns:
+
+            A structured array of type [peak_list_dtype]
+            [om.lib.peakfinder8_extension_stub.peak_list_dtype], with one entry per
+            detected peak. The array does not share its memory with the slot.
+
+        Raises:
+
+            RuntimeError: A RuntimeError is raised if the peak search failed.
+        """
+        pass
+
+    def release_slot(self, slot: int) -> None:
+        """
+        Returns a slot to the producer.
+
+        Arguments:
+
+            slot: The index of the slot returned by the last call to [next_result]
+                [om.lib.peakfinder8_extension_stub.Peakfinder8Pipeline.next_result].
+        """
+        pass
+
+
+class MappedFrameReader:
+    """
+    See documentation of the `__init__` function.
+    """
+
+    def __init__(
+        self,
+        filename: str,
+        offset: int,
+        num_frames: int,
+        frame_shape: Tuple[int, ...],
+        dtype: Any,
+        prefetch_frames: int = 16,
+    ) -> None:
+        """
+        Memory-mapped reader of the data frames stored in a file.
+
+        This class maps into memory frames that are stored one after the other,
+        uncompressed, from a given offset of a file: for example the frames of a
+        contiguous HDF5 dataset. The frames are returned as arrays that share their
+        memory with the map, without being copied, and can be passed straight to the
+        functions of a [Peakfinder8Context]
+        [om.lib.peakfinder8_extension_stub.Peakfinder8Context]. When a frame is
+        retrieved, the kernel is asked to start reading the following frames, so that
+        they are already in memory when they are needed.
+
+        The map is private: the frames can be modified in place without changing the
+        file.
+
+        Arguments:
+
+            filename: The name of the file.
+
+            offset: The position, in bytes, of the first frame in the file.
+
+            num_frames: The number of frames stored in the file.
+
+            frame_shape: The shape of each frame.
+
+            dtype: The data type of the frames.
+
+            prefetch_frames: The number of frames that are read ahead of the retrieved
+                one. Defaults to 16.
+
+        Raises:
+
+            RuntimeError: A RuntimeError is raised if the frames cannot be mapped, for
+                example because the file is shorter than the frames.
+        """
+        pass
+
+    @property
+    def num_frames(self) -> int:
+        """
+        The number of frames stored in the file.
+        """
+        pass
+
+    def frame(self, index: int) -> numpy.ndarray:
+        """
+        Returns a frame stored in the file.
+
+        Arguments:
+
+            index: The index of the frame in the file.
+
+        Returns:
+
+            An array, with the shape and data type of the frames, that shares its
+            memory with the map. It must not be used after the reader is freed.
+
+        Raises:
+
+            IndexError: An IndexError is raised if the file does not store the frame.
+        """
+        pass
@@ -21,9 +21,13 @@ MPI-based Parallelization Engine for OM.
 This module contains a Parallelization Engine for OM which uses the MPI communication
 rotocol to manage the communication between the nodes.
 """
+import collections
 import sys
-from typing import Any, Dict, Tuple, Union
+import threading
+import time
+from typing import Any, Deque, Dict, List, Tuple, Union
 
+import numpy  # type: ignore
 from mpi4py import MPI  # type: ignore
 
 from om.data_retrieval_layer import base as data_ret_layer_base
@@ -35,6 +39,125 @@ from om.utils import exceptions, parameters
 _NOMORE: int = 998
 _DIETAG: int = 999
 _DEADTAG: int = 1000
+_BUFFERTAG: int = 1001
+
+# Key of the pickled part of the processed data that describes the buffers sent
+# after it.
+_BUFFERS_KEY: str = "__om_buffers__"
+
+
+def _split_processed_data(
+    data: Dict[str, Any]
+) -> Tuple[Dict[str, Any], List[numpy.ndarray]]:
+    # Separates the numpy arrays and the bytes objects, which are sent through the
+    # buffer interface without being copied, from the rest of the processed data,
+    # which is pickled together with the description of each buffer.
+    metadata: Dict[str, Any] = {}
+    buffers: List[numpy.ndarray] = []
+    descriptions: List[Tuple[str, Any, Tuple[int, ...]]] = []
+    key: str
+    value: Any
+    for key, value in data.items():
+        if isinstance(value, numpy.ndarray) and not value.dtype.hasobject:
+            array: numpy.ndarray = numpy.ascontiguousarray(value)
+            descriptions.append(
+                (key, numpy.lib.format.dtype_to_descr(array.dtype), array.shape)
+            )
+            buffers.append(array.reshape(-1).view(numpy.uint8))
+        elif isinstance(value, bytes):
+            descriptions.append((key, None, (len(value),)))
+            buffers.append(numpy.frombuffer(value, dtype=numpy.uint8))
+        else:
+            metadata[key] = value
+    metadata[_BUFFERS_KEY] = descriptions
+
+    return metadata, buffers
+
+
+class _MpiEventScheduler(data_ret_layer_base.OmEventScheduler):
+    # Hands out batches of events to the processing nodes through a counter of claimed
+    # events stored, in an MPI window, on the collecting node. Each node claims its
+    # next batch with an atomic fetch-and-add, without involving the collecting node,
+    # so faster nodes simply claim more batches. The size of each batch is chosen so
+    # that the node processes it in about the requested time, based on the time that
+    # the node took to process each event of its previous batches. Towards the end of
+    # the list the batches shrink, so that the last events are spread across all the
+    # nodes instead of being left to the slowest one.
+    #
+    # The list can grow between two claims (for example, when the events of a new run
+    # are appended to it). The part of a claimed batch that lies beyond the current end
+    # of the list is kept, and is handed out once the list has grown to include it.
+
+    def __init__(
+        self, window: Any, num_processing_nodes: int, batch_duration: float
+    ) -> None:
+        self._window: Any = window
+        self._num_processing_nodes: int = num_processing_nodes
+        self._batch_duration: float = batch_duration
+        self._increment: numpy.ndarray = numpy.zeros(1, dtype=numpy.int64)
+        self._first_event: numpy.ndarray = numpy.zeros(1, dtype=numpy.int64)
+        self._event_time: Union[float, None] = None
+        self._claim_time: float = 0.0
+        self._batch_size: int = 0
+        self._num_claimed_events: int = 0
+        self._pending_batch: Union[Tuple[int, int], None] = None
+
+    def claim_events(self, num_events: int) -> Union[Tuple[int, int], None]:
+        if self._pending_batch is None:
+            self._pending_batch = self._fetch_batch(num_events)
+        first_event: int = self._pending_batch[0]
+        last_event: int = self._pending_batch[1]
+        if first_event >= num_events:
+            return None
+        batch_end: int = min(last_event, num_events)
+        self._batch_size += batch_end - first_event
+        if batch_end < last_event:
+            self._pending_batch = (batch_end, last_event)
+        else:
+            self._pending_batch = None
+
+        return first_event, batch_end
+
+    def _fetch_batch(self, num_events: int) -> Tuple[int, int]:
+        # The node asks for its next batch only after retrieving all the events of
+        # the previous one, so the time between two claims measures how long the node
+        # takes to process each event. The estimate is averaged over the batches.
+        now: float = time.time()
+        if self._batch_size > 0:
+            event_time: float = (now - self._claim_time) / self._batch_size
+            if self._event_time is None:
+                self._event_time = event_time
+            else:
+                self._event_time = 0.5 * (self._event_time + event_time)
+        if self._event_time is None or self._event_time <= 0.0:
+            batch_size: int = 1
+        else:
+            batch_size = int(self._batch_duration / self._event_time)
+        batch_size = max(
+            1,
+            min(
+                batch_size,
+                (num_events - self._num_claimed_events)
+                // (2 * self._num_processing_nodes),
+            ),
+        )
+
+        self._increment[0] = batch_size
+        self._window.Lock(0, MPI.LOCK_SHARED)
+        self._window.Fetch_and_op(
+            [self._increment, MPI.INT64_T],
+            [self._first_event, MPI.INT64_T],
+            target_rank=0,
+            target_disp=0,
+            op=MPI.SUM,
+        )
+        self._window.Unlock(0)
+        first_event: int = int(self._first_event[0])
+        self._num_claimed_events = first_event + batch_size
+        self._claim_time = time.time()
+        self._batch_size = 0
+
+        return first_event, first_event + batch_size
 
 
 class MpiParallelizationEngine(par_layer_base.OmParallelizationEngine):
@@ -80,6 +203,126 @@ class MpiParallelizationEngine(par_layer_base.OmParallelizationEngine):
         self._mpi_size: int = MPI.COMM_WORLD.Get_size()
         self._rank: int = MPI.COMM_WORLD.Get_rank()
 
+        mpi_transport: Union[str, None] = self._monitor_params.get_param(
+            group="om",
+            parameter="mpi_transport",
+            parameter_type=str,
+        )
+        if mpi_transport is None:
+            mpi_transport = "pickle"
+        if mpi_transport not in ("pickle", "buffers"):
+            raise exceptions.OmConfigurationFileSyntaxError(
+                "Unknown MPI transport: {0}.".format(mpi_transport)
+            )
+        self._use_buffers: bool = mpi_transport == "buffers"
+        max_requests_in_flight: Union[int, None] = self._monitor_params.get_param(
+            group="om",
+            parameter="mpi_max_requests_in_flight",
+            parameter_type=int,
+        )
+        if max_requests_in_flight is None:
+            max_requests_in_flight = 4
+        if max_requests_in_flight < 1:
+            raise exceptions.OmConfigurationFileSyntaxError(
+                "The maximum number of MPI requests in flight must be positive."
+            )
+        self._max_requests_in_flight: int = max_requests_in_flight
+        # The messages still being sent by a processing node, with the buffers that
+        # must be kept alive until they are sent, and the receive buffers of the
+        # collecting node, which are reused for every event.
+        self._requests_in_flight: Deque[
+            Tuple[List[Any], List[numpy.ndarray]]
+        ] = collections.deque()
+        self._receive_buffers: Dict[str, numpy.ndarray] = {}
+
+        processing_pipeline: Union[str, None] = self._monitor_params.get_param(
+            group="om",
+            parameter="processing_pipeline",
+            parameter_type=str,
+        )
+        if processing_pipeline is None:
+            processing_pipeline = "serial"
+        if processing_pipeline not in ("serial", "ring"):
+            raise exceptions.OmConfigurationFileSyntaxError(
+                "Unknown processing pipeline: {0}.".format(processing_pipeline)
+            )
+        self._use_pipeline: bool = processing_pipeline == "ring"
+        pipeline_num_slots: Union[int, None] = self._monitor_params.get_param(
+            group="om",
+            parameter="pipeline_num_slots",
+            parameter_type=int,
+        )
+        if pipeline_num_slots is None:
+            pipeline_num_slots = 8
+        pipeline_num_workers: Union[int, None] = self._monitor_params.get_param(
+            group="om",
+            parameter="pipeline_num_workers",
+            parameter_type=int,
+        )
+        if pipeline_num_workers is None:
+            pipeline_num_workers = 2
+        if pipeline_num_slots < 1 or pipeline_num_workers < 1:
+            raise exceptions.OmConfigurationFileSyntaxError(
+                "The numbers of pipeline slots and workers must be positive."
+            )
+        self._pipeline_num_slots: int = pipeline_num_slots
+        self._pipeline_num_workers: int = pipeline_num_workers
+
+        event_scheduling: Union[str, None] = self._monitor_params.get_param(
+            group="om",
+            parameter="event_scheduling",
+            parameter_type=str,
+        )
+        if event_scheduling is None:
+            event_scheduling = "static"
+        if event_scheduling not in ("static", "dynamic"):
+            raise exceptions.OmConfigurationFileSyntaxError(
+                "Unknown event scheduling: {0}.".format(event_scheduling)
+            )
+        self._event_window: Any = None
+        if event_scheduling == "dynamic":
+            event_batch_duration: Union[float, None] = self._monitor_params.get_param(
+                group="om",
+                parameter="event_batch_duration_in_s",
+                parameter_type=float,
+            )
+            if event_batch_duration is None:
+                event_batch_duration = 0.5
+            if event_batch_duration <= 0.0:
+                raise exceptions.OmConfigurationFileSyntaxError(
+                    "The duration of the event batches must be positive."
+                )
+            # With a pipeline, the events are claimed by the retrieval thread while
+            # the main thread sends the processed data.
+            if self._use_pipeline and MPI.Query_thread() < MPI.THREAD_MULTIPLE:
+                if self._rank == 0:
+                    print(
+                        "OM Warning: The MPI library does not support multiple "
+                        "threads. The frames will be processed serially."
+                    )
+                self._use_pipeline = False
+            # The counter of the claimed events is stored on the collecting node. All
+            # the nodes must take part in the creation of the window, and must wait
+            # until the counter is initialized.
+            self._event_window = MPI.Win.Allocate(
+                numpy.dtype(numpy.int64).itemsize if self._rank == 0 else 0,
+                disp_unit=numpy.dtype(numpy.int64).itemsize,
+                comm=MPI.COMM_WORLD,
+            )
+            if self._rank == 0:
+                self._event_window.Lock(0, MPI.LOCK_EXCLUSIVE)
+                self._event_window.Put(
+                    [numpy.zeros(1, dtype=numpy.int64), MPI.INT64_T], target_rank=0
+                )
+                self._event_window.Unlock(0)
+            MPI.COMM_WORLD.Barrier()
+            if self._rank != 0:
+                self._data_event_handler.set_event_scheduler(
+                    _MpiEventScheduler(
+                        self._event_window, self._mpi_size - 1, event_batch_duration
+                    )
+                )
+
         if self._rank == 0:
             self._data_event_handler.initialize_event_handling_on_collecting_node(
                 self._rank, self._mpi_size
@@ -112,9 +355,7 @@ class MpiParallelizationEngine(par_layer_base.OmParallelizationEngine):
 
             while True:
                 try:
-                    received_data: Tuple[Dict[str, Any], int] = MPI.COMM_WORLD.recv(
-                        source=MPI.ANY_SOURCE, tag=0
-                    )
+                    received_data: Tuple[Dict[str, Any], int] = self._receive()
                     if "end" in received_data[0].keys():
                         # If the received message announces that a processing node has
                         # finished processing data, keeps track of how many processing
@@ -130,7 +371,7 @@ class MpiParallelizationEngine(par_layer_base.OmParallelizationEngine):
                             self._monitor.end_processing_on_collecting_node(
                                 self._rank, self._mpi_size
                             )
-                            MPI.Finalize()
+                            self._finalize()
                             exit(0)
                         else:
                             continue
@@ -149,52 +390,78 @@ class MpiParallelizationEngine(par_layer_base.OmParallelizationEngine):
         else:
             self._monitor.initialize_processing_node(self._rank, self._mpi_size)
 
+            pipeline: Any = None
+            if self._use_pipeline:
+                pipeline = self._monitor.create_processing_pipeline(
+                    self._rank,
+                    self._mpi_size,
+                    self._pipeline_num_slots,
+                    self._pipeline_num_workers,
+                )
+                if pipeline is None:
+                    print(
+                        "OM Warning: The monitor does not support processing "
+                        "pipelines. The frames will be processed serially."
+                    )
+
             # Flag used to make sure that the MPI messages have been processed.
             req = None
             events = self._data_event_handler.event_generator(
                 node_rank=self._rank,
                 node_pool_size=self._mpi_size,
             )
+            if pipeline is not None:
+                self._process_frames_with_pipeline(pipeline, events)
+            else:
+                event: Dict[str, Any]
+                for event in events:
+                    # Listens for requests to shut down.
+                    if MPI.COMM_WORLD.Iprobe(source=0, tag=_DIETAG):
+                        self.shutdown("Shutting down RANK: {0}.".format(self._rank))
 
-            event: Dict[str, Any]
-            for event in events:
-                # Listens for requests to shut down.
-                if MPI.COMM_WORLD.Iprobe(source=0, tag=_DIETAG):
-                    self.shutdown("Shutting down RANK: {0}.".format(self._rank))
-
-                self._data_event_handler.open_event(event)
-                n_frames_in_evt: int = self._data_event_handler.get_num_frames_in_event(
-                    event
-                )
-                if self._num_frames_in_event_to_process is not None:
-                    num_frames_to_process: int = min(
-                        n_frames_in_evt, self._num_frames_in_event_to_process
+                    self._data_event_handler.open_event(event)
+                    n_frames_in_evt: int = (
+                        self._data_event_handler.get_num_frames_in_event(event)
                     )
-                else:
-                    num_frames_to_process = n_frames_in_evt
-                # Iterates over the last 'num_frames_to_process' frames in the event.
-                frame_offset: int
-                for frame_offset in range(-num_frames_to_process, 0):
-                    current_frame: int = n_frames_in_evt + frame_offset
-                    event["current_frame"] = current_frame
-                    try:
-                        data: Dict[str, Any] = self._data_event_handler.extract_data(
-                            event
+                    if self._num_frames_in_event_to_process is not None:
+                        num_frames_to_process: int = min(
+                            n_frames_in_evt, self._num_frames_in_event_to_process
                         )
-                    except exceptions.OmDataExtractionError as exc:
-                        print(exc)
-                        print("Skipping event...")
-                        continue
-                    processed_data: Tuple[
-                        Dict[str, Any], int
-                    ] = self._monitor.process_data(self._rank, self._mpi_size, data)
+                    else:
+                        num_frames_to_process = n_frames_in_evt
+                    # Iterates over the last 'num_frames_to_process' frames in the
+                    # event.
+                    frame_offset: int
+                    for frame_offset in range(-num_frames_to_process, 0):
+                        current_frame: int = n_frames_in_evt + frame_offset
+                        event["current_frame"] = current_frame
+                        try:
+                            data: Dict[
+                                str, Any
+                            ] = self._data_event_handler.extract_data(event)
+                        except exceptions.OmDataExtractionError as exc:
+                            print(exc)
+                            print("Skipping event...")
+                            continue
+                        processed_data: Tuple[
+                            Dict[str, Any], int
+                        ] = self._monitor.process_data(
+                            self._rank, self._mpi_size, data
+                        )
+                        if self._use_buffers:
+                            self._send(processed_data)
+                            continue
+                        if req:
+                            req.Wait()
+                        req = MPI.COMM_WORLD.isend(processed_data, dest=0, tag=0)
+                    # Makes sure that the last MPI message has processed.
                     if req:
                         req.Wait()
-                    req = MPI.COMM_WORLD.isend(processed_data, dest=0, tag=0)
-                # Makes sure that the last MPI message has processed.
-                if req:
-                    req.Wait()
-                self._data_event_handler.close_event(event)
+                    self._data_event_handler.close_event(event)
+
+            # The buffers sent from the ring must also be processed before the final
+            # messages are sent.
+            self._wait_for_requests_in_flight(0)
 
             # After finishing iterating over the events to process, calls the
             # end_processing function, and if the function returns something, sends it
@@ -205,17 +472,26 @@ class MpiParallelizationEngine(par_layer_base.OmParallelizationEngine):
                 self._rank, self._mpi_size
             )
             if final_data is not None:
-                req = MPI.COMM_WORLD.isend((final_data, self._rank), dest=0, tag=0)
-                if req:
-                    req.Wait()
+                if self._use_buffers:
+                    self._send((final_data, self._rank))
+                    self._wait_for_requests_in_flight(0)
+                else:
+                    req = MPI.COMM_WORLD.isend(
+                        (final_data, self._rank), dest=0, tag=0
+                    )
+                    if req:
+                        req.Wait()
 
             # Sends a message to the collecting node saying that there are no more
-            # events.
-            end_dict = {"end": True}
+            # events. When the buffers are used, the collecting node expects the
+            # description of the buffers in every message.
+            end_dict: Dict[str, Any] = {"end": True}
+            if self._use_buffers:
+                end_dict[_BUFFERS_KEY] = []
             req = MPI.COMM_WORLD.isend((end_dict, self._rank), dest=0, tag=0)
             if req:
                 req.Wait()
-            MPI.Finalize()
+            self._finalize()
             exit(0)
 
     def shutdown(self, msg: Union[str, None] = "Reason not provided.") -> None:
@@ -246,16 +522,25 @@ class MpiParallelizationEngine(par_layer_base.OmParallelizationEngine):
                 for node_num in range(1, self._mpi_size):
                     MPI.COMM_WORLD.isend(0, dest=node_num, tag=_DIETAG)
                 num_shutdown_confirm = 0
+                status: MPI.Status = MPI.Status()
                 while True:
                     if MPI.COMM_WORLD.Iprobe(source=MPI.ANY_SOURCE, tag=0):
                         _ = MPI.COMM_WORLD.recv(source=MPI.ANY_SOURCE, tag=0)
+                    if MPI.COMM_WORLD.Iprobe(
+                        source=MPI.ANY_SOURCE, tag=_BUFFERTAG, status=status
+                    ):
+                        MPI.COMM_WORLD.Recv(
+                            [numpy.empty(status.Get_count(), numpy.uint8), MPI.BYTE],
+                            source=status.Get_source(),
+                            tag=_BUFFERTAG,
+                        )
                     if MPI.COMM_WORLD.Iprobe(source=MPI.ANY_SOURCE, tag=_DEADTAG):
                         num_shutdown_confirm += 1
                     if num_shutdown_confirm == self._mpi_size - 1:
                         break
                 # When all the processing nodes have confirmed, shuts down the
                 # collecting node.
-                MPI.Finalize()
+                self._finalize()
                 exit(0)
             except RuntimeError:
                 # In case of error, crashes hard!
@@ -263,5 +548,173 @@ class MpiParallelizationEngine(par_layer_base.OmParallelizationEngine):
                 exit(0)
         else:
             _ = MPI.COMM_WORLD.send(dest=0, tag=_DEADTAG)
-            MPI.Finalize()
+            self._finalize()
             exit(0)
+
+    def _finalize(self) -> None:
+        # Frees the window of the claimed events, if the events are scheduled
+        # dynamically, then finalizes MPI. All the nodes must free the window
+        # together, and all the nodes call this function when they shut down.
+        if self._event_window is not None:
+            self._event_window.Free()
+            self._event_window = None
+        MPI.Finalize()
+
+    def _fill_pipeline(
+        self,
+        pipeline: Any,
+        events: Any,
+        slot_data: List[Union[Dict[str, Any], None]],
+        errors: List[BaseException],
+    ) -> None:
+        # Retrieves the frames of all the events and stores them in the slots of the
+        # pipeline, in order, together with the data returned by the monitor for each
+        # frame. This function runs on its own thread, and never uses MPI. Any error is
+        # passed to the main thread.
+        try:
+            event: Dict[str, Any]
+            for event in events:
+                self._data_event_handler.open_event(event)
+                n_frames_in_evt: int = self._data_event_handler.get_num_frames_in_event(
+                    event
+                )
+                if self._num_frames_in_event_to_process is not None:
+                    num_frames_to_process: int = min(
+                        n_frames_in_evt, self._num_frames_in_event_to_process
+                    )
+                else:
+                    num_frames_to_process = n_frames_in_evt
+                frame_offset: int
+                for frame_offset in range(-num_frames_to_process, 0):
+                    event["current_frame"] = n_frames_in_evt + frame_offset
+                    try:
+                        data: Dict[str, Any] = self._data_event_handler.extract_data(
+                            event
+                        )
+                    except exceptions.OmDataExtractionError as exc:
+                        print(exc)
+                        print("Skipping event...")
+                        continue
+                    slot: int = pipeline.acquire_slot()
+                    slot_data[slot] = self._monitor.preprocess_data(
+                        self._rank, self._mpi_size, data, pipeline.slot_data(slot)
+                    )
+                    pipeline.publish_slot(slot)
+                self._data_event_handler.close_event(event)
+        except BaseException as exc:
+            errors.append(exc)
+        finally:
+            pipeline.close()
+
+    def _process_frames_with_pipeline(self, pipeline: Any, events: Any) -> None:
+        # Processes the frames of all the events with a pipeline: a thread retrieves
+        # the frames and fills the slots of the pipeline, while this thread completes
+        # the processing of each frame, in order, and sends the results to the
+        # collecting node.
+        slot_data: List[Union[Dict[str, Any], None]] = [
+            None
+        ] * self._pipeline_num_slots
+        errors: List[BaseException] = []
+        retrieval_thread: threading.Thread = threading.Thread(
+            target=self._fill_pipeline,
+            args=(pipeline, events, slot_data, errors),
+            daemon=True,
+        )
+        retrieval_thread.start()
+
+        req = None
+        while True:
+            # Listens for requests to shut down.
+            if MPI.COMM_WORLD.Iprobe(source=0, tag=_DIETAG):
+                self.shutdown("Shutting down RANK: {0}.".format(self._rank))
+
+            slot: Union[int, None] = pipeline.next_result()
+            if slot is None:
+                break
+            processed_data: Tuple[
+                Dict[str, Any], int
+            ] = self._monitor.postprocess_data(
+                self._rank, self._mpi_size, slot_data[slot], pipeline, slot
+            )
+            slot_data[slot] = None
+            pipeline.release_slot(slot)
+            if self._use_buffers:
+                self._send(processed_data)
+                continue
+            if req:
+                req.Wait()
+            req = MPI.COMM_WORLD.isend(processed_data, dest=0, tag=0)
+        # Makes sure that the last MPI message has processed.
+        if req:
+            req.Wait()
+
+        retrieval_thread.join()
+        if errors:
+            raise errors[0]
+
+    def _wait_for_requests_in_flight(self, max_requests_in_flight: int) -> None:
+        # Waits until no more than the given number of messages are still being sent
+        # by the processing node, starting from the oldest.
+        while len(self._requests_in_flight) > max_requests_in_flight:
+            requests: List[Any]
+            requests, _ = self._requests_in_flight.popleft()
+            MPI.Request.Waitall(requests)
+
+    def _send(self, processed_data: Tuple[Dict[str, Any], int]) -> None:
+        # Sends the processed data to the collecting node. The arrays are sent with
+        # non-blocking sends straight from their memory, after the rest of the data.
+        # The number of messages in flight is bounded: when the ring is full, waits
+        # for the oldest message to be sent.
+        self._wait_for_requests_in_flight(self._max_requests_in_flight - 1)
+        metadata: Dict[str, Any]
+        buffers: List[numpy.ndarray]
+        metadata, buffers = _split_processed_data(processed_data[0])
+        requests: List[Any] = [
+            MPI.COMM_WORLD.isend((metadata, processed_data[1]), dest=0, tag=0)
+        ]
+        buffer: numpy.ndarray
+        for buffer in buffers:
+            requests.append(
+                MPI.COMM_WORLD.Isend([buffer, MPI.BYTE], dest=0, tag=_BUFFERTAG)
+            )
+        self._requests_in_flight.append((requests, buffers))
+
+    def _receive(self) -> Tuple[Dict[str, Any], int]:
+        # Receives the processed data sent by a processing node. When the buffers are
+        # used, the arrays are received into buffers that are reused for every event:
+        # they are only valid until the next event is received.
+        if not self._use_buffers:
+            return MPI.COMM_WORLD.recv(source=MPI.ANY_SOURCE, tag=0)
+
+        status: MPI.Status = MPI.Status()
+        received_data: Tuple[Dict[str, Any], int] = MPI.COMM_WORLD.recv(
+            source=MPI.ANY_SOURCE, tag=0, status=status
+        )
+        # MPI does not let messages from the same node overtake each other, so the
+        # buffers of the message are the next ones received from its node.
+        data: Dict[str, Any] = received_data[0]
+        key: str
+        descr: Any
+        shape: Tuple[int, ...]
+        for key, descr, shape in data.pop(_BUFFERS_KEY):
+            dtype: numpy.dtype = (
+                numpy.dtype(numpy.uint8)
+                if descr is None
+                else numpy.lib.format.descr_to_dtype(descr)
+            )
+            num_bytes: int = int(numpy.prod(shape)) * dtype.itemsize
+            buffer: Union[numpy.ndarray, None] = self._receive_buffers.get(key)
+            if buffer is None or buffer.shape[0] < num_bytes:
+                buffer = numpy.empty(num_bytes, dtype=numpy.uint8)
+                self._receive_buffers[key] = buffer
+            MPI.COMM_WORLD.Recv(
+                [buffer[:num_bytes], MPI.BYTE],
+                source=status.Get_source(),
+                tag=_BUFFERTAG,
+            )
+            if descr is None:
+                data[key] = buffer[:num_bytes].tobytes()
+            else:
+                data[key] = buffer[:num_bytes].view(dtype).reshape(shape)
+
+        return received_data
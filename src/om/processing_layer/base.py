@@ -219,3 +219,127 @@ class OmMonitor(ABC):
                 processing nodes and the collecting node.
         """
         pass
+
+    def create_processing_pipeline(
+        self, node_rank: int, node_pool_size: int, num_slots: int, num_workers: int
+    ) -> Any:
+        """
+        Creates the pipeline used to process the data frames on a processing node.
+
+        This function is called by the Parallelization Engine on the processing nodes,
+        after the [initialize_processing_node]
+        [om.processing_layer.base.OmMonitor.initialize_processing_node] function, when
+        the frames must be processed by a pipeline instead of by the
+        [process_data][om.processing_layer.base.OmMonitor.process_data] function. In a
+        pipeline, a thread retrieves the frames, prepares them with the
+        [preprocess_data][om.processing_layer.base.OmMonitor.preprocess_data]
+        function, and stores them in the slots of a ring, while worker threads
+        process the stored frames. The results of each frame are then completed, in
+        order, by the [postprocess_data]
+        [om.processing_layer.base.OmMonitor.postprocess_data] function. The three
+        functions must be implemented together. By default, this function returns
+        None, meaning that the Monitor does not support pipelines.
+
+        Arguments:
+
+            node_rank: The OM rank of the current node, which is an integer that
+                unambiguously identifies the current node in the OM node pool.
+
+            node_pool_size: The total number of nodes in the OM pool, including all the
+                processing nodes and the collecting node.
+
+            num_slots: The number of frame slots in the ring.
+
+            num_workers: The number of worker threads.
+
+        Returns:
+
+            An object with the interface of the [Peakfinder8Pipeline]
+            [om.lib.peakfinder8_extension_stub.Peakfinder8Pipeline] class, or None if
+            the Monitor does not support pipelines.
+        """
+        return None
+
+    def preprocess_data(
+        self,
+        node_rank: int,
+        node_pool_size: int,
+        data: Dict[str, Any],
+        frame_buffer: Any,
+    ) -> Dict[str, Any]:
+        """
+        Prepares a single frame in a data event for a processing pipeline.
+
+        This function is invoked on each processing node, on the thread that retrieves
+        the data, for every detector data frame, when a pipeline created by the
+        [create_processing_pipeline]
+        [om.processing_layer.base.OmMonitor.create_processing_pipeline] function is
+        used. It must store the frame that the workers of the pipeline process in the
+        frame buffer of a slot, and return the data that the
+        [postprocess_data][om.processing_layer.base.OmMonitor.postprocess_data]
+        function needs to complete the processing of the frame.
+
+        Arguments:
+
+            node_rank: The OM rank of the current node, which is an integer that
+                unambiguously identifies the current node in the OM node pool.
+
+            node_pool_size: The total number of nodes in the OM pool, including all the
+                processing nodes and the collecting node.
+
+            data: A dictionary containing the data retrieved by OM for the detector
+                data frame being processed (see the documentation of the
+                [process_data][om.processing_layer.base.OmMonitor.process_data]
+                function).
+
+            frame_buffer: The frame buffer of the slot in which the frame must be
+                stored.
+
+        Returns:
+
+            A dictionary with the data needed to complete the processing of the frame.
+        """
+        raise NotImplementedError
+
+    def postprocess_data(
+        self,
+        node_rank: int,
+        node_pool_size: int,
+        data: Dict[str, Any],
+        pipeline: Any,
+        slot: int,
+    ) -> Tuple[Dict[str, Any], int]:
+        """
+        Completes the processing of a single frame in a processing pipeline.
+
+        This function is invoked on each processing node, in the order in which the
+        frames were retrieved, when the workers of a pipeline created by the
+        [create_processing_pipeline]
+        [om.processing_layer.base.OmMonitor.create_processing_pipeline] function have
+        processed a frame. The slot of the frame is released after this function
+        returns, so the returned data must not share memory with the slot.
+
+        Arguments:
+
+            node_rank: The OM rank of the current node, which is an integer that
+                unambiguously identifies the current node in the OM node pool.
+
+            node_pool_size: The total number of nodes in the OM pool, including all the
+                processing nodes and the collecting node.
+
+            data: The dictionary returned by the [preprocess_data]
+                [om.processing_layer.base.OmMonitor.preprocess_data] function for the
+                frame.
+
+            pipeline: The pipeline.
+
+            slot: The index of the slot storing the frame.
+
+        Returns:
+
+            A tuple whose first entry is a dictionary storing the data that should be
+            sent to the collecting node, and whose second entry is the OM rank number
+            of the node that processed the information (see the documentation of the
+            [process_data][om.processing_layer.base.OmMonitor.process_data] function).
+        """
+        raise NotImplementedError
@@ -23,7 +23,7 @@ This module contains an OnDA Monitor for serial x-ray crystallography experiment
 import collections
 import sys
 import time
-from typing import Any, Deque, Dict, List, Tuple, Union
+from typing import Any, Deque, Dict, Tuple, Union
 
 import h5py  # type: ignore
 import numpy  # type: ignore
@@ -34,6 +34,7 @@ from om.processing_layer import base as process_layer_base
 from om.utils import crystfel_geometry, exceptions, parameters, zmq_monitor
 from om.utils.crystfel_geometry import TypeDetector, TypePixelMaps
 from om.algorithms.crystallography import TypePeakfinder8Info
+from om.lib.peakfinder8_extension import PixelMapCache  # type: ignore
 
 try:
     import msgpack  # type: ignore
@@ -105,10 +106,19 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
         _: Any
         __: Any
         geometry, _, __ = crystfel_geometry.load_crystfel_geometry(geometry_filename)
-        self._pixelmaps: TypePixelMaps = crystfel_geometry.compute_pix_maps(geometry)
+        self._pixel_map_cache: Union[
+            PixelMapCache, None
+        ] = self._load_pixel_map_cache(geometry, geometry_filename)
+        if self._pixel_map_cache is not None:
+            self._pixelmaps: TypePixelMaps = self._pixel_map_cache.pixel_maps()
+        else:
+            self._pixelmaps = crystfel_geometry.compute_pix_maps(geometry)
 
         self._hit_frame_sending_counter: int = 0
         self._non_hit_frame_sending_counter: int = 0
+        self._frame_compression: Union[
+            cryst_algs.SparseFrameCompression, None
+        ] = self._initialize_frame_compression()
 
         dark_data_filename: str = self._monitor_params.get_param(
             group="correction", parameter="dark_filename", parameter_type=str
@@ -128,6 +138,13 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
         gain_map_hdf5_path: str = self._monitor_params.get_param(
             group="correction", parameter="gain_hdf5_path", parameter_type=str
         )
+        shared_detector_constants: Union[
+            str, None
+        ] = self._monitor_params.get_param(
+            group="om", parameter="shared_detector_constants", parameter_type=str
+        )
+        if shared_detector_constants is None:
+            shared_detector_constants = "none"
         self._correction = gen_algs.Correction(
             dark_filename=dark_data_filename,
             dark_hdf5_path=dark_data_hdf5_path,
@@ -135,6 +152,7 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
             mask_hdf5_path=mask_hdf5_path,
             gain_filename=gain_map_filename,
             gain_hdf5_path=gain_map_hdf5_path,
+            shared_constants=shared_detector_constants,
         )
 
         pf8_detector_info: TypePeakfinder8Info = cryst_algs.get_peakfinder8_info(
@@ -193,6 +211,78 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
             parameter_type=int,
             required=True,
         )
+        pf8_background_estimator: Union[str, None] = self._monitor_params.get_param(
+            group="peakfinder8_peak_detection",
+            parameter="background_estimator",
+            parameter_type=str,
+        )
+        if pf8_background_estimator is None:
+            pf8_background_estimator = "sigma_clipping"
+        pf8_background_decay: Union[float, None] = self._monitor_params.get_param(
+            group="peakfinder8_peak_detection",
+            parameter="background_decay",
+            parameter_type=float,
+        )
+        if pf8_background_decay is None:
+            pf8_background_decay = 0.1
+        pf8_num_threads: Union[int, None] = self._monitor_params.get_param(
+            group="peakfinder8_peak_detection",
+            parameter="num_threads",
+            parameter_type=int,
+        )
+        if pf8_num_threads is None:
+            pf8_num_threads = 1
+        pf8_seed_scan: Union[str, None] = self._monitor_params.get_param(
+            group="peakfinder8_peak_detection",
+            parameter="seed_scan",
+            parameter_type=str,
+        )
+        if pf8_seed_scan is None:
+            pf8_seed_scan = "pixel"
+        pf8_local_background: Union[str, None] = self._monitor_params.get_param(
+            group="peakfinder8_peak_detection",
+            parameter="local_background",
+            parameter_type=str,
+        )
+        if pf8_local_background is None:
+            pf8_local_background = "ring"
+        pf8_backend: Union[str, None] = self._monitor_params.get_param(
+            group="peakfinder8_peak_detection",
+            parameter="backend",
+            parameter_type=str,
+        )
+        if pf8_backend is None:
+            pf8_backend = "cpu"
+        pf8_peak_refinement: Union[str, None] = self._monitor_params.get_param(
+            group="peakfinder8_peak_detection",
+            parameter="peak_refinement",
+            parameter_type=str,
+        )
+        if pf8_peak_refinement is None:
+            pf8_peak_refinement = "center_of_mass"
+        pf8_prescreen: Union[bool, None] = self._monitor_params.get_param(
+            group="peakfinder8_peak_detection",
+            parameter="prescreen",
+            parameter_type=bool,
+        )
+        if pf8_prescreen is None:
+            pf8_prescreen = False
+        self._pf8_prescreen_validation: Union[
+            bool, None
+        ] = self._monitor_params.get_param(
+            group="peakfinder8_peak_detection",
+            parameter="prescreen_validation",
+            parameter_type=bool,
+        )
+        if self._pf8_prescreen_validation is None:
+            self._pf8_prescreen_validation = False
+        pf8_collect_stats: Union[bool, None] = self._monitor_params.get_param(
+            group="peakfinder8_peak_detection",
+            parameter="collect_stats",
+            parameter_type=bool,
+        )
+        if pf8_collect_stats is None:
+            pf8_collect_stats = False
         pf8_bad_pixel_map_fname: Union[str, None] = self._monitor_params.get_param(
             group="peakfinder8_peak_detection",
             parameter="bad_pixel_map_filename",
@@ -233,6 +323,24 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
         else:
             bad_pixel_map = None
 
+        self._min_num_peaks_for_hit: int = self._monitor_params.get_param(
+            group="crystallography",
+            parameter="min_num_peaks_for_hit",
+            parameter_type=int,
+            required=True,
+        )
+        # A frame is a hit if it has more than min_num_peaks_for_hit peaks
+        if pf8_prescreen:
+            pf8_prescreen_min_peaks: int = self._min_num_peaks_for_hit + 1
+        else:
+            pf8_prescreen_min_peaks = 0
+
+        # The assembled position and the resolution of the peaks are computed by the
+        # peak search. As on the collecting node, the pixel size and the offset of
+        # the first panel are taken for the whole detector.
+        first_panel: str = list(geometry["panels"].keys())[0]
+        self._first_panel_coffset = geometry["panels"][first_panel]["coffset"]
+
         self._peak_detection: cryst_algs.Peakfinder8PeakDetection = (
             cryst_algs.Peakfinder8PeakDetection(
                 max_num_peaks=pf8_max_num_peaks,
@@ -249,15 +357,36 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
                 max_res=pf8_max_res,
                 bad_pixel_map=bad_pixel_map,
                 radius_pixel_map=self._pixelmaps["radius"],
+                background_estimator=pf8_background_estimator,
+                background_decay=pf8_background_decay,
+                num_threads=pf8_num_threads,
+                prescreen_min_peaks=pf8_prescreen_min_peaks,
+                prescreen_validation=self._pf8_prescreen_validation,
+                seed_scan=pf8_seed_scan,
+                local_background=pf8_local_background,
+                backend=pf8_backend,
+                collect_stats=pf8_collect_stats,
+                pixel_map_cache=self._pixel_map_cache,
+                x_pixel_map=self._pixelmaps["x"],
+                y_pixel_map=self._pixelmaps["y"],
+                pixels_per_meter=geometry["panels"][first_panel]["res"],
+                peak_refinement=pf8_peak_refinement,
             )
         )
+        self._pf8_prescreen: bool = pf8_prescreen
+
+        # The statistics of the peak search are sent to the collecting node, and then
+        # reset, every time the node has processed speed_report_interval frames.
+        self._pf8_stats_interval: Union[int, None] = None
+        if pf8_collect_stats:
+            self._pf8_stats_interval = self._monitor_params.get_param(
+                group="crystallography",
+                parameter="speed_report_interval",
+                parameter_type=int,
+                required=True,
+            )
+        self._pf8_stats_counter: int = 0
 
-        self._min_num_peaks_for_hit: int = self._monitor_params.get_param(
-            group="crystallography",
-            parameter="min_num_peaks_for_hit",
-            parameter_type=int,
-            required=True,
-        )
         self._max_num_peaks_for_hit: int = self._monitor_params.get_param(
             group="crystallography",
             parameter="max_num_peaks_for_hit",
@@ -332,7 +461,13 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
         self._geometry, _, __ = crystfel_geometry.load_crystfel_geometry(
             geometry_filename
         )
-        self._pixelmaps = crystfel_geometry.compute_pix_maps(self._geometry)
+        self._pixel_map_cache = self._load_pixel_map_cache(
+            self._geometry, geometry_filename
+        )
+        if self._pixel_map_cache is not None:
+            self._pixelmaps = self._pixel_map_cache.pixel_maps()
+        else:
+            self._pixelmaps = crystfel_geometry.compute_pix_maps(self._geometry)
 
         # Theoretically, the pixel size could be different for every module of the
         # detector. The pixel size of the first module is taken as the pixel size
@@ -347,10 +482,6 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
             parameter_type=int,
             required=True,
         )
-        self._hit_rate_running_window: Deque[float] = collections.deque(
-            [0.0] * self._running_average_window_size,
-            maxlen=self._running_average_window_size,
-        )
         self._avg_hit_rate: int = 0
         self._hit_rate_timestamp_history: Deque[float] = collections.deque(
             5000 * [0.0], maxlen=5000
@@ -382,12 +513,25 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
             + visual_img_shape[0] // 2
             - 1
         ).flatten()
-        self._virt_powd_plot_img: numpy.ndarray = numpy.zeros(
-            visual_img_shape, dtype=numpy.int32
+        # The accumulator owns the virtual powder plot, and keeps the running hit
+        # rate.
+        self._powder_accumulator: cryst_algs.PowderAccumulator = (
+            cryst_algs.PowderAccumulator(
+                visual_pixelmap_x=self._visual_pixelmap_x.reshape(
+                    self._pixelmaps["x"].shape
+                ).astype(numpy.int32),
+                visual_pixelmap_y=self._visual_pixelmap_y.reshape(
+                    self._pixelmaps["y"].shape
+                ).astype(numpy.int32),
+                powder_shape=visual_img_shape,
+                window_size=self._running_average_window_size,
+            )
         )
+        self._virt_powd_plot_img: numpy.ndarray = self._powder_accumulator.powder
         self._frame_data_img: numpy.ndarray = numpy.zeros(
             visual_img_shape, dtype=numpy.float32
         )
+        self._frame_compression = self._initialize_frame_compression()
 
         first_panel: str = list(self._geometry["panels"].keys())[0]
         self._first_panel_coffset: float = self._geometry["panels"][first_panel][
@@ -420,6 +564,7 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
         self._num_events: int = 0
         self._old_time: float = time.time()
         self._time: Union[float, None] = None
+        self._pf8_stats: Union[Dict[str, Any], None] = None
 
         print("Starting the monitor...")
         sys.stdout.flush()
@@ -460,17 +605,187 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
             sent to the collecting node, and whose second entry is the OM rank number
             of the node that processed the information.
         """
-        processed_data: Dict[str, Any] = {}
         corrected_detector_data: numpy.ndarray = self._correction.apply_correction(
             data=data["detector_data"]
         )
-        peak_list: cryst_algs.TypePeakList = self._peak_detection.find_peaks(
+        # The peak list is a numpy structured array, which is sent to the collecting
+        # node as it is
+        self._peak_detection.set_beam_parameters(*self._beam_parameters(data))
+        peak_list: numpy.ndarray = self._peak_detection.find_peaks_array(
             corrected_detector_data
         )
+
+        return (
+            self._process_peaks(
+                data, data["detector_data"].shape, corrected_detector_data, peak_list
+            ),
+            node_rank,
+        )
+
+    def create_processing_pipeline(
+        self, node_rank: int, node_pool_size: int, num_slots: int, num_workers: int
+    ) -> cryst_algs.Peakfinder8Pipeline:
+        """
+        Creates the pipeline used to process the data frames on a processing node.
+
+        This method overrides the corresponding method of the base class: please also
+        refer to the documentation of that class for more information.
+
+        This function creates a pipeline in which the peaks of the corrected frames
+        are searched by native worker threads (see the documentation of the
+        [create_pipeline]
+        [om.algorithms.crystallography.Peakfinder8PeakDetection.create_pipeline]
+        function of the peakfinder8 algorithm).
+
+        Arguments:
+
+            node_rank: The OM rank of the current node, which is an integer that
+                unambiguously identifies the current node in the OM node pool.
+
+            node_pool_size: The total number of nodes in the OM pool, including all the
+                processing nodes and the collecting node.
+
+            num_slots: The number of frame slots in the ring.
+
+            num_workers: The number of worker threads.
+
+        Returns:
+
+            The pipeline.
+        """
+        return self._peak_detection.create_pipeline(num_slots, num_workers)
+
+    def preprocess_data(
+        self,
+        node_rank: int,
+        node_pool_size: int,
+        data: Dict[str, Any],
+        frame_buffer: numpy.ndarray,
+    ) -> Dict[str, Any]:
+        """
+        Corrects a detector data frame for a processing pipeline.
+
+        This method overrides the corresponding method of the base class: please also
+        refer to the documentation of that class for more information.
+
+        This function writes the corrected detector data frame directly into the frame
+        buffer of a slot of the pipeline.
+
+        Arguments:
+
+            node_rank: The OM rank of the current node, which is an integer that
+                unambiguously identifies the current node in the OM node pool.
+
+            node_pool_size: The total number of nodes in the OM pool, including all the
+                processing nodes and the collecting node.
+
+            data: A dictionary containing the data retrieved by OM for the frame being
+                processed.
+
+            frame_buffer: The frame buffer of the slot in which the corrected frame
+                must be stored.
+
+        Returns:
+
+            A dictionary with the data, other than the detector data frame, that is
+            sent to the collecting node.
+        """
+        self._correction.apply_correction(data=data["detector_data"], out=frame_buffer)
+
+        return {
+            "timestamp": data["timestamp"],
+            "detector_distance": data["detector_distance"],
+            "beam_energy": data["beam_energy"],
+            "event_id": data["event_id"],
+            "frame_id": data["frame_id"],
+            "data_shape": data["detector_data"].shape,
+        }
+
+    def postprocess_data(
+        self,
+        node_rank: int,
+        node_pool_size: int,
+        data: Dict[str, Any],
+        pipeline: cryst_algs.Peakfinder8Pipeline,
+        slot: int,
+    ) -> Tuple[Dict[str, Any], int]:
+        """
+        Prepares the Bragg peak information found by a processing pipeline.
+
+        This method overrides the corresponding method of the base class: please also
+        refer to the documentation of that class for more information.
+
+        This function prepares the Bragg peak data found in a frame by the workers of
+        the pipeline (and optionally, the detector frame data) for transmission to the
+        collecting node, like the [process_data]
+        [om.processing_layer.crystallography.CrystallographyMonitor.process_data]
+        function.
+
+        Arguments:
+
+            node_rank: The OM rank of the current node, which is an integer that
+                unambiguously identifies the current node in the OM node pool.
+
+            node_pool_size: The total number of nodes in the OM pool, including all the
+                processing nodes and the collecting node.
+
+            data: The dictionary returned by the [preprocess_data]
+                [om.processing_layer.crystallography.CrystallographyMonitor.preprocess_data]
+                function for the frame.
+
+            pipeline: The pipeline.
+
+            slot: The index of the slot storing the frame.
+
+        Returns:
+
+            A tuple whose first entry is a dictionary storing the data that should be
+            sent to the collecting node, and whose second entry is the OM rank number
+            of the node that processed the information.
+        """
+        # The workers do not know the beam parameters of each frame: the resolution
+        # of the peaks is filled here.
+        peak_list: numpy.ndarray = pipeline.slot_peaks(slot)
+        self._peak_detection.fill_peak_resolution(
+            peak_list, *self._beam_parameters(data)
+        )
+        processed_data: Dict[str, Any] = self._process_peaks(
+            data,
+            data["data_shape"],
+            pipeline.slot_data(slot),
+            peak_list,
+        )
+        # The slot is reused as soon as it is released.
+        if "detector_data" in processed_data:
+            processed_data["detector_data"] = processed_data["detector_data"].copy()
+
+        return (processed_data, node_rank)
+
+    def _beam_parameters(
+        self, data: Dict[str, Any]
+    ) -> Tuple[Union[float, None], Union[float, None]]:
+        # Returns the beam energy, in eV, and the distance between the sample and the
+        # detector, in meters, of a frame. The detector distance retrieved with the
+        # frame is in mm, and does not include the offset of the detector panels.
+        detector_distance: Union[float, None] = None
+        if data["detector_distance"] is not None:
+            detector_distance = (
+                data["detector_distance"] * 1e-3 + self._first_panel_coffset
+            )
+        return data["beam_energy"], detector_distance
+
+    def _process_peaks(
+        self,
+        data: Dict[str, Any],
+        data_shape: Tuple[int, ...],
+        corrected_detector_data: numpy.ndarray,
+        peak_list: numpy.ndarray,
+    ) -> Dict[str, Any]:
+        # Decides whether the frame is a hit, and prepares the data sent to the
+        # collecting node.
+        processed_data: Dict[str, Any] = {}
         frame_is_hit: bool = (
-            self._min_num_peaks_for_hit
-            < len(peak_list["intensity"])
-            < self._max_num_peaks_for_hit
+            self._min_num_peaks_for_hit < len(peak_list) < self._max_num_peaks_for_hit
         )
 
         processed_data["timestamp"] = data["timestamp"]
@@ -479,7 +794,13 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
         processed_data["beam_energy"] = data["beam_energy"]
         processed_data["event_id"] = data["event_id"]
         processed_data["frame_id"] = data["frame_id"]
-        processed_data["data_shape"] = data["detector_data"].shape
+        processed_data["data_shape"] = data_shape
+        if self._pf8_stats_interval is not None:
+            self._pf8_stats_counter += 1
+            if self._pf8_stats_counter == self._pf8_stats_interval:
+                processed_data["peakfinder8_stats"] = self._peak_detection.get_stats()
+                self._peak_detection.reset_stats()
+                self._pf8_stats_counter = 0
         if frame_is_hit:
             processed_data["peak_list"] = peak_list
             if self._hit_frame_sending_interval is not None:
@@ -489,11 +810,15 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
                     # attribute says that the detector frame data should be sent to
                     # the collecting node, adds the data to the 'processed_data'
                     # dictionary (and resets the counter).
-                    processed_data["detector_data"] = corrected_detector_data
+                    self._add_detector_data(
+                        processed_data, corrected_detector_data, peak_list
+                    )
                     self._hit_frame_sending_counter = 0
         else:
             # If the frame is not a hit, sends an empty peak list.
-            processed_data["peak_list"] = {"fs": [], "ss": [], "intensity": []}
+            processed_data["peak_list"] = numpy.empty(
+                0, dtype=cryst_algs.peak_list_dtype
+            )
             if self._non_hit_frame_sending_interval is not None:
                 self._non_hit_frame_sending_counter += 1
                 if (
@@ -504,10 +829,12 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
                     # attribute says that the detector frame data should be sent to
                     # the collecting node, adds the data to the 'processed_data'
                     # dictionary (and resets the counter).
-                    processed_data["detector_data"] = corrected_detector_data
+                    self._add_detector_data(
+                        processed_data, corrected_detector_data, peak_list
+                    )
                     self._non_hit_frame_sending_counter = 0
 
-        return (processed_data, node_rank)
+        return processed_data
 
     def collect_data(
         self,
@@ -542,14 +869,31 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
         """
         received_data: Dict[str, Any] = processed_data[0]
         self._num_events += 1
+        if "peakfinder8_stats" in received_data:
+            self._accumulate_peakfinder8_stats(received_data["peakfinder8_stats"])
 
         if received_data["frame_is_hit"] is True:
             request: Union[str, None] = self._responding_socket.get_request()
             if request is not None:
                 if request == "next":
+                    # msgpack cannot serialize numpy arrays: the peak list is sent
+                    # with the same layout as before the peaks were stored in
+                    # structured arrays, a TypePeakList dictionary of lists, so that
+                    # the existing clients can still read it.
+                    peak_list: numpy.ndarray = received_data["peak_list"]
                     message: Any = msgpack.packb(
                         {
-                            "peak_list": received_data["peak_list"],
+                            "peak_list": {
+                                "num_peaks": len(peak_list),
+                                "fs": peak_list["fs"].tolist(),
+                                "ss": peak_list["ss"].tolist(),
+                                "intensity": peak_list["intensity"].tolist(),
+                                "num_pixels": peak_list["num_pixels"].tolist(),
+                                "max_pixel_intensity": peak_list[
+                                    "max_pixel_intensity"
+                                ].tolist(),
+                                "snr": peak_list["snr"].tolist(),
+                            },
                             "beam_energy": received_data["beam_energy"],
                             "detector_distance": received_data["detector_distance"],
                             "event_id": received_data["event_id"],
@@ -562,31 +906,18 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
                 else:
                     print("OM Warning: Could not understand request '{}'.")
 
-        self._hit_rate_running_window.append(float(received_data["frame_is_hit"]))
-        avg_hit_rate: float = (
-            sum(self._hit_rate_running_window) / self._running_average_window_size
+        # The peaks are added to the virtual powder plot in bulk, and their positions
+        # in the plot are returned for the frame data broadcast.
+        peak_list_x_in_frame: numpy.ndarray
+        peak_list_y_in_frame: numpy.ndarray
+        (
+            peak_list_x_in_frame,
+            peak_list_y_in_frame,
+        ) = self._powder_accumulator.add_frame(
+            received_data["frame_is_hit"], received_data["peak_list"]
         )
         self._hit_rate_timestamp_history.append(received_data["timestamp"])
-        self._hit_rate_history.append(avg_hit_rate * 100.0)
-
-        peak_list_x_in_frame: List[float] = []
-        peak_list_y_in_frame: List[float] = []
-        peak_fs: float
-        peak_ss: float
-        peak_value: float
-        for peak_fs, peak_ss, peak_value in zip(
-            received_data["peak_list"]["fs"],
-            received_data["peak_list"]["ss"],
-            received_data["peak_list"]["intensity"],
-        ):
-            peak_index_in_slab: int = int(round(peak_ss)) * received_data["data_shape"][
-                1
-            ] + int(round(peak_fs))
-            y_in_frame: float = self._visual_pixelmap_y[peak_index_in_slab]
-            x_in_frame: float = self._visual_pixelmap_x[peak_index_in_slab]
-            peak_list_x_in_frame.append(y_in_frame)
-            peak_list_y_in_frame.append(x_in_frame)
-            self._virt_powd_plot_img[y_in_frame, x_in_frame] += peak_value
+        self._hit_rate_history.append(self._powder_accumulator.hit_rate * 100.0)
 
         if self._num_events % self._data_broadcast_interval == 0:
             self._data_broadcast_socket.send_data(
@@ -604,33 +935,60 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
                 },
             )
 
-            if "detector_data" in received_data:
+            if (
+                "detector_data" in received_data
+                or "compressed_detector_data" in received_data
+            ):
                 # If detector frame data is found in the data received from the
                 # processing node, it must be broadcasted to visualization programs.
+                detector_data: numpy.ndarray
+                if "compressed_detector_data" in received_data:
+                    detector_data = cryst_algs.decompress_frame(
+                        received_data["compressed_detector_data"]
+                    )
+                else:
+                    detector_data = received_data["detector_data"]
 
                 self._frame_data_img[
                     self._visual_pixelmap_y, self._visual_pixelmap_x
-                ] = (
-                    received_data["detector_data"]
-                    .ravel()
-                    .astype(self._frame_data_img.dtype)
-                )
+                ] = detector_data.ravel().astype(self._frame_data_img.dtype)
 
+                frame_data_message: Dict[str, Any] = {
+                    "timestamp": received_data["timestamp"],
+                    "peak_list_x_in_frame": peak_list_x_in_frame,
+                    "peak_list_y_in_frame": peak_list_y_in_frame,
+                }
+                if self._frame_compression is not None:
+                    # The assembled frame is compressed around the positions of the
+                    # peaks in the frame image.
+                    frame_peak_list: numpy.ndarray = numpy.zeros(
+                        len(peak_list_x_in_frame), dtype=cryst_algs.peak_list_dtype
+                    )
+                    frame_peak_list["ss"] = peak_list_x_in_frame
+                    frame_peak_list["fs"] = peak_list_y_in_frame
+                    frame_data_message[
+                        "compressed_frame_data"
+                    ] = self._frame_compression.compress(
+                        self._frame_data_img, frame_peak_list
+                    )
+                else:
+                    frame_data_message["frame_data"] = self._frame_data_img
                 self._data_broadcast_socket.send_data(
-                    tag=u"view:omframedata",
-                    message={
-                        "frame_data": self._frame_data_img,
-                        "timestamp": received_data["timestamp"],
-                        "peak_list_x_in_frame": peak_list_x_in_frame,
-                        "peak_list_y_in_frame": peak_list_y_in_frame,
-                    },
+                    tag=u"view:omframedata", message=frame_data_message
                 )
+
+                # The compressed frame data is forwarded as it is.
+                tweaking_data_message: Dict[str, Any] = {
+                    "timestamp": received_data["timestamp"],
+                }
+                if "compressed_detector_data" in received_data:
+                    tweaking_data_message["compressed_detector_data"] = received_data[
+                        "compressed_detector_data"
+                    ]
+                else:
+                    tweaking_data_message["detector_data"] = detector_data
                 self._data_broadcast_socket.send_data(
-                    tag=u"view:omtweakingdata",
-                    message={
-                        "detector_data": received_data["detector_data"],
-                        "timestamp": received_data["timestamp"],
-                    },
+                    tag=u"view:omtweakingdata", message=tweaking_data_message
                 )
 
         if self._num_events % self._speed_report_interval == 0:
@@ -646,6 +1004,10 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
                     ),
                 )
             )
+            if self._pf8_stats is not None:
+                speed_report_msg += self._report_peakfinder8_stats(
+                    received_data["timestamp"]
+                )
             print(speed_report_msg)
             sys.stdout.flush()
             self._old_time = now_time
@@ -676,6 +1038,21 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
             to the processing node.
 
         """
+        if self._pf8_prescreen:
+            prescreen_stats: Dict[str, int] = self._peak_detection.get_prescreen_stats()
+            prescreen_msg: str = (
+                "Processing node {0}: the peakfinder8 pre-screen rejected {1} of {2} "
+                "frames".format(
+                    node_rank,
+                    prescreen_stats["num_rejected"],
+                    prescreen_stats["num_frames"],
+                )
+            )
+            if self._pf8_prescreen_validation:
+                prescreen_msg += ", {0} of which had enough peaks to be hits".format(
+                    prescreen_stats["num_false_negatives"]
+                )
+            print(prescreen_msg + ".")
         print("Processing node {0} shutting down.".format(node_rank))
         sys.stdout.flush()
 
@@ -704,3 +1081,142 @@ class CrystallographyMonitor(process_layer_base.OmMonitor):
             )
         )
         sys.stdout.flush()
+
+    def _accumulate_peakfinder8_stats(self, stats: Dict[str, Any]) -> None:
+        # Adds the peakfinder8 statistics sent by a processing node to the ones
+        # received since the last speed report.
+        if self._pf8_stats is None:
+            self._pf8_stats = {
+                key: (dict(value) if isinstance(value, dict) else value)
+                for key, value in stats.items()
+            }
+            return
+        key: str
+        for key in stats:
+            if isinstance(stats[key], dict):
+                sub_key: str
+                for sub_key in stats[key]:
+                    self._pf8_stats[key][sub_key] += stats[key][sub_key]
+            elif key == "max_peak_pixels":
+                self._pf8_stats[key] = max(self._pf8_stats[key], stats[key])
+            else:
+                self._pf8_stats[key] += stats[key]
+
+    def _report_peakfinder8_stats(self, timestamp: float) -> str:
+        # Broadcasts the peakfinder8 statistics received since the last speed report,
+        # and returns their summary for the report.
+        stats: Dict[str, Any] = self._pf8_stats
+        self._pf8_stats = None
+        self._data_broadcast_socket.send_data(
+            tag=u"view:omstats",
+            message={"timestamp": timestamp, "peakfinder8_stats": stats},
+        )
+        num_frames: int = max(stats["num_frames"], 1)
+        stage_ms: Dict[str, float] = {
+            stage: 1000.0 * time_s / num_frames
+            for stage, time_s in stats["stage_times"].items()
+        }
+        return (
+            ", peakfinder8 per frame: {0:.2f} ms (radial stats {1:.2f}, candidate "
+            "scan {2:.2f}, peak growth {3:.2f}, local background {4:.2f}), "
+            "{5:.1f} candidates, {6:.1f} rejected, largest peak {7} pixels".format(
+                stage_ms["total"],
+                stage_ms["radial_stats"],
+                stage_ms["candidate_scan"],
+                stage_ms["peak_growth"],
+                stage_ms["local_background"],
+                stats["num_candidates"] / num_frames,
+                sum(stats["num_rejected"].values()) / num_frames,
+                stats["max_peak_pixels"],
+            )
+        )
+
+    def _initialize_frame_compression(
+        self,
+    ) -> Union[cryst_algs.SparseFrameCompression, None]:
+        # Reads the frame compression parameters. Returns None if the detector frame
+        # data must be sent uncompressed.
+        frame_compression: Union[bool, None] = self._monitor_params.get_param(
+            group="crystallography",
+            parameter="frame_compression",
+            parameter_type=bool,
+        )
+        if not frame_compression:
+            return None
+
+        peak_radius: Union[int, None] = self._monitor_params.get_param(
+            group="crystallography",
+            parameter="frame_compression_peak_radius",
+            parameter_type=int,
+        )
+        if peak_radius is None:
+            peak_radius = 4
+        quantization_step: Union[float, None] = self._monitor_params.get_param(
+            group="crystallography",
+            parameter="frame_compression_quantization_step",
+            parameter_type=float,
+        )
+        if quantization_step is None:
+            quantization_step = 1.0
+        bin_size: Union[int, None] = self._monitor_params.get_param(
+            group="crystallography",
+            parameter="frame_compression_bin_size",
+            parameter_type=int,
+        )
+        if bin_size is None:
+            bin_size = 1
+        zlib_level: Union[int, None] = self._monitor_params.get_param(
+            group="crystallography",
+            parameter="frame_compression_zlib_level",
+            parameter_type=int,
+        )
+        if zlib_level is None:
+            zlib_level = 0
+
+        return cryst_algs.SparseFrameCompression(
+            peak_radius=peak_radius,
+            quantization_step=quantization_step,
+            bin_size=bin_size,
+            zlib_level=zlib_level,
+        )
+
+    def _load_pixel_map_cache(
+        self, geometry: TypeDetector, geometry_filename: str
+    ) -> Union[PixelMapCache, None]:
+        # Opens the pixel map cache of the geometry, writing it if needed. Returns
+        # None if no cache directory is configured, or if the cache cannot be
+        # written: the pixel maps are then computed by each node.
+        cache_directory: Union[str, None] = self._monitor_params.get_param(
+            group="crystallography",
+            parameter="pixel_map_cache_directory",
+            parameter_type=str,
+        )
+        if cache_directory is None:
+            return None
+
+        try:
+            return crystfel_geometry.load_pix_maps_cache(
+                geometry, geometry_filename, cache_directory
+            )
+        except (OSError, RuntimeError) as exc:
+            print(
+                "OM Warning: The pixel map cache cannot be used ({0}). The pixel "
+                "maps will be computed without it.".format(exc)
+            )
+            sys.stdout.flush()
+            return None
+
+    def _add_detector_data(
+        self,
+        processed_data: Dict[str, Any],
+        detector_data: numpy.ndarray,
+        peak_list: numpy.ndarray,
+    ) -> None:
+        # Adds the detector frame data to the data sent to the collecting node,
+        # compressed around the peaks if required.
+        if self._frame_compression is not None:
+            processed_data[
+                "compressed_detector_data"
+            ] = self._frame_compression.compress(detector_data, peak_list)
+        else:
+            processed_data["detector_data"] = detector_data
@@ -23,14 +23,20 @@ used by the CrystFEL software package.
 """
 import collections
 import copy
+import hashlib
 import math
+import os
 import re
 import sys
-from typing import Dict, List, TextIO, Tuple, Union
+from typing import BinaryIO, Dict, List, TextIO, Tuple, Union
 
 import numpy  # type: ignore
 from mypy_extensions import TypedDict
 
+from om.lib.peakfinder8_extension import (  # type: ignore
+    PixelMapCache,
+    write_pixel_map_cache,
+)
 from om.utils import exceptions
 
 
@@ -1191,6 +1197,63 @@ def compute_pix_maps(geometry: TypeDetector) -> TypePixelMaps:
     }
 
 
+def load_pix_maps_cache(
+    geometry: TypeDetector, geometry_filename: str, cache_directory: str
+) -> PixelMapCache:
+    """
+    Opens the pixel map cache of a CrystFEL geometry, writing it if needed.
+
+    This function returns the pixel maps of a geometry, stored in a cache file in the
+    provided directory. The pixel maps are the same as the ones computed by the
+    [compute_pix_maps][om.utils.crystfel_geometry.compute_pix_maps] function, but
+    they are computed only once, by the first process that needs them, and all the
+    processes of a machine that open the cache share the same copy of the maps in
+    memory. The cache also stores the radial bin of each pixel used by the
+    peakfinder8 algorithm.
+
+    The cache file is identified by a hash of the content of the geometry file: when
+    the geometry file changes, a new cache file is written.
+
+    Arguments:
+
+        geometry: A [TypeDetector][om.utils.crystfel_geometry.TypeDetector] dictionary
+            returned by the [load_crystfel_geometry]
+            [om.utils.crystfel_geometry.load_crystfel_geometry] function, storing the
+            detector geometry information.
+
+        geometry_filename: The name of the file from which the geometry information
+            was read.
+
+        cache_directory: The directory where the cache files are stored. The
+            directory is created if it does not exist.
+
+    Returns:
+
+        A [PixelMapCache][om.lib.peakfinder8_extension_stub.PixelMapCache] object
+        storing the pixel maps.
+
+    Raises:
+
+        RuntimeError: A RuntimeError is raised if the cache file cannot be written.
+    """
+    file_handle: BinaryIO
+    with open(geometry_filename, "rb") as file_handle:
+        key: str = hashlib.sha256(file_handle.read()).hexdigest()
+    cache_filename: str = os.path.join(cache_directory, "{0}.pixelmaps".format(key))
+
+    try:
+        return PixelMapCache(cache_filename, key)
+    except RuntimeError:
+        pass
+
+    # Other processes might be writing the same cache at the same time: the file
+    # written last replaces the others, which store the same maps.
+    os.makedirs(cache_directory, exist_ok=True)
+    write_pixel_map_cache(cache_filename, key, list(geometry["panels"].values()))
+
+    return PixelMapCache(cache_filename, key)
+
+
 def compute_visualization_pix_maps(geometry: TypeDetector) -> TypePixelMaps:
     """
     Computes pixel maps for data visualization from CrystFEL geometry information.
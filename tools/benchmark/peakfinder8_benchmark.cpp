@@ -0,0 +1,610 @@
+// This file is part of OM.
+//
+// OM is free software: you can redistribute it and/or modify it under the terms of
+// the GNU General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+// OM is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+// PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with OnDA.
+// If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2020 -2021 SLAC National Accelerator Laboratory
+//
+// Based on OnDA - Copyright 2014-2019 Deutsches Elektronen-Synchrotron DESY,
+// a research centre of the Helmholtz Association.
+
+// Standalone benchmark of the peakfinder8 extension. It runs the original
+// peakfinder8 function and the context API on synthetic frames, or on recorded
+// frames, for the detector layouts supported by OM, and reports the time spent on
+// each frame. The peaks found can be written to a golden file, and compared with the
+// ones stored in a golden file, so that optimizations can be checked for changes in
+// the output. The time spent in each stage of the context API, and the number of
+// candidate peaks rejected for each reason, are measured in a separate pass, so that
+// reading the timers does not affect the main measurement. The context API is timed
+// with the panel kernels compiled for each layout, and with the generic one that
+// they replace. Build it with
+// 'make benchmark' and run it with -h for the options.
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+
+#include "peakfinder8.hh"
+
+
+struct benchmark_layout
+{
+	const char *name;
+	long asic_nx;
+	long asic_ny;
+	long nasics_x;
+	long nasics_y;
+};
+
+// The layouts returned by get_peakfinder8_info in om.algorithms.crystallography
+static const struct benchmark_layout layouts[] = {
+	{ "cspad", 194, 185, 8, 8 },
+	{ "pilatus", 2463, 2527, 1, 1 },
+	{ "jungfrau1M", 1024, 512, 1, 2 },
+	{ "jungfrau4M", 1024, 512, 1, 8 },
+	{ "epix10k2M", 384, 352, 1, 16 },
+	{ "rayonix", 1920, 1920, 1, 1 },
+};
+static const int num_layouts = sizeof(layouts) / sizeof(layouts[0]);
+
+// Peak finding parameters, suited to the synthetic frames
+static const long max_num_peaks = 2048;
+static const float adc_thresh = 50;
+static const float min_snr = 5;
+static const long min_pix_count = 1;
+static const long max_pix_count = 20;
+static const long local_bg_radius = 3;
+
+
+struct benchmark_frames
+{
+	long num_pix;
+	long num_frames;
+	float *data;
+	char *mask;
+	float *pix_r;
+};
+
+
+// The synthetic frames are generated with a self-contained random number
+// generator, so that they are the same with every compiler and C library
+static unsigned long long rng_state;
+
+static double rng_uniform(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return (rng_state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+static double rng_normal(void)
+{
+	double u1, u2;
+
+	u1 = rng_uniform();
+	u2 = rng_uniform();
+	if ( u1 < 1e-300 ) {
+		u1 = 1e-300;
+	}
+	return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) * 1e-6;
+}
+
+
+// The radius of each pixel is measured from the center of the data frame, which is
+// used as a detector image
+static void fill_radius_map(const struct benchmark_layout *layout, float *pix_r)
+{
+	long width, height;
+	long x, y;
+	double cx, cy;
+
+	width = layout->asic_nx * layout->nasics_x;
+	height = layout->asic_ny * layout->nasics_y;
+	cx = width / 2.0 + 0.3;
+	cy = height / 2.0 - 0.7;
+	for ( y=0 ; y<height ; y++ ) {
+		for ( x=0 ; x<width ; x++ ) {
+			pix_r[y * width + x] = sqrt((x - cx) * (x - cx) + (y - cy) * (y - cy));
+		}
+	}
+}
+
+
+// Synthetic frames have a noisy radial background, about 1% of masked pixels, an ice
+// ring on every fourth frame and a number of Gaussian peaks that grows with the frame
+// index, starting from an empty frame
+static void generate_frame(const struct benchmark_layout *layout, long frame,
+                           const float *pix_r, float *data, char *mask)
+{
+	long width, height, num_pix;
+	long num_peaks;
+	long pi, pki;
+	long x, y, dx, dy;
+	double px, py, amplitude, sigma;
+
+	width = layout->asic_nx * layout->nasics_x;
+	height = layout->asic_ny * layout->nasics_y;
+	num_pix = width * height;
+	rng_state = 0x9E3779B97F4A7C15ULL ^ (frame * 7919 + layout->asic_nx);
+
+	for ( pi=0 ; pi<num_pix ; pi++ ) {
+		data[pi] = 10 + 3 * rng_normal() + 30 * exp(-pix_r[pi] / 300);
+		mask[pi] = rng_uniform() < 0.01 ? 0 : 1;
+		if ( frame % 4 == 3 && fabs(pix_r[pi] - 200) < 3 ) {
+			data[pi] += 60;
+		}
+	}
+
+	num_peaks = (frame % 8) * 100;
+	for ( pki=0 ; pki<num_peaks ; pki++ ) {
+		px = rng_uniform() * width;
+		py = rng_uniform() * height;
+		amplitude = 50 + rng_uniform() * 500;
+		sigma = 0.5 + rng_uniform() * 1.5;
+		for ( dy=-5 ; dy<=5 ; dy++ ) {
+			for ( dx=-5 ; dx<=5 ; dx++ ) {
+				x = (long)px + dx;
+				y = (long)py + dy;
+				if ( x < 0 || y < 0 || x >= width || y >= height ) {
+					continue;
+				}
+				data[y * width + x] += amplitude * exp(-((x - px) * (x - px)
+				                       + (y - py) * (y - py)) / (2 * sigma * sigma));
+			}
+		}
+	}
+}
+
+
+static void free_frames(struct benchmark_frames *frames)
+{
+	free(frames->data);
+	free(frames->mask);
+	free(frames->pix_r);
+}
+
+
+// Prepares the frames of a layout, generating them or reading them from a file of
+// float32 values. Recorded frames are not masked. Returns 1 on error
+static int load_frames(const struct benchmark_layout *layout, long num_frames,
+                       const char *frame_filename, struct benchmark_frames *frames)
+{
+	FILE *fh = NULL;
+	long file_size;
+	long frame;
+	long pi;
+
+	frames->num_pix = layout->asic_nx * layout->nasics_x * layout->asic_ny
+	                  * layout->nasics_y;
+	frames->data = NULL;
+	frames->mask = NULL;
+	frames->pix_r = (float *)malloc(frames->num_pix * sizeof(float));
+
+	if ( frame_filename != NULL ) {
+		fh = fopen(frame_filename, "rb");
+		if ( fh == NULL ) {
+			fprintf(stderr, "Cannot open %s\n", frame_filename);
+			free_frames(frames);
+			return 1;
+		}
+		fseek(fh, 0, SEEK_END);
+		file_size = ftell(fh);
+		fseek(fh, 0, SEEK_SET);
+		num_frames = file_size / (frames->num_pix * (long)sizeof(float));
+		if ( num_frames == 0 ) {
+			fprintf(stderr, "%s does not store any %s frame\n", frame_filename,
+			        layout->name);
+			fclose(fh);
+			free_frames(frames);
+			return 1;
+		}
+	}
+
+	frames->num_frames = num_frames;
+	frames->data = (float *)malloc(num_frames * frames->num_pix * sizeof(float));
+	frames->mask = (char *)malloc(num_frames * frames->num_pix * sizeof(char));
+	if ( frames->pix_r == NULL || frames->data == NULL || frames->mask == NULL ) {
+		fprintf(stderr, "Cannot allocate the %s frames\n", layout->name);
+		if ( frame_filename != NULL ) {
+			fclose(fh);
+		}
+		free_frames(frames);
+		return 1;
+	}
+	fill_radius_map(layout, frames->pix_r);
+
+	if ( frame_filename != NULL ) {
+		if ( fread(frames->data, sizeof(float), num_frames * frames->num_pix, fh)
+		     != (size_t)(num_frames * frames->num_pix) ) {
+			fprintf(stderr, "Cannot read %s\n", frame_filename);
+			fclose(fh);
+			free_frames(frames);
+			return 1;
+		}
+		fclose(fh);
+		for ( pi=0 ; pi<num_frames*frames->num_pix ; pi++ ) {
+			frames->mask[pi] = 1;
+		}
+		return 0;
+	}
+
+	for ( frame=0 ; frame<num_frames ; frame++ ) {
+		generate_frame(layout, frame, frames->pix_r,
+		               frames->data + frame * frames->num_pix,
+		               frames->mask + frame * frames->num_pix);
+	}
+	return 0;
+}
+
+
+// Number of values stored for each peak in a golden file: the fields up to the
+// signal-to-noise ratio. The benchmark does not set a geometry, so the assembled
+// position and the resolution of the peaks are not stored
+#define GOLDEN_NUM_PEAK_FIELDS (PF8_PEAK_SNR + 1)
+
+
+static void write_golden_peaks(FILE *fh, const char *layout_name, long frame,
+                               const tPeakList *peak_list)
+{
+	long pki;
+
+	fprintf(fh, "%s %ld %ld\n", layout_name, frame, peak_list->nPeaks);
+	for ( pki=0 ; pki<peak_list->nPeaks ; pki++ ) {
+		fprintf(fh, "%.9g %.9g %.9g %.9g %.9g %.9g %.9g\n", peak_list->peak_com_x[pki],
+		        peak_list->peak_com_y[pki], peak_list->peak_totalintensity[pki],
+		        peak_list->peak_npix[pki], peak_list->peak_maxintensity[pki],
+		        peak_list->peak_sigma[pki], peak_list->peak_snr[pki]);
+	}
+}
+
+
+static int values_differ(double golden, double value, double tolerance)
+{
+	return fabs(golden - value) > tolerance * (1 + fabs(golden));
+}
+
+
+// Compares the peaks of a frame with its entry in a golden file. The entries of the
+// other layouts and frames found before it are skipped, so that a golden file
+// written for all the layouts can be used to check any of them. The values are
+// written with enough digits to be read back exactly as floats. Returns the number
+// of differences found
+static long compare_golden_peaks(FILE *fh, const char *layout_name, long frame,
+                                 const tPeakList *peak_list, double tolerance)
+{
+	char golden_layout[64];
+	long golden_frame, golden_num_peaks;
+	float golden[GOLDEN_NUM_PEAK_FIELDS];
+	float value[GOLDEN_NUM_PEAK_FIELDS];
+	long pki;
+	int fi;
+	long num_differences;
+
+	while ( 1 ) {
+		if ( fscanf(fh, "%63s %ld %ld", golden_layout, &golden_frame,
+		            &golden_num_peaks) != 3 ) {
+			fprintf(stderr, "The golden file does not store frame %ld of %s\n",
+			        frame, layout_name);
+			return 1;
+		}
+		if ( strcmp(golden_layout, layout_name) == 0 && golden_frame == frame ) {
+			break;
+		}
+		for ( pki=0 ; pki<golden_num_peaks*GOLDEN_NUM_PEAK_FIELDS ; pki++ ) {
+			if ( fscanf(fh, "%f", &golden[0]) != 1 ) {
+				fprintf(stderr, "The golden file is truncated\n");
+				return 1;
+			}
+		}
+	}
+
+	num_differences = 0;
+	if ( golden_num_peaks != peak_list->nPeaks ) {
+		printf("%s frame %ld: %ld peaks, %ld in the golden file\n", layout_name,
+		       frame, peak_list->nPeaks, golden_num_peaks);
+		num_differences += 1;
+	}
+
+	for ( pki=0 ; pki<golden_num_peaks ; pki++ ) {
+		for ( fi=0 ; fi<GOLDEN_NUM_PEAK_FIELDS ; fi++ ) {
+			if ( fscanf(fh, "%f", &golden[fi]) != 1 ) {
+				fprintf(stderr, "The golden file is truncated\n");
+				return num_differences + 1;
+			}
+		}
+		if ( pki >= peak_list->nPeaks ) {
+			continue;
+		}
+		value[PF8_PEAK_FS] = peak_list->peak_com_x[pki];
+		value[PF8_PEAK_SS] = peak_list->peak_com_y[pki];
+		value[PF8_PEAK_INTENSITY] = peak_list->peak_totalintensity[pki];
+		value[PF8_PEAK_NUM_PIXELS] = peak_list->peak_npix[pki];
+		value[PF8_PEAK_MAX_PIXEL_INTENSITY] = peak_list->peak_maxintensity[pki];
+		value[PF8_PEAK_SIGMA] = peak_list->peak_sigma[pki];
+		value[PF8_PEAK_SNR] = peak_list->peak_snr[pki];
+		for ( fi=0 ; fi<GOLDEN_NUM_PEAK_FIELDS ; fi++ ) {
+			if ( values_differ(golden[fi], value[fi], tolerance) ) {
+				printf("%s frame %ld peak %ld field %d: %.9g, %.9g in the golden "
+				       "file\n", layout_name, frame, pki, fi, value[fi], golden[fi]);
+				num_differences += 1;
+				break;
+			}
+		}
+	}
+
+	return num_differences;
+}
+
+
+// Processes each frame once more with the statistics of the context enabled, and
+// prints them
+static void print_stage_stats(const struct benchmark_layout *layout,
+                              tPeakfinder8Context *context,
+                              const struct benchmark_frames *frames)
+{
+	const tPeakfinder8Stats *stats;
+	long frame;
+	double scale;
+
+	setPeakfinder8CollectStats(context, 1);
+	resetPeakfinder8Stats(context);
+	for ( frame=0 ; frame<frames->num_frames ; frame++ ) {
+		peakfinder8_context(context, frames->data + frame * frames->num_pix,
+		                    frames->mask + frame * frames->num_pix, adc_thresh,
+		                    min_snr, min_pix_count, max_pix_count, local_bg_radius,
+		                    NULL);
+	}
+	setPeakfinder8CollectStats(context, 0);
+
+	stats = &context->stats;
+	scale = 1e-6 / stats->num_frames;
+	printf("%-12s %12.3f %12.3f %12.3f %12.3f %12.3f\n", layout->name,
+	       stats->stage_ns[PF8_STAGE_RADIAL_STATS] * scale,
+	       stats->stage_ns[PF8_STAGE_CANDIDATE_SCAN] * scale,
+	       stats->stage_ns[PF8_STAGE_PEAK_GROWTH] * scale,
+	       stats->stage_ns[PF8_STAGE_LOCAL_BACKGROUND] * scale,
+	       stats->stage_ns[PF8_STAGE_TOTAL] * scale);
+	printf("%-12s seeds %ld, candidates %ld, peaks %ld, largest %ld pixels; "
+	       "rejected: pixel count %ld, intensity %ld, snr %ld, background %ld, "
+	       "panel edge %ld\n", "", stats->num_seeds, stats->num_candidates,
+	       stats->num_peaks, stats->max_peak_pixels,
+	       stats->num_rejected[PF8_REJECTED_PIX_COUNT],
+	       stats->num_rejected[PF8_REJECTED_INTENSITY],
+	       stats->num_rejected[PF8_REJECTED_SNR],
+	       stats->num_rejected[PF8_REJECTED_BACKGROUND],
+	       stats->num_rejected[PF8_REJECTED_PANEL_EDGE]);
+}
+
+
+static void print_usage(const char *program)
+{
+	printf("Usage: %s [-l layout] [-n num_frames] [-r repeats] [-i frame_file]\n"
+	       "       [-w golden_file | -g golden_file [-t tolerance]]\n\n"
+	       "  -l  Detector layout (default: all of them):", program);
+	for ( int li=0 ; li<num_layouts ; li++ ) {
+		printf(" %s", layouts[li].name);
+	}
+	printf("\n"
+	       "  -n  Number of synthetic frames for each layout (default: 16)\n"
+	       "  -r  Number of times each frame is processed (default: 3)\n"
+	       "  -i  File of float32 frames with the layout given with -l, used instead\n"
+	       "      of the synthetic frames\n"
+	       "  -w  Writes the peaks found by the context API to a golden file\n"
+	       "  -g  Compares the peaks found by the context API with a golden file\n"
+	       "  -t  Relative tolerance of the comparison (default: 0, bit-exact)\n"
+	       "  -s  Does not measure the time spent in each stage\n");
+}
+
+
+int main(int argc, char **argv)
+{
+	const char *layout_name = NULL;
+	const char *frame_filename = NULL;
+	const char *golden_filename = NULL;
+	int write_golden = 0;
+	int measure_stages = 1;
+	long num_frames = 16;
+	int num_repeats = 3;
+	double tolerance = 0;
+	FILE *golden_fh = NULL;
+	struct benchmark_frames frames;
+	const struct benchmark_layout *layout;
+	tPeakfinder8Context *context;
+	tPeakList peak_list;
+	struct timespec start, end;
+	double time_function, time_generic, time_context;
+	long num_differences = 0;
+	long num_peaks;
+	long num_generic_peaks;
+	long frame;
+	int li, ri;
+	int opt;
+
+	while ( (opt = getopt(argc, argv, "l:n:r:i:w:g:t:sh")) != -1 ) {
+		switch ( opt ) {
+			case 'l':
+				layout_name = optarg;
+				break;
+
+			case 'n':
+				num_frames = atol(optarg);
+				break;
+
+			case 'r':
+				num_repeats = atoi(optarg);
+				break;
+
+			case 'i':
+				frame_filename = optarg;
+				break;
+
+			case 'w':
+				golden_filename = optarg;
+				write_golden = 1;
+				break;
+
+			case 'g':
+				golden_filename = optarg;
+				write_golden = 0;
+				break;
+
+			case 't':
+				tolerance = atof(optarg);
+				break;
+
+			case 's':
+				measure_stages = 0;
+				break;
+
+			default:
+				print_usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if ( num_frames < 1 || num_repeats < 1 || (frame_filename != NULL
+	                                           && layout_name == NULL) ) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	if ( golden_filename != NULL ) {
+		golden_fh = fopen(golden_filename, write_golden ? "w" : "r");
+		if ( golden_fh == NULL ) {
+			fprintf(stderr, "Cannot open %s\n", golden_filename);
+			return 1;
+		}
+	}
+
+	printf("%-12s %7s %7s %12s %12s %12s %8s\n", "layout", "pixels", "frames",
+	       "function ms", "generic ms", "context ms", "peaks");
+
+	allocatePeakList(&peak_list, max_num_peaks);
+	for ( li=0 ; li<num_layouts ; li++ ) {
+		layout = &layouts[li];
+		if ( layout_name != NULL && strcmp(layout_name, layout->name) != 0 ) {
+			continue;
+		}
+		if ( load_frames(layout, num_frames, frame_filename, &frames) != 0 ) {
+			freePeakList(peak_list);
+			return 1;
+		}
+
+		context = allocatePeakfinder8Context(frames.pix_r, layout->asic_nx,
+		                                     layout->asic_ny, layout->nasics_x,
+		                                     layout->nasics_y, max_num_peaks,
+		                                     max_pix_count);
+		if ( context == NULL ) {
+			fprintf(stderr, "Cannot allocate the %s context\n", layout->name);
+			free_frames(&frames);
+			freePeakList(peak_list);
+			return 1;
+		}
+
+		// The original function allocates its buffers on every call, the context
+		// allocates them once
+		time_function = 0;
+		time_generic = 0;
+		time_context = 0;
+		num_peaks = 0;
+		num_generic_peaks = 0;
+		for ( frame=0 ; frame<frames.num_frames ; frame++ ) {
+			for ( ri=0 ; ri<num_repeats ; ri++ ) {
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				peakfinder8(&peak_list, frames.data + frame * frames.num_pix,
+				            frames.mask + frame * frames.num_pix, frames.pix_r,
+				            layout->asic_nx, layout->asic_ny, layout->nasics_x,
+				            layout->nasics_y, adc_thresh, min_snr, min_pix_count,
+				            max_pix_count, local_bg_radius, NULL);
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				time_function += elapsed_ms(&start, &end);
+
+				setPeakfinder8PanelKernel(context, PF8_PANEL_KERNEL_GENERIC);
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				peakfinder8_context(context, frames.data + frame * frames.num_pix,
+				                    frames.mask + frame * frames.num_pix, adc_thresh,
+				                    min_snr, min_pix_count, max_pix_count,
+				                    local_bg_radius, NULL);
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				time_generic += elapsed_ms(&start, &end);
+				setPeakfinder8PanelKernel(context, PF8_PANEL_KERNEL_LAYOUT);
+
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				peakfinder8_context(context, frames.data + frame * frames.num_pix,
+				                    frames.mask + frame * frames.num_pix, adc_thresh,
+				                    min_snr, min_pix_count, max_pix_count,
+				                    local_bg_radius, NULL);
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				time_context += elapsed_ms(&start, &end);
+			}
+			num_peaks += context->peak_list.nPeaks;
+
+			// The kernels are expected to find the same peaks
+			setPeakfinder8PanelKernel(context, PF8_PANEL_KERNEL_GENERIC);
+			peakfinder8_context(context, frames.data + frame * frames.num_pix,
+			                    frames.mask + frame * frames.num_pix, adc_thresh,
+			                    min_snr, min_pix_count, max_pix_count, local_bg_radius,
+			                    NULL);
+			num_generic_peaks += context->peak_list.nPeaks;
+			setPeakfinder8PanelKernel(context, PF8_PANEL_KERNEL_LAYOUT);
+			peakfinder8_context(context, frames.data + frame * frames.num_pix,
+			                    frames.mask + frame * frames.num_pix, adc_thresh,
+			                    min_snr, min_pix_count, max_pix_count, local_bg_radius,
+			                    NULL);
+
+			if ( golden_fh != NULL && write_golden ) {
+				write_golden_peaks(golden_fh, layout->name, frame, &context->peak_list);
+			} else if ( golden_fh != NULL ) {
+				num_differences += compare_golden_peaks(golden_fh, layout->name, frame,
+				                                        &context->peak_list, tolerance);
+			}
+		}
+
+		printf("%-12s %7ld %7ld %12.3f %12.3f %12.3f %8ld\n", layout->name,
+		       frames.num_pix, frames.num_frames,
+		       time_function / (frames.num_frames * num_repeats),
+		       time_generic / (frames.num_frames * num_repeats),
+		       time_context / (frames.num_frames * num_repeats), num_peaks);
+		if ( num_generic_peaks != num_peaks ) {
+			printf("%-12s the generic kernel found %ld peaks\n", "",
+			       num_generic_peaks);
+		}
+
+		if ( measure_stages ) {
+			printf("%-12s %12s %12s %12s %12s %12s\n", "stages ms", "radial",
+			       "candidates", "growth", "local bg", "total");
+			print_stage_stats(layout, context, &frames);
+		}
+
+		freePeakfinder8Context(context);
+		free_frames(&frames);
+	}
+	freePeakList(peak_list);
+
+	if ( golden_fh != NULL ) {
+		fclose(golden_fh);
+		if ( !write_golden ) {
+			printf("%ld differences from %s\n", num_differences, golden_filename);
+		}
+	}
+
+	return num_differences > 0 ? 1 : 0;
+}
@@ -0,0 +1,285 @@
+# This file is part of OM.
+#
+# OM is free software: you can redistribute it and/or modify it under the terms of
+# the GNU General Public License as published by the Free Software Foundation, either
+# version 3 of the License, or (at your option) any later version.
+#
+# OM is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+# without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along with OM.
+# If not, see <http://www.gnu.org/licenses/>.
+#
+# Copyright 2020 -2021 SLAC National Accelerator Laboratory
+#
+# Based on OnDA - Copyright 2014-2019 Deutsches Elektronen-Synchrotron DESY,
+# a research centre of the Helmholtz Association.
+"""
+Benchmark of OM's peakfinder8 peak detection.
+
+This script times the [Peakfinder8PeakDetection]
+[om.algorithms.crystallography.Peakfinder8PeakDetection] algorithm, through its
+find_peaks and find_peaks_array functions, on synthetic or recorded frames, for the
+detector layouts returned by the [get_peakfinder8_info]
+[om.algorithms.crystallography.get_peakfinder8_info] function. The peaks found can be
+written to a golden file, and compared with the ones stored in a golden file.
+"""
+import sys
+import time
+from typing import Any, Dict, List, Tuple, Union
+
+import click
+import h5py  # type: ignore
+import numpy  # type: ignore
+
+from om.algorithms import crystallography as cryst_algs
+
+_LAYOUTS: List[str] = [
+    "cspad",
+    "pilatus",
+    "jungfrau1M",
+    "jungfrau4M",
+    "epix10k2M",
+    "rayonix",
+]
+
+# Peak finding parameters, suited to the synthetic frames.
+_PF8_PARAMETERS: Dict[str, Any] = {
+    "max_num_peaks": 2048,
+    "adc_threshold": 50.0,
+    "minimum_snr": 5.0,
+    "min_pixel_count": 1,
+    "max_pixel_count": 20,
+    "local_bg_radius": 3,
+    "min_res": 0,
+    "max_res": 100000,
+}
+
+
+def _radius_map(shape: Tuple[int, int]) -> numpy.ndarray:
+    # The radius of each pixel is measured from the center of the data frame, which
+    # is used as a detector image.
+    y: numpy.ndarray
+    x: numpy.ndarray
+    y, x = numpy.indices(shape, dtype=numpy.float64)
+    return numpy.sqrt(
+        (x - (shape[1] / 2.0 + 0.3)) ** 2 + (y - (shape[0] / 2.0 - 0.7)) ** 2
+    ).astype(numpy.float32)
+
+
+def _synthetic_frames(
+    shape: Tuple[int, int], num_frames: int, radius: numpy.ndarray
+) -> numpy.ndarray:
+    # Generates frames with a noisy radial background, an ice ring on every fourth
+    # frame and a number of Gaussian peaks that grows with the frame index, starting
+    # from an empty frame.
+    frames: numpy.ndarray = numpy.empty((num_frames,) + shape, dtype=numpy.float32)
+    frame: int
+    for frame in range(num_frames):
+        random_state: numpy.random.RandomState = numpy.random.RandomState(frame)
+        data: numpy.ndarray = (
+            10.0
+            + 3.0 * random_state.standard_normal(shape)
+            + 30.0 * numpy.exp(-radius / 300.0)
+        )
+        if frame % 4 == 3:
+            data[numpy.abs(radius - 200.0) < 3.0] += 60.0
+        num_peaks: int = (frame % 8) * 100
+        peak_y: numpy.ndarray = random_state.uniform(0, shape[0], num_peaks)
+        peak_x: numpy.ndarray = random_state.uniform(0, shape[1], num_peaks)
+        amplitude: numpy.ndarray = random_state.uniform(50.0, 550.0, num_peaks)
+        sigma: numpy.ndarray = random_state.uniform(0.5, 2.0, num_peaks)
+        offset_y: numpy.ndarray
+        offset_x: numpy.ndarray
+        offset_y, offset_x = numpy.mgrid[-5:6, -5:6]
+        pki: int
+        for pki in range(num_peaks):
+            y: numpy.ndarray = peak_y[pki].astype(int) + offset_y
+            x: numpy.ndarray = peak_x[pki].astype(int) + offset_x
+            inside: numpy.ndarray = (
+                (y >= 0) & (x >= 0) & (y < shape[0]) & (x < shape[1])
+            )
+            data[y[inside], x[inside]] += amplitude[pki] * numpy.exp(
+                -((x[inside] - peak_x[pki]) ** 2 + (y[inside] - peak_y[pki]) ** 2)
+                / (2.0 * sigma[pki] ** 2)
+            )
+        frames[frame] = data
+
+    return frames
+
+
+def _time_calls(function: Any, frames: numpy.ndarray, num_repeats: int) -> float:
+    # Returns the average time, in milliseconds, of a call on each frame.
+    start: float = time.perf_counter()
+    frame: numpy.ndarray
+    for frame in frames:
+        repeat: int
+        for repeat in range(num_repeats):
+            function(frame)
+    return (time.perf_counter() - start) * 1000.0 / (len(frames) * num_repeats)
+
+
+def _compare_peaks(
+    name: str,
+    golden: numpy.ndarray,
+    peak_list: numpy.ndarray,
+    tolerance: float,
+) -> int:
+    # Compares the peaks of a frame with the ones in the golden file. Returns the
+    # number of differences found.
+    if len(golden) != len(peak_list):
+        print(
+            "{0}: {1} peaks, {2} in the golden file".format(
+                name, len(peak_list), len(golden)
+            )
+        )
+        return 1
+    num_differences: int = 0
+    field: str
+    for field in golden.dtype.names:
+        differ: numpy.ndarray = numpy.abs(
+            golden[field].astype(numpy.float64) - peak_list[field]
+        ) > tolerance * (1.0 + numpy.abs(golden[field]))
+        if numpy.any(differ):
+            print(
+                "{0}: field {1} differs for {2} peaks".format(
+                    name, field, numpy.count_nonzero(differ)
+                )
+            )
+            num_differences += 1
+    return num_differences
+
+
+@click.command()
+@click.option(
+    "--layout",
+    "-l",
+    type=click.Choice(_LAYOUTS),
+    multiple=True,
+    help="Detector layout (default: all of them).",
+)
+@click.option(
+    "--num-frames", "-n", type=int, default=16, help="Number of synthetic frames."
+)
+@click.option(
+    "--repeats", "-r", type=int, default=3, help="Times each frame is processed."
+)
+@click.option("--hdf5-file", type=str, help="HDF5 file with recorded frames.")
+@click.option(
+    "--hdf5-path", type=str, default="/data/data", help="Path of the recorded frames."
+)
+@click.option("--write-golden", "-w", type=str, help="Writes the peaks to a file.")
+@click.option("--golden", "-g", type=str, help="Compares the peaks with a file.")
+@click.option(
+    "--tolerance", "-t", type=float, default=0.0, help="Relative tolerance."
+)
+def main(
+    layout: Tuple[str, ...],
+    num_frames: int,
+    repeats: int,
+    hdf5_file: Union[str, None],
+    hdf5_path: str,
+    write_golden: Union[str, None],
+    golden: Union[str, None],
+    tolerance: float,
+) -> None:
+    """
+    Benchmark of OM's peakfinder8 peak detection. This script times the find_peaks
+    and find_peaks_array functions of the Peakfinder8PeakDetection algorithm on
+    synthetic frames, or on the frames recorded in an HDF5 file (which requires a
+    single layout), and prints the average time per frame for each detector layout.
+    The peaks found by find_peaks_array can be written to a golden file (a numpy .npz
+    file), or compared with the ones in a golden file. The script exits with an error
+    if any difference is found.
+    """
+    layouts: Tuple[str, ...] = layout if layout else tuple(_LAYOUTS)
+    if hdf5_file is not None and len(layouts) != 1:
+        sys.exit("A single layout must be chosen for the recorded frames.")
+
+    golden_peaks: Dict[str, numpy.ndarray] = {}
+    if golden is not None:
+        golden_peaks = dict(numpy.load(golden))
+    written_peaks: Dict[str, numpy.ndarray] = {}
+    num_differences: int = 0
+
+    print(
+        "{0:<12} {1:>7} {2:>7} {3:>12} {4:>12} {5:>8}".format(
+            "layout", "pixels", "frames", "lists ms", "array ms", "peaks"
+        )
+    )
+    layout_name: str
+    for layout_name in layouts:
+        pf8_info: cryst_algs.TypePeakfinder8Info = cryst_algs.get_peakfinder8_info(
+            layout_name
+        )
+        shape: Tuple[int, int] = (
+            pf8_info["asic_ny"] * pf8_info["nasics_y"],
+            pf8_info["asic_nx"] * pf8_info["nasics_x"],
+        )
+        radius: numpy.ndarray = _radius_map(shape)
+        frames: numpy.ndarray
+        if hdf5_file is not None:
+            hdf5_file_handle: Any
+            with h5py.File(hdf5_file, "r") as hdf5_file_handle:
+                frames = hdf5_file_handle[hdf5_path][:].astype(numpy.float32)
+            frames = frames.reshape((-1,) + shape)
+        else:
+            frames = _synthetic_frames(shape, num_frames, radius)
+
+        peak_detection: cryst_algs.Peakfinder8PeakDetection = (
+            cryst_algs.Peakfinder8PeakDetection(
+                asic_nx=pf8_info["asic_nx"],
+                asic_ny=pf8_info["asic_ny"],
+                nasics_x=pf8_info["nasics_x"],
+                nasics_y=pf8_info["nasics_y"],
+                bad_pixel_map=None,
+                radius_pixel_map=radius,
+                **_PF8_PARAMETERS
+            )
+        )
+        time_lists: float = _time_calls(peak_detection.find_peaks, frames, repeats)
+        time_array: float = _time_calls(
+            peak_detection.find_peaks_array, frames, repeats
+        )
+
+        num_peaks: int = 0
+        frame_index: int
+        for frame_index in range(len(frames)):
+            peak_list: numpy.ndarray = peak_detection.find_peaks_array(
+                frames[frame_index]
+            )
+            num_peaks += len(peak_list)
+            name: str = "{0}_{1}".format(layout_name, frame_index)
+            if write_golden is not None:
+                written_peaks[name] = peak_list
+            elif golden is not None:
+                if name not in golden_peaks:
+                    print("{0}: not in the golden file".format(name))
+                    num_differences += 1
+                    continue
+                num_differences += _compare_peaks(
+                    name, golden_peaks[name], peak_list, tolerance
+                )
+
+        print(
+            "{0:<12} {1:>7} {2:>7} {3:>12.3f} {4:>12.3f} {5:>8}".format(
+                layout_name,
+                shape[0] * shape[1],
+                len(frames),
+                time_lists,
+                time_array,
+                num_peaks,
+            )
+        )
+
+    if write_golden is not None:
+        numpy.savez(write_golden, **written_peaks)
+    elif golden is not None:
+        print("{0} differences from {1}".format(num_differences, golden))
+        if num_differences > 0:
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()